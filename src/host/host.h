@@ -0,0 +1,36 @@
+#ifndef HOST_H_INCLUDED
+#define HOST_H_INCLUDED
+
+#include"std.h"
+
+// hosted build (see Makefile-host)
+// std.h conflicts with the C library headers, so declare the used functions here
+
+// stdio.h
+typedef struct _IO_FILE FILE;
+FILE *fopen(const char *fileName, const char *mode);
+int fclose(FILE *file);
+int fscanf(FILE *file, const char *format, ...);
+int printf(const char *format, ...);
+int vprintf(const char *format, va_list args);
+int vsnprintf(char *str, size_t len, const char *format, va_list args);
+
+// stdlib.h
+void *malloc(size_t size);
+void free(void *ptr);
+int posix_memalign(void **ptr, size_t alignment, size_t size);
+int atoi(const char *str);
+void abort(void);
+void exit(int status);
+
+// time.h
+typedef long clock_t;
+#define CLOCKS_PER_SEC ((clock_t)1000000)
+clock_t clock(void);
+long time(long *t);
+
+// hoststub.c
+// bytes allocated by systemCall_allocateHeap and allocateKernelPages
+uintptr_t getHostPageUsage(void);
+
+#endif
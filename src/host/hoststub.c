@@ -0,0 +1,216 @@
+#include"host.h"
+#include"common.h"
+#include"kernel.h"
+#include"memory/memory.h"
+#include"memory/memory_private.h"
+#include"multiprocessor/spinlock.h"
+#include"task/exclusivelock.h"
+#include"assembly/assembly.h"
+
+// single-threaded replacement of the kernel functions used by
+// buddy.c, physicalblock.c, linearblock.c, slab.c and fifoarray.c
+
+// kernel.h
+
+int snprintf(char *str, size_t len, const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	int r = vsnprintf(str, len, format, args);
+	va_end(args);
+	// kernel snprintf returns the truncated length
+	return (r < 0? 0: MIN((unsigned)r, (len == 0? 0: len - 1)));
+}
+
+int printk(const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	int r = vprintf(format, args);
+	va_end(args);
+	return r;
+}
+
+void printAndHalt(const char *condition, const char *file, int line){
+	printf("%s:%d: %s\n", file, line, condition);
+	abort();
+}
+
+// spinlock.h
+
+const Spinlock initialSpinlock = INITIAL_SPINLOCK;
+
+int isAcquirable(Spinlock *spinlock){
+	return spinlock->acquirable;
+}
+
+int acquireLock(Spinlock *spinlock){
+	if(spinlock->acquirable != 1){
+		panic("acquire a locked spinlock in single thread");
+	}
+	spinlock->acquirable = 0;
+	return 0;
+}
+
+void releaseLock(Spinlock *spinlock){
+	assert(spinlock->acquirable == 0);
+	spinlock->acquirable = 1;
+}
+
+// assembly.h
+
+uint32_t bsf32(uint32_t value){
+	return __builtin_ctz(value);
+}
+
+// exclusivelock.h
+// acquiring a semaphore of value 0 never returns in single thread
+
+struct Semaphore{
+	int value;
+};
+
+Semaphore *createSemaphore(int initialValue){
+	Semaphore *s = malloc(sizeof(*s));
+	if(s != NULL){
+		s->value = initialValue;
+	}
+	return s;
+}
+
+void deleteSemaphore(Semaphore *s){
+	free(s);
+}
+
+int tryAcquireSemaphore(Semaphore *s){
+	if(s->value == 0){
+		return 0;
+	}
+	s->value--;
+	return 1;
+}
+
+void acquireSemaphore(Semaphore *s){
+	if(tryAcquireSemaphore(s) == 0){
+		panic("acquire a semaphore of value 0 in single thread");
+	}
+}
+
+void releaseSemaphore(Semaphore *s){
+	s->value++;
+}
+
+int getSemaphoreValue(Semaphore *s){
+	return s->value;
+}
+
+// memory.h
+// linear blocks are not backed by pages; _mapPage_L only extends linear block arrays,
+// which are allocated to the maximum size in hosted build
+
+LinearMemoryManager *kernelLinear = NULL;
+
+int isKernelLinearAddress(__attribute__((__unused__)) uintptr_t address){
+	return 0;
+}
+
+int _mapPage_L(
+	PageManager *p, PhysicalMemoryBlockManager *physical,
+	void *linearAddress, size_t size,
+	__attribute__((__unused__)) PageAttribute attribute
+){
+	assert(p == NULL && physical == NULL && ((uintptr_t)linearAddress) % PAGE_SIZE == 0 && size % PAGE_SIZE == 0);
+	return 1;
+}
+
+int _mapPage_LP(
+	PageManager *p, PhysicalMemoryBlockManager *physical,
+	void *linearAddress, __attribute__((__unused__)) PhysicalAddress physicalAddress, size_t size,
+	__attribute__((__unused__)) PageAttribute attribute
+){
+	assert(p == NULL && physical == NULL && ((uintptr_t)linearAddress) % PAGE_SIZE == 0 && size % PAGE_SIZE == 0);
+	return 1;
+}
+
+void _unmapPage(PageManager *p, PhysicalMemoryBlockManager *physical, void *linearAddress, size_t size){
+	assert(p == NULL && physical == NULL && ((uintptr_t)linearAddress) % PAGE_SIZE == 0 && size % PAGE_SIZE == 0);
+}
+
+int _isPagePresent(PageManager *p, __attribute__((__unused__)) uintptr_t linearAddress){
+	assert(p == NULL);
+	return 0;
+}
+
+void _unmapPresentPage(PageManager *p, PhysicalMemoryBlockManager *physical, void *linearAddress, size_t size){
+	_unmapPage(p, physical, linearAddress, size);
+}
+
+PhysicalAddress _translatePage(
+	__attribute__((__unused__)) PageManager *p,
+	__attribute__((__unused__)) uintptr_t linearAddress,
+	__attribute__((__unused__)) PageAttribute hasAttribute
+){
+	PhysicalAddress a = {INVALID_PAGE_ADDRESS};
+	return a;
+}
+
+// the size of each page allocation is stored before the returned address
+
+static uintptr_t pageUsage = 0;
+
+uintptr_t getHostPageUsage(void){
+	return pageUsage;
+}
+
+static void *allocateHostPages(size_t size){
+	void *p;
+	assert(size % PAGE_SIZE == 0);
+	if(posix_memalign(&p, PAGE_SIZE, size + PAGE_SIZE) != 0){
+		return NULL;
+	}
+	*(size_t*)p = size;
+	pageUsage += size;
+	return ((uint8_t*)p) + PAGE_SIZE;
+}
+
+static int releaseHostPages(void *address){
+	if(((uintptr_t)address) % PAGE_SIZE != 0){
+		return 0;
+	}
+	void *p = ((uint8_t*)address) - PAGE_SIZE;
+	pageUsage -= *(size_t*)p;
+	free(p);
+	return 1;
+}
+
+void *allocateKernelPages(size_t size, __attribute__((__unused__)) PageAttribute attribute){
+	return allocateHostPages(size);
+}
+
+int checkAndReleaseKernelPages(void *linearAddress){
+	return releaseHostPages(linearAddress);
+}
+
+void *allocateKernelMemory(size_t size){
+	return malloc(size);
+}
+
+void releaseKernelMemory(void *address){
+	free(address);
+}
+
+// systemcall.h
+
+void *systemCall_allocateHeap(uintptr_t size, __attribute__((__unused__)) PageAttribute attribute){
+	return allocateHostPages(size);
+}
+
+int systemCall_releaseHeap(void *address){
+	return releaseHostPages(address);
+}
+
+uint64_t systemCall_getTime(void){
+	return time(NULL);
+}
+
+void systemCall_terminate(void){
+	exit(0);
+}
@@ -0,0 +1,377 @@
+#include"host.h"
+#include"common.h"
+#include"kernel.h"
+#include"memory/memory.h"
+#include"memory/memory_private.h"
+#include"memory/buddy.h"
+#include"io/fifo.h"
+
+// replay an allocation trace on the buddy (physical and linear) and slab allocators
+// usage: memorybenchmark [trace file]
+// each line of the trace file is either "a <id> <size>" (allocate) or "f <id>" (release)
+// without trace file, a random trace is generated
+
+typedef struct{
+	char isAllocate;
+	uint32_t id;
+	uint32_t size;
+}TraceRecord;
+
+#define MAX_TRACE_ID (65536)
+
+typedef struct{
+	TraceRecord *record;
+	int length;
+}Trace;
+
+static int readTrace(Trace *t, const char *fileName){
+	FILE *f = fopen(fileName, "r");
+	if(f == NULL){
+		return 0;
+	}
+	int maxLength = 1024;
+	t->record = malloc(maxLength * sizeof(t->record[0]));
+	t->length = 0;
+	while(t->record != NULL){
+		char op;
+		unsigned id, size = 0;
+		if(fscanf(f, " %c %u", &op, &id) != 2){
+			break;
+		}
+		if(op == 'a' && fscanf(f, " %u", &size) != 1){
+			break;
+		}
+		if((op != 'a' && op != 'f') || id >= MAX_TRACE_ID){
+			printf("invalid trace record %d\n", t->length);
+			break;
+		}
+		if(t->length == maxLength){
+			TraceRecord *r = malloc(maxLength * 2 * sizeof(r[0]));
+			if(r != NULL){
+				memcpy(r, t->record, maxLength * sizeof(r[0]));
+			}
+			free(t->record);
+			t->record = r;
+			maxLength *= 2;
+			if(r == NULL){
+				break;
+			}
+		}
+		t->record[t->length].isAllocate = (op == 'a');
+		t->record[t->length].id = id;
+		t->record[t->length].size = size;
+		t->length++;
+	}
+	fclose(f);
+	return t->record != NULL;
+}
+
+// mostly small objects, some pages, and few large blocks
+static uint32_t randomSize(uint32_t r){
+	switch(r % 20){
+	case 0:
+		return PAGE_SIZE * 16 + (r >> 8) % (PAGE_SIZE * 240);
+	case 1:
+	case 2:
+	case 3:
+	case 4:
+		return PAGE_SIZE + (r >> 8) % (PAGE_SIZE * 15);
+	default:
+		return 8 + (r >> 8) % 2000;
+	}
+}
+
+static int generateTrace(Trace *t, int length, int liveCount){
+	t->record = malloc(length * sizeof(t->record[0]));
+	if(t->record == NULL){
+		return 0;
+	}
+	uint8_t *isLive = malloc(liveCount);
+	if(isLive == NULL){
+		return 0;
+	}
+	memset(isLive, 0, liveCount);
+	uint32_t r = 1;
+	int i;
+	for(i = 0; i < length; i++){
+		r = r * 1103515245 + 12345;
+		const uint32_t id = (r >> 8) % liveCount;
+		r = r * 1103515245 + 12345;
+		t->record[i].isAllocate = (isLive[id] == 0);
+		t->record[i].id = id;
+		t->record[i].size = (isLive[id]? 0: randomSize(r));
+		isLive[id] = !isLive[id];
+	}
+	t->length = length;
+	free(isLive);
+	return 1;
+}
+
+// allocators
+
+typedef struct{
+	const char *name;
+	// return UINTPTR_NULL if failure
+	uintptr_t (*allocate)(uint32_t size);
+	void (*release)(uintptr_t address, uint32_t size);
+	// bytes held by the allocator
+	uintptr_t (*getUsedSize)(void);
+	// return 0 if not available
+	int (*getUsage)(MemoryBlockUsage *u);
+}Allocator;
+
+// physical buddy allocator with free bitmap
+
+#define BUDDY_BEGIN_ADDRESS ((uintptr_t)(1 << 20))
+#define BUDDY_SIZE ((uintptr_t)(1 << 30))
+static PhysicalMemoryBlockManager *physical;
+
+static uintptr_t allocatePhysical(uint32_t size){
+	const uintptr_t s = CEIL(size, PAGE_SIZE);
+	uintptr_t a = allocatePhysicalBlock(physical, s, s);
+	return (a == INVALID_PAGE_ADDRESS? UINTPTR_NULL: a);
+}
+
+static void releasePhysical(uintptr_t address, __attribute__((__unused__)) uint32_t size){
+	releasePhysicalBlock(physical, address);
+}
+
+static uintptr_t getPhysicalUsedSize(void){
+	return BUDDY_SIZE - getFreePhysicalBlockSize(physical);
+}
+
+static int getPhysicalUsage(MemoryBlockUsage *u){
+	getPhysicalBlockUsage(physical, u);
+	return 1;
+}
+
+static int initPhysicalAllocator(void){
+	size_t manageSize = sizeof(MemoryBlockManager) + (BUDDY_SIZE / MIN_BLOCK_SIZE) * 20;
+	uintptr_t manageBase = (uintptr_t)malloc(manageSize);
+	if(manageBase == UINTPTR_NULL){
+		return 0;
+	}
+	physical = createPhysicalMemoryBlockManager(manageBase, manageSize,
+		BUDDY_BEGIN_ADDRESS, BUDDY_BEGIN_ADDRESS + BUDDY_SIZE);
+	uintptr_t a;
+	for(a = BUDDY_BEGIN_ADDRESS; a < BUDDY_BEGIN_ADDRESS + BUDDY_SIZE; a += MIN_BLOCK_SIZE){
+		releasePhysicalBlock(physical, a);
+	}
+	return 1;
+}
+
+// linear buddy allocator growing from empty, as in user space
+
+static LinearMemoryManager linear;
+static uintptr_t linearUsedSize;
+
+static uintptr_t allocateLinear(uint32_t size){
+	const uintptr_t s = CEIL(size, PAGE_SIZE);
+	uintptr_t a = allocateLinearBlock(&linear, s);
+	if(a == INVALID_PAGE_ADDRESS){
+		return UINTPTR_NULL;
+	}
+	commitAllocatingLinearBlock(&linear, a);
+	linearUsedSize += (1 << ceilAllocateOrder(s));
+	return a;
+}
+
+static void releaseLinear(uintptr_t address, uint32_t size){
+	int ok = checkAndReleaseLinearBlock(&linear, address);
+	assert(ok);
+	linearUsedSize -= (1 << ceilAllocateOrder(CEIL(size, PAGE_SIZE)));
+}
+
+static uintptr_t getLinearUsedSize(void){
+	return linearUsedSize;
+}
+
+static int getLinearUsage(MemoryBlockUsage *u){
+	getLinearBlockUsage(linear.linear, u);
+	return 1;
+}
+
+static int initLinearAllocator(void){
+	size_t manageSize = sizeof(MemoryBlockManager) + (BUDDY_SIZE / MIN_BLOCK_SIZE) * 24;
+	uintptr_t manageBase = (uintptr_t)malloc(manageSize + PAGE_SIZE);
+	if(manageBase == UINTPTR_NULL){
+		return 0;
+	}
+	// see extendLinearBlock_noLock
+	manageBase = CEIL(manageBase, PAGE_SIZE);
+	linear.physical = NULL;
+	linear.page = NULL;
+	linear.linear = createLinearBlockManager(manageBase, manageSize,
+		BUDDY_BEGIN_ADDRESS, BUDDY_BEGIN_ADDRESS, BUDDY_BEGIN_ADDRESS + BUDDY_SIZE);
+	linearUsedSize = 0;
+	return 1;
+}
+
+// slab allocator
+
+static SlabManager *slab;
+
+static uintptr_t allocateSlabObject(uint32_t size){
+	return (uintptr_t)allocateSlab(slab, size);
+}
+
+static void releaseSlabObject(uintptr_t address, __attribute__((__unused__)) uint32_t size){
+	releaseSlab(slab, (void*)address);
+}
+
+static uintptr_t getSlabUsedSize(void){
+	return getHostPageUsage();
+}
+
+static int getSlabUsage(__attribute__((__unused__)) MemoryBlockUsage *u){
+	return 0;
+}
+
+static int initSlabAllocator(void){
+	slab = createUserSlabManager();
+	return slab != NULL;
+}
+
+// see printBlockUsage in memorymanager.c
+static unsigned evaluateFragmentation(const MemoryBlockUsage *u){
+	uintptr_t freeSize = 0, maxFreeSize = 0;
+	int o;
+	for(o = MIN_BLOCK_ORDER; o <= MAX_BLOCK_ORDER; o++){
+		const uintptr_t f = u->freeBlockCount[o - MIN_BLOCK_ORDER];
+		freeSize += f * ((1 << (o - MIN_BLOCK_ORDER)) * (MIN_BLOCK_SIZE / 1024));
+		if(f != 0){
+			maxFreeSize = (1 << (o - MIN_BLOCK_ORDER)) * (MIN_BLOCK_SIZE / 1024);
+		}
+	}
+	return (freeSize == 0? 0: 100 - maxFreeSize * 100 / freeSize);
+}
+
+typedef struct{
+	uintptr_t address;
+	uint32_t size;
+}LiveObject;
+
+static void replayTrace(const Allocator *a, const Trace *t, LiveObject *object){
+	int i, failCount = 0;
+	uintptr_t requestSize = 0, peakRequestSize = 0, peakUsedSize = 0;
+	MemoryBlockUsage u;
+	for(i = 0; i < MAX_TRACE_ID; i++){
+		object[i].address = UINTPTR_NULL;
+		object[i].size = 0;
+	}
+	const clock_t beginClock = clock();
+	for(i = 0; i < t->length; i++){
+		const TraceRecord *r = t->record + i;
+		LiveObject *o = object + r->id;
+		if(r->isAllocate){
+			if(o->address != UINTPTR_NULL){
+				continue;
+			}
+			o->address = a->allocate(r->size);
+			if(o->address == UINTPTR_NULL){
+				failCount++;
+				continue;
+			}
+			o->size = r->size;
+			requestSize += r->size;
+			peakRequestSize = MAX(peakRequestSize, requestSize);
+			peakUsedSize = MAX(peakUsedSize, a->getUsedSize());
+		}
+		else{
+			if(o->address == UINTPTR_NULL){
+				continue;
+			}
+			a->release(o->address, o->size);
+			requestSize -= o->size;
+			o->address = UINTPTR_NULL;
+		}
+	}
+	const clock_t elapsed = MAX(clock() - beginClock, 1);
+	printf("%-8s %10u ops/s, %6d failed, peak %8u KB requested, %8u KB used",
+		a->name, (unsigned)(((uint64_t)t->length) * CLOCKS_PER_SEC / elapsed), failCount,
+		peakRequestSize / 1024, peakUsedSize / 1024);
+	if(a->getUsage(&u)){
+		printf(", fragmentation %u%%\n", evaluateFragmentation(&u));
+	}
+	else{
+		printf("\n");
+	}
+	for(i = 0; i < MAX_TRACE_ID; i++){
+		if(object[i].address != UINTPTR_NULL){
+			a->release(object[i].address, object[i].size);
+		}
+	}
+}
+
+static void benchmarkFIFO(int opCount){
+	const uintptr_t elementSize = 16;
+	FIFO *f = createFIFO(1024, elementSize);
+	assert(f != NULL);
+	uint8_t data[16];
+	int i, j;
+	memset(data, 0, sizeof(data));
+	const clock_t beginClock = clock();
+	for(i = 0; i < opCount; i += 512){
+		for(j = 0; j < 512; j++){
+			int ok = writeFIFO(f, data);
+			assert(ok);
+		}
+		for(j = 0; j < 512; j++){
+			readFIFO(f, data);
+		}
+	}
+	const clock_t elapsed = MAX(clock() - beginClock, 1);
+	printf("%-8s %10u ops/s\n", "fifo", (unsigned)(((uint64_t)i) * 2 * CLOCKS_PER_SEC / elapsed));
+	deleteFIFO(f);
+}
+
+// see testBuddySpeed in buddy.c
+static void benchmarkBuddyBitmap(int useFreeBitmap, int opCount){
+	const size_t manageSize = 4 * 1024 * 1024;
+	uint8_t *manageBuffer = malloc(manageSize);
+	assert(manageBuffer != NULL);
+	const clock_t beginClock = clock();
+	int failCount = benchmarkBuddy((uintptr_t)manageBuffer, manageSize, useFreeBitmap,
+		MIN_BLOCK_ORDER, MIN_BLOCK_ORDER + 8, opCount);
+	const clock_t elapsed = MAX(clock() - beginClock, 1);
+	printf("buddy %s free bitmap: %u ops/s, %d failed\n", (useFreeBitmap? "with": "without"),
+		(unsigned)(((uint64_t)opCount) * CLOCKS_PER_SEC / elapsed), failCount);
+	free(manageBuffer);
+}
+
+int main(int argc, char *argv[]){
+	const Allocator allocator[3] = {
+		{"physical", allocatePhysical, releasePhysical, getPhysicalUsedSize, getPhysicalUsage},
+		{"linear", allocateLinear, releaseLinear, getLinearUsedSize, getLinearUsage},
+		{"slab", allocateSlabObject, releaseSlabObject, getSlabUsedSize, getSlabUsage}
+	};
+	Trace t;
+	int ok;
+	if(argc > 1){
+		ok = readTrace(&t, argv[1]);
+	}
+	else{
+		ok = generateTrace(&t, 1000000, 4096);
+	}
+	if(!ok){
+		printf("cannot load trace\n");
+		return 1;
+	}
+	LiveObject *object = malloc(MAX_TRACE_ID * sizeof(object[0]));
+	if(object == NULL || initPhysicalAllocator() == 0 || initLinearAllocator() == 0 || initSlabAllocator() == 0){
+		printf("cannot initialize allocators\n");
+		return 1;
+	}
+	printf("%d operations\n", t.length);
+	unsigned i;
+	for(i = 0; i < LENGTH_OF(allocator); i++){
+		replayTrace(allocator + i, &t, object);
+	}
+	benchmarkFIFO(t.length);
+	for(i = 0; i < 2; i++){
+		benchmarkBuddyBitmap(i, t.length);
+	}
+	free(object);
+	free(t.record);
+	return 0;
+}
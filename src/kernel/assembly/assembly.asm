@@ -32,6 +32,11 @@ lock_cmpxchg32:
 	lock cmpxchg [edx], ecx
 	ret
 
+global bsf32
+bsf32:
+	bsf eax, [esp + 4]
+	ret
+
 global getEFlags
 getEFlags:
 	pushfd
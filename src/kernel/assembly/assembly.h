@@ -35,6 +35,8 @@ void lock_add32(volatile uint32_t *a, uint32_t b);
 //else *dst = src
 //return cmp
 uint32_t lock_cmpxchg32(volatile uint32_t *dst, uint32_t cmp, uint32_t src);
+// index of the least significant set bit; value must not be 0
+uint32_t bsf32(uint32_t value);
 #define ATOMIC_READ_32(ADDRESS) lock_cmpxchg32((ADDRESS), 0, 0)
 #define ATOMIC_WRITE_32(ADDRESS, VALUE) xchg32((ADDRESS), (VALUE))
 
@@ -77,6 +79,13 @@ EFlags getEFlags(void);
 int cpuid_isSupported(void);
 int cpuid_hasAPIC(void);
 int cpuid_getInitialAPICID(void);
+int cpuid_hasSSE2(void);
+
+// copy without filling cache, for buffers read by devices
+// fall back to memcpy_volatile if the processor does not support MOVNTI or size is small
+#define MIN_NON_TEMPORAL_COPY_SIZE (64)
+void initNonTemporalCopy(void);
+volatile void *memcpy_nonTemporal(volatile void *dst, const void *src, size_t size);
 
 enum MSR{
 	IA32_APIC_BASE = 0x1b
@@ -85,4 +94,7 @@ enum MSR{
 void rdmsr(enum MSR ecx, uint32_t *edx, uint32_t *eax);
 void wrmsr(enum MSR ecx, uint32_t edx, uint32_t eax);
 
+// time stamp counter
+uint64_t rdtsc(void);
+
 #endif
@@ -79,6 +79,12 @@ int cpuid_hasAPIC(void){
 	return (edx >> 9) & 1;
 }
 
+int cpuid_hasSSE2(void){
+	uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	return (edx >> 26) & 1;
+}
+
 int cpuid_getInitialAPICID(){
 	uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
 	cpuid(&eax, &ebx, &ecx, &edx);
@@ -100,3 +106,44 @@ void wrmsr(enum MSR ecx, uint32_t edx, uint32_t eax){
 	:"c"(ecx), "d"(edx), "a"(eax)
 	);
 }
+
+uint64_t rdtsc(void){
+	uint32_t edx, eax;
+	__asm__ __volatile__(
+	"rdtsc\n"
+	:"=d"(edx),"=a"(eax)
+	);
+	return (((uint64_t)edx) << 32) | eax;
+}
+
+// MOVNTI and SFENCE are SSE2 instructions but do not use XMM registers
+static int hasNonTemporalStore = 0;
+
+void initNonTemporalCopy(void){
+	hasNonTemporalStore = (cpuid_isSupported() && cpuid_hasSSE2());
+}
+
+volatile void *memcpy_nonTemporal(volatile void *dst, const void *src, size_t size){
+	if(hasNonTemporalStore == 0 || size < MIN_NON_TEMPORAL_COPY_SIZE){
+		return memcpy_volatile(dst, src, size);
+	}
+	const size_t head = (4 - ((uintptr_t)dst) % 4) % 4;
+	const size_t dwordCount = (size - head) / 4;
+	memcpy_volatile(dst, src, head);
+	uint32_t d0, d1, d2, d3;
+	__asm__ __volatile__(
+	"1:\n"
+	"movl (%%esi), %%eax\n"
+	"movnti %%eax, (%%edi)\n"
+	"addl $4, %%esi\n"
+	"addl $4, %%edi\n"
+	"loop 1b\n"
+	"sfence\n"
+	:"=D"(d0), "=S"(d1), "=c"(d2), "=a"(d3)
+	:"0"(((uintptr_t)dst) + head), "1"(((uintptr_t)src) + head), "2"(dwordCount)
+	:"memory", "cc"
+	);
+	memcpy_volatile(((volatile uint8_t*)dst) + head + dwordCount * 4,
+		((const uint8_t*)src) + head + dwordCount * 4, size - head - dwordCount * 4);
+	return dst;
+}
@@ -0,0 +1,536 @@
+#include"blockcache.h"
+#include"file.h"
+#include"io.h"
+#include"common.h"
+#include"kernel.h"
+#include"multiprocessor/spinlock.h"
+#include"task/exclusivelock.h"
+#include"task/task.h"
+#include"multiprocessor/processorlocal.h"
+
+struct CachedBlock{
+	uintptr_t diskHandle;
+	uint64_t position;
+	void *data;
+	int referenceCount;
+	// data is loaded
+	char isValid;
+	// CLOCK reference bit
+	char isReferenced;
+	// modified and not written back. dirty blocks are not evicted
+	char isDirty;
+	// held by the loading task
+	Semaphore *loading;
+	// blocks in hash table. prev == NULL if the block is free
+	struct CachedBlock **prev, *next;
+};
+
+#define BLOCK_CACHE_HASH_SIZE (1024)
+
+struct BlockCache{
+	Spinlock lock;
+	uintptr_t maxBlockCount, blockCount;
+	// all allocated blocks, scanned by CLOCK
+	CachedBlock **block;
+	uintptr_t clockHand;
+	CachedBlock *hashTable[BLOCK_CACHE_HASH_SIZE];
+	uint64_t hitCount, missCount, evictCount, prefetchCount;
+	uintptr_t dirtyCount;
+	uint64_t writeBackCount;
+};
+
+static CachedBlock *createCachedBlock(void){
+	CachedBlock *NEW(b);
+	EXPECT(b != NULL);
+	b->data = allocateKernelPages(CACHED_BLOCK_SIZE, KERNEL_PAGE);
+	EXPECT(b->data != NULL);
+	b->loading = createSemaphore(1);
+	EXPECT(b->loading != NULL);
+	b->diskHandle = 0;
+	b->position = 0;
+	b->referenceCount = 0;
+	b->isValid = 0;
+	b->isReferenced = 0;
+	b->isDirty = 0;
+	b->prev = NULL;
+	b->next = NULL;
+	return b;
+	ON_ERROR;
+	checkAndReleaseKernelPages(b->data);
+	ON_ERROR;
+	DELETE(b);
+	ON_ERROR;
+	return NULL;
+}
+
+static void deleteCachedBlock(CachedBlock *b){
+	deleteSemaphore(b->loading);
+	checkAndReleaseKernelPages(b->data);
+	DELETE(b);
+}
+
+BlockCache *createBlockCache(uintptr_t maxBlockCount){
+	BlockCache *NEW(bc);
+	EXPECT(bc != NULL);
+	NEW_ARRAY(bc->block, maxBlockCount);
+	EXPECT(bc->block != NULL);
+	bc->lock = initialSpinlock;
+	bc->maxBlockCount = maxBlockCount;
+	bc->blockCount = 0;
+	bc->clockHand = 0;
+	memset(bc->hashTable, 0, sizeof(bc->hashTable));
+	bc->hitCount = 0;
+	bc->missCount = 0;
+	bc->evictCount = 0;
+	bc->prefetchCount = 0;
+	bc->dirtyCount = 0;
+	bc->writeBackCount = 0;
+	return bc;
+	ON_ERROR;
+	DELETE(bc);
+	ON_ERROR;
+	return NULL;
+}
+
+static void deleteBlockCache(BlockCache *bc){
+	uintptr_t i;
+	for(i = 0; i < bc->blockCount; i++){
+		assert(bc->block[i]->referenceCount == 0);
+		deleteCachedBlock(bc->block[i]);
+	}
+	DELETE(bc->block);
+	DELETE(bc);
+}
+
+// 4MB
+#define DISK_BLOCK_CACHE_SIZE (1024)
+// dirty blocks are written back periodically
+#define BLOCK_CACHE_FLUSH_INTERVAL (1000)
+// writers start write-back when 3/4 of the blocks are dirty,
+// so that readers can still find clean blocks to evict
+#define DIRTY_HIGH_WATER_MARK(MAX_BLOCK_COUNT) ((MAX_BLOCK_COUNT) - (MAX_BLOCK_COUNT) / 4)
+
+static void flushBlockCacheTask(void *arg){
+	BlockCache *bc = *(BlockCache**)arg;
+	while(1){
+		sleep(BLOCK_CACHE_FLUSH_INTERVAL);
+		flushBlockCache(bc);
+	}
+}
+
+static BlockCache *diskBlockCache = NULL;
+static Spinlock diskBlockCacheLock = INITIAL_SPINLOCK;
+
+BlockCache *getDiskBlockCache(void){
+	acquireLock(&diskBlockCacheLock);
+	BlockCache *bc = diskBlockCache;
+	releaseLock(&diskBlockCacheLock);
+	if(bc != NULL){
+		return bc;
+	}
+	BlockCache *newCache = createBlockCache(DISK_BLOCK_CACHE_SIZE);
+	if(newCache == NULL){
+		return NULL;
+	}
+	acquireLock(&diskBlockCacheLock);
+	if(diskBlockCache == NULL){
+		diskBlockCache = newCache;
+		newCache = NULL;
+	}
+	bc = diskBlockCache;
+	releaseLock(&diskBlockCacheLock);
+	if(newCache != NULL){
+		deleteBlockCache(newCache);
+		return bc;
+	}
+	// the flush task writes back through the global disk handles, which do not belong to the caller
+	Task *t = createSharedMemoryTask(flushBlockCacheTask, &bc, sizeof(bc), processorLocalTask());
+	if(t == NULL){
+		printk("warning: cannot create block cache flush task\n");
+	}
+	else{
+		resume(t);
+	}
+	return bc;
+}
+
+static CachedBlock **getHashBucket(BlockCache *bc, uintptr_t diskHandle, uint64_t blockPosition){
+	const uint32_t blockIndex = (((uint32_t)LOW64(blockPosition)) / CACHED_BLOCK_SIZE) ^ HIGH64(blockPosition);
+	return &bc->hashTable[(blockIndex ^ (diskHandle * 0x9e3779b1)) % BLOCK_CACHE_HASH_SIZE];
+}
+
+static CachedBlock *searchBlock_noLock(BlockCache *bc, uintptr_t diskHandle, uint64_t blockPosition){
+	CachedBlock *b;
+	for(b = *getHashBucket(bc, diskHandle, blockPosition); b != NULL; b = b->next){
+		if(b->diskHandle == diskHandle && b->position == blockPosition)
+			return b;
+	}
+	return NULL;
+}
+
+// CLOCK: skip referenced blocks and give recently used blocks a second chance
+static CachedBlock *evictBlock_noLock(BlockCache *bc){
+	uintptr_t i;
+	for(i = 0; i < bc->blockCount * 2; i++){
+		CachedBlock *b = bc->block[bc->clockHand];
+		bc->clockHand = (bc->clockHand + 1) % bc->blockCount;
+		if(b->referenceCount != 0 || b->isDirty)
+			continue;
+		if(b->prev == NULL) // free
+			return b;
+		if(b->isReferenced){
+			b->isReferenced = 0;
+			continue;
+		}
+		REMOVE_FROM_DQUEUE(b);
+		b->isValid = 0;
+		bc->evictCount++;
+		return b;
+	}
+	return NULL;
+}
+
+// return a referenced block at blockPosition
+// if *needLoad is set, the caller has to read the block and call finishLoadingBlock
+// prefetching does not count as hit or miss
+static CachedBlock *lookupOrReserveBlock(
+	BlockCache *bc, uintptr_t diskHandle, uint64_t blockPosition,
+	int isPrefetch, int *needLoad
+){
+	CachedBlock *newBlock = NULL;
+	int allocationFailed = 0;
+	while(1){
+		acquireLock(&bc->lock);
+		CachedBlock *b = searchBlock_noLock(bc, diskHandle, blockPosition);
+		if(b == NULL && newBlock == NULL && allocationFailed == 0 && bc->blockCount < bc->maxBlockCount){
+			// allocate outside the lock and search again
+			releaseLock(&bc->lock);
+			newBlock = createCachedBlock();
+			allocationFailed = (newBlock == NULL);
+			continue;
+		}
+		CachedBlock *freeBlock = NULL;
+		if(newBlock != NULL && bc->blockCount < bc->maxBlockCount){
+			bc->block[bc->blockCount] = newBlock;
+			bc->blockCount++;
+			freeBlock = newBlock;
+			newBlock = NULL;
+		}
+		if(b != NULL){
+			b->referenceCount++;
+			b->isReferenced = 1;
+			if(isPrefetch == 0){
+				bc->hitCount++;
+			}
+			*needLoad = 0;
+		}
+		else{
+			// if allocation failed, reuse blocks under memory pressure
+			b = freeBlock;
+			if(b == NULL && bc->blockCount != 0){
+				b = evictBlock_noLock(bc);
+			}
+			if(b != NULL){
+				int ok = tryAcquireSemaphore(b->loading);
+				assert(ok);
+				b->diskHandle = diskHandle;
+				b->position = blockPosition;
+				b->referenceCount = 1;
+				b->isReferenced = 1;
+				b->isValid = 0;
+				ADD_TO_DQUEUE(b, getHashBucket(bc, diskHandle, blockPosition));
+				if(isPrefetch){
+					bc->prefetchCount++;
+				}
+				else{
+					bc->missCount++;
+				}
+				*needLoad = 1;
+			}
+		}
+		releaseLock(&bc->lock);
+		if(newBlock != NULL){
+			deleteCachedBlock(newBlock);
+		}
+		return b;
+	}
+}
+
+// evictBlock_noLock skips dirty blocks. if all blocks are dirty, write them back and try again
+static CachedBlock *lookupOrWriteBackBlock(BlockCache *bc, uintptr_t diskHandle, uint64_t blockPosition, int *needLoad){
+	CachedBlock *b = lookupOrReserveBlock(bc, diskHandle, blockPosition, 0, needLoad);
+	if(b != NULL)
+		return b;
+	acquireLock(&bc->lock);
+	const uintptr_t dirtyCount = bc->dirtyCount;
+	releaseLock(&bc->lock);
+	if(dirtyCount == 0)
+		return NULL;
+	flushBlockCache(bc);
+	return lookupOrReserveBlock(bc, diskHandle, blockPosition, 0, needLoad);
+}
+
+static void finishLoadingBlock(BlockCache *bc, CachedBlock *b, int ok){
+	acquireLock(&bc->lock);
+	if(ok){
+		b->isValid = 1;
+	}
+	else{
+		REMOVE_FROM_DQUEUE(b);
+	}
+	releaseLock(&bc->lock);
+	releaseSemaphore(b->loading);
+}
+
+static int waitBlockLoaded(CachedBlock *b){
+	acquireSemaphore(b->loading);
+	releaseSemaphore(b->loading);
+	return b->isValid;
+}
+
+static uintptr_t issueLoadBlock(CachedBlock *b){
+	return systemCall_seekReadFile(b->diskHandle, b->data, b->position, CACHED_BLOCK_SIZE);
+}
+
+static int waitLoadBlock(uintptr_t io){
+	uintptr_t readSize = 0;
+	if(io == IO_REQUEST_FAILURE)
+		return 0;
+	if(systemCall_waitIOReturn(io, 1, &readSize) != io)
+		return 0;
+	return readSize == CACHED_BLOCK_SIZE;
+}
+
+CachedBlock *acquireCachedBlock(BlockCache *bc, uintptr_t diskHandle, uint64_t blockPosition){
+	assert(LOW64(blockPosition) % CACHED_BLOCK_SIZE == 0);
+	int needLoad;
+	CachedBlock *b = lookupOrWriteBackBlock(bc, diskHandle, blockPosition, &needLoad);
+	if(b == NULL)
+		return NULL;
+	int ok;
+	if(needLoad){
+		ok = waitLoadBlock(issueLoadBlock(b));
+		finishLoadingBlock(bc, b, ok);
+	}
+	else{
+		ok = waitBlockLoaded(b);
+	}
+	if(!ok){
+		releaseCachedBlock(bc, b);
+		return NULL;
+	}
+	return b;
+}
+
+const void *getCachedBlockData(CachedBlock *b){
+	assert(b->isValid);
+	return b->data;
+}
+
+void releaseCachedBlock(BlockCache *bc, CachedBlock *b){
+	acquireLock(&bc->lock);
+	assert(b->referenceCount > 0);
+	b->referenceCount--;
+	releaseLock(&bc->lock);
+}
+
+// missing blocks in a batch are read concurrently
+#define MAX_LOAD_BLOCK_COUNT (16)
+
+// if buffer is NULL, load the missing blocks without waiting for the blocks being loaded by others
+static uintptr_t loadBlockRange(BlockCache *bc, uintptr_t diskHandle, void *buffer, uint64_t position, uintptr_t size){
+	const uint64_t endPosition = position + size;
+	uintptr_t readSize = 0;
+	while(readSize < size){
+		const uint64_t firstPosition = (position + readSize) & ~(uint64_t)(CACHED_BLOCK_SIZE - 1);
+		CachedBlock *b[MAX_LOAD_BLOCK_COUNT];
+		int needLoad[MAX_LOAD_BLOCK_COUNT];
+		uintptr_t io[MAX_LOAD_BLOCK_COUNT];
+		int blockCount, validCount, i;
+		for(blockCount = 0; blockCount < MAX_LOAD_BLOCK_COUNT; blockCount++){
+			const uint64_t p = firstPosition + blockCount * CACHED_BLOCK_SIZE;
+			if(p >= endPosition)
+				break;
+			// prefetching gives up instead of waiting for write-back
+			b[blockCount] = (buffer == NULL?
+				lookupOrReserveBlock(bc, diskHandle, p, 1, &needLoad[blockCount]):
+				lookupOrWriteBackBlock(bc, diskHandle, p, &needLoad[blockCount]));
+			if(b[blockCount] == NULL)
+				break;
+		}
+		if(blockCount == 0)
+			break;
+		for(i = 0; i < blockCount; i++){
+			io[i] = (needLoad[i]? issueLoadBlock(b[i]): IO_REQUEST_FAILURE);
+		}
+		validCount = blockCount;
+		for(i = 0; i < blockCount; i++){
+			int ok;
+			if(needLoad[i]){
+				ok = waitLoadBlock(io[i]);
+				finishLoadingBlock(bc, b[i], ok);
+			}
+			else{
+				ok = (buffer == NULL? 1: waitBlockLoaded(b[i]));
+			}
+			if(!ok && validCount > i){
+				validCount = i;
+			}
+		}
+		for(i = 0; i < validCount; i++){
+			const uint64_t blockBegin = b[i]->position;
+			const uintptr_t copyBegin = (uintptr_t)(MAX(blockBegin, position + readSize) - blockBegin);
+			const uintptr_t copyEnd = (uintptr_t)(MIN(blockBegin + CACHED_BLOCK_SIZE, endPosition) - blockBegin);
+			if(buffer != NULL){
+				memcpy(((uint8_t*)buffer) + readSize, ((const uint8_t*)b[i]->data) + copyBegin, copyEnd - copyBegin);
+			}
+			readSize += copyEnd - copyBegin;
+		}
+		for(i = 0; i < blockCount; i++){
+			releaseCachedBlock(bc, b[i]);
+		}
+		if(validCount < blockCount)
+			break;
+	}
+	return readSize;
+}
+
+uintptr_t readBlockCache(BlockCache *bc, uintptr_t diskHandle, void *buffer, uint64_t position, uintptr_t size){
+	assert(buffer != NULL);
+	return loadBlockRange(bc, diskHandle, buffer, position, size);
+}
+
+uintptr_t prefetchBlockCache(BlockCache *bc, uintptr_t diskHandle, uint64_t position, uintptr_t size){
+	return loadBlockRange(bc, diskHandle, NULL, position, size);
+}
+
+int isBlockCached(BlockCache *bc, uintptr_t diskHandle, uint64_t position, uintptr_t size){
+	uint64_t p;
+	int r = 0;
+	acquireLock(&bc->lock);
+	for(p = position & ~(uint64_t)(CACHED_BLOCK_SIZE - 1); r == 0 && p < position + size; p += CACHED_BLOCK_SIZE){
+		r = (searchBlock_noLock(bc, diskHandle, p) != NULL);
+	}
+	releaseLock(&bc->lock);
+	return r;
+}
+
+// return 1 if the number of dirty blocks reaches DIRTY_HIGH_WATER_MARK
+static int markBlockDirty(BlockCache *bc, CachedBlock *b){
+	acquireLock(&bc->lock);
+	if(b->isDirty == 0){
+		b->isDirty = 1;
+		bc->dirtyCount++;
+	}
+	const int needWriteBack = (bc->dirtyCount >= DIRTY_HIGH_WATER_MARK(bc->maxBlockCount));
+	releaseLock(&bc->lock);
+	return needWriteBack;
+}
+
+uintptr_t writeBlockCache(BlockCache *bc, uintptr_t diskHandle, const void *buffer, uint64_t position, uintptr_t size){
+	uintptr_t writeSize = 0;
+	int needWriteBack = 0;
+	while(writeSize < size){
+		const uint64_t blockPosition = (position + writeSize) & ~(uint64_t)(CACHED_BLOCK_SIZE - 1);
+		const uintptr_t copyBegin = (uintptr_t)(position + writeSize - blockPosition);
+		const uintptr_t copySize = MIN(CACHED_BLOCK_SIZE - copyBegin, size - writeSize);
+		int needLoad;
+		CachedBlock *b = lookupOrWriteBackBlock(bc, diskHandle, blockPosition, &needLoad);
+		if(b == NULL)
+			break;
+		int ok;
+		if(needLoad){
+			// do not read a block that is entirely overwritten
+			ok = (copySize == CACHED_BLOCK_SIZE? 1: waitLoadBlock(issueLoadBlock(b)));
+			if(ok){
+				memcpy(((uint8_t*)b->data) + copyBegin, ((const uint8_t*)buffer) + writeSize, copySize);
+				needWriteBack |= markBlockDirty(bc, b);
+			}
+			finishLoadingBlock(bc, b, ok);
+		}
+		else{
+			ok = waitBlockLoaded(b);
+			if(ok){
+				memcpy(((uint8_t*)b->data) + copyBegin, ((const uint8_t*)buffer) + writeSize, copySize);
+				needWriteBack |= markBlockDirty(bc, b);
+			}
+		}
+		releaseCachedBlock(bc, b);
+		if(!ok)
+			break;
+		writeSize += copySize;
+	}
+	// the writer pays for write-back instead of waiting for flushBlockCacheTask
+	if(needWriteBack){
+		flushBlockCache(bc);
+	}
+	return writeSize;
+}
+
+// write back dirty blocks in batches
+// a block modified during write back is dirty again and written in the next flush
+int flushBlockCache(BlockCache *bc){
+	CachedBlock *b[MAX_LOAD_BLOCK_COUNT];
+	uintptr_t io[MAX_LOAD_BLOCK_COUNT];
+	uintptr_t scanIndex = 0;
+	int allOK = 1;
+	while(1){
+		int blockCount = 0, i;
+		acquireLock(&bc->lock);
+		for(; scanIndex < bc->blockCount && blockCount < MAX_LOAD_BLOCK_COUNT; scanIndex++){
+			CachedBlock *d = bc->block[scanIndex];
+			if(d->isDirty == 0)
+				continue;
+			d->isDirty = 0;
+			d->referenceCount++;
+			bc->dirtyCount--;
+			b[blockCount] = d;
+			blockCount++;
+		}
+		releaseLock(&bc->lock);
+		if(blockCount == 0)
+			break;
+		for(i = 0; i < blockCount; i++){
+			io[i] = systemCall_seekWriteFile(b[i]->diskHandle, b[i]->data, b[i]->position, CACHED_BLOCK_SIZE);
+		}
+		for(i = 0; i < blockCount; i++){
+			if(waitLoadBlock(io[i]) == 0){
+				markBlockDirty(bc, b[i]);
+				allOK = 0;
+			}
+			else{
+				acquireLock(&bc->lock);
+				bc->writeBackCount++;
+				releaseLock(&bc->lock);
+			}
+			releaseCachedBlock(bc, b[i]);
+		}
+	}
+	return allOK;
+}
+
+void invalidateBlockCache(BlockCache *bc, uintptr_t diskHandle){
+	uintptr_t i;
+	acquireLock(&bc->lock);
+	for(i = 0; i < bc->blockCount; i++){
+		CachedBlock *b = bc->block[i];
+		if(b->prev == NULL || b->referenceCount != 0 || b->isDirty || b->diskHandle != diskHandle)
+			continue;
+		REMOVE_FROM_DQUEUE(b);
+		b->isValid = 0;
+	}
+	releaseLock(&bc->lock);
+}
+
+void getBlockCacheStatistics(BlockCache *bc, BlockCacheStatistics *s){
+	acquireLock(&bc->lock);
+	s->hitCount = bc->hitCount;
+	s->missCount = bc->missCount;
+	s->evictCount = bc->evictCount;
+	s->prefetchCount = bc->prefetchCount;
+	s->dirtyCount = bc->dirtyCount;
+	s->writeBackCount = bc->writeBackCount;
+	s->blockCount = bc->blockCount;
+	s->maxBlockCount = bc->maxBlockCount;
+	releaseLock(&bc->lock);
+}
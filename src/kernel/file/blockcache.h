@@ -0,0 +1,54 @@
+#ifndef BLOCKCACHE_H_INCLUDED
+#define BLOCKCACHE_H_INCLUDED
+
+#include<std.h>
+#include"memory/memory.h"
+
+// cache of disk data keyed by (disk file handle, position)
+// the disk handles are global handles (see syncOpenGlobalFileN),
+// so they are unique among the open disks and valid in the flush task
+// a block is PAGE_SIZE bytes and its position is aligned to PAGE_SIZE
+#define CACHED_BLOCK_SIZE (PAGE_SIZE)
+
+typedef struct BlockCache BlockCache;
+typedef struct CachedBlock CachedBlock;
+
+// maxBlockCount is the maximum number of blocks in memory
+BlockCache *createBlockCache(uintptr_t maxBlockCount);
+// the cache shared by all file systems
+BlockCache *getDiskBlockCache(void);
+
+// return a referenced block containing the data at blockPosition, or NULL if failed
+// blockPosition has to be a multiple of CACHED_BLOCK_SIZE
+CachedBlock *acquireCachedBlock(BlockCache *bc, uintptr_t diskHandle, uint64_t blockPosition);
+const void *getCachedBlockData(CachedBlock *b);
+void releaseCachedBlock(BlockCache *bc, CachedBlock *b);
+
+// read size bytes at position through the cache
+// return the number of bytes read
+uintptr_t readBlockCache(BlockCache *bc, uintptr_t diskHandle, void *buffer, uint64_t position, uintptr_t size);
+// load size bytes at position into the cache for later reads
+uintptr_t prefetchBlockCache(BlockCache *bc, uintptr_t diskHandle, uint64_t position, uintptr_t size);
+// return 1 if any block in [position, position + size) is cached or being loaded
+int isBlockCached(BlockCache *bc, uintptr_t diskHandle, uint64_t position, uintptr_t size);
+
+// write-back: copy size bytes to the cache and mark the blocks dirty
+// return the number of bytes written
+uintptr_t writeBlockCache(BlockCache *bc, uintptr_t diskHandle, const void *buffer, uint64_t position, uintptr_t size);
+// write all dirty blocks to disk. return 1 if all writes succeeded
+// dirty blocks are also flushed periodically, and by writers when too many blocks are dirty
+int flushBlockCache(BlockCache *bc);
+
+// remove all unreferenced clean blocks of diskHandle
+void invalidateBlockCache(BlockCache *bc, uintptr_t diskHandle);
+
+typedef struct{
+	uint64_t hitCount, missCount, evictCount, prefetchCount;
+	uintptr_t dirtyCount;
+	uint64_t writeBackCount;
+	uintptr_t blockCount, maxBlockCount;
+}BlockCacheStatistics;
+
+void getBlockCacheStatistics(BlockCache *bc, BlockCacheStatistics *s);
+
+#endif
@@ -2,6 +2,7 @@
 #include"kernel.h"
 #include"memory/memory.h"
 #include"fileservice.h"
+#include"blockcache.h"
 #include"resource/resource.h"
 #include"task/exclusivelock.h"
 #include"task/task.h"
@@ -90,6 +91,8 @@ typedef struct __attribute__((__packed__)){
 
 static_assert(sizeof(FATDirEntry) == 32);
 
+#define FAT_SHORT_NAME_LENGTH (11)
+
 typedef struct __attribute__((__packed__)){
 	uint8_t position;
 	uint16_t fileName0[5];
@@ -113,18 +116,46 @@ enum FATAttribute{
 
 static_assert(sizeof(LongFATDirEntry) == 32);
 
+typedef struct __attribute__((__packed__)){
+	uint32_t leadSignature; // 0x41615252
+	uint8_t reserved[480];
+	uint32_t structSignature; // 0x61417272
+	uint32_t freeClusterCount; // 0xffffffff if unknown
+	uint32_t nextFreeCluster; // 0xffffffff if unknown
+	uint8_t reserved2[12];
+	uint32_t trailSignature; // 0xaa550000
+}FSInfoSector;
+
+static_assert(sizeof(FSInfoSector) == 512);
+
+#define FSINFO_LEAD_SIGNATURE (0x41615252)
+#define FSINFO_STRUCT_SIGNATURE (0x61417272)
+#define FSINFO_UNKNOWN (0xffffffff)
+
 #pragma pack()
 
 //static struct SlabManager *slab = NULL;
 
 typedef struct FAT32DiskPartition{
+	// global handle of the disk, which is also the key of its blocks in cache
 	uintptr_t diskFileHandle;
 	uint64_t startLBA;
 	uint64_t firstDataLBA;
 	uintptr_t sectorSize;
 	char partitionName;
 	const FATBootSector *bootRecord;
-	uint32_t *fat;
+	// FAT is read through block cache
+	uint64_t fatPosition;
+	uint32_t fatEntryCount;
+	BlockCache *cache;
+	// cluster allocation. FAT and FSInfo are written to block cache and flushed together
+	Semaphore *allocationLock;
+	// 0 if the partition has no valid FSInfo sector
+	uint64_t fsInfoPosition;
+	uint32_t freeClusterCount, nextFreeCluster;
+	// bytes returned by readByFAT and bytes copied from block cache
+	Spinlock statisticsLock;
+	uint64_t readByteCount, copyByteCount, writeByteCount;
 
 	struct FAT32DiskPartition **prev, *next;
 }FAT32DiskPartition;
@@ -140,6 +171,11 @@ static uint32_t getBeginCluster(const FATDirEntry *d){
 	return ((uint32_t)d->clusterLow) + (((uint32_t)d->clusterHigh) << 16);
 }
 
+static void setBeginCluster(FATDirEntry *d, uint32_t cluster){
+	d->clusterLow = (cluster & 0xffff);
+	d->clusterHigh = ((cluster >> 16) & 0xffff);
+}
+
 // assume size of name >= 12
 static uintptr_t getFileName(const FATDirEntry *d, char *name){
 	uintptr_t mainEnd, extEnd;
@@ -161,6 +197,87 @@ static int isEmptyDirEntry(const FATDirEntry *d){
 	return d->mainName[0] == 0xe5;
 }
 
+// VFAT long file name
+// long name entries are stored before the short name entry in reverse order
+
+#define MAX_LONG_FILE_NAME_LENGTH (255)
+#define LONG_NAME_CHARACTER_COUNT (13)
+#define LAST_LONG_NAME_ENTRY (0x40)
+#define LONG_NAME_SEQUENCE_MASK (0x1f)
+
+typedef struct{
+	// 0 if no long name is being parsed
+	int nextSequence;
+	uint8_t checksum;
+	uintptr_t length;
+	char name[LONG_NAME_CHARACTER_COUNT * LONG_NAME_SEQUENCE_MASK];
+}LongFileName;
+
+static void resetLongFileName(LongFileName *lfn){
+	lfn->nextSequence = 0;
+	lfn->length = 0;
+}
+
+static uint8_t getShortNameChecksum(const FATDirEntry *d){
+	uint8_t sum = 0;
+	int i;
+	for(i = 0; i < FAT_SHORT_NAME_LENGTH; i++){
+		sum = ((sum & 1) << 7) + (sum >> 1) + d->fileName[i];
+	}
+	return sum;
+}
+
+static uint16_t getLongNameCharacter(const LongFATDirEntry *le, int i){
+	if(i < 5)
+		return le->fileName0[i];
+	if(i < 11)
+		return le->fileName5[i - 5];
+	return le->fileName11[i - 11];
+}
+
+static void parseLongNameEntry(LongFileName *lfn, const LongFATDirEntry *le){
+	const int sequence = (le->position & LONG_NAME_SEQUENCE_MASK);
+	if(le->position & LAST_LONG_NAME_ENTRY){
+		lfn->nextSequence = sequence;
+		lfn->checksum = le->checksum;
+		lfn->length = 0;
+	}
+	if(sequence == 0 || sequence != lfn->nextSequence || le->checksum != lfn->checksum){
+		resetLongFileName(lfn);
+		return;
+	}
+	const uintptr_t begin = (sequence - 1) * LONG_NAME_CHARACTER_COUNT;
+	int i;
+	for(i = 0; i < LONG_NAME_CHARACTER_COUNT; i++){
+		const uint16_t c = getLongNameCharacter(le, i);
+		if(c == 0 || c == 0xffff)
+			break;
+		// UCS-2 characters out of ASCII are not supported
+		lfn->name[begin + i] = (c < 0x80? (char)c: '?');
+	}
+	if(le->position & LAST_LONG_NAME_ENTRY){
+		lfn->length = begin + i;
+	}
+	lfn->nextSequence = sequence - 1;
+}
+
+// return 1 if lfn is the long name of the short name entry d
+static int isLongFileNameOf(const LongFileName *lfn, const FATDirEntry *d){
+	return lfn->length != 0 && lfn->length <= MAX_LONG_FILE_NAME_LENGTH &&
+		lfn->nextSequence == 0 && lfn->checksum == getShortNameChecksum(d);
+}
+
+static int equalsIgnoreCase(const char *s1, uintptr_t length1, const char *s2, uintptr_t length2){
+	uintptr_t i;
+	if(length1 != length2)
+		return 0;
+	for(i = 0; i < length1; i++){
+		if(tolower(s1[i]) != tolower(s2[i]))
+			return 0;
+	}
+	return 1;
+}
+
 static uintptr_t getClusterSize(const FAT32DiskPartition *dp){
 	return dp->bootRecord->sectorsPerCluster * dp->sectorSize;
 }
@@ -169,62 +286,216 @@ static uint64_t clusterToLBA(const FAT32DiskPartition *dp, uint32_t cluster){
 	return dp->firstDataLBA + (cluster - 2) * (uint64_t)dp->bootRecord->sectorsPerCluster;
 }
 
-static uint32_t *loadFAT32(const FATBootSector *br, const FAT32DiskPartition *dp){
-	const size_t fatSize = br->ebr32.sectorsPerFAT32 * br->bytesPerSector; // what is the actual length of fat?
-	const uint64_t fatBeginLBA = dp->startLBA + br->reservedSectorCount;
-	//TODO: ahci driver accepts non-aligned buffer
-	uint32_t *fat = systemCall_allocateHeap(CEIL(fatSize, PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
-	EXPECT(fat != NULL);
-	unsigned p;
-	for(p = 0; p * PAGE_SIZE < fatSize; p++){
-		uintptr_t readSize = PAGE_SIZE;
-		uintptr_t rwDisk = syncSeekReadFile(dp->diskFileHandle,
-			(void*)(((uintptr_t)fat) + PAGE_SIZE * p), fatBeginLBA * dp->sectorSize + p * PAGE_SIZE, &readSize);
-		if(rwDisk == IO_REQUEST_FAILURE || readSize != PAGE_SIZE){
+#define FREE_CLUSTER (0)
+#define END_OF_CLUSTER (0x0ffffff8)
+#define BAD_CLUSTER (0x0ffffff7)
+// value written at the end of a new cluster chain
+#define END_OF_CHAIN (0x0fffffff)
+#define FAT32_ENTRY_MASK (0x0fffffff)
+
+static int isValidCluster(uint32_t cluster, const FAT32DiskPartition *dp){
+	// end of cluster chain
+	return cluster >= 2 && cluster < END_OF_CLUSTER && cluster < dp->fatEntryCount;
+}
+
+// FATReader holds the cached block of the last read entry,
+// so that walking a cluster chain does not search the cache for every cluster
+typedef struct{
+	FAT32DiskPartition *diskPartition;
+	CachedBlock *block;
+	uint64_t blockPosition;
+}FATReader;
+
+static void initFATReader(FATReader *r, FAT32DiskPartition *dp){
+	r->diskPartition = dp;
+	r->block = NULL;
+	r->blockPosition = 0;
+}
+
+static void closeFATReader(FATReader *r){
+	if(r->block != NULL){
+		releaseCachedBlock(r->diskPartition->cache, r->block);
+		r->block = NULL;
+	}
+}
+
+// return END_OF_CLUSTER if the entry is bad or cannot be read
+static uint32_t nextClusterByFAT(FATReader *r, uint32_t cluster){
+	FAT32DiskPartition *const dp = r->diskPartition;
+	const uint64_t position = dp->fatPosition + cluster * sizeof(uint32_t);
+	const uint64_t blockPosition = (position & ~(uint64_t)(CACHED_BLOCK_SIZE - 1));
+	if(r->block == NULL || r->blockPosition != blockPosition){
+		closeFATReader(r);
+		r->block = acquireCachedBlock(dp->cache, dp->diskFileHandle, blockPosition);
+		if(r->block == NULL){
 			printk("warning: failed to read FAT\n");
-			break;
+			return END_OF_CLUSTER;
 		}
+		r->blockPosition = blockPosition;
 	}
-	EXPECT(p * PAGE_SIZE >= fatSize);
-	return fat;
-	ON_ERROR;
-	systemCall_releaseHeap(fat);
-	ON_ERROR;
-	return NULL;
+	const uint32_t next = FAT32_ENTRY_MASK & *(const uint32_t*)
+		(((uintptr_t)getCachedBlockData(r->block)) + (uintptr_t)(position - blockPosition));
+	if(next == BAD_CLUSTER)
+		return END_OF_CLUSTER;
+	return next;
 }
 
-#define END_OF_CLUSTER (0x0ffffff8)
-#define BAD_CLUSTER (0x0ffffff7)
+// write value to the entry of cluster in every FAT copy
+// the high 4 bits of an entry are reserved and preserved
+static int setClusterByFAT(FAT32DiskPartition *dp, uint32_t cluster, uint32_t value){
+	const uint64_t fatSize = dp->bootRecord->ebr32.sectorsPerFAT32 * (uint64_t)dp->sectorSize;
+	int f;
+	for(f = 0; f < dp->bootRecord->fatCount; f++){
+		const uint64_t position = dp->fatPosition + f * fatSize + cluster * sizeof(uint32_t);
+		uint32_t entry;
+		if(readBlockCache(dp->cache, dp->diskFileHandle, &entry, position, sizeof(entry)) != sizeof(entry))
+			return 0;
+		entry = ((entry & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK));
+		if(writeBlockCache(dp->cache, dp->diskFileHandle, &entry, position, sizeof(entry)) != sizeof(entry))
+			return 0;
+	}
+	return 1;
+}
 
-static uint32_t nextClusterByFAT(uint32_t cluster, const FAT32DiskPartition *dp){
-	return dp->fat[cluster];
+// FSInfo is a hint. if it is unknown or invalid, free clusters are counted on mount
+static void loadFSInfo(FAT32DiskPartition *dp){
+	const FATBootSector *br = dp->bootRecord;
+	dp->fsInfoPosition = 0;
+	dp->freeClusterCount = FSINFO_UNKNOWN;
+	dp->nextFreeCluster = 2;
+	if(br->ebr32.fsInfoSector != 0 && br->ebr32.fsInfoSector < br->reservedSectorCount){
+		FSInfoSector *fsInfo = allocateKernelMemory(sizeof(*fsInfo));
+		if(fsInfo != NULL){
+			const uint64_t position = (dp->startLBA + br->ebr32.fsInfoSector) * dp->sectorSize;
+			if(readBlockCache(dp->cache, dp->diskFileHandle, fsInfo, position, sizeof(*fsInfo)) == sizeof(*fsInfo) &&
+			fsInfo->leadSignature == FSINFO_LEAD_SIGNATURE && fsInfo->structSignature == FSINFO_STRUCT_SIGNATURE){
+				dp->fsInfoPosition = position;
+				dp->freeClusterCount = fsInfo->freeClusterCount;
+				if(isValidCluster(fsInfo->nextFreeCluster, dp)){
+					dp->nextFreeCluster = fsInfo->nextFreeCluster;
+				}
+			}
+			DELETE(fsInfo);
+		}
+	}
+	if(dp->freeClusterCount != FSINFO_UNKNOWN && dp->freeClusterCount < dp->fatEntryCount)
+		return;
+	uint32_t c, freeCount = 0;
+	FATReader r;
+	initFATReader(&r, dp);
+	for(c = 2; c < dp->fatEntryCount; c++){
+		if(nextClusterByFAT(&r, c) == FREE_CLUSTER){
+			freeCount++;
+		}
+	}
+	closeFATReader(&r);
+	dp->freeClusterCount = freeCount;
 }
 
-static int isValidCluster(uint32_t cluster, const FAT32DiskPartition *dp){
-	const uint32_t clustersPerFAT = (dp->bootRecord->ebr32.sectorsPerFAT32 * dp->bootRecord->bytesPerSector) / sizeof(dp->fat[0]);
-	if(cluster >= END_OF_CLUSTER || cluster >= clustersPerFAT) // end of cluster chain
-		return 0;
-	if(dp->fat[cluster] == BAD_CLUSTER)
-		return 0;
-	return 1;
+static void writeFSInfo_noLock(FAT32DiskPartition *dp){
+	if(dp->fsInfoPosition == 0)
+		return;
+	const uint32_t value[2] = {dp->freeClusterCount, dp->nextFreeCluster};
+	writeBlockCache(dp->cache, dp->diskFileHandle, value,
+		dp->fsInfoPosition + MEMBER_OFFSET(FSInfoSector, freeClusterCount), sizeof(value));
 }
 
-#undef BAD_CLUSTER
-#undef END_OF_CLUSTER
+// prefer extending the chain after prevCluster, then the first free run of count clusters
+// return the first cluster of the longest found run and set *runLength
+static uint32_t searchFreeClusters_noLock(FAT32DiskPartition *dp, uint32_t prevCluster, uint32_t count, uint32_t *runLength){
+	FATReader r;
+	initFATReader(&r, dp);
+	uint32_t bestBegin = 0, bestLength = 0;
+	if(prevCluster != 0 && isValidCluster(prevCluster + 1, dp) && nextClusterByFAT(&r, prevCluster + 1) == FREE_CLUSTER){
+		bestBegin = prevCluster + 1;
+		for(bestLength = 1; bestLength < count && isValidCluster(bestBegin + bestLength, dp) &&
+			nextClusterByFAT(&r, bestBegin + bestLength) == FREE_CLUSTER; bestLength++);
+	}
+	const uint32_t entryCount = dp->fatEntryCount - 2;
+	uint32_t i, runBegin = 0, length = 0;
+	for(i = 0; i < entryCount && bestLength < count; i++){
+		const uint32_t c = 2 + (dp->nextFreeCluster - 2 + i) % entryCount;
+		// a run does not wrap around
+		if(c == 2){
+			length = 0;
+		}
+		if(nextClusterByFAT(&r, c) != FREE_CLUSTER){
+			length = 0;
+			continue;
+		}
+		if(length == 0){
+			runBegin = c;
+		}
+		length++;
+		if(length > bestLength){
+			bestBegin = runBegin;
+			bestLength = length;
+		}
+	}
+	closeFATReader(&r);
+	*runLength = bestLength;
+	return bestBegin;
+}
 
-static uint32_t countClusterByFAT(uint32_t cluster, const FAT32DiskPartition *dp){
-	uint32_t clusterCount;
-	for(clusterCount = 0; isValidCluster(cluster, dp); clusterCount++){
-		cluster = nextClusterByFAT(cluster, dp);
+// allocate at most count contiguous clusters and link them after prevCluster (0 if the file is empty)
+// return the number of allocated clusters and set *firstCluster
+static uint32_t allocateFATClusters(FAT32DiskPartition *dp, uint32_t prevCluster, uint32_t count, uint32_t *firstCluster){
+	uint32_t runLength = 0;
+	acquireSemaphore(dp->allocationLock);
+	const uint32_t runBegin = (dp->freeClusterCount == 0? 0:
+		searchFreeClusters_noLock(dp, prevCluster, count, &runLength));
+	runLength = MIN(runLength, count);
+	uint32_t c;
+	for(c = runBegin; c < runBegin + runLength; c++){
+		if(setClusterByFAT(dp, c, (c + 1 == runBegin + runLength? END_OF_CHAIN: c + 1)) == 0)
+			break;
 	}
-	return clusterCount;
+	if(c != runBegin + runLength || (prevCluster != 0 && runLength != 0 && setClusterByFAT(dp, prevCluster, runBegin) == 0)){
+		printk("warning: failed to write FAT\n");
+		// do not leak the partially written chain
+		while(c != runBegin){
+			c--;
+			setClusterByFAT(dp, c, FREE_CLUSTER);
+		}
+		runLength = 0;
+	}
+	if(runLength != 0){
+		dp->freeClusterCount -= MIN(dp->freeClusterCount, runLength);
+		dp->nextFreeCluster = (isValidCluster(runBegin + runLength, dp)? runBegin + runLength: 2);
+		writeFSInfo_noLock(dp);
+	}
+	releaseSemaphore(dp->allocationLock);
+	*firstCluster = runBegin;
+	return runLength;
 }
 
-// currently not support long file name
-#define FAT_SHORT_NAME_LENGTH (11)
+// free the cluster chain beginning at cluster
+static void freeFATClusters(FAT32DiskPartition *dp, uint32_t cluster){
+	FATReader r;
+	initFATReader(&r, dp);
+	acquireSemaphore(dp->allocationLock);
+	while(isValidCluster(cluster, dp)){
+		const uint32_t next = nextClusterByFAT(&r, cluster);
+		// r reads the same cached block that setClusterByFAT writes
+		if(setClusterByFAT(dp, cluster, FREE_CLUSTER) == 0){
+			printk("warning: failed to write FAT\n");
+			break;
+		}
+		dp->freeClusterCount++;
+		if(cluster < dp->nextFreeCluster){
+			dp->nextFreeCluster = cluster;
+		}
+		cluster = next;
+	}
+	writeFSInfo_noLock(dp);
+	releaseSemaphore(dp->allocationLock);
+	closeFATReader(&r);
+}
 
 static int toFATFileName(char *newName, const char *name, uintptr_t length){
 	uintptr_t i;
+	if(length == 0)
+		return 0;
 	for(i = length - 1; i > 0 && name[i] != '.'; i--){ // find last dot
 	}
 	uintptr_t mainLen, ext;
@@ -251,19 +522,28 @@ static FATDirEntry *searchDirectory(
 	const char *name, uintptr_t length
 ){
 	char formattedName[FAT_SHORT_NAME_LENGTH];
-	toFATFileName(formattedName, name, length);
-	FATDirEntry *e = NULL;
+	const int isShortName = toFATFileName(formattedName, name, length);
+	LongFileName lfn;
+	resetLongFileName(&lfn);
 	unsigned p;
 	for(p = 0; p < dirLength; p++){
 		if(isEndOfDirEntry(&dir[p])) // end of directory
 			break;
-		if(isEmptyDirEntry(&dir[p])) // empty entry
+		if(isEmptyDirEntry(&dir[p])){ // empty entry
+			resetLongFileName(&lfn);
 			continue;
-		if(strncmp((const char*)dir[p].fileName, formattedName, FAT_SHORT_NAME_LENGTH) == 0){
-			e = dir + p;
 		}
+		if(dir[p].attribute == FAT_LONG_FILE_NAME){
+			parseLongNameEntry(&lfn, (const LongFATDirEntry*)(dir + p));
+			continue;
+		}
+		if(isLongFileNameOf(&lfn, dir + p) && equalsIgnoreCase(lfn.name, lfn.length, name, length))
+			return dir + p;
+		if(isShortName && strncmp((const char*)dir[p].fileName, formattedName, FAT_SHORT_NAME_LENGTH) == 0)
+			return dir + p;
+		resetLongFileName(&lfn);
 	}
-	return e;
+	return NULL;
 }
 
 static FAT32DiskPartition *createFATPartition(uintptr_t fileHandle, uint64_t startLBA, uintptr_t sectorSize, char partitionName){
@@ -273,9 +553,17 @@ static FAT32DiskPartition *createFATPartition(uintptr_t fileHandle, uint64_t sta
 	dp->startLBA = startLBA;
 	dp->sectorSize = sectorSize;
 	dp->partitionName = partitionName;
+	dp->statisticsLock = initialSpinlock;
+	dp->readByteCount = 0;
+	dp->copyByteCount = 0;
+	dp->writeByteCount = 0;
+	dp->cache = getDiskBlockCache();
+	EXPECT(dp->cache != NULL);
+	dp->allocationLock = createSemaphore(1);
+	EXPECT(dp->allocationLock != NULL);
 	const uintptr_t readSize = CEIL(sizeof(FATBootSector), dp->sectorSize);
-	//TODO: dp->bootRecord is in user space, and thus not accessible in interrupt handler
-	FATBootSector *br = systemCall_allocateHeap(readSize, KERNEL_NON_CACHED_PAGE);
+	// global handles only accept kernel buffers
+	FATBootSector *br = allocateKernelMemory(readSize);
 	EXPECT(br != NULL);
 	dp->bootRecord = br;
 	MEMSET0(br);
@@ -289,22 +577,28 @@ static FAT32DiskPartition *createFATPartition(uintptr_t fileHandle, uint64_t sta
 	//uint32_t bytesPerCluster = br->sectorsPerCluster * br->bytesPerSector;
 	//printk("%x %x %x %x\n",br->ebr32.rootCluster, fatBeginLBA, sectorsPerFAT32, bytesPerCluster);
 
-	uint32_t *fat = loadFAT32(br, dp);
-	EXPECT(fat != NULL);
-	dp->fat = fat;
-	//const unsigned fatEntryCount = br->ebr32.sectorsPerFAT32 * (sectorSize / 4);
-	//unsigned p;
+	// FAT sectors are loaded on demand
+	dp->fatPosition = (dp->startLBA + br->reservedSectorCount) * sectorSize;
+	dp->fatEntryCount = (br->ebr32.sectorsPerFAT32 * br->bytesPerSector) / sizeof(uint32_t);
 	dp->firstDataLBA = dp->startLBA +
 		(uint64_t)br->reservedSectorCount + br->ebr32.sectorsPerFAT32 * (uint64_t)br->fatCount;
+	// the last FAT entries may be beyond the data area
+	const uint64_t sectorCount = (br->sectorCount != 0? br->sectorCount: br->SectorCount2);
+	EXPECT(sectorCount > dp->firstDataLBA - dp->startLBA && br->sectorsPerCluster != 0);
+	dp->fatEntryCount = (uint32_t)MIN(dp->fatEntryCount,
+		2 + (sectorCount - (dp->firstDataLBA - dp->startLBA)) / br->sectorsPerCluster);
+	loadFSInfo(dp);
 	//printk("read fat ok\n");
 	dp->prev = NULL;
 	dp->next = NULL;
 	return dp;
-	//systemCall_releaseHeap(fat);
 	ON_ERROR;
 	ON_ERROR;
 	ON_ERROR;
-	systemCall_releaseHeap((void*)br);
+	releaseKernelMemory((void*)br);
+	ON_ERROR;
+	deleteSemaphore(dp->allocationLock);
+	ON_ERROR;
 	ON_ERROR;
 	DELETE(dp);
 	ON_ERROR;
@@ -312,6 +606,70 @@ static FAT32DiskPartition *createFATPartition(uintptr_t fileHandle, uint64_t sta
 	return NULL;
 }
 
+// format
+
+#define FORMAT_RESERVED_SECTOR_COUNT (32)
+#define FORMAT_FAT_COUNT (2)
+#define FORMAT_FSINFO_SECTOR (1)
+#define FORMAT_ROOT_CLUSTER (2)
+
+// clusters are PAGE_SIZE bytes, the same as block cache
+// the cluster count is not checked against the FAT32 minimum, so small partitions are not portable
+int formatFAT32(void *partition, uint64_t startLBA, uint32_t sectorCount, uintptr_t sectorSize){
+	EXPECT(sectorSize >= sizeof(FATBootSector) && PAGE_SIZE % sectorSize == 0);
+	const uint32_t sectorsPerCluster = PAGE_SIZE / sectorSize;
+	EXPECT(sectorCount > FORMAT_RESERVED_SECTOR_COUNT + sectorsPerCluster);
+	// overestimate FAT size by assuming all sectors after reserved area are clusters
+	const uint32_t maxClusterCount = (sectorCount - FORMAT_RESERVED_SECTOR_COUNT) / sectorsPerCluster;
+	const uint32_t sectorsPerFAT = CEIL((maxClusterCount + 2) * sizeof(uint32_t), sectorSize) / sectorSize;
+	const uint32_t firstDataSector = FORMAT_RESERVED_SECTOR_COUNT + FORMAT_FAT_COUNT * sectorsPerFAT;
+	EXPECT(sectorCount >= firstDataSector + sectorsPerCluster);
+	const uint32_t clusterCount = (sectorCount - firstDataSector) / sectorsPerCluster;
+	// clear reserved sectors, FAT and root directory
+	memset(partition, 0, (firstDataSector + sectorsPerCluster) * sectorSize);
+
+	FATBootSector *br = partition;
+	const uint8_t jmp[3] = {0xeb, 0x58, 0x90};
+	memcpy(br->jmp, jmp, sizeof(br->jmp));
+	memcpy(br->oemName, "HOMEOS3 ", sizeof(br->oemName));
+	br->bytesPerSector = sectorSize;
+	br->sectorsPerCluster = sectorsPerCluster;
+	br->reservedSectorCount = FORMAT_RESERVED_SECTOR_COUNT;
+	br->fatCount = FORMAT_FAT_COUNT;
+	br->mediaType = 0xf8;
+	br->hiddenSectorCount = (uint32_t)startLBA;
+	br->SectorCount2 = sectorCount;
+	br->ebr32.sectorsPerFAT32 = sectorsPerFAT;
+	br->ebr32.rootCluster = FORMAT_ROOT_CLUSTER;
+	br->ebr32.fsInfoSector = FORMAT_FSINFO_SECTOR;
+	br->ebr32.ext.driveNumber = 0x80;
+	br->ebr32.ext.signature = 0x29;
+	memcpy(br->ebr32.ext.partitionName, "NO NAME    ", sizeof(br->ebr32.ext.partitionName));
+	memcpy(br->ebr32.ext.fatName, "FAT32   ", sizeof(br->ebr32.ext.fatName));
+	br->bootSignature = 0xaa55;
+
+	FSInfoSector *fsInfo = (FSInfoSector*)(((uintptr_t)partition) + FORMAT_FSINFO_SECTOR * sectorSize);
+	fsInfo->leadSignature = FSINFO_LEAD_SIGNATURE;
+	fsInfo->structSignature = FSINFO_STRUCT_SIGNATURE;
+	fsInfo->freeClusterCount = clusterCount - 1;
+	fsInfo->nextFreeCluster = FORMAT_ROOT_CLUSTER + 1;
+	fsInfo->trailSignature = 0xaa550000;
+
+	int f;
+	for(f = 0; f < FORMAT_FAT_COUNT; f++){
+		uint32_t *fat = (uint32_t*)(((uintptr_t)partition) +
+			(FORMAT_RESERVED_SECTOR_COUNT + f * sectorsPerFAT) * sectorSize);
+		fat[0] = (END_OF_CHAIN & ~0xff) | br->mediaType;
+		fat[1] = END_OF_CHAIN;
+		fat[FORMAT_ROOT_CLUSTER] = END_OF_CHAIN;
+	}
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
 #define FAT32_SERVICE_NAME "fat32"
 
 struct FAT32DiskPartitionList{
@@ -345,13 +703,29 @@ static void addFAT32DiskPartition(FAT32DiskPartition *dp){
 
 // FAT file
 
+// a run of physically contiguous clusters
+typedef struct{
+	// index of the first cluster in file
+	uint32_t fileCluster;
+	uint32_t cluster;
+	uint32_t clusterCount;
+}FATExtent;
+
 typedef struct FATFile{
 	// search key
-	uint32_t beginCluster;
-	const FAT32DiskPartition *diskPartition;
+	// disk position of the directory entry. 0 for root directory
+	// (empty files do not have a cluster)
+	uint64_t dirEntryPosition;
+	FAT32DiskPartition *diskPartition;
+	// size and begin cluster are updated by writes
+	FATDirEntry dirEntry;
 	// lock
 	ReaderWriterLock *rwLock;
 	int referenceCount;
+	// cluster chain, built on first read and extended by writes
+	Spinlock extentLock;
+	FATExtent *extent;
+	uint32_t extentCount, extentCapacity;
 
 	struct FATFile *next, **prev;
 }FATFile;
@@ -361,11 +735,12 @@ struct FATFileList{
 	Spinlock lock;
 }fatFileList = {NULL, INITIAL_SPINLOCK};
 
-static FATFile *searchCreateFATFile(const FAT32DiskPartition *dp, uint32_t cluster, int refCnt){
+// if the file is opened, d is ignored and the shared entry is used
+static FATFile *searchCreateFATFile(FAT32DiskPartition *dp, const FATDirEntry *d, uint64_t dirEntryPosition, int refCnt){
 	acquireLock(&fatFileList.lock);
 	FATFile *ff;
 	for(ff = fatFileList.head; ff != NULL; ff = ff->next){
-		if(ff->beginCluster == cluster && ff->diskPartition == dp)
+		if(ff->dirEntryPosition == dirEntryPosition && ff->diskPartition == dp)
 			break;
 	}
 	while(ff != NULL){
@@ -378,7 +753,8 @@ static FATFile *searchCreateFATFile(const FAT32DiskPartition *dp, uint32_t clust
 		releaseLock(&fatFileList.lock);
 		return NULL;
 	}
-	ff->beginCluster = cluster;
+	ff->dirEntryPosition = dirEntryPosition;
+	ff->dirEntry = *d;
 	ff->rwLock = createReaderWriterLock(1);
 	if(ff->rwLock == NULL){
 		releaseLock(&fatFileList.lock);
@@ -387,6 +763,10 @@ static FATFile *searchCreateFATFile(const FAT32DiskPartition *dp, uint32_t clust
 	}
 	ff->referenceCount = refCnt;
 	ff->diskPartition = dp;
+	ff->extentLock = initialSpinlock;
+	ff->extent = NULL;
+	ff->extentCount = 0;
+	ff->extentCapacity = 0;
 	ff->next = NULL;
 	ff->prev = NULL;
 	ADD_TO_DQUEUE(ff, &fatFileList.head);
@@ -404,27 +784,218 @@ static int addFATFileReference(FATFile *ff, int refCnt){
 	}
 	releaseLock(&fatFileList.lock);
 	if(needDelete){
+		if(ff->extent != NULL){
+			DELETE(ff->extent);
+		}
 		deleteReaderWriterLock(ff->rwLock);
 		DELETE(ff);
 	}
 	return r;
 }
 
+static uint32_t countFATExtent(uint32_t cluster, FAT32DiskPartition *dp){
+	uint32_t extentCount = 0, prevCluster = 0;
+	FATReader r;
+	initFATReader(&r, dp);
+	for(; isValidCluster(cluster, dp); cluster = nextClusterByFAT(&r, cluster)){
+		if(extentCount == 0 || cluster != prevCluster + 1){
+			extentCount++;
+		}
+		prevCluster = cluster;
+	}
+	closeFATReader(&r);
+	return extentCount;
+}
+
+// return the number of filled extents
+static uint32_t fillFATExtent(FATExtent *extent, uint32_t extentCount, uint32_t cluster, FAT32DiskPartition *dp){
+	uint32_t e = 0, fileCluster;
+	FATReader r;
+	initFATReader(&r, dp);
+	for(fileCluster = 0; isValidCluster(cluster, dp); fileCluster++){
+		if(fileCluster != 0 && cluster == extent[e].cluster + extent[e].clusterCount){
+			extent[e].clusterCount++;
+		}
+		else{
+			if(fileCluster != 0){
+				e++;
+			}
+			// reading FAT failed between counting and filling
+			if(e >= extentCount)
+				break;
+			extent[e].fileCluster = fileCluster;
+			extent[e].cluster = cluster;
+			extent[e].clusterCount = 1;
+		}
+		cluster = nextClusterByFAT(&r, cluster);
+	}
+	closeFATReader(&r);
+	return (fileCluster == 0? 0: MIN(e + 1, extentCount));
+}
+
+// return NULL if failed
+static const FATExtent *getFATExtent(FATFile *ff, uint32_t *extentCount){
+	acquireLock(&ff->extentLock);
+	FATExtent *extent = ff->extent;
+	*extentCount = ff->extentCount;
+	releaseLock(&ff->extentLock);
+	if(extent != NULL){
+		return extent;
+	}
+	// walk the cluster chain outside the lock. if another reader finishes first, use its extents
+	const uint32_t beginCluster = getBeginCluster(&ff->dirEntry);
+	const uint32_t maxCount = countFATExtent(beginCluster, ff->diskPartition);
+	FATExtent *NEW_ARRAY(newExtent, MAX(maxCount, 1));
+	if(newExtent == NULL){
+		return NULL;
+	}
+	const uint32_t newCount = fillFATExtent(newExtent, maxCount, beginCluster, ff->diskPartition);
+	acquireLock(&ff->extentLock);
+	if(ff->extent == NULL){
+		ff->extent = newExtent;
+		ff->extentCount = newCount;
+		ff->extentCapacity = MAX(maxCount, 1);
+		newExtent = NULL;
+	}
+	extent = ff->extent;
+	*extentCount = ff->extentCount;
+	releaseLock(&ff->extentLock);
+	if(newExtent != NULL){
+		DELETE(newExtent);
+	}
+	return extent;
+}
+
+// return the index of the extent containing fileCluster, or extentCount if out of range
+static uint32_t searchFATExtent(const FATExtent *extent, uint32_t extentCount, uint32_t fileCluster){
+	uint32_t begin = 0, end = extentCount;
+	while(begin < end){
+		const uint32_t middle = begin + (end - begin) / 2;
+		if(fileCluster < extent[middle].fileCluster){
+			end = middle;
+		}
+		else if(fileCluster >= extent[middle].fileCluster + extent[middle].clusterCount){
+			begin = middle + 1;
+		}
+		else{
+			return middle;
+		}
+	}
+	return extentCount;
+}
+
+static uint32_t getFATExtentClusterCount(const FATExtent *extent, uint32_t extentCount){
+	if(extentCount == 0)
+		return 0;
+	return extent[extentCount - 1].fileCluster + extent[extentCount - 1].clusterCount;
+}
+
+// the extents are rebuilt from FAT on next use
+static void resetFATExtent(FATFile *ff){
+	acquireLock(&ff->extentLock);
+	FATExtent *extent = ff->extent;
+	ff->extent = NULL;
+	ff->extentCount = 0;
+	ff->extentCapacity = 0;
+	releaseLock(&ff->extentLock);
+	if(extent != NULL){
+		DELETE(extent);
+	}
+}
+
+// the following functions modify the extents. the caller holds the writer lock of ff
+
+// add a run of clusters to the end of file. the extents have to be loaded
+static int appendFATExtent(FATFile *ff, uint32_t fileCluster, uint32_t cluster, uint32_t clusterCount){
+	assert(ff->extent != NULL);
+	if(ff->extentCount != 0){
+		FATExtent *last = ff->extent + ff->extentCount - 1;
+		if(last->cluster + last->clusterCount == cluster){
+			acquireLock(&ff->extentLock);
+			last->clusterCount += clusterCount;
+			releaseLock(&ff->extentLock);
+			return 1;
+		}
+	}
+	if(ff->extentCount == ff->extentCapacity){
+		FATExtent *NEW_ARRAY(newExtent, ff->extentCapacity * 2);
+		if(newExtent == NULL){
+			resetFATExtent(ff);
+			return 0;
+		}
+		memcpy(newExtent, ff->extent, ff->extentCount * sizeof(*newExtent));
+		acquireLock(&ff->extentLock);
+		FATExtent *oldExtent = ff->extent;
+		ff->extent = newExtent;
+		ff->extentCapacity *= 2;
+		releaseLock(&ff->extentLock);
+		DELETE(oldExtent);
+	}
+	acquireLock(&ff->extentLock);
+	FATExtent *e = ff->extent + ff->extentCount;
+	e->fileCluster = fileCluster;
+	e->cluster = cluster;
+	e->clusterCount = clusterCount;
+	ff->extentCount++;
+	releaseLock(&ff->extentLock);
+	return 1;
+}
+
+// remove the clusters after the first clusterCount clusters
+static void truncateFATExtent(FATFile *ff, uint32_t clusterCount){
+	acquireLock(&ff->extentLock);
+	while(ff->extentCount != 0 && ff->extent[ff->extentCount - 1].fileCluster >= clusterCount){
+		ff->extentCount--;
+	}
+	if(ff->extentCount != 0){
+		FATExtent *last = ff->extent + ff->extentCount - 1;
+		last->clusterCount = MIN(last->clusterCount, clusterCount - last->fileCluster);
+	}
+	releaseLock(&ff->extentLock);
+}
+
+// return 1 and set *position to the disk position of offset in file
+static int getFATFilePosition(FATFile *ff, uint32_t offset, uint64_t *position){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	const uintptr_t clusterSize = getClusterSize(dp);
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	if(extent == NULL)
+		return 0;
+	const uint32_t e = searchFATExtent(extent, extentCount, offset / clusterSize);
+	if(e == extentCount)
+		return 0;
+	*position = dp->sectorSize * clusterToLBA(dp, extent[e].cluster) +
+		(offset - (uint64_t)extent[e].fileCluster * clusterSize);
+	return 1;
+}
+
 typedef struct{
 	OpenFileMode mode;
-	FATDirEntry dirEntry;
 	FATFile *shared;
+	// sequential readahead
+	Spinlock readaheadLock;
+	enum FileAccessPattern accessPattern;
+	// end of the previous read
+	uint32_t nextOffset;
+	uint32_t readaheadWindow;
+	// readahead has been issued up to readaheadEnd
+	uint32_t readaheadEnd;
 }OpenedFATFile;
 
 static OpenedFATFile *createOpenedFATFile(
 	OpenFileMode ofm,
-	const FAT32DiskPartition *dp, const FATDirEntry *dir
+	FAT32DiskPartition *dp, const FATDirEntry *dir, uint64_t dirEntryPosition
 ){
 	OpenedFATFile *NEW(f);
 	EXPECT(f != NULL);
 	f->mode = ofm;
-	f->dirEntry = (*dir);
-	f->shared = searchCreateFATFile(dp, getBeginCluster(dir), 1);
+	f->readaheadLock = initialSpinlock;
+	f->accessPattern = FILE_ACCESS_NORMAL;
+	f->nextOffset = 0;
+	f->readaheadWindow = 0;
+	f->readaheadEnd = 0;
+	f->shared = searchCreateFATFile(dp, dir, dirEntryPosition, 1);
 	EXPECT(f->shared != NULL);
 	return f;
 	//addFATFileReference(f->shared, -1);
@@ -468,28 +1039,32 @@ static int openFAT(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLen
 	return 0;
 }
 
-// readFAT
+// readFAT, writeFAT
 
 typedef struct{
+	// const if isWrite
 	void *buffer;
 	uintptr_t inputRWSize;
 	OpenedFATFile *file;
 	uint32_t inputOffset;
+	int isWrite;
 	RWFileRequest *rwfr;
 }RWFATRequest;
 
 static void rwFATTask(void *rwfrPtr);
 
-static int seekReadFAT(
+static int startRWFATTask(
 	RWFileRequest *rwfr, OpenedFile *of,
-	uint8_t *buffer, uint64_t offset, uintptr_t readSize
+	void *buffer, uint64_t offset, uintptr_t rwSize, int isWrite
 ){
 	RWFATRequest *NEW(rwfr2);
 	EXPECT(rwfr2 != NULL);
 	rwfr2->rwfr = rwfr;
 	rwfr2->file = getFileInstance(of);
-	rwfr2->inputRWSize = readSize;
-	rwfr2->inputOffset = (uint32_t)offset;
+	rwfr2->inputRWSize = rwSize;
+	// FAT32 file size < 4GB
+	rwfr2->inputOffset = (uint32_t)MIN(offset, 0xffffffff);
+	rwfr2->isWrite = isWrite;
 	rwfr2->buffer = buffer;
 	Task *t = createSharedMemoryTask(rwFATTask, &rwfr2, sizeof(rwfr2), fat32List.mainTask);
 	EXPECT(t != NULL);
@@ -502,6 +1077,13 @@ static int seekReadFAT(
 	return 0;
 }
 
+static int seekReadFAT(
+	RWFileRequest *rwfr, OpenedFile *of,
+	uint8_t *buffer, uint64_t offset, uintptr_t readSize
+){
+	return startRWFATTask(rwfr, of, buffer, offset, readSize, 0);
+}
+
 static int readFAT(
 	RWFileRequest *rwfr, OpenedFile *of,
 	uint8_t *buffer, uintptr_t readSize
@@ -509,83 +1091,443 @@ static int readFAT(
 	return seekReadFAT(rwfr, of, buffer, getFileOffset(of), readSize);
 }
 
+static int seekWriteFAT(
+	RWFileRequest *rwfr, OpenedFile *of,
+	const uint8_t *buffer, uint64_t offset, uintptr_t writeSize
+){
+	return startRWFATTask(rwfr, of, (void*)buffer, offset, writeSize, 1);
+}
+
+// maximum size of a disk read for contiguous clusters
+#define MAX_DIRECT_READ_SIZE (256 * PAGE_SIZE)
+// smaller reads are served from block cache
+#define MIN_DIRECT_READ_SIZE (16 * PAGE_SIZE)
+// maximum number of outstanding direct reads of a request
+#define MAX_PARALLEL_READ_COUNT (16)
+
+typedef struct{
+	// IO_REQUEST_FAILURE if copied from block cache
+	uintptr_t io;
+	uintptr_t size, readSize;
+}FATReadSegment;
+
+// large sector-aligned reads in extents are read to buffer directly
+// other reads are copied from block cache so that hot files and directories stay in memory
+// direct reads of all extents are issued before waiting, and cache copies are done while they are pending
 static uintptr_t readByFAT(
-	const FAT32DiskPartition *dp, void *buffer, uint32_t beginCluster,
+	FATFile *ff, void *buffer,
 	uint32_t readOffset, uint32_t readSize
 ){
-	const uint32_t readFileEnd = readOffset + readSize;
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	const uint64_t readFileEnd = (uint64_t)readOffset + readSize;
+	const uintptr_t clusterSize = getClusterSize(dp);
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	if(extent == NULL){
+		return 0;
+	}
+	uint32_t e = searchFATExtent(extent, extentCount, readOffset / clusterSize);
+	uint64_t fileIndex = readOffset;
+	uintptr_t bufferIndex = 0, issueIndex = 0, copySize = 0;
+	int ok = 1;
+	while(ok && fileIndex < readFileEnd && e < extentCount){
+		FATReadSegment segment[MAX_PARALLEL_READ_COUNT];
+		int segmentCount, i;
+		for(segmentCount = 0; segmentCount < MAX_PARALLEL_READ_COUNT && fileIndex < readFileEnd && e < extentCount; segmentCount++){
+			const uint64_t extentBegin = (uint64_t)extent[e].fileCluster * clusterSize;
+			const uint64_t extentEnd = extentBegin + (uint64_t)extent[e].clusterCount * clusterSize;
+			const uintptr_t size = (uintptr_t)MIN(MIN(extentEnd, readFileEnd) - fileIndex, MAX_DIRECT_READ_SIZE);
+			const uintptr_t extentOffset = (uintptr_t)(fileIndex - extentBegin);
+			const uint64_t diskPosition = dp->sectorSize * clusterToLBA(dp, extent[e].cluster) + extentOffset;
+			void *const dst = (void*)(((uintptr_t)buffer) + issueIndex);
+			FATReadSegment *const s1 = segment + segmentCount;
+			s1->size = size;
+			s1->readSize = 0;
+			if(size >= MIN_DIRECT_READ_SIZE && extentOffset % dp->sectorSize == 0 &&
+			size % dp->sectorSize == 0 && ((uintptr_t)dst) % dp->sectorSize == 0 &&
+			isBlockCached(dp->cache, dp->diskFileHandle, diskPosition, size) == 0){
+				s1->io = systemCall_seekReadFile(dp->diskFileHandle, dst, diskPosition, size);
+				if(s1->io == IO_REQUEST_FAILURE){
+					segmentCount++;
+					break;
+				}
+			}
+			else{
+				s1->io = IO_REQUEST_FAILURE;
+				s1->readSize = readBlockCache(dp->cache, dp->diskFileHandle, dst, diskPosition, size);
+				copySize += s1->readSize;
+				if(s1->readSize != size){
+					segmentCount++;
+					break;
+				}
+			}
+			issueIndex += size;
+			fileIndex += size;
+			if(fileIndex >= extentEnd){
+				e++;
+			}
+		}
+		// wait for all issued reads. the result is the size of the successful prefix
+		for(i = 0; i < segmentCount; i++){
+			FATReadSegment *const s1 = segment + i;
+			if(s1->io != IO_REQUEST_FAILURE){
+				uintptr_t readDiskSize = 0;
+				if(systemCall_waitIOReturn(s1->io, 1, &readDiskSize) == s1->io){
+					s1->readSize = readDiskSize;
+				}
+			}
+			if(ok){
+				bufferIndex += MIN(s1->readSize, s1->size);
+				ok = (s1->readSize == s1->size);
+			}
+		}
+	}
+	acquireLock(&dp->statisticsLock);
+	dp->readByteCount += bufferIndex;
+	dp->copyByteCount += copySize;
+	releaseLock(&dp->statisticsLock);
+	return bufferIndex;
+}
+
+// writeFAT
+// data, FAT and directory entries are written to block cache and flushed together
+
+static const uint8_t zeroBlock[CACHED_BLOCK_SIZE];
+
+static void updateFATDentry(FAT32DiskPartition *dp, uint64_t dirEntryPosition, const FATDirEntry *d);
+
+// write to allocated clusters. buffer is NULL to write zeros
+static uintptr_t writeClustersByFAT(
+	FATFile *ff, const void *buffer,
+	uint32_t writeOffset, uint32_t writeSize
+){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	const uint64_t writeFileEnd = (uint64_t)writeOffset + writeSize;
 	const uintptr_t clusterSize = getClusterSize(dp);
-	void *clusterBuffer = systemCall_allocateHeap(clusterSize, USER_NON_CACHED_PAGE);
-	EXPECT(clusterBuffer != NULL);
-	uint32_t fileIndex = 0;
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	if(extent == NULL){
+		return 0;
+	}
+	uint32_t e = searchFATExtent(extent, extentCount, writeOffset / clusterSize);
+	uint64_t fileIndex = writeOffset;
 	uintptr_t bufferIndex = 0;
-	uint32_t cluster = beginCluster;
-	while(fileIndex < readFileEnd && isValidCluster(cluster, dp)){
-		if(/*fileIndex < readFileEnd &&*/fileIndex + clusterSize > readOffset){
-			// read next cluster to buffer1
-			uintptr_t readDiskSize = clusterSize;
-			uintptr_t ret = syncSeekReadFile(dp->diskFileHandle, clusterBuffer,
-				dp->sectorSize * clusterToLBA(dp, cluster), &readDiskSize);
-			if(readDiskSize != clusterSize || ret == IO_REQUEST_FAILURE)
-				break;
-			// copy clusterBuffer to buffer
-			uintptr_t copyBegin = MAX(fileIndex, readOffset);
-			uintptr_t copyEnd = MIN(fileIndex + clusterSize, readFileEnd);
-			memcpy((void*)(((uintptr_t)buffer) + bufferIndex),
-				(const void*)(((uintptr_t)clusterBuffer) + copyBegin % clusterSize), copyEnd - copyBegin);
-			bufferIndex += copyEnd - copyBegin;
+	while(fileIndex < writeFileEnd && e < extentCount){
+		const uint64_t extentBegin = (uint64_t)extent[e].fileCluster * clusterSize;
+		const uint64_t extentEnd = extentBegin + (uint64_t)extent[e].clusterCount * clusterSize;
+		const uintptr_t size = (uintptr_t)MIN(MIN(extentEnd, writeFileEnd) - fileIndex,
+			buffer == NULL? sizeof(zeroBlock): MAX_DIRECT_READ_SIZE);
+		const uint64_t diskPosition = dp->sectorSize * clusterToLBA(dp, extent[e].cluster) + (fileIndex - extentBegin);
+		const void *src = (buffer == NULL? zeroBlock: (const void*)(((uintptr_t)buffer) + bufferIndex));
+		const uintptr_t writeCacheSize = writeBlockCache(dp->cache, dp->diskFileHandle, src, diskPosition, size);
+		bufferIndex += writeCacheSize;
+		fileIndex += writeCacheSize;
+		if(writeCacheSize != size)
+			break;
+		if(fileIndex >= extentEnd){
+			e++;
 		}
-		fileIndex += clusterSize;
-		cluster = nextClusterByFAT(cluster, dp);
 	}
-	systemCall_releaseHeap(clusterBuffer);
 	return bufferIndex;
+}
+
+// the root directory does not have a directory entry
+static void writeFATDirEntry(FATFile *ff){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	if(ff->dirEntryPosition == 0)
+		return;
+	if(writeBlockCache(dp->cache, dp->diskFileHandle, &ff->dirEntry,
+		ff->dirEntryPosition, sizeof(ff->dirEntry)) != sizeof(ff->dirEntry)){
+		printk("warning: failed to write FAT directory entry\n");
+	}
+	updateFATDentry(dp, ff->dirEntryPosition, &ff->dirEntry);
+}
 
-	// systemCall_releaseHeap(clusterBuffer);
+// allocate clusters until the file has clusterCount clusters
+// return the number of clusters of the file
+static uint32_t extendFATFile(FATFile *ff, uint32_t clusterCount){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	if(extent == NULL)
+		return 0;
+	uint32_t fileClusterCount = getFATExtentClusterCount(extent, extentCount);
+	while(fileClusterCount < clusterCount){
+		const uint32_t lastCluster = (extentCount == 0? 0:
+			extent[extentCount - 1].cluster + extent[extentCount - 1].clusterCount - 1);
+		uint32_t firstCluster;
+		const uint32_t allocateCount = allocateFATClusters(dp, lastCluster, clusterCount - fileClusterCount, &firstCluster);
+		if(allocateCount == 0)
+			break;
+		if(lastCluster == 0){
+			setBeginCluster(&ff->dirEntry, firstCluster);
+			writeFATDirEntry(ff);
+		}
+		if(appendFATExtent(ff, fileClusterCount, firstCluster, allocateCount) == 0)
+			return fileClusterCount + allocateCount;
+		fileClusterCount += allocateCount;
+		extent = getFATExtent(ff, &extentCount);
+		if(extent == NULL)
+			break;
+	}
+	return fileClusterCount;
+}
+
+// write and extend the file. if writeOffset is beyond the end of file, the gap is filled with zeros
+// buffer is NULL to write zeros
+// return the number of bytes written
+static uintptr_t writeByFAT(
+	FATFile *ff, const void *buffer,
+	uint32_t writeOffset, uintptr_t writeSize
+){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	const uint32_t fileSize = ff->dirEntry.fileSize;
+	const uintptr_t clusterSize = getClusterSize(dp);
+	// the maximum file size is 4GB - 1
+	writeSize = (uintptr_t)MIN((uint64_t)writeSize, 0xffffffff - (uint64_t)writeOffset);
+	if(writeSize == 0)
+		return 0;
+	const uint64_t writeFileEnd = (uint64_t)writeOffset + writeSize;
+	if(writeFileEnd > fileSize){
+		const uint64_t allocatedSize = clusterSize *
+			(uint64_t)extendFATFile(ff, (uint32_t)((writeFileEnd + clusterSize - 1) / clusterSize));
+		if(allocatedSize <= writeOffset)
+			return 0;
+		writeSize = (uintptr_t)MIN(writeSize, allocatedSize - writeOffset);
+	}
+	if(writeOffset > fileSize){
+		const uint32_t gapSize = writeOffset - fileSize;
+		if(writeClustersByFAT(ff, NULL, fileSize, gapSize) != gapSize)
+			return 0;
+	}
+	const uintptr_t outputWriteSize = writeClustersByFAT(ff, buffer, writeOffset, writeSize);
+	if(writeOffset + outputWriteSize > fileSize){
+		ff->dirEntry.fileSize = writeOffset + outputWriteSize;
+		ff->dirEntry.attribute |= FAT_ARCHIVE;
+		writeFATDirEntry(ff);
+	}
+	acquireLock(&dp->statisticsLock);
+	dp->writeByteCount += outputWriteSize;
+	releaseLock(&dp->statisticsLock);
+	notifyFileChange(ff->dirEntryPosition);
+	return outputWriteSize;
+}
+
+// change the file size. a larger size is filled with zeros
+// return 1 if succeeded
+static int truncateFATFile(FATFile *ff, uint32_t newSize){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	const uint32_t fileSize = ff->dirEntry.fileSize;
+	if(newSize >= fileSize){
+		return writeByFAT(ff, NULL, fileSize, newSize - fileSize) == newSize - fileSize;
+	}
+	const uintptr_t clusterSize = getClusterSize(dp);
+	const uint32_t clusterCount = (uint32_t)(((uint64_t)newSize + clusterSize - 1) / clusterSize);
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	if(extent == NULL)
+		return 0;
+	uint32_t freeCluster = FREE_CLUSTER;
+	if(clusterCount < getFATExtentClusterCount(extent, extentCount)){
+		if(clusterCount == 0){
+			freeCluster = getBeginCluster(&ff->dirEntry);
+			setBeginCluster(&ff->dirEntry, 0);
+		}
+		else{
+			const FATExtent *e = extent + searchFATExtent(extent, extentCount, clusterCount - 1);
+			const uint32_t lastCluster = e->cluster + (clusterCount - 1 - e->fileCluster);
+			FATReader r;
+			initFATReader(&r, dp);
+			freeCluster = nextClusterByFAT(&r, lastCluster);
+			closeFATReader(&r);
+			if(setClusterByFAT(dp, lastCluster, END_OF_CHAIN) == 0)
+				return 0;
+		}
+		truncateFATExtent(ff, clusterCount);
+	}
+	ff->dirEntry.fileSize = newSize;
+	ff->dirEntry.attribute |= FAT_ARCHIVE;
+	writeFATDirEntry(ff);
+	// free clusters after the directory entry no longer refers to them
+	if(isValidCluster(freeCluster, dp)){
+		freeFATClusters(dp, freeCluster);
+	}
+	notifyFileChange(ff->dirEntryPosition);
+	return 1;
+}
+
+// readahead
+
+#define MIN_READAHEAD_WINDOW (4 * PAGE_SIZE)
+#define MAX_READAHEAD_WINDOW (64 * PAGE_SIZE)
+
+static void prefetchByFAT(FATFile *ff, uint32_t offset, uint32_t size){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	const uint64_t prefetchEnd = (uint64_t)offset + size;
+	const uintptr_t clusterSize = getClusterSize(dp);
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	if(extent == NULL){
+		return;
+	}
+	uint32_t e;
+	uint64_t fileIndex = offset;
+	for(e = searchFATExtent(extent, extentCount, offset / clusterSize); fileIndex < prefetchEnd && e < extentCount; e++){
+		const uint64_t extentBegin = (uint64_t)extent[e].fileCluster * clusterSize;
+		const uint64_t extentEnd = extentBegin + (uint64_t)extent[e].clusterCount * clusterSize;
+		const uintptr_t size1 = (uintptr_t)(MIN(extentEnd, prefetchEnd) - fileIndex);
+		const uint64_t diskPosition = dp->sectorSize * clusterToLBA(dp, extent[e].cluster) + (fileIndex - extentBegin);
+		if(prefetchBlockCache(dp->cache, dp->diskFileHandle, diskPosition, size1) != size1)
+			break;
+		fileIndex += size1;
+	}
+}
+
+typedef struct{
+	FATFile *file;
+	uint32_t offset, size;
+}ReadaheadFATRequest;
+
+static void readaheadFATTask(void *rarPtr){
+	ReadaheadFATRequest *rar = *(ReadaheadFATRequest**)rarPtr;
+	acquireReaderLock(rar->file->rwLock);
+	prefetchByFAT(rar->file, rar->offset, rar->size);
+	releaseReaderWriterLock(rar->file->rwLock);
+	addFATFileReference(rar->file, -1);
+	DELETE(rar);
+	systemCall_terminate();
+}
+
+static void startReadahead(FATFile *ff, uint32_t offset, uint32_t size){
+	ReadaheadFATRequest *NEW(rar);
+	EXPECT(rar != NULL);
+	rar->file = ff;
+	rar->offset = offset;
+	rar->size = size;
+	addFATFileReference(ff, 1);
+	Task *t = createSharedMemoryTask(readaheadFATTask, &rar, sizeof(rar), fat32List.mainTask);
+	EXPECT(t != NULL);
+	resume(t);
+	return;
 	ON_ERROR;
-	return 0;
+	addFATFileReference(ff, -1);
+	DELETE(rar);
+	ON_ERROR;
+}
+
+// the window grows on sequential reads and shrinks on other reads
+// return the size to read ahead after [offset, offset + size)
+static uint32_t updateReadahead(OpenedFATFile *f, uint32_t offset, uint32_t size, uint32_t *readaheadBegin){
+	const uint32_t end = offset + size;
+	uint32_t readaheadSize = 0;
+	acquireLock(&f->readaheadLock);
+	const int isSequential = (offset == f->nextOffset);
+	switch(f->accessPattern){
+	case FILE_ACCESS_RANDOM:
+		f->readaheadWindow = 0;
+		break;
+	case FILE_ACCESS_SEQUENTIAL:
+		f->readaheadWindow = MAX_READAHEAD_WINDOW;
+		break;
+	default:
+		if(isSequential){
+			f->readaheadWindow = (f->readaheadWindow == 0? MIN_READAHEAD_WINDOW:
+				MIN(f->readaheadWindow * 2, MAX_READAHEAD_WINDOW));
+		}
+		else{
+			f->readaheadWindow /= 2;
+			if(f->readaheadWindow < MIN_READAHEAD_WINDOW){
+				f->readaheadWindow = 0;
+			}
+		}
+		break;
+	}
+	if(isSequential == 0){
+		f->readaheadEnd = 0;
+	}
+	f->nextOffset = end;
+	const uint32_t begin = MAX(end, f->readaheadEnd);
+	const uint32_t windowEnd = (uint32_t)MIN((uint64_t)end + f->readaheadWindow, f->shared->dirEntry.fileSize);
+	// issue readahead in batches of at least half window
+	if(windowEnd > begin && (windowEnd - begin >= f->readaheadWindow / 2 || windowEnd == f->shared->dirEntry.fileSize)){
+		f->readaheadEnd = windowEnd;
+		*readaheadBegin = begin;
+		readaheadSize = windowEnd - begin;
+	}
+	releaseLock(&f->readaheadLock);
+	return readaheadSize;
 }
 
 static void rwFATTask(void *rwfrPtr){
 	RWFATRequest *rwfr = *(RWFATRequest**)rwfrPtr;
 	OpenedFATFile *f = rwfr->file;
-	acquireReaderLock(f->shared->rwLock);
+	if(rwfr->isWrite){
+		acquireWriterLock(f->shared->rwLock);
+	}
+	else{
+		acquireReaderLock(f->shared->rwLock);
+	}
 	uintptr_t outputRWSize = 0;
 	uint32_t offset = rwfr->inputOffset;
 	// IMPROVE: f->offset is not locked
-	if(f->mode.enumeration){
+	if(rwfr->isWrite){
+		if(f->mode.append){
+			offset = f->shared->dirEntry.fileSize;
+		}
+		outputRWSize = writeByFAT(f->shared, rwfr->buffer, offset, rwfr->inputRWSize);
+		offset += outputRWSize;
+	}
+	else if(f->mode.enumeration){
 		outputRWSize = 0;
 		if(rwfr->inputRWSize >= sizeof(FileEnumeration)){
 			// rwfr->buffer is in kernel space
 			FileEnumeration *fileEnum = rwfr->buffer;
+			LongFileName lfn;
+			resetLongFileName(&lfn);
 			while(1){
 				FATDirEntry dir;
 				assert(offset % sizeof(dir) == 0);
-				uintptr_t readDirSize = readByFAT(f->shared->diskPartition,
-						&dir, f->shared->beginCluster, offset, sizeof(dir));
+				uintptr_t readDirSize = readByFAT(f->shared, &dir, offset, sizeof(dir));
 				if(readDirSize != sizeof(dir) || isEndOfDirEntry(&dir)){
 					fileEnum->nameLength = 0;
 					break;
 				}
 				offset += readDirSize;
-				if(isEmptyDirEntry(&dir))
+				if(isEmptyDirEntry(&dir)){
+					resetLongFileName(&lfn);
+					continue;
+				}
+				if(dir.attribute == FAT_LONG_FILE_NAME){
+					parseLongNameEntry(&lfn, (const LongFATDirEntry*)&dir);
 					continue;
+				}
 				assert(sizeof(fileEnum->name) >= sizeof(dir.fileName));
-				fileEnum->nameLength = getFileName(&dir, fileEnum->name);
+				if(isLongFileNameOf(&lfn, &dir) && lfn.length <= sizeof(fileEnum->name)){
+					strncpy(fileEnum->name, lfn.name, lfn.length);
+					fileEnum->nameLength = lfn.length;
+				}
+				else{
+					fileEnum->nameLength = getFileName(&dir, fileEnum->name);
+				}
 				outputRWSize = sizeof(*fileEnum);
 				break;
 			}
 		}
 	}
-	else{
-		uint32_t readFileSize = MIN(rwfr->inputRWSize, f->dirEntry.fileSize - rwfr->inputOffset);
-		outputRWSize = readByFAT(f->shared->diskPartition,
-			rwfr->buffer, f->shared->beginCluster, offset, readFileSize);
+	else if(offset < f->shared->dirEntry.fileSize){
+		uint32_t readFileSize = MIN(rwfr->inputRWSize, f->shared->dirEntry.fileSize - offset);
+		uint32_t readaheadBegin;
+		uint32_t readaheadSize = updateReadahead(f, offset, readFileSize, &readaheadBegin);
+		if(readaheadSize != 0){
+			startReadahead(f->shared, readaheadBegin, readaheadSize);
+		}
+		outputRWSize = readByFAT(f->shared, rwfr->buffer, offset, readFileSize);
 		offset += outputRWSize;
 	}
 	releaseReaderWriterLock(f->shared->rwLock);
 
-	completeRWFileIO(rwfr->rwfr, outputRWSize, offset - rwfr->inputOffset);
+	// in append mode, the file offset moves to the end of file
+	completeRWFileIO(rwfr->rwfr, outputRWSize, (offset > rwfr->inputOffset? offset - rwfr->inputOffset: 0));
 	DELETE(rwfr);
 	systemCall_terminate();
 }
@@ -596,7 +1538,90 @@ static int getFATParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t para
 	OpenedFATFile *f = getFileInstance(of);
 	switch(parameterCode){
 	case FILE_PARAM_SIZE:
-		completeFileIO64(fior2, f->dirEntry.fileSize);
+		completeFileIO64(fior2, f->shared->dirEntry.fileSize);
+		break;
+	case FILE_PARAM_ACCESS_PATTERN:
+		completeFileIO1(fior2, f->accessPattern);
+		break;
+	case FILE_PARAM_FILE_ID:
+		completeFileIO64(fior2, f->shared->dirEntryPosition);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+// FILE_PARAM_SIZE and FILE_PARAM_FLUSH wait for disk
+
+typedef struct{
+	OpenedFATFile *file;
+	uintptr_t parameterCode;
+	uint64_t value;
+	FileIORequest2 *fior2;
+}SetFATParameterRequest;
+
+static void setFATParameterTask(void *sprPtr){
+	SetFATParameterRequest *spr = *(SetFATParameterRequest**)sprPtr;
+	FATFile *ff = spr->file->shared;
+	switch(spr->parameterCode){
+	case FILE_PARAM_SIZE:
+		acquireWriterLock(ff->rwLock);
+		if(truncateFATFile(ff, (uint32_t)spr->value) == 0){
+			printk("warning: failed to change FAT file size\n");
+		}
+		releaseReaderWriterLock(ff->rwLock);
+		break;
+	case FILE_PARAM_FLUSH:
+		if(flushBlockCache(ff->diskPartition->cache) == 0){
+			printk("warning: failed to flush FAT file\n");
+		}
+		break;
+	default:
+		assert(0);
+	}
+	// FileIORequest2 cannot fail after the request is accepted
+	completeFileIO0(spr->fior2);
+	DELETE(spr);
+	systemCall_terminate();
+}
+
+static int startSetFATParameterTask(FileIORequest2 *fior2, OpenedFATFile *f, uintptr_t parameterCode, uint64_t value){
+	SetFATParameterRequest *NEW(spr);
+	EXPECT(spr != NULL);
+	spr->file = f;
+	spr->parameterCode = parameterCode;
+	spr->value = value;
+	spr->fior2 = fior2;
+	Task *t = createSharedMemoryTask(setFATParameterTask, &spr, sizeof(spr), fat32List.mainTask);
+	EXPECT(t != NULL);
+	resume(t);
+	return 1;
+	// delete task
+	ON_ERROR;
+	DELETE(spr);
+	ON_ERROR;
+	return 0;
+}
+
+static int setFATParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode, uint64_t value){
+	OpenedFATFile *f = getFileInstance(of);
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		if(f->mode.enumeration || value > 0xffffffff){
+			return 0;
+		}
+		return startSetFATParameterTask(fior2, f, parameterCode, value);
+	case FILE_PARAM_FLUSH:
+		return startSetFATParameterTask(fior2, f, parameterCode, value);
+	case FILE_PARAM_ACCESS_PATTERN:
+		if(value != FILE_ACCESS_NORMAL && value != FILE_ACCESS_SEQUENTIAL && value != FILE_ACCESS_RANDOM){
+			return 0;
+		}
+		acquireLock(&f->readaheadLock);
+		f->accessPattern = (enum FileAccessPattern)value;
+		releaseLock(&f->readaheadLock);
+		completeFileIO0(fior2);
 		break;
 	default:
 		return 0;
@@ -613,35 +1638,306 @@ static void closeFAT(CloseFileRequest *cfr, OpenedFile *of){
 	deleteOpenedFATFile(f);
 }
 
-static int nextLevelDirectory(FATDirEntry *d, const FAT32DiskPartition *dp,
+// directory entry cache
+// key is (partition, cluster of parent directory, case-insensitive name)
+// a negative entry means the name is not in the directory
+// positive entries are also indexed by (partition, dirEntryPosition) for updateFATDentry
+
+#define DENTRY_CACHE_SIZE (256)
+#define DENTRY_HASH_SIZE (64)
+
+typedef struct FATDentry{
+	// NULL if unused
+	FAT32DiskPartition *diskPartition;
+	uint32_t parentCluster;
+	char isNegative;
+	// CLOCK reference bit
+	char isReferenced;
+	FATDirEntry dirEntry;
+	uint64_t dirEntryPosition;
+	uintptr_t nameLength;
+	char name[MAX_LONG_FILE_NAME_LENGTH];
+	struct FATDentry **prev, *next;
+	// in positionTable if isNegative == 0
+	struct FATDentry *positionNext;
+}FATDentry;
+
+struct FATDentryCache{
+	Spinlock lock;
+	// allocated on first insertion
+	FATDentry *entry;
+	uintptr_t clockHand;
+	FATDentry *hashTable[DENTRY_HASH_SIZE];
+	FATDentry *positionTable[DENTRY_HASH_SIZE];
+	uint64_t hitCount, missCount;
+}dentryCache = {INITIAL_SPINLOCK, NULL, 0, {NULL}, {NULL}, 0, 0};
+
+static FATDentry **getDentryBucket(const FAT32DiskPartition *dp, uint32_t parentCluster, const char *name, uintptr_t length){
+	uint32_t h = (((uintptr_t)dp) ^ parentCluster) * 16777619;
+	uintptr_t i;
+	for(i = 0; i < length; i++){
+		h = (h ^ (uint8_t)tolower(name[i])) * 16777619;
+	}
+	return &dentryCache.hashTable[h % DENTRY_HASH_SIZE];
+}
+
+static FATDentry **getDentryPositionBucket(const FAT32DiskPartition *dp, uint64_t dirEntryPosition){
+	const uint32_t entryIndex = (((uint32_t)LOW64(dirEntryPosition)) / sizeof(FATDirEntry)) ^ HIGH64(dirEntryPosition);
+	return &dentryCache.positionTable[((((uintptr_t)dp) ^ entryIndex) * 16777619) % DENTRY_HASH_SIZE];
+}
+
+static void addDentryPosition_noLock(FATDentry *e){
+	FATDentry **bucket = getDentryPositionBucket(e->diskPartition, e->dirEntryPosition);
+	e->positionNext = *bucket;
+	*bucket = e;
+}
+
+static void removeDentryPosition_noLock(FATDentry *e){
+	FATDentry **p;
+	for(p = getDentryPositionBucket(e->diskPartition, e->dirEntryPosition); *p != NULL; p = &(*p)->positionNext){
+		if(*p == e){
+			*p = e->positionNext;
+			e->positionNext = NULL;
+			return;
+		}
+	}
+	assert(0);
+}
+
+static FATDentry *searchFATDentry_noLock(const FAT32DiskPartition *dp, uint32_t parentCluster, const char *name, uintptr_t length){
+	FATDentry *e;
+	for(e = *getDentryBucket(dp, parentCluster, name, length); e != NULL; e = e->next){
+		if(e->diskPartition == dp && e->parentCluster == parentCluster &&
+		equalsIgnoreCase(e->name, e->nameLength, name, length))
+			return e;
+	}
+	return NULL;
+}
+
+// return 1 and copy the entry to d if found. *isNegative is set if the name does not exist
+static int searchFATDentry(const FAT32DiskPartition *dp, uint32_t parentCluster,
+	const char *name, uintptr_t length, FATDirEntry *d, uint64_t *dirEntryPosition, int *isNegative){
+	acquireLock(&dentryCache.lock);
+	FATDentry *e = searchFATDentry_noLock(dp, parentCluster, name, length);
+	if(e != NULL){
+		e->isReferenced = 1;
+		*isNegative = e->isNegative;
+		if(e->isNegative == 0){
+			*d = e->dirEntry;
+			*dirEntryPosition = e->dirEntryPosition;
+		}
+		dentryCache.hitCount++;
+	}
+	else{
+		dentryCache.missCount++;
+	}
+	releaseLock(&dentryCache.lock);
+	return e != NULL;
+}
+
+static FATDentry *evictFATDentry_noLock(void){
+	while(1){
+		FATDentry *e = dentryCache.entry + dentryCache.clockHand;
+		dentryCache.clockHand = (dentryCache.clockHand + 1) % DENTRY_CACHE_SIZE;
+		if(e->diskPartition == NULL)
+			return e;
+		if(e->isReferenced){
+			e->isReferenced = 0;
+			continue;
+		}
+		REMOVE_FROM_DQUEUE(e);
+		if(e->isNegative == 0){
+			removeDentryPosition_noLock(e);
+		}
+		e->diskPartition = NULL;
+		return e;
+	}
+}
+
+// d is NULL for negative entry
+static void addFATDentry(FAT32DiskPartition *dp, uint32_t parentCluster,
+	const char *name, uintptr_t length, const FATDirEntry *d, uint64_t dirEntryPosition){
+	if(length > MAX_LONG_FILE_NAME_LENGTH)
+		return;
+	FATDentry *newEntry = NULL;
+	acquireLock(&dentryCache.lock);
+	if(dentryCache.entry == NULL){
+		releaseLock(&dentryCache.lock);
+		NEW_ARRAY(newEntry, DENTRY_CACHE_SIZE);
+		if(newEntry == NULL)
+			return;
+		uintptr_t i;
+		for(i = 0; i < DENTRY_CACHE_SIZE; i++){
+			newEntry[i].diskPartition = NULL;
+			newEntry[i].prev = NULL;
+			newEntry[i].next = NULL;
+			newEntry[i].positionNext = NULL;
+		}
+		acquireLock(&dentryCache.lock);
+		if(dentryCache.entry == NULL){
+			dentryCache.entry = newEntry;
+			newEntry = NULL;
+		}
+	}
+	FATDentry *e = searchFATDentry_noLock(dp, parentCluster, name, length);
+	if(e == NULL){
+		e = evictFATDentry_noLock();
+		e->diskPartition = dp;
+		e->parentCluster = parentCluster;
+		e->nameLength = length;
+		strncpy(e->name, name, length);
+		ADD_TO_DQUEUE(e, getDentryBucket(dp, parentCluster, name, length));
+	}
+	else if(e->isNegative == 0){
+		removeDentryPosition_noLock(e);
+	}
+	e->isReferenced = 1;
+	e->isNegative = (d == NULL);
+	if(d != NULL){
+		e->dirEntry = *d;
+		e->dirEntryPosition = dirEntryPosition;
+		addDentryPosition_noLock(e);
+	}
+	releaseLock(&dentryCache.lock);
+	if(newEntry != NULL){
+		DELETE(newEntry);
+	}
+}
+
+// called when a directory entry is written
+static void updateFATDentry(FAT32DiskPartition *dp, uint64_t dirEntryPosition, const FATDirEntry *d){
+	FATDentry *e;
+	acquireLock(&dentryCache.lock);
+	// a file may be cached by both its long and short name
+	for(e = *getDentryPositionBucket(dp, dirEntryPosition); e != NULL; e = e->positionNext){
+		if(e->diskPartition == dp && e->dirEntryPosition == dirEntryPosition){
+			e->dirEntry = *d;
+		}
+	}
+	releaseLock(&dentryCache.lock);
+}
+
+// read the whole directory. the caller holds the lock of ff and releases the returned buffer
+static FATDirEntry *loadFATDirectory(FATFile *ff, uintptr_t *dirLength){
+	FAT32DiskPartition *const dp = ff->diskPartition;
+	uint32_t extentCount;
+	const FATExtent *extent = getFATExtent(ff, &extentCount);
+	EXPECT(extent != NULL);
+	const uint32_t allocateSize = getFATExtentClusterCount(extent, extentCount) * getClusterSize(dp);
+	EXPECT(allocateSize != 0);
+	FATDirEntry *dir = allocateKernelPages(CEIL(allocateSize, PAGE_SIZE), KERNEL_PAGE);
+	EXPECT(dir != NULL);
+	uintptr_t readSize = readByFAT(ff, dir, 0, allocateSize);
+	EXPECT(readSize == allocateSize);
+	*dirLength = allocateSize / sizeof(FATDirEntry);
+	return dir;
+	ON_ERROR;
+	checkAndReleaseKernelPages(dir);
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return NULL;
+}
+
+// d and dPosition are the parent directory on input, and the found entry on output
+static int nextLevelDirectory(FATDirEntry *d, uint64_t *dPosition, FAT32DiskPartition *dp,
 	const char *name, uintptr_t length){
-	FATFile *ff = searchCreateFATFile(dp, getBeginCluster(d), 1);
+	const uint32_t parentCluster = getBeginCluster(d);
+	int isNegative;
+	if(searchFATDentry(dp, parentCluster, name, length, d, dPosition, &isNegative)){
+		return isNegative == 0;
+	}
+	FATFile *ff = searchCreateFATFile(dp, d, *dPosition, 1);
 	EXPECT(ff != NULL);
 	acquireReaderLock(ff->rwLock);
-	const uint32_t clusterCount = countClusterByFAT(ff->beginCluster, dp);
-	const uint32_t allocateSize = clusterCount * dp->bootRecord->sectorsPerCluster * dp->sectorSize;
-	FATDirEntry *dirEntry = systemCall_allocateHeap(allocateSize, USER_NON_CACHED_PAGE);
-	if(dirEntry == NULL){
+	uintptr_t dirLength;
+	FATDirEntry *dir = loadFATDirectory(ff, &dirLength);
+	if(dir == NULL){
 		releaseReaderWriterLock(ff->rwLock);
 	}
-	EXPECT(dirEntry != NULL);
-	uintptr_t readSize = readByFAT(dp, dirEntry, ff->beginCluster, 0, allocateSize);
+	EXPECT(dir != NULL);
+	FATDirEntry *newDirEntry = searchDirectory(dir, dirLength, name, length);
+	uint64_t newPosition = 0;
+	const int found = (newDirEntry != NULL &&
+		getFATFilePosition(ff, (uint32_t)((newDirEntry - dir) * sizeof(*dir)), &newPosition));
+	// add the entry before a writer can create the file
+	if(newDirEntry == NULL || found){
+		addFATDentry(dp, parentCluster, name, length, newDirEntry, newPosition);
+	}
 	releaseReaderWriterLock(ff->rwLock);
-	EXPECT(readSize == allocateSize);
-	FATDirEntry *newDirEntry = searchDirectory(dirEntry,
-		allocateSize / sizeof(FATDirEntry), name, length);
-	EXPECT(newDirEntry != NULL);
+	EXPECT(found);
 	*d = *newDirEntry;
-	systemCall_releaseHeap(dirEntry);
+	*dPosition = newPosition;
+	checkAndReleaseKernelPages(dir);
 	addFATFileReference(ff, -1);
 	return 1;
 
 	ON_ERROR;
+	checkAndReleaseKernelPages(dir);
+	ON_ERROR;
+	addFATFileReference(ff, -1);
+	ON_ERROR;
+	return 0;
+}
+
+// create an empty file in directory d
+// d and dPosition are the directory on input, and the new entry on output
+static int createFATDirEntry(FATDirEntry *d, uint64_t *dPosition, FAT32DiskPartition *dp,
+	const char *name, uintptr_t length){
+	FATDirEntry newEntry;
+	MEMSET0(&newEntry);
+	// IMPROVE: create long file name entries
+	EXPECT(toFATFileName((char*)newEntry.fileName, name, length));
+	newEntry.attribute = FAT_ARCHIVE;
+	const uint32_t parentCluster = getBeginCluster(d);
+	FATFile *ff = searchCreateFATFile(dp, d, *dPosition, 1);
+	EXPECT(ff != NULL);
+	acquireWriterLock(ff->rwLock);
+	uintptr_t dirLength;
+	FATDirEntry *dir = loadFATDirectory(ff, &dirLength);
+	if(dir == NULL){
+		releaseReaderWriterLock(ff->rwLock);
+	}
+	EXPECT(dir != NULL);
+	// another task may have created the file
+	const FATDirEntry *oldEntry = searchDirectory(dir, dirLength, name, length);
+	uintptr_t p;
+	if(oldEntry != NULL){
+		newEntry = *oldEntry;
+		p = oldEntry - dir;
+	}
+	else{
+		for(p = 0; p < dirLength && isEndOfDirEntry(dir + p) == 0 && isEmptyDirEntry(dir + p) == 0; p++);
+	}
+	int ok = 1;
+	if(p == dirLength){ // the directory is full
+		const uintptr_t clusterSize = getClusterSize(dp);
+		const uint32_t clusterCount = (uint32_t)(dirLength * sizeof(*dir) / clusterSize);
+		ok = (extendFATFile(ff, clusterCount + 1) == clusterCount + 1 &&
+			writeClustersByFAT(ff, NULL, dirLength * sizeof(*dir), clusterSize) == clusterSize);
+	}
+	uint64_t newPosition = 0;
+	ok = ok && getFATFilePosition(ff, p * sizeof(*dir), &newPosition);
+	if(ok && oldEntry == NULL){
+		ok = (writeBlockCache(dp->cache, dp->diskFileHandle, &newEntry, newPosition, sizeof(newEntry)) == sizeof(newEntry));
+	}
+	if(ok){
+		addFATDentry(dp, parentCluster, name, length, &newEntry, newPosition);
+	}
+	releaseReaderWriterLock(ff->rwLock);
+	checkAndReleaseKernelPages(dir);
+	EXPECT(ok);
+	*d = newEntry;
+	*dPosition = newPosition;
+	addFATFileReference(ff, -1);
+	return 1;
+
 	ON_ERROR;
-	systemCall_releaseHeap(dirEntry);
 	ON_ERROR;
 	addFATFileReference(ff, -1);
 	ON_ERROR;
+	ON_ERROR;
+	printk("warning: failed to create FAT file\n");
 	return 0;
 }
 
@@ -652,6 +1948,8 @@ static void openFATTask(void *p){
 	EXPECT(dp != NULL);
 
 	FATDirEntry d;
+	// the root directory does not have an entry
+	uint64_t dPosition = 0;
 	initRootDirEntry(&d, dp->bootRecord->ebr32.rootCluster);
 	int ok = 1;
 	while(ok){
@@ -666,29 +1964,50 @@ static void openFATTask(void *p){
 			ok = 0;
 			break;
 		}
-		ok = nextLevelDirectory(&d, dp, ofr->fileName + nameIndex, nextNameIndex - nameIndex);
+		ok = nextLevelDirectory(&d, &dPosition, dp, ofr->fileName + nameIndex, nextNameIndex - nameIndex);
+		// create the last file in path
+		if(ok == 0 && ofr->mode.create &&
+		indexOfNot(ofr->fileName, nextNameIndex, ofr->nameLength, '/') == ofr->nameLength){
+			ok = createFATDirEntry(&d, &dPosition, dp, ofr->fileName + nameIndex, nextNameIndex - nameIndex);
+		}
 		nameIndex = nextNameIndex;
 	}
 	// if open in enumeration mode, the file has to be a directory
 	// if not in enumeration, what is the size of the directory?
 	EXPECT(ok && (ofr->mode.enumeration == 0 || (d.attribute & FAT_DIRECTORY) != 0));
+	// directories are not writable
+	const int isWritable = ((d.attribute & FAT_DIRECTORY) == 0);
+	EXPECT(isWritable || (ofr->mode.create == 0 && ofr->mode.truncate == 0 && ofr->mode.append == 0));
 
 	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
 	ff.read = readFAT;
 	if(ofr->mode.enumeration == 0){
 		ff.seekRead = seekReadFAT;
 	}
+	if(isWritable){
+		ff.write = seekWriteByOffset;
+		ff.seekWrite = seekWriteFAT;
+	}
 	ff.getParameter = getFATParameter;
+	ff.setParameter = setFATParameter;
 	ff.close = closeFAT;
-	OpenedFATFile *file = createOpenedFATFile(ofr->mode, dp, &d);
+	OpenedFATFile *file = createOpenedFATFile(ofr->mode, dp, &d, dPosition);
 	EXPECT(file != NULL);
+	if(ofr->mode.truncate){
+		acquireWriterLock(file->shared->rwLock);
+		ok = truncateFATFile(file->shared, 0);
+		releaseReaderWriterLock(file->shared->rwLock);
+	}
+	EXPECT(ok);
 
 	completeOpenFile(ofr->ofr, file, &ff);
 	DELETE(ofr);
 
 	systemCall_terminate();
 
-	//deleteOpenedFATFile(file);
+	ON_ERROR;
+	deleteOpenedFATFile(file);
+	ON_ERROR;
 	ON_ERROR;
 	ON_ERROR;
 	ON_ERROR;
@@ -718,7 +2037,8 @@ void fatService(void){
 		uintptr_t r = enumNextDiskPartition(enumDiskPartition, MBR_FAT32, &fe);
 		assert(r == sizeof(fe));
 		OpenFileMode ofm = OPEN_FILE_MODE_0;
-		uintptr_t diskFile = syncOpenFileN(fe.name, fe.nameLength, ofm);
+		// the block cache and its flush task are shared by all file systems; see blockcache.h
+		uintptr_t diskFile = syncOpenGlobalFileN(fe.name, fe.nameLength, ofm);
 		if(diskFile == IO_REQUEST_FAILURE){
 			printk("warning: failed to open disk\n");
 			continue;
@@ -737,6 +2057,46 @@ void fatService(void){
 }
 
 #ifndef NDEBUG
+static void printFATCopyStatistics(void){
+	FAT32DiskPartition *dp;
+	acquireLock(&fat32List.lock);
+	for(dp = fat32List.head; dp != NULL; dp = dp->next){
+		acquireLock(&dp->statisticsLock);
+		const uint64_t readSize = dp->readByteCount, copySize = dp->copyByteCount;
+		releaseLock(&dp->statisticsLock);
+		if(readSize == 0){
+			continue;
+		}
+		printk("fat %c: read %u KB, copied %u bytes per 1000 bytes read\n",
+			dp->partitionName, (uint32_t)(readSize / 1024), (uint32_t)((copySize * 1000) / readSize));
+	}
+	for(dp = fat32List.head; dp != NULL; dp = dp->next){
+		acquireLock(&dp->statisticsLock);
+		const uint64_t writeSize = dp->writeByteCount;
+		releaseLock(&dp->statisticsLock);
+		if(writeSize == 0){
+			continue;
+		}
+		printk("fat %c: wrote %u KB, %u free clusters\n",
+			dp->partitionName, (uint32_t)(writeSize / 1024), dp->freeClusterCount);
+	}
+	releaseLock(&fat32List.lock);
+	acquireLock(&dentryCache.lock);
+	const uint64_t dentryHit = dentryCache.hitCount, dentryMiss = dentryCache.missCount;
+	releaseLock(&dentryCache.lock);
+	printk("dentry cache: %u hit, %u miss\n", (uint32_t)dentryHit, (uint32_t)dentryMiss);
+	BlockCache *bc = getDiskBlockCache();
+	if(bc == NULL){
+		return;
+	}
+	BlockCacheStatistics s;
+	getBlockCacheStatistics(bc, &s);
+	printk("block cache: %u hit, %u miss, %u prefetched, %u evicted, %u/%u blocks\n",
+		(uint32_t)s.hitCount, (uint32_t)s.missCount, (uint32_t)s.prefetchCount,
+		(uint32_t)s.evictCount, s.blockCount, s.maxBlockCount);
+	printk("block cache: %u dirty, %u written back\n", s.dirtyCount, (uint32_t)s.writeBackCount);
+}
+
 static void testFATDir(const char *path){
 	printk("test fat dir...\n");
 	uintptr_t fileHandle, r;
@@ -781,6 +2141,11 @@ void testFAT(void){
 	r = syncSizeOfFile(fileHandle, &fileSize);
 	assert(r == fileHandle);
 	printk("fat file size = %d\n", (uintptr_t)fileSize);
+	r = syncSetFileParameter(fileHandle, FILE_PARAM_ACCESS_PATTERN, FILE_ACCESS_SEQUENTIAL);
+	assert(r == fileHandle);
+	uint64_t accessPattern = FILE_ACCESS_NORMAL;
+	r = syncGetFileParameter(fileHandle, FILE_PARAM_ACCESS_PATTERN, &accessPattern);
+	assert(r == fileHandle && accessPattern == FILE_ACCESS_SEQUENTIAL);
 	uintptr_t totalReadSize = 0;
 	while(1){
 		char str[33] = "abcd";
@@ -807,7 +2172,84 @@ void testFAT(void){
 	r = syncCloseFile(fileHandle);
 	assert(r == fileHandle);
 	printk("test close fat ok\n");
+	// the second lookup of a missing file is a negative entry
+	r = syncOpenFile("fat:C/FDOS/NOFILE.TXT");
+	assert(r == IO_REQUEST_FAILURE);
+	r = syncOpenFile("fat:C/FDOS/nofile.txt");
+	assert(r == IO_REQUEST_FAILURE);
+	acquireLock(&dentryCache.lock);
+	assert(dentryCache.hitCount > 0);
+	releaseLock(&dentryCache.lock);
+	// small sequential reads hit the cached blocks of previous reads
+	BlockCacheStatistics s;
+	getBlockCacheStatistics(getDiskBlockCache(), &s);
+	assert(s.hitCount > 0);
 	testFATDir("fat:C/");
+	printFATCopyStatistics();
+	systemCall_terminate();
+}
+
+// sequential 4KB appends for testSecond seconds or until maxSize
+void testFATAppend(void);
+void testFATAppend(void){
+	const char *const fileName = "fat:C/APPEND.TXT";
+	const int testSecond = 3;
+	const uintptr_t blockSize = 4096, maxSize = 16 * 1024 * 1024;
+	sleep(1000);
+	printk("test fat append...\n");
+	OpenFileMode mode = OPEN_FILE_MODE_0;
+	mode.create = 1;
+	mode.truncate = 1;
+	mode.append = 1;
+	uintptr_t fileHandle = syncOpenFileN(fileName, strlen(fileName), mode);
+	assert(fileHandle != IO_REQUEST_FAILURE);
+	uint8_t *buffer = systemCall_allocateHeap(blockSize, USER_WRITABLE_PAGE);
+	assert(buffer != NULL);
+	uintptr_t r, i, totalSize = 0;
+	uint64_t t0 = systemCall_getTime(), t1;
+	while((t1 = systemCall_getTime()) == t0);
+	while(systemCall_getTime() - t1 < (uint64_t)testSecond && totalSize < maxSize){
+		for(i = 0; i < blockSize; i++){
+			buffer[i] = (uint8_t)(totalSize / blockSize + i);
+		}
+		uintptr_t writeSize = blockSize;
+		r = syncWriteFile(fileHandle, buffer, &writeSize);
+		assert(r == fileHandle && writeSize == blockSize);
+		totalSize += writeSize;
+	}
+	const uint64_t t2 = systemCall_getTime();
+	r = syncSetFileParameter(fileHandle, FILE_PARAM_FLUSH, 0);
+	assert(r == fileHandle);
+	const uint64_t t3 = systemCall_getTime();
+	printk("append %u KB in %u s, flush in %u s: %u KB/s\n",
+		totalSize / 1024, (uint32_t)(t2 - t1), (uint32_t)(t3 - t2),
+		(uint32_t)(totalSize / 1024 / MAX(t3 - t1, 1)));
+	uint64_t fileSize = 0;
+	r = syncSizeOfFile(fileHandle, &fileSize);
+	assert(r == fileHandle && fileSize == totalSize);
+	r = syncCloseFile(fileHandle);
+	assert(r == fileHandle);
+	// read the last block after reopening
+	fileHandle = syncOpenFile(fileName);
+	assert(fileHandle != IO_REQUEST_FAILURE);
+	uintptr_t readSize = blockSize;
+	r = syncSeekReadFile(fileHandle, buffer, totalSize - blockSize, &readSize);
+	assert(r == fileHandle && readSize == blockSize);
+	for(i = 0; i < blockSize; i++){
+		assert(buffer[i] == (uint8_t)((totalSize - blockSize) / blockSize + i));
+	}
+	// shrink and flush
+	r = syncSetFileParameter(fileHandle, FILE_PARAM_SIZE, blockSize);
+	assert(r == fileHandle);
+	r = syncSizeOfFile(fileHandle, &fileSize);
+	assert(r == fileHandle && fileSize == blockSize);
+	r = syncSetFileParameter(fileHandle, FILE_PARAM_FLUSH, 0);
+	assert(r == fileHandle);
+	r = syncCloseFile(fileHandle);
+	assert(r == fileHandle);
+	systemCall_releaseHeap(buffer);
+	printFATCopyStatistics();
+	printk("test fat append ok\n");
 	systemCall_terminate();
 }
 #endif
@@ -416,4 +416,49 @@ void testFIFOFile(void){
 	systemCall_terminate();
 }
 
+// count write+read pairs in testSecond seconds
+static unsigned countRWFIFOPerSecond(uintptr_t f, uint8_t *buffer, uintptr_t bufferSize, unsigned testSecond){
+	unsigned count = 0;
+	uint64_t beginSecond = systemCall_getTime();
+	// wait for next second
+	while(systemCall_getTime() == beginSecond);
+	beginSecond++;
+	while(systemCall_getTime() < beginSecond + testSecond){
+		uintptr_t s = bufferSize, r;
+		r = syncWriteFile(f, buffer, &s);
+		assert(r != IO_REQUEST_FAILURE && s == bufferSize);
+		s = bufferSize;
+		r = syncReadFile(f, buffer, &s);
+		assert(r != IO_REQUEST_FAILURE && s == bufferSize);
+		count++;
+	}
+	return count / testSecond;
+}
+
+void testFIFOFileSpeed(void);
+void testFIFOFileSpeed(void){
+	const unsigned testSecond = 3;
+	const uintptr_t bufferSize[2] = {64, PAGE_SIZE};
+	int ok = waitForFirstResource("fifo", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	uintptr_t f = syncOpenFIFOFile();
+	assert(f != IO_REQUEST_FAILURE);
+	// kernel buffer is used directly; user buffer is mapped by cached alias
+	uint8_t *kernelBuffer = allocateKernelMemory(PAGE_SIZE);
+	uint8_t *userBuffer = systemCall_allocateHeap(PAGE_SIZE, KERNEL_PAGE);
+	assert(kernelBuffer != NULL && userBuffer != NULL);
+	unsigned i;
+	for(i = 0; i < LENGTH_OF(bufferSize); i++){
+		unsigned k = countRWFIFOPerSecond(f, kernelBuffer, bufferSize[i], testSecond);
+		unsigned u = countRWFIFOPerSecond(f, userBuffer, bufferSize[i], testSecond);
+		printk("fifo %u bytes: kernel buffer %u/s, user buffer %u/s\n", bufferSize[i], k, u);
+	}
+	ok = systemCall_releaseHeap(userBuffer);
+	assert(ok);
+	DELETE(kernelBuffer);
+	f = syncCloseFile(f);
+	assert(f != IO_REQUEST_FAILURE);
+	systemCall_terminate();
+}
+
 #endif
@@ -112,6 +112,16 @@ void readPartitions(const char *fileName, uintptr_t nameLength, uint64_t sectorC
 	assert(r != IO_REQUEST_FAILURE);
 }
 
+void initSinglePartitionMBR(void *mbr, DiskPartitionType diskType, uint32_t startLBA, uint32_t sectorCount){
+	struct MBR *m = mbr;
+	MEMSET0(m);
+	struct PartitionEntry *pe = m->partition + 0;
+	pe->systemID = diskType;
+	pe->startLBA = startLBA;
+	pe->sectorCount = sectorCount;
+	m->signature = MBR_SIGNATRUE;
+}
+
 static int matchDiskType(const FileEnumeration *fe, uintptr_t t){
 	return fe->diskPartition.type == t;
 }
@@ -187,13 +197,15 @@ struct OpenedFile{
 
 	CloseFileRequest *cfr;
 	OpenFileManager *fileManager;
+	// 1 if handle is reserved or used in fileManager, see reserveFileHandle
+	int hasHandle;
 	//Task *task;
 	OpenedFile *next, **prev;
 };
 
 static void initOpenedFile(OpenedFile *of, CloseFileRequest *cfr/*, Task *task, */){
 	of->instance = NULL; // see initOpenedFile2
-	of->handle = (uintptr_t)&of->handle;
+	of->handle = IO_REQUEST_FAILURE; // see reserveFileHandle
 	of->lock = initialSpinlock;
 	// delete if failed to open
 	of->deleteOnCompletion = 1;
@@ -201,7 +213,8 @@ static void initOpenedFile(OpenedFile *of, CloseFileRequest *cfr/*, Task *task,
 	of->offset = 0;
 	of->cfr = cfr;
 
-	of->fileManager = NULL; // see initOpenedFile2
+	of->fileManager = NULL; // see reserveFileHandle
+	of->hasHandle = 0;
 	//ofr->task = task;
 	MEMSET0(&of->fileFunctions); // see initOpenedFile2
 	of->next = NULL;
@@ -233,6 +246,8 @@ static int setFileClosing(OpenedFile *of){
 	return ok;
 }
 
+static void releaseFileHandle(OpenedFile *of);
+
 static int addFileIOCount(OpenedFile *of, int v){
 	acquireLock(&of->lock);
 	int doDelete = ((of->deleteOnCompletion != 0 && of->ioCount + v == 0));
@@ -244,6 +259,10 @@ static int addFileIOCount(OpenedFile *of, int v){
 	releaseLock(&of->lock);
 	if(doDelete){
 		assert(ok && v == -1);
+		// failed to open
+		if(of->hasHandle){
+			releaseFileHandle(of);
+		}
 		DELETE(of);
 	}
 	return ok;
@@ -262,13 +281,61 @@ uint64_t getFileOffset(OpenedFile *of){
 	return r;
 }
 
-// IMPROVE: openFileHashTable
+// kernel alias of user buffer, see mapRWBuffer
+typedef struct BufferAlias{
+	uintptr_t userPage;
+	size_t pageSize; // 0 if not used
+	void *kernelPage;
+	int referenceCount; // number of RWFileRequest using kernelPage
+	int isValid; // 0 if userPage may have been released
+	PageAttribute hasAttribute; // see mapTaskPages
+	unsigned lastUsed;
+}BufferAlias;
+
+#define BUFFER_ALIAS_LENGTH (8)
+#define MAX_BUFFER_ALIAS_SIZE (16 * PAGE_SIZE)
+
+// file handle = generation << FILE_HANDLE_INDEX_BITS | index of FileHandleEntry
+// the generation of an entry changes whenever the entry is released, so closed handles are not valid
+// the handles of globalFileManager also have GLOBAL_FILE_HANDLE_BIT, which no generation reaches
+#define FILE_HANDLE_INDEX_BITS (12)
+#define MAX_FILE_HANDLE_COUNT (1 << FILE_HANDLE_INDEX_BITS)
+#define FILE_HANDLE_INDEX(H) ((H) & (MAX_FILE_HANDLE_COUNT - 1))
+#define GLOBAL_FILE_HANDLE_BIT (((uintptr_t)1) << (sizeof(uintptr_t) * 8 - 1))
+#define FILE_HANDLE_GENERATION(H) (((H) & ~GLOBAL_FILE_HANDLE_BIT) >> FILE_HANDLE_INDEX_BITS)
+#define MAX_FILE_HANDLE_GENERATION ((((uintptr_t)1) << (sizeof(uintptr_t) * 8 - 1 - FILE_HANDLE_INDEX_BITS)) - 1)
+// entries are allocated in blocks, which are not released until the OpenFileManager is deleted
+#define FILE_HANDLE_BLOCK_LENGTH (64)
+#define FILE_HANDLE_BLOCK_COUNT (MAX_FILE_HANDLE_COUNT / FILE_HANDLE_BLOCK_LENGTH)
+
+typedef struct{
+	// NULL if the entry is free or reserved
+	OpenedFile *volatile file;
+	// number of searchOpenFile reading file
+	volatile uint32_t searchCount;
+	// 1 ~ MAX_FILE_HANDLE_GENERATION, so that a handle is never IO_REQUEST_FAILURE
+	uintptr_t generation;
+	// index of the next free entry, or -1
+	int nextFree;
+}FileHandleEntry;
+
 struct OpenFileManager{
+	// files opened and not closed yet, see closeAllOpenFileRequest
 	OpenedFile *openFileList;
 	Spinlock lock;
 	int referenceCount;
+	// handle table; searchOpenFile does not acquire lock
+	FileHandleEntry *volatile handleBlock[FILE_HANDLE_BLOCK_COUNT];
+	int handleCount, freeHandle;
+	// all tasks sharing OpenFileManager share the same user space
+	Spinlock aliasLock;
+	unsigned aliasGeneration, aliasClock;
+	BufferAlias alias[BUFFER_ALIAS_LENGTH];
 };
 
+// owned by the kernel and never deleted; see syncOpenGlobalFileN
+static OpenFileManager *globalFileManager = NULL;
+
 OpenFileManager *createOpenFileManager(void){
 	OpenFileManager *NEW(ofm);
 	if(ofm == NULL){
@@ -277,11 +344,34 @@ OpenFileManager *createOpenFileManager(void){
 	ofm->openFileList = NULL;
 	ofm->lock = initialSpinlock;
 	ofm->referenceCount = 0;
+	int b;
+	for(b = 0; b < FILE_HANDLE_BLOCK_COUNT; b++){
+		ofm->handleBlock[b] = NULL;
+	}
+	ofm->handleCount = 0;
+	ofm->freeHandle = -1;
+	ofm->aliasLock = initialSpinlock;
+	ofm->aliasGeneration = 0;
+	ofm->aliasClock = 0;
+	memset(ofm->alias, 0, sizeof(ofm->alias));
 	return ofm;
 }
 
 void deleteOpenFileManager(OpenFileManager *ofm){
 	assert(ofm->openFileList == NULL && ofm->referenceCount == 0 && isAcquirable(&ofm->lock));
+	invalidateBufferAlias(ofm);
+#ifndef NDEBUG
+	int i;
+	for(i = 0; i < BUFFER_ALIAS_LENGTH; i++){
+		assert(ofm->alias[i].pageSize == 0);
+	}
+#endif
+	int b;
+	for(b = 0; b < FILE_HANDLE_BLOCK_COUNT; b++){
+		if(ofm->handleBlock[b] != NULL){
+			DELETE(ofm->handleBlock[b]);
+		}
+	}
 	DELETE(ofm);
 }
 
@@ -293,31 +383,134 @@ int addOpenFileManagerReference(OpenFileManager *ofm, int n){
 	return refCnt;
 }
 
-static OpenedFile *searchOpenFileList(OpenFileManager *ofm, uintptr_t handle, int isClosing){
-	int ok = 0;
-	acquireLock(&ofm->lock);
-	OpenedFile *of;
-	for(of = ofm->openFileList; of != NULL; of = of->next){
-		if(of->handle == handle){
-			ok = (isClosing? setFileClosing(of): addFileIOCount(of, 1));
+// return NULL if the handle is out of the table
+static FileHandleEntry *handleToEntry(OpenFileManager *ofm, uintptr_t handle){
+	const uintptr_t index = FILE_HANDLE_INDEX(handle);
+	FileHandleEntry *block = ofm->handleBlock[index / FILE_HANDLE_BLOCK_LENGTH];
+	if(block == NULL)
+		return NULL;
+	return block + index % FILE_HANDLE_BLOCK_LENGTH;
+}
+
+static FileHandleEntry *createFileHandleBlock(void){
+	FileHandleEntry *block;
+	NEW_ARRAY(block, FILE_HANDLE_BLOCK_LENGTH);
+	if(block == NULL)
+		return NULL;
+	int i;
+	for(i = 0; i < FILE_HANDLE_BLOCK_LENGTH; i++){
+		block[i].file = NULL;
+		block[i].searchCount = 0;
+		block[i].generation = 1;
+		block[i].nextFree = -1;
+	}
+	return block;
+}
+
+// return the index of a free entry, or -1 if the table is full or needs *newBlock
+// *newBlock is set to NULL if it is added to the table
+static int allocateFileHandle_noLock(OpenFileManager *ofm, FileHandleEntry **newBlock){
+	int index = ofm->freeHandle;
+	if(index >= 0){
+		ofm->freeHandle = handleToEntry(ofm, index)->nextFree;
+		return index;
+	}
+	if(ofm->handleCount >= MAX_FILE_HANDLE_COUNT)
+		return -1;
+	index = ofm->handleCount;
+	const int b = index / FILE_HANDLE_BLOCK_LENGTH;
+	if(ofm->handleBlock[b] == NULL){
+		if(*newBlock == NULL)
+			return -1;
+		// initialize the block before searchOpenFile can read it
+		ATOMIC_WRITE_32((volatile uint32_t*)&ofm->handleBlock[b], (uint32_t)*newBlock);
+		*newBlock = NULL;
+	}
+	ofm->handleCount++;
+	return index;
+}
+
+// allocate a handle for of in advance so that completing open does not fail
+static int reserveFileHandle(OpenFileManager *ofm, OpenedFile *of){
+	assert(of->fileManager == NULL && of->hasHandle == 0);
+	FileHandleEntry *newBlock = NULL;
+	int index;
+	while(1){
+		acquireLock(&ofm->lock);
+		index = allocateFileHandle_noLock(ofm, &newBlock);
+		const int needBlock = (index < 0 && ofm->handleCount < MAX_FILE_HANDLE_COUNT);
+		releaseLock(&ofm->lock);
+		if(needBlock == 0)
 			break;
-		}
+		newBlock = createFileHandleBlock();
+		if(newBlock == NULL)
+			break;
+	}
+	if(newBlock != NULL){
+		// another task has added the block
+		DELETE(newBlock);
+	}
+	if(index < 0)
+		return 0;
+	of->fileManager = ofm;
+	of->hasHandle = 1;
+	of->handle = (ofm == globalFileManager? GLOBAL_FILE_HANDLE_BIT: 0) |
+		(handleToEntry(ofm, index)->generation << FILE_HANDLE_INDEX_BITS) | index;
+	return 1;
+}
+
+static void releaseFileHandle(OpenedFile *of){
+	OpenFileManager *ofm = of->fileManager;
+	FileHandleEntry *e = handleToEntry(ofm, of->handle);
+	assert(of->hasHandle && e != NULL && (e->file == NULL || e->file == of));
+	ATOMIC_WRITE_32((volatile uint32_t*)&e->file, (uint32_t)NULL);
+	// wait for searchOpenFile which has read of
+	while(ATOMIC_READ_32(&e->searchCount) != 0){
+		pause();
 	}
+	acquireLock(&ofm->lock);
+	e->generation = (e->generation == MAX_FILE_HANDLE_GENERATION? 1: e->generation + 1);
+	e->nextFree = ofm->freeHandle;
+	ofm->freeHandle = FILE_HANDLE_INDEX(of->handle);
 	releaseLock(&ofm->lock);
-	return (ok? of: NULL);
+	of->hasHandle = 0;
 }
 
+// O(1) and lock-free unless the file is being closed
+static OpenedFile *searchOpenFile(OpenFileManager *ofm, uintptr_t handle, int isClosing){
+	FileHandleEntry *e = handleToEntry(ofm, handle);
+	if(e == NULL)
+		return NULL;
+	int ok = 0;
+	// releaseFileHandle waits with interrupt enabled or disabled, so do not switch task here
+	const int interruptEnabled = getEFlags().bit.interrupt;
+	cli();
+	lock_add32(&e->searchCount, 1);
+	OpenedFile *of = e->file;
+	if(of != NULL && of->handle == handle){
+		ok = (isClosing? setFileClosing(of): addFileIOCount(of, 1));
+	}
+	lock_add32(&e->searchCount, (uint32_t)-1);
+	if(interruptEnabled){
+		sti();
+	}
+	return (ok? of: NULL);
+}
 
 void addToOpenFileList(OpenFileManager *ofm, OpenedFile *of){
-	assert(of->fileManager == NULL);
-	of->fileManager = ofm;
+	assert(of->fileManager == ofm && of->hasHandle);
+	FileHandleEntry *e = handleToEntry(ofm, of->handle);
+	assert(e->file == NULL);
 	acquireLock(&ofm->lock);
 	ADD_TO_DQUEUE(of, &ofm->openFileList);
 	releaseLock(&ofm->lock);
+	// of is initialized before searchOpenFile can read it
+	ATOMIC_WRITE_32((volatile uint32_t*)&e->file, (uint32_t)of);
 }
 
 void removeFromOpenFileList(OpenedFile *of){
 	assert(of->fileManager != NULL);
+	releaseFileHandle(of);
 	acquireLock(&of->fileManager->lock);
 	REMOVE_FROM_DQUEUE(of);
 	releaseLock(&of->fileManager->lock);
@@ -333,7 +526,7 @@ void *getFileInstance(OpenedFile *of){
 
 // buffer memory
 
-static void unmapKernelBuffer(void *buffer){
+void unmapKernelBuffer(void *buffer){
 	unmapPages(kernelLinear, (void*)FLOOR((uintptr_t)buffer, PAGE_SIZE));
 }
 
@@ -346,20 +539,162 @@ static void bufferToPageRange(
 	*pageSize = CEIL(bufferBegin + bufferSize, PAGE_SIZE) - (*pageBegin);
 }
 
-static void *mapBufferToKernel(const void *buffer, uintptr_t size){
+// user pages may be unmapped ELF segments or mapped files; see loadELFPage and loadMappedFilePage
+// if the kernel writes to the pages, hasAttribute has to be KERNEL_PAGE,
+// because read-only pages may be shared by other tasks
+static void *mapTaskPages(uintptr_t pageBegin, size_t pageSize, PageAttribute hasAttribute){
+	loadELFPages(pageBegin, pageSize);
+	loadMappedFilePages(pageBegin, pageSize);
+	return checkAndMapExistingPages(
+		kernelLinear, getTaskLinearMemory(processorLocalTask()), pageBegin, pageSize, KERNEL_PAGE, hasAttribute);
+}
+
+void *mapBufferToKernel(const void *buffer, uintptr_t size){
 	uintptr_t pageOffset, pageBegin;
 	size_t pageSize;
 	void *mappedPage;
 	bufferToPageRange((uintptr_t)buffer, size, &pageBegin, &pageOffset, &pageSize);
-	mappedPage = checkAndMapExistingPages(
-		kernelLinear, getTaskLinearMemory(processorLocalTask()),
-		pageBegin, pageSize, KERNEL_PAGE, 0);
+	mappedPage = mapTaskPages(pageBegin, pageSize, 0);
 	if(mappedPage == NULL){
 		return 0;
 	}
 	return (void*)(pageOffset + ((uintptr_t)mappedPage));
 }
 
+// a buffer in kernel space is mapped in every page table, so it is not necessary to map it again
+static int isKernelBuffer(uintptr_t buffer, uintptr_t size){
+	if(isKernelLinearAddress(buffer) == 0 || size > KERNEL_LINEAR_END - buffer)
+		return 0;
+	uintptr_t pageOffset, pageBegin;
+	size_t pageSize;
+	bufferToPageRange(buffer, size, &pageBegin, &pageOffset, &pageSize);
+	uintptr_t s;
+	for(s = 0; s < pageSize; s += PAGE_SIZE){
+		if(checkAndTranslatePage(kernelLinear, (void*)(pageBegin + s)).value == INVALID_PAGE_ADDRESS)
+			return 0;
+	}
+	return 1;
+}
+
+static BufferAlias *searchBufferAlias_noLock(
+	OpenFileManager *ofm, uintptr_t pageBegin, size_t pageSize, PageAttribute hasAttribute
+){
+	int i;
+	for(i = 0; i < BUFFER_ALIAS_LENGTH; i++){
+		BufferAlias *a = ofm->alias + i;
+		if(a->pageSize != 0 && a->isValid && (a->hasAttribute & hasAttribute) == hasAttribute &&
+			a->userPage <= pageBegin && pageBegin + pageSize <= a->userPage + a->pageSize){
+			return a;
+		}
+	}
+	return NULL;
+}
+
+// return an unused or least recently used entry; NULL if all entries are being used
+static BufferAlias *replaceableBufferAlias_noLock(OpenFileManager *ofm){
+	BufferAlias *r = NULL;
+	int i;
+	for(i = 0; i < BUFFER_ALIAS_LENGTH; i++){
+		BufferAlias *a = ofm->alias + i;
+		if(a->referenceCount != 0)
+			continue;
+		if(a->pageSize == 0)
+			return a;
+		if(r == NULL || ofm->aliasClock - a->lastUsed > ofm->aliasClock - r->lastUsed){
+			r = a;
+		}
+	}
+	return r;
+}
+
+// return kernel address of user pages
+// *alias = NULL if the pages are not cached and have to be unmapped by unmapKernelBuffer
+static void *mapUserPages(
+	OpenFileManager *ofm, uintptr_t pageBegin, size_t pageSize, PageAttribute hasAttribute, BufferAlias **alias
+){
+	*alias = NULL;
+	if(pageSize == 0 || pageSize > MAX_BUFFER_ALIAS_SIZE){
+		return mapTaskPages(pageBegin, pageSize, hasAttribute);
+	}
+	acquireLock(&ofm->aliasLock);
+	BufferAlias *a = searchBufferAlias_noLock(ofm, pageBegin, pageSize, hasAttribute);
+	if(a != NULL){
+		a->referenceCount++;
+		a->lastUsed = ofm->aliasClock++;
+	}
+	const unsigned generation = ofm->aliasGeneration;
+	releaseLock(&ofm->aliasLock);
+	if(a != NULL){
+		*alias = a;
+		return (void*)(((uintptr_t)a->kernelPage) + (pageBegin - a->userPage));
+	}
+	// not found; do not map pages with lock
+	void *kernelPage = mapTaskPages(pageBegin, pageSize, hasAttribute);
+	if(kernelPage == NULL){
+		return NULL;
+	}
+	void *replacedPage = NULL;
+	acquireLock(&ofm->aliasLock);
+	// if the alias is invalidated during mapping, do not cache it
+	a = (generation == ofm->aliasGeneration? replaceableBufferAlias_noLock(ofm): NULL);
+	if(a != NULL){
+		replacedPage = (a->pageSize != 0? a->kernelPage: NULL);
+		a->userPage = pageBegin;
+		a->pageSize = pageSize;
+		a->kernelPage = kernelPage;
+		a->referenceCount = 1;
+		a->isValid = 1;
+		a->hasAttribute = hasAttribute;
+		a->lastUsed = ofm->aliasClock++;
+	}
+	releaseLock(&ofm->aliasLock);
+	if(replacedPage != NULL){
+		unmapKernelBuffer(replacedPage);
+	}
+	*alias = a;
+	return kernelPage;
+}
+
+static void releaseBufferAlias(OpenFileManager *ofm, BufferAlias *a){
+	void *unmappedPage = NULL;
+	acquireLock(&ofm->aliasLock);
+	assert(a->referenceCount > 0 && a->pageSize != 0);
+	a->referenceCount--;
+	if(a->referenceCount == 0 && a->isValid == 0){
+		unmappedPage = a->kernelPage;
+		a->pageSize = 0;
+		a->kernelPage = NULL;
+	}
+	releaseLock(&ofm->aliasLock);
+	if(unmappedPage != NULL){
+		unmapKernelBuffer(unmappedPage);
+	}
+}
+
+void invalidateBufferAlias(OpenFileManager *ofm){
+	void *unmappedPage[BUFFER_ALIAS_LENGTH];
+	int i, unmappedCount = 0;
+	acquireLock(&ofm->aliasLock);
+	ofm->aliasGeneration++;
+	for(i = 0; i < BUFFER_ALIAS_LENGTH; i++){
+		BufferAlias *a = ofm->alias + i;
+		if(a->pageSize == 0)
+			continue;
+		a->isValid = 0;
+		// unmap in releaseBufferAlias
+		if(a->referenceCount != 0)
+			continue;
+		unmappedPage[unmappedCount] = a->kernelPage;
+		unmappedCount++;
+		a->pageSize = 0;
+		a->kernelPage = NULL;
+	}
+	releaseLock(&ofm->aliasLock);
+	for(i = 0; i < unmappedCount; i++){
+		unmapKernelBuffer(unmappedPage[i]);
+	}
+}
+
 /*
 static PhysicalAddressArray *reserveBufferPages(void *buffer, uintptr_t bufferSize, uintptr_t *bufferOffset){
 	uintptr_t pageBegin, pageSize;
@@ -384,10 +719,19 @@ struct FileIORequest{
 	uintptr_t returnValues[0];
 };
 
+enum RWBufferType{
+	KERNEL_BUFFER, // the buffer is in kernel space
+	MAPPED_BUFFER, // unmapKernelBuffer(mappedBuffer)
+	ALIAS_BUFFER // releaseBufferAlias(fileManager, bufferAlias)
+};
+
 struct RWFileRequest{
 	int isWrite: 1;
 	int updateOffset: 1;
+	enum RWBufferType bufferType;
 	void *mappedBuffer;
+	OpenFileManager *fileManager;
+	BufferAlias *bufferAlias;
 	struct FileIORequest fior;
 	uintptr_t returnValues[1];
 };
@@ -505,10 +849,21 @@ void completeFileIO0(FileIORequest2 *r0){
 	completeFileIO(&r0->fior, 0);
 }
 
+// see mapRWBuffer
 static void beforeDeleteRWFileIO(void *instance){
 	RWFileRequest *rwfr = instance;
 	assert(rwfr->mappedBuffer != NULL);
-	unmapKernelBuffer(rwfr->mappedBuffer);
+	switch(rwfr->bufferType){
+	case KERNEL_BUFFER:
+		break;
+	case MAPPED_BUFFER:
+		unmapKernelBuffer(rwfr->mappedBuffer);
+		break;
+	case ALIAS_BUFFER:
+		releaseBufferAlias(rwfr->fileManager, rwfr->bufferAlias);
+		rwfr->bufferAlias = NULL;
+		break;
+	}
 	rwfr->mappedBuffer = NULL;
 }
 
@@ -544,7 +899,7 @@ static void beforeDeleteOpenFileIO(void *instance){
 
 static void _completeOpenFile(OpenFileRequest *r1, void *fileInstance, const FileFunctions *ff, int ok){
 	OpenedFile *of = r1->ofior.file;
-	assert(of->fileManager == NULL && r1->mappedBuffer != NULL);
+	assert(isOpenedFileInitialized(of) == 0 && r1->mappedBuffer != NULL);
 	if(ok){
 		initOpenedFile2(of, fileInstance, ff, r1->fileManager);
 		beforeDeleteOpenFileIO(r1);
@@ -584,16 +939,43 @@ static void initFileIO(struct FileIORequest *fior, void *instance, OpenedFile *f
 	fior->acceptFileIO = defaultAcceptFileIO;
 }
 
-static OpenFileRequest *createOpenFileIO(OpenedFile *openingFile, void *mappedBuffer){
+static OpenFileRequest *createOpenFileIO(OpenedFile *openingFile, OpenFileManager *ofm, void *mappedBuffer){
 	OpenFileRequest *NEW(ofr);
 	if(ofr == NULL)
 		return NULL;
 	initFileIO(&ofr->ofior, ofr, openingFile, defaultBeforeDeleteFileIO);
-	ofr->fileManager = getOpenFileManager(processorLocalTask());
+	ofr->fileManager = ofm;
 	ofr->mappedBuffer = mappedBuffer;
 	return ofr;
 }
 
+// mapping and unmapping the buffer in every request is slow, because unmapping has to invalidate TLB of all processors
+// 1. if the buffer is in kernel space, use it directly
+// 2. if the buffer is small, use the kernel alias cached in OpenFileManager
+// 3. otherwise, map the buffer to kernel
+static void *mapRWBuffer(RWFileRequest *rwfr, OpenFileManager *ofm, uintptr_t buffer, uintptr_t size){
+	rwfr->fileManager = ofm;
+	rwfr->bufferAlias = NULL;
+	if(isKernelBuffer(buffer, size)){
+		rwfr->bufferType = KERNEL_BUFFER;
+		return (void*)buffer;
+	}
+	// the aliases of globalFileManager would mix the user spaces of its callers
+	if(ofm == globalFileManager)
+		return NULL;
+	uintptr_t pageOffset, pageBegin;
+	size_t pageSize;
+	bufferToPageRange(buffer, size, &pageBegin, &pageOffset, &pageSize);
+	// the kernel writes to the buffer of read requests
+	void *mappedPage = mapUserPages(ofm, pageBegin, pageSize,
+		(rwfr->isWrite? 0: KERNEL_PAGE), &rwfr->bufferAlias);
+	if(mappedPage == NULL){
+		return NULL;
+	}
+	rwfr->bufferType = (rwfr->bufferAlias != NULL? ALIAS_BUFFER: MAPPED_BUFFER);
+	return (void*)(pageOffset + ((uintptr_t)mappedPage));
+}
+
 static RWFileRequest *createRWFileIO(
 	OpenedFile *file, int doWrite, int updateOffset,
 	uintptr_t notMappedBuffer, uintptr_t size
@@ -604,7 +986,7 @@ static RWFileRequest *createRWFileIO(
 	rwfr->isWrite = doWrite;
 	rwfr->updateOffset = updateOffset;
 	// see beforeDeleteRWFileIO
-	rwfr->mappedBuffer =  mapBufferToKernel((const void*)notMappedBuffer, size);
+	rwfr->mappedBuffer = mapRWBuffer(rwfr, file->fileManager, notMappedBuffer, size);
 	EXPECT(rwfr->mappedBuffer != NULL);
 
 	return rwfr;
@@ -629,7 +1011,10 @@ static CloseFileRequest *initCloseFileIO(CloseFileRequest *cfr, OpenedFile *file
 }
 
 // call DELETE if fail
-static int createOpenFileRequests(OpenedFile **of, CloseFileRequest **cfr, OpenFileRequest **ofr, void *mappedBuffer){
+static int createOpenFileRequests(
+	OpenedFile **of, CloseFileRequest **cfr, OpenFileRequest **ofr,
+	OpenFileManager *ofm, void *mappedBuffer
+){
 	// allocate memory in advance to avoid failure during closing file
 	OpenedFile *NEW(of2);
 	EXPECT(of2 != NULL);
@@ -638,14 +1023,16 @@ static int createOpenFileRequests(OpenedFile **of, CloseFileRequest **cfr, OpenF
 	CloseFileRequest *NEW(cfr2);
 	EXPECT(cfr2 != NULL);
 	MEMSET0(cfr2);
-	OpenFileRequest *ofr2 = createOpenFileIO(of2, mappedBuffer);
+	OpenFileRequest *ofr2 = createOpenFileIO(of2, ofm, mappedBuffer);
 	EXPECT(ofr2 != NULL);
 	initOpenedFile(of2, cfr2);
+	EXPECT(reserveFileHandle(ofr2->fileManager, of2));
 	(*of) = of2;
 	(*cfr) = cfr2;
 	(*ofr) = ofr2;
 	return 1;
-	//DELETE(ofr2);
+	ON_ERROR;
+	DELETE(ofr2);
 	ON_ERROR;
 	DELETE(cfr2);
 	ON_ERROR;
@@ -708,6 +1095,12 @@ int seekWriteByOffset(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buffer
 }
 
 #define NULL_OR(R) ((R) == NULL? (NULL): &(R)->fior)
+
+// global handles are only for the kernel
+static int isUserModeCall(const InterruptParam *p){
+	return (p->cs & 3) != 0 || p->eflags.bit.virtual8086;
+}
+
 // arg0 = str; arg1 = strLen
 static IORequest *dispatchFileNameCommand(
 	FileSystem *fs,
@@ -717,11 +1110,18 @@ static IORequest *dispatchFileNameCommand(
 	struct FileIORequest *fior = NULL;
 	switch(SYSTEM_CALL_NUMBER(p)){
 	case SYSCALL_OPEN_FILE:
+	case SYSCALL_OPEN_GLOBAL_FILE:
 		{
+			OpenFileManager *ofm = getOpenFileManager(processorLocalTask());
+			if(SYSTEM_CALL_NUMBER(p) == SYSCALL_OPEN_GLOBAL_FILE){
+				if(isUserModeCall(p))
+					break;
+				ofm = globalFileManager;
+			}
 			OpenedFile *openingFile;
 			OpenFileRequest *ofr;
 			CloseFileRequest *cfr;
-			int ok = createOpenFileRequests(&openingFile, &cfr, &ofr, mappedBuffer);
+			int ok = createOpenFileRequests(&openingFile, &cfr, &ofr, ofm, mappedBuffer);
 			if(!ok)
 				break;
 			pendFileIO(&ofr->ofior);
@@ -786,9 +1186,15 @@ static RWFileRequest *dispatchRWFileCommand(OpenedFile *of, const InterruptParam
 
 static IORequest *dispatchFileHandleCommand(const InterruptParam *p){
 	const int isClosing = (SYSTEM_CALL_NUMBER(p) == SYSCALL_CLOSE_FILE);
+	const uintptr_t handle = SYSTEM_CALL_ARGUMENT_0(p);
 	// file handle to OpenedFile
 	OpenFileManager *ofm = getOpenFileManager(processorLocalTask());
-	OpenedFile *of = searchOpenFileList(ofm, SYSTEM_CALL_ARGUMENT_0(p), isClosing);
+	if(handle & GLOBAL_FILE_HANDLE_BIT){
+		if(isUserModeCall(p))
+			return IO_REQUEST_FAILURE;
+		ofm = globalFileManager;
+	}
+	OpenedFile *of = searchOpenFile(ofm, handle, isClosing);
 
 	if(of == NULL)
 		return IO_REQUEST_FAILURE;
@@ -852,7 +1258,7 @@ static IORequest *dispatchFileHandleCommand(const InterruptParam *p){
 	}
 	// if failed
 	assert(isClosing == 0);
-	addFileIOCount(of, -1); // undo addIOCount in searchOpenFileList
+	addFileIOCount(of, -1); // undo addIOCount in searchOpenFile
 	return IO_REQUEST_FAILURE;
 }
 
@@ -921,8 +1327,63 @@ static void FileHandleCommandHandler(InterruptParam *p){
 	SYSTEM_CALL_RETURN_VALUE_0(p) = (uintptr_t)ior;
 }
 
+uintptr_t syncOpenGlobalFileN(const char *fileName, uintptr_t nameLength, OpenFileMode openMode){
+	uintptr_t handle;
+	uintptr_t r = systemCall4(SYSCALL_OPEN_GLOBAL_FILE, (uintptr_t)fileName, nameLength, openMode.value);
+	if(r == IO_REQUEST_FAILURE)
+		return r;
+	if(r != systemCall_waitIOReturn(r, 1, &handle))
+		return IO_REQUEST_FAILURE;
+	return handle;
+}
+
+// file change notification
+
+#define MAX_FILE_CHANGE_HANDLER_COUNT (4)
+static Spinlock fileChangeLock = INITIAL_SPINLOCK;
+static FileChangeHandler *fileChangeHandler[MAX_FILE_CHANGE_HANDLER_COUNT];
+static int fileChangeHandlerCount = 0;
+static volatile uint32_t fileChangeCount = 0;
+
+int addFileChangeHandler(FileChangeHandler *h){
+	int ok;
+	acquireLock(&fileChangeLock);
+	ok = (fileChangeHandlerCount < MAX_FILE_CHANGE_HANDLER_COUNT);
+	if(ok){
+		fileChangeHandler[fileChangeHandlerCount] = h;
+		fileChangeHandlerCount++;
+	}
+	releaseLock(&fileChangeLock);
+	return ok;
+}
+
+void notifyFileChange(uint64_t fileID){
+	FileChangeHandler *h[MAX_FILE_CHANGE_HANDLER_COUNT];
+	int i, handlerCount;
+	acquireLock(&fileChangeLock);
+	fileChangeCount++;
+	handlerCount = fileChangeHandlerCount;
+	for(i = 0; i < handlerCount; i++){
+		h[i] = fileChangeHandler[i];
+	}
+	releaseLock(&fileChangeLock);
+	// handlers may release memory, so do not call them with lock
+	for(i = 0; i < handlerCount; i++){
+		h[i](fileID);
+	}
+}
+
+uint32_t getFileChangeCount(void){
+	return fileChangeCount;
+}
+
 void initFile(SystemCallTable *s){
+	globalFileManager = createOpenFileManager();
+	if(globalFileManager == NULL){
+		panic("cannot initialize global file handles");
+	}
 	registerSystemCall(s, SYSCALL_OPEN_FILE, FileNameCommandHandler, -1);
+	registerSystemCall(s, SYSCALL_OPEN_GLOBAL_FILE, FileNameCommandHandler, -1);
 	registerSystemCall(s, SYSCALL_CLOSE_FILE, FileHandleCommandHandler, 1);
 	registerSystemCall(s, SYSCALL_READ_FILE, FileHandleCommandHandler, 2);
 	registerSystemCall(s, SYSCALL_WRITE_FILE, FileHandleCommandHandler, 3);
@@ -931,3 +1392,82 @@ void initFile(SystemCallTable *s){
 	registerSystemCall(s, SYSCALL_GET_FILE_PARAMETER, FileHandleCommandHandler, 7);
 	registerSystemCall(s, SYSCALL_SET_FILE_PARAMETER, FileHandleCommandHandler, 8);
 }
+
+#ifndef NDEBUG
+
+// closed handles are invalid even if their entries are reused
+void testFileHandle(void);
+void testFileHandle(void){
+	const char *fileName = "kernelfs:testfile.txt";
+	const int fileCount = 100;
+	printk("test file handle...\n");
+	uintptr_t *handle = allocateKernelMemory(fileCount * sizeof(handle[0]));
+	assert(handle != NULL);
+	int i;
+	for(i = 0; i < fileCount; i++){
+		handle[i] = syncOpenFile(fileName);
+		assert(handle[i] != IO_REQUEST_FAILURE);
+	}
+	uint64_t size;
+	uintptr_t r;
+	for(i = 0; i < fileCount; i += 2){
+		r = syncCloseFile(handle[i]);
+		assert(r == handle[i]);
+		r = syncSizeOfFile(handle[i], &size);
+		assert(r == IO_REQUEST_FAILURE);
+	}
+	for(i = 0; i < fileCount; i += 2){
+		uintptr_t h = syncOpenFile(fileName);
+		assert(h != IO_REQUEST_FAILURE && h != handle[i]);
+		r = syncSizeOfFile(handle[i], &size);
+		assert(r == IO_REQUEST_FAILURE);
+		handle[i] = h;
+	}
+	// the kernel does not write to read-only user pages
+	uint8_t *readOnlyPage = systemCall_allocateHeap(PAGE_SIZE, USER_READ_ONLY_PAGE);
+	assert(readOnlyPage != NULL);
+	uintptr_t readSize = 1;
+	r = syncSeekReadFile(handle[0], readOnlyPage, 0, &readSize);
+	assert(r == IO_REQUEST_FAILURE);
+	uint8_t *writablePage = systemCall_allocateHeap(PAGE_SIZE, USER_WRITABLE_PAGE);
+	assert(writablePage != NULL);
+	readSize = 1;
+	r = syncSeekReadFile(handle[0], writablePage, 0, &readSize);
+	assert(r == handle[0] && readSize == 1);
+	// global handles are valid in every task, but only with kernel buffers
+	uintptr_t globalHandle = syncOpenGlobalFileN(fileName, strlen(fileName), OPEN_FILE_MODE_0);
+	assert(globalHandle != IO_REQUEST_FAILURE && (globalHandle & GLOBAL_FILE_HANDLE_BIT) != 0);
+	readSize = 1;
+	r = syncSeekReadFile(globalHandle, writablePage, 0, &readSize);
+	assert(r == IO_REQUEST_FAILURE);
+	uint8_t *kernelBuffer = allocateKernelMemory(1);
+	assert(kernelBuffer != NULL);
+	readSize = 1;
+	r = syncSeekReadFile(globalHandle, kernelBuffer, 0, &readSize);
+	assert(r == globalHandle && readSize == 1 && kernelBuffer[0] == writablePage[0]);
+	releaseKernelMemory(kernelBuffer);
+	r = syncCloseFile(globalHandle);
+	assert(r == globalHandle);
+	r = syncSizeOfFile(globalHandle, &size);
+	assert(r == IO_REQUEST_FAILURE);
+	systemCall_releaseHeap(writablePage);
+	systemCall_releaseHeap(readOnlyPage);
+	uint64_t t0 = systemCall_getTime(), t1;
+	uintptr_t count = 0;
+	while((t1 = systemCall_getTime()) == t0);
+	while(systemCall_getTime() - t1 < 1){
+		r = syncSizeOfFile(handle[count % fileCount], &size);
+		assert(r == handle[count % fileCount]);
+		count++;
+	}
+	printk("%d files: %u get parameter calls per second\n", fileCount, count);
+	for(i = 0; i < fileCount; i++){
+		r = syncCloseFile(handle[i]);
+		assert(r == handle[i]);
+	}
+	releaseKernelMemory(handle);
+	printk("test file handle ok\n");
+	systemCall_terminate();
+}
+
+#endif
@@ -10,6 +10,8 @@
 // disk driver
 
 void readPartitions(const char *fileName, uintptr_t nameLength, uint64_t sectorCount, uintptr_t sectorSize);
+// fill a 512-byte sector with an MBR of one primary partition
+void initSinglePartitionMBR(void *mbr, DiskPartitionType diskType, uint32_t startLBA, uint32_t sectorCount);
 
 uintptr_t enumNextDiskPartition(uintptr_t f, DiskPartitionType t, FileEnumeration *fe);
 
@@ -90,19 +92,60 @@ typedef struct OpenFileManager OpenFileManager;
 OpenFileManager *createOpenFileManager(void);
 void deleteOpenFileManager(OpenFileManager *ofm);
 int addOpenFileManagerReference(OpenFileManager *ofm, int n);
+// the handle of ofr is reserved in ofm when the open request is created
 void addToOpenFileList(OpenFileManager *ofm, OpenedFile *ofr);
+// release the handle; searching the handle fails after this function returns
 void removeFromOpenFileList(OpenedFile *of);
+// a small index in the handle table of OpenFileManager with a generation number
 uintptr_t getFileHandle(OpenedFile *of);
 void *getFileInstance(OpenedFile *of);
 uint64_t getFileOffset(OpenedFile *of);
+// open fileName in the handle table owned by the kernel
+// the handle is valid in all tasks, but only for kernel-mode callers with kernel buffers
+// user programs cannot use or close it
+uintptr_t syncOpenGlobalFileN(const char *fileName, uintptr_t nameLength, OpenFileMode openMode);
+// map the buffer of the current task to kernel memory; return NULL if failed
+void *mapBufferToKernel(const void *buffer, uintptr_t size);
+// buffer is returned by mapBufferToKernel
+void unmapKernelBuffer(void *buffer);
 // assume no pending IO requests
 void closeAllOpenFileRequest(OpenFileManager *ofm);
+// call when user pages of the task are released
+void invalidateBufferAlias(OpenFileManager *ofm);
+
+// file systems call notifyFileChange after a file is written or truncated
+// caches of file content register FileChangeHandler to invalidate the file
+// fileID is FILE_PARAM_FILE_ID of the file
+typedef void FileChangeHandler(uint64_t fileID);
+int addFileChangeHandler(FileChangeHandler *h);
+void notifyFileChange(uint64_t fileID);
+// the number of notifyFileChange calls
+uint32_t getFileChangeCount(void);
 
 // FAT32
 void fatService(void);
+// create an empty FAT32 file system in memory. partition is the first sector of the partition
+int formatFAT32(void *partition, uint64_t startLBA, uint32_t sectorCount, uintptr_t sectorSize);
 
 // kernel file
 void initKernelFile(void);
+// map the BLOB fileName read-only to the user linear memory m without copying
+// return the address of the file data, or NULL if failed
+void *mapKernelFile(LinearMemoryManager *m, const char *fileName, uintptr_t nameLength, uintptr_t *fileSize);
+// address is returned by mapKernelFile
+int unmapKernelFile(LinearMemoryManager *m, void *address);
+
+// memory-mapped file, see systemCall_mapFile
+void initMappedFile(SystemCallTable *s);
+// return 1 if the page at address of the current task has been loaded from its mapped file
+int loadMappedFilePage(uintptr_t address);
+// load the unmapped pages in range, for the kernel to access user buffers
+void loadMappedFilePages(uintptr_t pageBegin, uintptr_t pageSize);
+// call when the linear memory of the task is released
+void releaseFileMappings(LinearMemoryManager *m);
+
+// memory usage report
+void initMemoryInfoFile(void);
 
 // FIFO with file system call
 void initFIFOFile(void);
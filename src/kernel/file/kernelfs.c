@@ -78,16 +78,88 @@ static OpenedBLOBFile *createOpenedBLOBFile(const BLOBAddress *blob){
 	return f;
 }
 
-static const BLOBAddress *findByName(const char *fileName, uintptr_t length){
-	const BLOBAddress *file;
-	for(file = blobList; file != blobList + blobCount; file++){
-		if(strncmp(fileName, file->name, length) == 0){
-			break;
+// index of blobList by name, built by initKernelFile
+// open addressing with linear probing; an entry is (index in blobList + 1), or 0 if unused
+static struct{
+	int *table;
+	// power of 2 and larger than blobCount
+	uintptr_t size;
+}blobIndex = {NULL, 0};
+
+static uint32_t hashBLOBName(const char *name, uintptr_t length){
+	uint32_t h = 2166136261u;
+	uintptr_t i;
+	for(i = 0; i < length; i++){
+		h = (h ^ (uint8_t)name[i]) * 16777619;
+	}
+	return h;
+}
+
+static int equalsBLOBName(const BLOBAddress *blob, const char *fileName, uintptr_t length){
+	return strncmp(fileName, blob->name, length) == 0 && blob->name[length] == '\0';
+}
+
+static int initBLOBIndex(void){
+	uintptr_t size = 1;
+	while(size < (uintptr_t)blobCount * 2){
+		size *= 2;
+	}
+	NEW_ARRAY(blobIndex.table, size);
+	if(blobIndex.table == NULL){
+		return 0;
+	}
+	memset(blobIndex.table, 0, size * sizeof(blobIndex.table[0]));
+	blobIndex.size = size;
+	int b;
+	for(b = 0; b < blobCount; b++){
+		uintptr_t i = hashBLOBName(blobList[b].name, strlen(blobList[b].name)) & (size - 1);
+		while(blobIndex.table[i] != 0){
+			i = (i + 1) & (size - 1);
 		}
+		blobIndex.table[i] = b + 1;
 	}
-	if(file == blobList + blobCount)
+	return 1;
+}
+
+static const BLOBAddress *findByName(const char *fileName, uintptr_t length){
+	if(blobIndex.table == NULL){
+		// see initKernelFile
+		int b;
+		for(b = 0; b < blobCount; b++){
+			if(equalsBLOBName(blobList + b, fileName, length)){
+				return blobList + b;
+			}
+		}
 		return NULL;
-	else return file;
+	}
+	uintptr_t i = hashBLOBName(fileName, length) & (blobIndex.size - 1);
+	for(; blobIndex.table[i] != 0; i = (i + 1) & (blobIndex.size - 1)){
+		const BLOBAddress *blob = blobList + (blobIndex.table[i] - 1);
+		if(equalsBLOBName(blob, fileName, length)){
+			return blob;
+		}
+	}
+	return NULL;
+}
+
+// BLOBs are aligned to pages (see kernel.ld), so no other kernel data is mapped
+void *mapKernelFile(LinearMemoryManager *m, const char *fileName, uintptr_t nameLength, uintptr_t *fileSize){
+	assert(m != kernelLinear);
+	const BLOBAddress *blob = findByName(fileName, nameLength);
+	EXPECT(blob != NULL && blob->end > blob->begin);
+	const uintptr_t pageBegin = FLOOR(blob->begin, PAGE_SIZE);
+	void *page = checkAndMapExistingPages(
+		m, kernelLinear, pageBegin, CEIL(blob->end, PAGE_SIZE) - pageBegin, USER_READ_ONLY_PAGE, 0);
+	EXPECT(page != NULL);
+	*fileSize = blob->end - blob->begin;
+	return (void*)(((uintptr_t)page) + (blob->begin - pageBegin));
+	ON_ERROR;
+	ON_ERROR;
+	return NULL;
+}
+
+int unmapKernelFile(LinearMemoryManager *m, void *address){
+	return checkAndUnmapPages(m, (void*)FLOOR((uintptr_t)address, PAGE_SIZE));
 }
 
 static BLOBAddress kfDirectory;
@@ -128,6 +200,9 @@ void initKernelFile(void){
 	kfDirectory.name = "";
 	kfDirectory.begin = (uintptr_t)blobList;
 	kfDirectory.end = (uintptr_t)(blobList + blobCount);
+	if(initBLOBIndex() == 0){
+		printk("cannot allocate kernel file index\n");
+	}
 
 	FileNameFunctions ff = INITIAL_FILE_NAME_FUNCTIONS;
 	ff.open = openKFS;
@@ -163,6 +238,18 @@ static void testListKFS(void){
 	printk("end of file list: (total %d)\n", a);
 }
 
+static void testMapKFS(const char *name){
+	LinearMemoryManager *m = getTaskLinearMemory(processorLocalTask());
+	uintptr_t size;
+	const char *mapped = mapKernelFile(m, name, strlen(name), &size);
+	assert(mapped != NULL && ((uintptr_t)mapped) % PAGE_SIZE == 0);
+	const BLOBAddress *blob = findByName(name, strlen(name));
+	assert(blob != NULL && size == blob->end - blob->begin);
+	assert(memcmp(mapped, (const void*)blob->begin, size) == 0);
+	int ok = unmapKernelFile(m, (void*)mapped);
+	assert(ok);
+}
+
 void testKFS(void);
 void testKFS(void){
 	//waitForFirstFileSystem
@@ -226,6 +313,10 @@ void testKFS(void){
 	r2 = systemCall_readFile(file, &r2, 1);
 	assert(r2 == IO_REQUEST_FAILURE);
 
+	// prefix of file name
+	r = syncOpenFile("kernelfs:testfile");
+	assert(r == IO_REQUEST_FAILURE);
+	testMapKFS("testfile.txt");
 	// test auto close file
 	file = syncOpenFile(f2);
 	assert(file != IO_REQUEST_FAILURE);
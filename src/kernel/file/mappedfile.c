@@ -0,0 +1,663 @@
+#include"common.h"
+#include"kernel.h"
+#include"fileservice.h"
+#include"memory/memory.h"
+#include"memory/memory_private.h"
+#include"task/task.h"
+#include"interrupt/systemcalltable.h"
+#include"multiprocessor/processorlocal.h"
+#include"multiprocessor/spinlock.h"
+#include"resource/resource.h"
+
+// read-only memory-mapped files
+// kernel files are BLOBs in kernel memory, so they are mapped directly (see mapKernelFile)
+// the other files are mapped on demand. the pages are read through the file system and its block cache
+// when a task touches them, and shared by all mappings of the same file
+// the file stays open in a global handle, so the tasks cannot close it and faults do not open it again
+
+#define KERNEL_FILE_PREFIX "kernelfs:"
+
+typedef struct MappedFile{
+	// number of FileMappings and page loaders
+	int referenceCount;
+	// 0 if the file may have changed. new mappings do not use the pages
+	int isValid;
+	// 1 if notifyFileChange is called for fileID. protected by pageLock
+	// the pages not loaded yet would come from the new file, so the existing mappings cannot load them
+	int isChanged;
+	int hasFileID;
+	uint64_t fileID;
+	uintptr_t pageCount;
+	// global handle for loading pages, closed in deleteMappedFile
+	uintptr_t file;
+	// content of every page of the file; NULL if not loaded
+	Spinlock pageLock;
+	void **page;
+	uintptr_t nameLength;
+	char *fileName;
+	struct MappedFile **prev, *next;
+}MappedFile;
+
+// in LinearMemoryManager.fileMappingList of memory
+typedef struct FileMapping{
+	LinearMemoryManager *memory;
+	// returned by mapFile
+	uintptr_t address;
+	// the linear block
+	uintptr_t blockAddress, size;
+	// NULL if the file is a kernel file
+	MappedFile *file;
+	// index of the page at blockAddress in file
+	uintptr_t filePage;
+	struct FileMapping **prev, *next;
+}FileMapping;
+
+// protect mappedFileList, LinearMemoryManager.fileMappingList, and MappedFile.referenceCount
+static Spinlock mappedFileLock = INITIAL_SPINLOCK;
+static MappedFile *mappedFileList = NULL;
+
+// see testMapFile
+static Spinlock mappedFileStatisticsLock = INITIAL_SPINLOCK;
+static struct{
+	uint64_t faultCount, readPageCount, sharedFileCount;
+}mappedFileStatistics = {0, 0, 0};
+
+#define ADD_MAPPED_FILE_STATISTICS(FIELD, VALUE) do{\
+	acquireLock(&mappedFileStatisticsLock);\
+	mappedFileStatistics.FIELD += (VALUE);\
+	releaseLock(&mappedFileStatisticsLock);\
+}while(0)
+
+// MappedFile
+
+static void deleteMappedFile(MappedFile *f){
+	uintptr_t i;
+	for(i = 0; i < f->pageCount; i++){
+		if(f->page[i] != NULL){
+			// the tasks mapping the page keep their own reference
+			checkAndReleaseKernelPages(f->page[i]);
+		}
+	}
+	if(syncCloseFile(f->file) == IO_REQUEST_FAILURE){
+		printk("warning: cannot close mapped file\n");
+	}
+	DELETE(f->fileName);
+	DELETE(f->page);
+	DELETE(f);
+}
+
+static MappedFile *createMappedFile(
+	const char *fileName, uintptr_t nameLength, uintptr_t file,
+	int hasFileID, uint64_t fileID, int isValid, uintptr_t pageCount
+){
+	MappedFile *NEW(f);
+	EXPECT(f != NULL);
+	NEW_ARRAY(f->page, pageCount);
+	EXPECT(f->page != NULL);
+	memset(f->page, 0, pageCount * sizeof(f->page[0]));
+	NEW_ARRAY(f->fileName, nameLength);
+	EXPECT(f->fileName != NULL);
+	strncpy(f->fileName, fileName, nameLength);
+	f->nameLength = nameLength;
+	f->referenceCount = 1;
+	f->isValid = isValid;
+	f->isChanged = 0;
+	f->hasFileID = hasFileID;
+	f->fileID = fileID;
+	f->pageCount = pageCount;
+	f->file = file;
+	f->pageLock = initialSpinlock;
+	f->prev = NULL;
+	f->next = NULL;
+	return f;
+	ON_ERROR;
+	DELETE(f->page);
+	ON_ERROR;
+	DELETE(f);
+	ON_ERROR;
+	return NULL;
+}
+
+static int isSameMappedFile_noLock(
+	const MappedFile *f, const char *fileName, uintptr_t nameLength,
+	int hasFileID, uint64_t fileID, uintptr_t pageCount
+){
+	return f->isValid &&
+		f->nameLength == nameLength && strncmp(f->fileName, fileName, nameLength) == 0 &&
+		f->hasFileID == hasFileID && (hasFileID == 0 || f->fileID == fileID) &&
+		f->pageCount == pageCount;
+}
+
+// return a file being mapped with the same name, id, and size, or create one
+// the new MappedFile owns file; if the returned one is shared, the caller closes file
+// isValid = 0 if the file may have changed after its size was read
+static MappedFile *acquireMappedFile(
+	const char *fileName, uintptr_t nameLength, uintptr_t file,
+	int hasFileID, uint64_t fileID, int isValid, uintptr_t pageCount
+){
+	MappedFile *f;
+	acquireLock(&mappedFileLock);
+	for(f = (isValid? mappedFileList: NULL); f != NULL; f = f->next){
+		if(isSameMappedFile_noLock(f, fileName, nameLength, hasFileID, fileID, pageCount)){
+			f->referenceCount++;
+			break;
+		}
+	}
+	releaseLock(&mappedFileLock);
+	if(f != NULL){
+		ADD_MAPPED_FILE_STATISTICS(sharedFileCount, 1);
+		return f;
+	}
+	f = createMappedFile(fileName, nameLength, file, hasFileID, fileID, isValid, pageCount);
+	if(f == NULL){
+		return NULL;
+	}
+	acquireLock(&mappedFileLock);
+	ADD_TO_DQUEUE(f, &mappedFileList);
+	releaseLock(&mappedFileLock);
+	return f;
+}
+
+static void releaseMappedFile(MappedFile *f){
+	acquireLock(&mappedFileLock);
+	f->referenceCount--;
+	const int r = f->referenceCount;
+	if(r == 0){
+		REMOVE_FROM_DQUEUE(f);
+	}
+	releaseLock(&mappedFileLock);
+	if(r == 0){
+		deleteMappedFile(f);
+	}
+}
+
+// FileChangeHandler
+// existing mappings keep the loaded pages, but they fail to load the other pages
+// otherwise a mapping would show a mix of the old and new file
+static void invalidateMappedFile(uint64_t fileID){
+	MappedFile *f;
+	acquireLock(&mappedFileLock);
+	for(f = mappedFileList; f != NULL; f = f->next){
+		if(f->hasFileID && f->fileID == fileID){
+			f->isValid = 0;
+			acquireLock(&f->pageLock);
+			f->isChanged = 1;
+			releaseLock(&f->pageLock);
+		}
+	}
+	releaseLock(&mappedFileLock);
+}
+
+static MappedFile *openMappedFile(const char *fileName, uintptr_t nameLength){
+	const uint32_t fileChangeCount = getFileChangeCount();
+	uintptr_t file = syncOpenGlobalFileN(fileName, nameLength, OPEN_FILE_MODE_0);
+	EXPECT(file != IO_REQUEST_FAILURE);
+	uint64_t fileSize;
+	uintptr_t r = syncSizeOfFile(file, &fileSize);
+	EXPECT(r != IO_REQUEST_FAILURE && fileSize != 0 && HIGH64(fileSize) == 0);
+	uint64_t fileID = 0;
+	const int hasFileID = (syncGetFileParameter(file, FILE_PARAM_FILE_ID, &fileID) != IO_REQUEST_FAILURE);
+	// CEIL overflows if the size is close to 4GB
+	const uintptr_t pageCount = LOW64(fileSize) / PAGE_SIZE + (LOW64(fileSize) % PAGE_SIZE != 0? 1: 0);
+	MappedFile *f = acquireMappedFile(fileName, nameLength, file, hasFileID, fileID,
+		getFileChangeCount() == fileChangeCount, pageCount);
+	EXPECT(f != NULL);
+	if(f->file != file && syncCloseFile(file) == IO_REQUEST_FAILURE){
+		printk("warning: cannot close mapped file\n");
+	}
+	return f;
+	ON_ERROR;
+	ON_ERROR;
+	syncCloseFile(file);
+	ON_ERROR;
+	return NULL;
+}
+
+static void *getMappedFilePage(MappedFile *f, uintptr_t pageIndex){
+	acquireLock(&f->pageLock);
+	void *page = f->page[pageIndex];
+	releaseLock(&f->pageLock);
+	return page;
+}
+
+// return 0 if another task has loaded the page, or the file has changed during reading
+static int setMappedFilePage(MappedFile *f, uintptr_t pageIndex, void *page){
+	int ok;
+	acquireLock(&f->pageLock);
+	ok = (f->page[pageIndex] == NULL && f->isChanged == 0);
+	if(ok){
+		f->page[pageIndex] = page;
+	}
+	releaseLock(&f->pageLock);
+	return ok;
+}
+
+// the last page is filled with 0 after the end of the file
+static void *readMappedFilePage(uintptr_t file, uintptr_t pageIndex){
+	void *page = allocateKernelPages(PAGE_SIZE, KERNEL_PAGE);
+	EXPECT(page != NULL);
+	memset(page, 0, PAGE_SIZE);
+	uintptr_t readCount = PAGE_SIZE;
+	uintptr_t request = syncSeekReadFile(file, page, ((uint64_t)pageIndex) * PAGE_SIZE, &readCount);
+	EXPECT(request != IO_REQUEST_FAILURE);
+	ADD_MAPPED_FILE_STATISTICS(readPageCount, 1);
+	return page;
+	ON_ERROR;
+	checkAndReleaseKernelPages(page);
+	ON_ERROR;
+	return NULL;
+}
+
+// pages loaded together with a faulting page
+#define MAPPED_FILE_FAULT_AROUND_PAGES (16)
+
+// load the page at pageIndex and the following pages which are not loaded
+static int readMappedFilePages(MappedFile *f, uintptr_t pageIndex){
+	acquireLock(&f->pageLock);
+	const int isChanged = f->isChanged;
+	releaseLock(&f->pageLock);
+	if(isChanged){
+		printk("warning: mapped file changed\n");
+		return 0;
+	}
+	uintptr_t i;
+	for(i = pageIndex; i < f->pageCount && i - pageIndex < MAPPED_FILE_FAULT_AROUND_PAGES; i++){
+		if(i != pageIndex && getMappedFilePage(f, i) != NULL)
+			break;
+		void *page = readMappedFilePage(f->file, i);
+		if(page == NULL)
+			break;
+		if(setMappedFilePage(f, i, page) == 0){
+			checkAndReleaseKernelPages(page);
+		}
+	}
+	EXPECT(getMappedFilePage(f, pageIndex) != NULL);
+	return 1;
+	ON_ERROR;
+	return 0;
+}
+
+// FileMapping
+
+static void deleteFileMapping(FileMapping *fm){
+	if(fm->file != NULL){
+		releaseMappedFile(fm->file);
+	}
+	DELETE(fm);
+}
+
+static void deleteFileMappingList(FileMapping *fm){
+	while(fm != NULL){
+		FileMapping *next = fm->next;
+		deleteFileMapping(fm);
+		fm = next;
+	}
+}
+
+static int isInFileMapping(const FileMapping *fm, uintptr_t address){
+	return address - fm->blockAddress < fm->size;
+}
+
+// return the mapping covering address
+static FileMapping *searchFileMapping_noLock(LinearMemoryManager *m, uintptr_t address){
+	FileMapping *fm;
+	for(fm = m->fileMappingList; fm != NULL; fm = fm->next){
+		if(isInFileMapping(fm, address))
+			break;
+	}
+	return fm;
+}
+
+// the linear blocks of mappings released by systemCall_releaseHeap may be allocated again
+// remove the old mappings overlapping the new one
+static void addFileMapping(FileMapping *newFM){
+	FileMapping *fm, *removedList = NULL;
+	acquireLock(&mappedFileLock);
+	fm = newFM->memory->fileMappingList;
+	while(fm != NULL){
+		FileMapping *next = fm->next;
+		if(isInFileMapping(fm, newFM->blockAddress) || isInFileMapping(newFM, fm->blockAddress)){
+			REMOVE_FROM_DQUEUE(fm);
+			fm->next = removedList;
+			removedList = fm;
+		}
+		fm = next;
+	}
+	ADD_TO_DQUEUE(newFM, &newFM->memory->fileMappingList);
+	releaseLock(&mappedFileLock);
+	deleteFileMappingList(removedList);
+}
+
+static FileMapping *createFileMapping(
+	LinearMemoryManager *m, uintptr_t address,
+	uintptr_t blockAddress, uintptr_t size,
+	MappedFile *f, uintptr_t filePage
+){
+	FileMapping *NEW(fm);
+	if(fm == NULL)
+		return NULL;
+	fm->memory = m;
+	fm->address = address;
+	fm->blockAddress = blockAddress;
+	fm->size = size;
+	fm->file = f;
+	fm->filePage = filePage;
+	fm->prev = NULL;
+	fm->next = NULL;
+	return fm;
+}
+
+// the whole BLOB is mapped regardless of size because it takes no more memory
+static FileMapping *createKernelFileMapping(
+	LinearMemoryManager *m, const char *fileName, uintptr_t nameLength, uintptr_t offset
+){
+	uintptr_t fileSize;
+	const uintptr_t address = (uintptr_t)mapKernelFile(m, fileName, nameLength, &fileSize);
+	EXPECT(address != (uintptr_t)NULL);
+	EXPECT(offset < fileSize);
+	const uintptr_t blockAddress = FLOOR(address, PAGE_SIZE);
+	FileMapping *fm = createFileMapping(m, address + offset,
+		blockAddress, CEIL(address + fileSize, PAGE_SIZE) - blockAddress, NULL, 0);
+	EXPECT(fm != NULL);
+	return fm;
+	ON_ERROR;
+	ON_ERROR;
+	unmapKernelFile(m, (void*)address);
+	ON_ERROR;
+	return NULL;
+}
+
+// the pages are unmapped until the task touches them; see loadMappedFilePage
+static FileMapping *createDiskFileMapping(
+	LinearMemoryManager *m, const char *fileName, uintptr_t nameLength, uintptr_t offset, uintptr_t size
+){
+	EXPECT(size != 0);
+	MappedFile *f = openMappedFile(fileName, nameLength);
+	EXPECT(f != NULL);
+	const uintptr_t filePage = offset / PAGE_SIZE;
+	EXPECT(filePage < f->pageCount);
+	size = CEIL(MIN(size, (f->pageCount - filePage) * PAGE_SIZE), PAGE_SIZE);
+	const uintptr_t address = allocateUnmappedLinearBlock(m, size);
+	EXPECT(address != INVALID_PAGE_ADDRESS);
+	FileMapping *fm = createFileMapping(m, address, address, size, f, filePage);
+	EXPECT(fm != NULL);
+	return fm;
+	ON_ERROR;
+	checkAndReleasePages(m, (void*)address);
+	ON_ERROR;
+	ON_ERROR;
+	releaseMappedFile(f);
+	ON_ERROR;
+	ON_ERROR;
+	return NULL;
+}
+
+static int isKernelFileName(const char *fileName, uintptr_t nameLength){
+	const uintptr_t prefixLength = strlen(KERNEL_FILE_PREFIX);
+	return nameLength >= prefixLength && strncmp(fileName, KERNEL_FILE_PREFIX, prefixLength) == 0;
+}
+
+static void *mapFile(const char *userFileName, uintptr_t nameLength, uintptr_t offset, uintptr_t size){
+	EXPECT(nameLength != 0 && offset % PAGE_SIZE == 0);
+	const char *fileName = mapBufferToKernel(userFileName, nameLength);
+	EXPECT(fileName != NULL);
+	LinearMemoryManager *m = getTaskLinearMemory(processorLocalTask());
+	FileMapping *fm;
+	if(isKernelFileName(fileName, nameLength)){
+		const uintptr_t prefixLength = strlen(KERNEL_FILE_PREFIX);
+		fm = createKernelFileMapping(m, fileName + prefixLength, nameLength - prefixLength, offset);
+	}
+	else{
+		fm = createDiskFileMapping(m, fileName, nameLength, offset, size);
+	}
+	unmapKernelBuffer((void*)fileName);
+	EXPECT(fm != NULL);
+	addFileMapping(fm);
+	return (void*)fm->address;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return NULL;
+}
+
+static int unmapFile(uintptr_t address){
+	Task *t = processorLocalTask();
+	LinearMemoryManager *m = getTaskLinearMemory(t);
+	FileMapping *fm;
+	acquireLock(&mappedFileLock);
+	for(fm = m->fileMappingList; fm != NULL; fm = fm->next){
+		if(fm->address == address){
+			REMOVE_FROM_DQUEUE(fm);
+			break;
+		}
+	}
+	releaseLock(&mappedFileLock);
+	EXPECT(fm != NULL);
+	int ok = checkAndReleasePages(m, (void*)fm->blockAddress);
+	if(ok){
+		invalidateBufferAlias(getOpenFileManager(t));
+	}
+	deleteFileMapping(fm);
+	return ok;
+	ON_ERROR;
+	return 0;
+}
+
+// mappings are read-only, so there is nothing to write back
+static int syncMappedFile(uintptr_t address){
+	LinearMemoryManager *m = getTaskLinearMemory(processorLocalTask());
+	FileMapping *fm;
+	acquireLock(&mappedFileLock);
+	for(fm = m->fileMappingList; fm != NULL; fm = fm->next){
+		if(fm->address == address)
+			break;
+	}
+	releaseLock(&mappedFileLock);
+	return fm != NULL;
+}
+
+void releaseFileMappings(LinearMemoryManager *m){
+	acquireLock(&mappedFileLock);
+	FileMapping *removedList = m->fileMappingList;
+	m->fileMappingList = NULL;
+	releaseLock(&mappedFileLock);
+	deleteFileMappingList(removedList);
+}
+
+// page fault
+
+// the mapping may be removed while the page is being read
+static int mapMappedFilePage(LinearMemoryManager *m, MappedFile *f, uintptr_t pageIndex, uintptr_t address){
+	if(isUnmappedLinearBlock(m, address) == 0){
+		// loaded by another thread, or released by the task
+		return checkAndTranslatePage(m, (void*)address).value != INVALID_PAGE_ADDRESS;
+	}
+	ADD_MAPPED_FILE_STATISTICS(faultCount, 1);
+	void *page = getMappedFilePage(f, pageIndex);
+	if(page == NULL && readMappedFilePages(f, pageIndex)){
+		page = getMappedFilePage(f, pageIndex);
+	}
+	EXPECT(page != NULL);
+	acquireLock(&mappedFileLock);
+	FileMapping *fm = searchFileMapping_noLock(m, address);
+	int ok = (fm != NULL && fm->file == f &&
+		fm->filePage + (address - fm->blockAddress) / PAGE_SIZE == pageIndex &&
+		mapUnmappedLinearBlock(m, address, checkAndTranslatePage(kernelLinear, page), USER_READ_ONLY_PAGE));
+	releaseLock(&mappedFileLock);
+	if(ok == 0){
+		return checkAndTranslatePage(m, (void*)address).value != INVALID_PAGE_ADDRESS;
+	}
+	return 1;
+	ON_ERROR;
+	return 0;
+}
+
+int loadMappedFilePage(uintptr_t address){
+	LinearMemoryManager *m = getTaskLinearMemory(processorLocalTask());
+	address = FLOOR(address, PAGE_SIZE);
+	uintptr_t pageIndex = 0;
+	acquireLock(&mappedFileLock);
+	FileMapping *fm = searchFileMapping_noLock(m, address);
+	// kernel files are always mapped
+	MappedFile *f = (fm == NULL? NULL: fm->file);
+	if(f != NULL){
+		f->referenceCount++;
+		pageIndex = fm->filePage + (address - fm->blockAddress) / PAGE_SIZE;
+	}
+	releaseLock(&mappedFileLock);
+	EXPECT(f != NULL);
+	int ok = mapMappedFilePage(m, f, pageIndex, address);
+	releaseMappedFile(f);
+	return ok;
+	ON_ERROR;
+	return 0;
+}
+
+void loadMappedFilePages(uintptr_t pageBegin, uintptr_t pageSize){
+	LinearMemoryManager *m = getTaskLinearMemory(processorLocalTask());
+	uintptr_t a;
+	for(a = 0; a < pageSize; a += PAGE_SIZE){
+		if(isUnmappedLinearBlock(m, pageBegin + a)){
+			loadMappedFilePage(pageBegin + a);
+		}
+	}
+}
+
+// system calls
+
+static void mapFileHandler(InterruptParam *p){
+	sti();
+	const char *fileName = (const char*)SYSTEM_CALL_ARGUMENT_0(p);
+	uintptr_t nameLength = SYSTEM_CALL_ARGUMENT_1(p);
+	uintptr_t offset = SYSTEM_CALL_ARGUMENT_2(p);
+	uintptr_t size = SYSTEM_CALL_ARGUMENT_3(p);
+	SYSTEM_CALL_RETURN_VALUE_0(p) = (uintptr_t)mapFile(fileName, nameLength, offset, size);
+}
+
+static void unmapFileHandler(InterruptParam *p){
+	sti();
+	SYSTEM_CALL_RETURN_VALUE_0(p) = unmapFile(SYSTEM_CALL_ARGUMENT_0(p));
+}
+
+static void syncMappedFileHandler(InterruptParam *p){
+	sti();
+	SYSTEM_CALL_RETURN_VALUE_0(p) = syncMappedFile(SYSTEM_CALL_ARGUMENT_0(p));
+}
+
+void initMappedFile(SystemCallTable *s){
+	if(addFileChangeHandler(invalidateMappedFile) == 0){
+		panic("cannot initialize mapped file");
+	}
+	registerSystemCall(s, SYSCALL_MAP_FILE, mapFileHandler, 0);
+	registerSystemCall(s, SYSCALL_UNMAP_FILE, unmapFileHandler, 0);
+	registerSystemCall(s, SYSCALL_SYNC_MAPPED_FILE, syncMappedFileHandler, 0);
+}
+
+#ifndef NDEBUG
+
+// compare the mapping with the file read by syncSeekReadFile
+static void testCompareMappedFile(const char *fileName, const uint8_t *mapped, uintptr_t offset, uintptr_t size){
+	uintptr_t h = syncOpenFile(fileName);
+	assert(h != IO_REQUEST_FAILURE);
+	uint8_t *buffer = systemCall_allocateHeap(PAGE_SIZE, USER_WRITABLE_PAGE);
+	assert(buffer != NULL);
+	uintptr_t a;
+	for(a = 0; a < size; a += PAGE_SIZE){
+		uintptr_t readSize = MIN(size - a, PAGE_SIZE);
+		uintptr_t r = syncSeekReadFile(h, buffer, offset + a, &readSize);
+		assert(r == h && readSize == MIN(size - a, PAGE_SIZE));
+		assert(memcmp(mapped + a, buffer, readSize) == 0);
+	}
+	systemCall_releaseHeap(buffer);
+	uintptr_t r = syncCloseFile(h);
+	assert(r == h);
+}
+
+// the kernel does not write to read-only mapped pages. mapped is the page at offset in the file
+// read the file shifted by 1 byte so that a successful write would change the page
+static void testReadToMappedFile(const char *fileName, const uint8_t *mapped, uintptr_t offset, uintptr_t size){
+	uintptr_t h = syncOpenFile(fileName);
+	assert(h != IO_REQUEST_FAILURE);
+	uintptr_t readSize = MIN(size, PAGE_SIZE) - 1;
+	uintptr_t r = syncSeekReadFile(h, (void*)mapped, offset + 1, &readSize);
+	assert(r == IO_REQUEST_FAILURE);
+	r = syncCloseFile(h);
+	assert(r == h);
+	testCompareMappedFile(fileName, mapped, offset, MIN(size, PAGE_SIZE));
+}
+
+static uintptr_t testSizeOfFile(const char *fileName){
+	uintptr_t h = syncOpenFile(fileName);
+	assert(h != IO_REQUEST_FAILURE);
+	uint64_t size;
+	uintptr_t r = syncSizeOfFile(h, &size);
+	assert(r == h && HIGH64(size) == 0);
+	r = syncCloseFile(h);
+	assert(r == h);
+	return LOW64(size);
+}
+
+static void testMapKernelFile(const char *fileName){
+	const uintptr_t size = testSizeOfFile(fileName);
+	const uint8_t *mapped = systemCall_mapFile(fileName, strlen(fileName), 0, size);
+	assert(mapped != NULL);
+	testCompareMappedFile(fileName, mapped, 0, size);
+	testReadToMappedFile(fileName, mapped, 0, size);
+	int ok = systemCall_syncMappedFile((void*)mapped);
+	assert(ok);
+	ok = systemCall_unmapFile((void*)mapped);
+	assert(ok);
+	ok = systemCall_unmapFile((void*)mapped);
+	assert(ok == 0);
+}
+
+static void testMapDiskFile(const char *fileName){
+	const uintptr_t size = testSizeOfFile(fileName);
+	assert(size > PAGE_SIZE);
+	const uint64_t fault0 = mappedFileStatistics.faultCount, read0 = mappedFileStatistics.readPageCount,
+		shared0 = mappedFileStatistics.sharedFileCount;
+	// offset not aligned
+	const uint8_t *mapped = systemCall_mapFile(fileName, strlen(fileName), 1, size);
+	assert(mapped == NULL);
+	// size is truncated at the end of the file
+	mapped = systemCall_mapFile(fileName, strlen(fileName), PAGE_SIZE, size);
+	assert(mapped != NULL);
+	const uint8_t *mapped2 = systemCall_mapFile(fileName, strlen(fileName), 0, size);
+	assert(mapped2 != NULL && mapped2 != mapped);
+	testCompareMappedFile(fileName, mapped, PAGE_SIZE, size - PAGE_SIZE);
+	const uint64_t read1 = mappedFileStatistics.readPageCount;
+	// the second mapping shares the pages of the first
+	testCompareMappedFile(fileName, mapped2 + PAGE_SIZE, PAGE_SIZE, size - PAGE_SIZE);
+	assert(mappedFileStatistics.readPageCount == read1);
+	testCompareMappedFile(fileName, mapped2, 0, PAGE_SIZE);
+	assert(mappedFileStatistics.sharedFileCount == shared0 + 1);
+	testReadToMappedFile(fileName, mapped2, 0, size);
+	int ok = systemCall_syncMappedFile((void*)mapped);
+	assert(ok);
+	ok = systemCall_unmapFile((void*)mapped);
+	assert(ok);
+	ok = systemCall_unmapFile((void*)mapped);
+	assert(ok == 0);
+	ok = systemCall_unmapFile((void*)mapped2);
+	assert(ok);
+	printk("%s: %u KB, %u page faults, %u pages read\n", fileName, size / 1024,
+		(uintptr_t)(mappedFileStatistics.faultCount - fault0),
+		(uintptr_t)(mappedFileStatistics.readPageCount - read0));
+}
+
+void testMapFile(void);
+void testMapFile(void){
+	printk("test map file...\n");
+	int ok = waitForFirstResource("fat", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	testMapKernelFile("kernelfs:testfile.txt");
+	testMapDiskFile("fat:C/LARGEELF.ELF");
+	// not exist
+	const char *noFile = "fat:C/NOFILE.TXT";
+	void *mapped = systemCall_mapFile(noFile, strlen(noFile), 0, PAGE_SIZE);
+	assert(mapped == NULL);
+	printk("test map file ok\n");
+	systemCall_terminate();
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include"fileservice.h"
+#include"kernel.h"
+#include"memory/memory.h"
+#include"task/task.h"
+
+// a snapshot of memory usage is taken when the file is opened
+typedef struct{
+	uintptr_t length;
+	char text[];
+}MemoryInfo;
+
+#define MEMORY_INFO_SIZE (4 * PAGE_SIZE)
+
+static MemoryInfo *createMemoryInfo(void){
+	MemoryInfo *mi = allocateKernelMemory(MEMORY_INFO_SIZE);
+	if(mi == NULL){
+		return NULL;
+	}
+	const uintptr_t textSize = MEMORY_INFO_SIZE - sizeof(*mi);
+	mi->length = 0;
+	mi->length += printKernelMemoryUsage(mi->text + mi->length, textSize - mi->length);
+	mi->length += printTaskMemoryUsage(mi->text + mi->length, textSize - mi->length);
+	return mi;
+}
+
+static int seekReadMemoryInfo(
+	RWFileRequest *rwfr, OpenedFile *of,
+	uint8_t *buffer, uint64_t offset64, uintptr_t bufferSize
+){
+	MemoryInfo *mi = getFileInstance(of);
+	uintptr_t copySize = 0;
+	if(offset64 < mi->length){
+		copySize = MIN(bufferSize, mi->length - (uintptr_t)offset64);
+	}
+	memcpy(buffer, mi->text + (uintptr_t)offset64, copySize);
+	completeRWFileIO(rwfr, copySize, copySize);
+	return 1;
+}
+
+static int getMemoryInfoParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode){
+	MemoryInfo *mi = getFileInstance(of);
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		completeFileIO64(fior2, mi->length);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void closeMemoryInfo(CloseFileRequest *cfr, OpenedFile *of){
+	MemoryInfo *mi = getFileInstance(of);
+	completeCloseFile(cfr);
+	DELETE(mi);
+}
+
+static int openMemoryInfo(
+	OpenFileRequest *ofr,
+	__attribute__((__unused__)) const char *fileName, uintptr_t nameLength,
+	OpenFileMode mode
+){
+	EXPECT(nameLength == 0 && mode.enumeration == 0);
+	MemoryInfo *mi = createMemoryInfo();
+	EXPECT(mi != NULL);
+	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
+	ff.read = seekReadByOffset;
+	ff.seekRead = seekReadMemoryInfo;
+	ff.getParameter = getMemoryInfoParameter;
+	ff.close = closeMemoryInfo;
+	completeOpenFile(ofr, mi, &ff);
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+void initMemoryInfoFile(void){
+	FileNameFunctions fnf = INITIAL_FILE_NAME_FUNCTIONS;
+	fnf.open = openMemoryInfo;
+	if(addFileSystem(&fnf, "meminfo", strlen("meminfo")) == 0){
+		panic("cannot initialize memory information file");
+	}
+}
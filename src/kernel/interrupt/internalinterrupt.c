@@ -2,6 +2,9 @@
 #include"interrupt.h"
 #include"internalinterrupt.h"
 #include"multiprocessor/processorlocal.h"
+#include"memory/memory.h"
+#include"task/task.h"
+#include"file/fileservice.h"
 #include"kernel.h"
 #include"common.h"
 
@@ -118,8 +121,19 @@ static void generalProtectionHandler(InterruptParam *p){
 	}
 }
 
+#define PAGE_FAULT_PRESENT (1)
+
 static void pageFaultHandler(InterruptParam *p){
-	printk("page fault: CR0 = %x CR2 = %x CR3 = %x\n", getCR0(), getCR2(), getCR3());
+	const uintptr_t address = getCR2();
+	// a page of ELF segments or mapped files not loaded yet
+	// the task may block on reading file, so interrupt has to be enabled before page fault
+	if((p->errorCode & PAGE_FAULT_PRESENT) == 0 && p->eflags.bit.interrupt &&
+		isKernelLinearAddress(address) == 0){
+		sti();
+		if(loadELFPage(address) || loadMappedFilePage(address))
+			return;
+	}
+	printk("page fault: CR0 = %x CR2 = %x CR3 = %x\n", getCR0(), address, getCR3());
 	defaultInterruptHandler(p);
 }
 
@@ -10,6 +10,7 @@
 #include"task/exclusivelock.h"
 #include"multiprocessor/spinlock.h"
 #include"resource/resource.h"
+#include"assembly/assembly.h"
 
 typedef struct{
 	uint32_t commandBaseLow/*1KB aligned*/, commandBaseHigh, fisBaseLow/*256 byte aligned*/, fisBaseHigh;
@@ -59,6 +60,8 @@ typedef struct{
 
 static_assert(sizeof(HostToDeviceFIS) == 20);
 
+#define SLOT_PHYSICAL_REGION_COUNT (8)
+
 typedef struct{
 	// command list
 	struct CommandHeader{
@@ -98,12 +101,13 @@ typedef struct{
 			uint32_t byteCount: 22;
 			uint32_t reserved2: 9;
 			uint32_t completeInterrupt: 1; // HBAPortRegister.interruptStatus & (1 << 5)
-		}physicalRegion[8]; // length = 0 ~ 65535; size = 0 ~ 0x3fffc
+		}physicalRegion[SLOT_PHYSICAL_REGION_COUNT]; // length = 0 ~ 65535; size = 0 ~ 0x3fffc
 		// size of PhysicalRegion is at least 128
-	}commandTable[6];
+	}commandTable[32];
+	uint8_t reserved[PAGE_SIZE * 3 - 1024 - 256 * 6 - 256 * 32];
 }HBAPortMemory;
 
-// 6 command slots for a port
+// 32 command slots for a port
 // 8 physical regions for a command slot
 
 static_assert(MEMBER_OFFSET(HBAPortMemory, commandHeader) % 1024 == 0);
@@ -114,6 +118,11 @@ static_assert(sizeof(struct ReceivedFIS) == 256);
 static_assert(sizeof(struct PhysicalRegion) == 16);
 static_assert(sizeof(struct CommandTable) == 256);
 static_assert(sizeof(HBAPortMemory) % PAGE_SIZE == 0);
+#define MAX_COMMAND_SLOT_COUNT (32)
+// byteCount of PhysicalRegion has 22 bits
+#define MAX_PHYSICAL_REGION_SIZE (1 << 22)
+// sector count of FIS has 16 bits; 0 means 65536
+#define MAX_COMMAND_SECTOR_COUNT (65536)
 
 #define DEFAULT_SECTOR_SIZE (512)
 
@@ -134,7 +143,9 @@ static_assert(PAGE_SIZE % DEFAULT_SECTOR_SIZE == 0);
 	}\
 }while(0)
 
+#define HR_CAPABILITIES_SNCQ (1 << 30)
 #define HR_CAPABILITIES_CLO (1 << 24)
+#define HR_CAPABILITIES_NCS(CAP) ((((CAP) >> 8) & 0x1f) + 1)
 
 #define PR_COMMANDSTATUS_CR (1 << 15)
 #define PR_COMMANDSTATUS_FR (1 << 14)
@@ -191,38 +202,73 @@ static int startPort(volatile HBAPortRegister *pr, const volatile HBARegisters *
 	return 1;
 }
 
+#define PR_INTERRUPT_ERROR ((1 << 30)/*TFES*/ | (1 << 29)/*HBFS*/ | (1 << 28)/*HBDS*/ | (1 << 27)/*IFS*/)
+
+// stop the port, and send COMRESET if the command list does not stop or the device is still busy
+// all issued commands are discarded
+// return 1 if the HBA is no longer processing any command, which means no DMA is in flight
+static int stopAndResetPort(volatile HBAPortRegister *pr){
+	const int maxTry = 10000;
+	int ok;
+	const int stopped = stopPort(pr);
+	if(stopped == 0 || (pr->taskFileData & ((1 << 7) | (1 << 3)))){
+		// SATAControl.DET = 1 for at least 1 millisecond
+		pr->SATAControl = ((pr->SATAControl & ~0xf) | 1);
+		sleep(10);
+		pr->SATAControl = (pr->SATAControl & ~0xf);
+		POLL_UNTIL((pr->SATAStatus & 0xf) == 3, maxTry, ok);
+		if(!ok){
+			return 0;
+		}
+		if(stopped == 0){
+			POLL_UNTIL((pr->commandStatus & (PR_COMMANDSTATUS_CR | PR_COMMANDSTATUS_FR)) == 0, maxTry, ok);
+			if(!ok){
+				return 0;
+			}
+		}
+	}
+	// write 1 to clear
+	pr->SATAError = 0xffffffff;
+	pr->interruptStatus = 0xffffffff;
+	return 1;
+}
+
 enum ATACommand{
 	DMA_READ_EXT = 0x25, // DMA read LBA 48
 	DMA_WRITE_EXT = 0x35,
+	READ_FPDMA_QUEUED = 0x60, // native command queuing
+	WRITE_FPDMA_QUEUED = 0x61,
 	IDENTIFY_DEVICE = 0xec
 };
 
-static int issueIdentifyCommand(volatile HBAPortRegister *pr, HBAPortMemory *pm, uintptr_t buffer){
-	if(buffer % DEFAULT_SECTOR_SIZE != 0){
-		return 0;
-	}
-	{
-		uint32_t ctbl = pm->commandHeader[0].commandTableBaseLow;
-		uint32_t ctbh = pm->commandHeader[0].commandTableBaseHigh;
-		struct CommandHeader *pm_ch = &pm->commandHeader[0];
-		MEMSET0(pm_ch);
-		pm_ch->fisSize = sizeof(HostToDeviceFIS) / 4; // in double words
-		pm_ch->write = 0;
-		pm_ch->clearBusyOnReceive = 0;
-		pm_ch->physicalRegionLength = 1;
-		pm_ch->commandTableBaseLow = ctbl;
-		pm_ch->commandTableBaseHigh = ctbh;
-	}
-	{
-		struct PhysicalRegion *pm_ct_pr = &pm->commandTable[0].physicalRegion[0];
-		MEMSET0(pm_ct_pr);
-		pm_ct_pr->dataBaseLow = buffer;
-		pm_ct_pr->dataBaseHigh = 0;
-		pm_ct_pr->byteCount = DEFAULT_SECTOR_SIZE - 1;
-		pm_ct_pr->completeInterrupt = 0;
-	}
+// the physical regions are in ct
+static void initCommandHeader(
+	struct CommandHeader *ch, uintptr_t ctPhysical, int physicalRegionLength, int write, int clearBusyOnReceive
+){
+	MEMSET0(ch);
+	ch->fisSize = sizeof(HostToDeviceFIS) / 4; // in double words
+	//ch->atapi = 0;
+	ch->write = (write? 1 : 0);
+	//ch->prefetch = 0;
+	//ch->reset = 0;
+	//ch->bist = 0;
+	ch->clearBusyOnReceive = (clearBusyOnReceive? 1 : 0);
+	//ch->reserved = 0;
+	//ch->portMultiplitierPort = 0;
+	ch->physicalRegionLength = physicalRegionLength;
+	//ch->transferByteCount = 0;
+	//ch->reserved2 = 0;
+	ch->commandTableBaseLow = ctPhysical;
+	ch->commandTableBaseHigh = 0;
+}
+
+static int issueIdentifyCommand(
+	volatile HBAPortRegister *pr, HBAPortMemory *pm, int slot,
+	struct CommandTable *ct, uintptr_t ctPhysical, int physicalRegionLength
+){
+	initCommandHeader(&pm->commandHeader[slot], ctPhysical, physicalRegionLength, 0, 0);
 	{
-		HostToDeviceFIS *fis = &pm->commandTable[0].hostToDeviceFIS;
+		HostToDeviceFIS *fis = &ct->hostToDeviceFIS;
 		MEMSET0(fis);
 		fis->fisType = 0x27;
 		fis->command = IDENTIFY_DEVICE;
@@ -231,65 +277,36 @@ static int issueIdentifyCommand(volatile HBAPortRegister *pr, HBAPortMemory *pm,
 	}
 	//printk("tfd %x, cmd %x, sts %x ci %x is %x sact %x\n",pr->taskFileData,
 	//pr->commandStatus, pr->SATAStatus, pr->commandIssue, pr->interruptStatus, pr->SATAActive);
-	pr->commandIssue |= (1 << 0);
-	int ok;
-	// POLL_UNTIL((pr->taskFileData & 0x80)==0, 100000, ok);
-	POLL_UNTIL((pr->commandIssue & (1 << 0))==0, 100000, ok);
-	if(!ok){
-		printk("failed to issue IDENTIFY command\n");
-		return 0;
-	}
+	// writing 0 to commandIssue has no effect
+	// the command is completed in AHCIHandler
+	pr->commandIssue = (1 << slot);
 	return 1;
 }
 
+// if isQueued, send READ/WRITE FPDMA QUEUED with tag = slot
+// the command is completed in AHCIHandler
 static int issueDMACommand(
-	volatile HBAPortRegister *pr, HBAPortMemory *pm, uint32_t sectorSize,
-	uintptr_t buffer, uint64_t lba, unsigned int sectorCount, int write
+	volatile HBAPortRegister *pr, HBAPortMemory *pm, int slot,
+	struct CommandTable *ct, uintptr_t ctPhysical, int physicalRegionLength,
+	uint64_t lba, unsigned int sectorCount, int write, int isQueued
 ){
-	if(buffer % sectorSize != 0 ||
-	sectorCount == 0 || sectorCount > 65536 ||
-	sectorSize * sectorCount >= (1 << 22)){
+	if(sectorCount == 0 || sectorCount > MAX_COMMAND_SECTOR_COUNT){
 		return 0;
 	}
-	// HBAPortMemory *pm
+	initCommandHeader(&pm->commandHeader[slot], ctPhysical, physicalRegionLength, write, 1);
 	{
-		uint32_t ctbl = pm->commandHeader[0].commandTableBaseLow;
-		uint32_t ctbh = pm->commandHeader[0].commandTableBaseHigh;
-		struct CommandHeader *pm_ch = &pm->commandHeader[0];
-		MEMSET0(pm_ch);
-		pm_ch->fisSize = sizeof(HostToDeviceFIS) / 4; // in double words
-		//pm_ch->atapi = 0;
-		pm_ch->write = (write? 1 : 0);
-		//pm_ch->prefetch = 0;
-		//pm_ch->reset = 0;
-		//pm_ch->bist = 0;
-		pm_ch->clearBusyOnReceive = 1;
-		//pm->ch->reserved = 0;
-		//pm->ch->portMultiplitierPort = 0;
-		pm_ch->physicalRegionLength = 1;
-		//pm_ch->transferByteCount = 0;
-		//pm_ch->commandTableBaseLow;
-		//pm_ch->commandTableBaseHigh;
-		//pm_ch->reserved2 = 0;
-		pm_ch->commandTableBaseLow = ctbl;
-		pm_ch->commandTableBaseHigh = ctbh;
-	}
-	{
-		struct PhysicalRegion *pm_ct_pr = &pm->commandTable[0].physicalRegion[0];
-		MEMSET0(pm_ct_pr);
-		pm_ct_pr->dataBaseLow = buffer;
-		pm_ct_pr->dataBaseHigh = 0;
-		pm_ct_pr->byteCount = sectorCount * sectorSize - 1;
-		pm_ct_pr->completeInterrupt = 0;
-	}
-	{
-		HostToDeviceFIS *fis = &pm->commandTable[0].hostToDeviceFIS;
+		HostToDeviceFIS *fis = &ct->hostToDeviceFIS;
 		MEMSET0(fis); // all reserved fields shall be written as 0
 		fis->fisType = 0x27;
 		// fis->pmPort = 0;
 		// fis->reserved1 = 0;
 		fis->updateCommand = 1;
-		fis->command = (write? DMA_WRITE_EXT: DMA_READ_EXT);
+		if(isQueued){
+			fis->command = (write? WRITE_FPDMA_QUEUED: READ_FPDMA_QUEUED);
+		}
+		else{
+			fis->command = (write? DMA_WRITE_EXT: DMA_READ_EXT);
+		}
 		// fis->feature0_8 = 0;
 		fis->lba0_8 = ((lba >> 0) & 0xff);
 		fis->lba8_16 = ((lba >> 8) & 0xff);
@@ -299,9 +316,11 @@ static int issueDMACommand(
 		fis->lba32_40 = ((lba >> 32) & 0xff);
 		fis->lba40_48  = ((lba >> 40) & 0xff);
 		// fis->feature8_16 = 0;
-		if(sectorCount == 65536){ // see ATA spec
-			fis->sectorCount0_8 = 0;
-			fis->sectorCount8_16 = 0;
+		// if sectorCount == 65536, write 0; see ATA spec
+		if(isQueued){ // sector count is in feature field; tag is in sector count field
+			fis->feature0_8 = (sectorCount & 0xff);
+			fis->feature8_16 = ((sectorCount >> 8) & 0xff);
+			fis->sectorCount0_8 = (slot << 3);
 		}
 		else{
 			fis->sectorCount0_8 = (sectorCount & 0xff);
@@ -311,18 +330,13 @@ static int issueDMACommand(
 		// fis->control = 0;
 	}
 	//HBAPortRegister *pr
-	{
-		// issueCommand
-		int ok;
-		pr->commandIssue |= (1 << 0);
-		// when the HBA receives FIS clearing BSY, DRQ, and ERR bit, it clears CI
-		POLL_UNTIL((pr->commandIssue & (1 << 0)) == 0, 100000, ok);
-		if(!ok){
-			printk("failed to issue DMA command\n");
-			return 0;
-		}
-		return 1;
+	if(isQueued){
+		// the device clears SATAActive by Set Device Bits FIS when the command is completed
+		pr->SATAActive = (1 << slot);
 	}
+	// when the HBA receives FIS clearing BSY, DRQ, and ERR bit, it clears CI
+	pr->commandIssue = (1 << slot);
+	return 1;
 }
 
 static HBAPortMemory *initAHCIPort(volatile HBAPortRegister *pr, const volatile HBARegisters *hr){
@@ -332,7 +346,8 @@ static HBAPortMemory *initAHCIPort(volatile HBAPortRegister *pr, const volatile
 	ok = stopPort(pr);
 	EXPECT(ok);
 	// reset pointer to command list and received fis
-	HBAPortMemory *pm = allocateKernelPages(CEIL(sizeof(HBAPortMemory), PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
+	// command list, received FIS, and command tables are accessed by physical address
+	HBAPortMemory *pm = allocateContiguousPages(kernelLinear, sizeof(HBAPortMemory), KERNEL_NON_CACHED_PAGE);
 	EXPECT(pm != NULL);
 	PhysicalAddress pm_physical = checkAndTranslatePage(kernelLinear, pm);
 	MEMSET0(pm);
@@ -341,9 +356,12 @@ static HBAPortMemory *initAHCIPort(volatile HBAPortRegister *pr, const volatile
 
 	pr->fisBaseHigh = 0;
 	pr->fisBaseLow = pm_physical.value + MEMBER_OFFSET(HBAPortMemory, receivedFIS);
-	// initialize commandList[0]
-	pm->commandHeader[0].commandTableBaseHigh = 0;
-	pm->commandHeader[0].commandTableBaseLow = pm_physical.value + MEMBER_OFFSET(HBAPortMemory, commandTable[0]);
+	// initialize commandList
+	int s;
+	for(s = 0; s < MAX_COMMAND_SLOT_COUNT; s++){
+		pm->commandHeader[s].commandTableBaseHigh = 0;
+		pm->commandHeader[s].commandTableBaseLow = pm_physical.value + MEMBER_OFFSET(HBAPortMemory, commandTable[s]);
+	}
 
 	ok = startPort(pr, hr);
 	EXPECT(ok);
@@ -368,10 +386,43 @@ typedef struct AHCIInterruptArgument{
 		struct DiskDescription{
 			uintptr_t sectorSize;
 			uint64_t sectorCount;
+			// 0 if NCQ is not supported
+			int queueDepth;
 		}desc;
 		HBAPortMemory *hbaPortMemory;
+		PhysicalAddress hbaPortMemoryPhysical;
+		// sorted by lba; see addToPortQueue and selectPendingRequest
 		struct DiskRequest *pendingRequest;
-		struct DiskRequest *servingRequest;
+		// end of the last issued command
+		uint64_t nextLBA;
+		// number of usable command slots; > 1 only if both HBA and device support NCQ
+		int slotCount;
+		// maximum number of outstanding commands; see FILE_PARAM_MAX_QUEUE_DEPTH
+		int depthLimit;
+		// bit i is set if slotRequest[i] is issued
+		uint32_t issuedSlot;
+		struct DiskRequest *slotRequest[MAX_COMMAND_SLOT_COUNT];
+		// set by AHCIHandler on error or by watchdog on timeout; commands are not issued until reset
+		int needReset;
+		// see ahciWatchdogTask
+		uint32_t watchdogCompleteCount;
+		int stalledTime;
+		// statistics
+		uint32_t issueCount, completeCount;
+		uint64_t queueDepthSum;
+		int maxQueueDepth;
+		// bytes read and bytes copied from separate sector buffers
+		uint64_t readByteCount, copyByteCount;
+		// number of requests issued, number of requests merged into other commands,
+		// and time stamp cycles from addToPortQueue to issuing
+		uint32_t requestCount, mergeCount;
+		uint64_t queueWaitCycles, maxQueueWaitCycles;
+		// completed read and write requests, bytes written and failed requests
+		uint64_t readCount, writeCount, writeByteCount, errorCount;
+		// requests from addToPortQueue to completeDiskRequest
+		int inFlightCount, maxInFlightCount;
+		// log2 of time stamp cycles from addToPortQueue to AHCIHandler; see FILE_PARAM_READ_LATENCY
+		uint32_t readLatency[DISK_LATENCY_BUCKET_COUNT], writeLatency[DISK_LATENCY_BUCKET_COUNT];
 	}port[HBA_MAX_PORT_COUNT];
 
 	// manager
@@ -423,9 +474,36 @@ static AHCIInterruptArgument *initAHCIRegisters(uint32_t bar){
 		// see initDiskDescription
 		arg->port[p].desc.sectorCount = 0;
 		arg->port[p].desc.sectorSize = DEFAULT_SECTOR_SIZE;
+		arg->port[p].desc.queueDepth = 0;
 		arg->port[p].hbaPortMemory = NULL;
 		arg->port[p].pendingRequest = NULL;
-		arg->port[p].servingRequest = NULL;
+		arg->port[p].nextLBA = 0;
+		// see enableNCQ
+		arg->port[p].slotCount = 1;
+		arg->port[p].depthLimit = MAX_COMMAND_SLOT_COUNT;
+		arg->port[p].issuedSlot = 0;
+		MEMSET0(&arg->port[p].slotRequest);
+		arg->port[p].needReset = 0;
+		arg->port[p].watchdogCompleteCount = 0;
+		arg->port[p].stalledTime = 0;
+		arg->port[p].issueCount = 0;
+		arg->port[p].completeCount = 0;
+		arg->port[p].queueDepthSum = 0;
+		arg->port[p].maxQueueDepth = 0;
+		arg->port[p].readByteCount = 0;
+		arg->port[p].copyByteCount = 0;
+		arg->port[p].requestCount = 0;
+		arg->port[p].mergeCount = 0;
+		arg->port[p].queueWaitCycles = 0;
+		arg->port[p].maxQueueWaitCycles = 0;
+		arg->port[p].readCount = 0;
+		arg->port[p].writeCount = 0;
+		arg->port[p].writeByteCount = 0;
+		arg->port[p].errorCount = 0;
+		arg->port[p].inFlightCount = 0;
+		arg->port[p].maxInFlightCount = 0;
+		memset(arg->port[p].readLatency, 0, sizeof(arg->port[p].readLatency));
+		memset(arg->port[p].writeLatency, 0, sizeof(arg->port[p].writeLatency));
 		if(((portImpl >> p) & 1) == 0){
 			continue;
 		}
@@ -435,6 +513,7 @@ static AHCIInterruptArgument *initAHCIRegisters(uint32_t bar){
 			continue;
 		}
 		arg->port[p].hbaPortMemory = pm;
+		arg->port[p].hbaPortMemoryPhysical = checkAndTranslatePage(kernelLinear, pm);
 	}
 
 	return arg;
@@ -459,12 +538,11 @@ typedef struct DiskRequest{
 	Spinlock *lock;
 	enum ATACommand command;
 
-	LinearMemoryManager *physicalBufferManager;
 	// not aligned
 	void *inputBuffer;
 	uintptr_t inputSize;
-	// aligned to page
-	PhysicalAddress physicalBufferPage;
+	// reserved physical pages of sectorBufferPage
+	PhysicalAddressArray *physicalPages;
 	// if inputBuffer is aligned, sectorBuffer == inputBuffer and not need to copy
 	// aligned to Page
 	void *sectorBufferPage;
@@ -472,20 +550,33 @@ typedef struct DiskRequest{
 	uintptr_t sectorBufferOffset;
 	// not aligned
 	uintptr_t bufferOffset;
+	// if the physical regions do not fit in the command table of a slot,
+	// commandTable != NULL and the regions are in commandTable;
+	// otherwise, the regions are in physicalRegion and copied to the slot when issued
+	struct CommandTable *commandTable;
+	PhysicalAddress commandTablePhysical;
+	int physicalRegionLength;
+	struct PhysicalRegion physicalRegion[SLOT_PHYSICAL_REGION_COUNT];
 
 	uint64_t lba;
 	uint32_t sectorCount;
 	AHCIInterruptArgument *ahci;
 	int portIndex;
+	// command slot, valid if the request is issued
+	int slot;
+	// rdtsc() when added to port queue
+	uint64_t enqueueTime;
+	// the request is served first if issueCount of the port reaches deadline
+	uint32_t deadline;
+	// the requests with contiguous lba issued in the same command; see mergePendingRequests
+	struct DiskRequest *mergedRequest;
 	char isWrite;
+	// set if the command failed or timed out
+	char isFailed;
 	struct DiskRequest **prev, *next;
 }DiskRequest;
 
 
-static uintptr_t diskPhysicalSectorBuffer(DiskRequest *dr){
-	return dr->physicalBufferPage.value + dr->sectorBufferOffset;
-}
-
 static void *diskLinearBuffer(DiskRequest *dr){
 	return (void*)(((uintptr_t)dr->sectorBufferPage) + dr->bufferOffset);
 }
@@ -494,20 +585,110 @@ static int hasSeparateSectorBuffer(DiskRequest *dr){
 	return ((uintptr_t)dr->inputBuffer) != ((uintptr_t)dr->sectorBufferPage) + dr->bufferOffset;
 }
 
+static int isQueuedCommand(const DiskRequest *dr){
+	return dr->command == READ_FPDMA_QUEUED || dr->command == WRITE_FPDMA_QUEUED;
+}
+
+static void setPhysicalRegion(struct PhysicalRegion *region, uintptr_t base, uintptr_t size){
+	MEMSET0(region);
+	region->dataBaseLow = base;
+	region->dataBaseHigh = 0;
+	region->byteCount = size - 1;
+	region->completeInterrupt = 0;
+}
+
+// merge physically contiguous pages of sector buffer into regions
+// if region == NULL, only count the regions
+static int buildPhysicalRegions(struct PhysicalRegion *region, const PhysicalAddressArray *pa, uintptr_t offset, uintptr_t size){
+	assert(offset < PAGE_SIZE && CEIL(offset + size, PAGE_SIZE) / PAGE_SIZE <= pa->length);
+	int regionLength = 0;
+	uintptr_t regionBase = 0, regionSize = 0;
+	uintptr_t i;
+	for(i = 0; size > 0; i++){
+		const uintptr_t pageOffset = (i == 0? offset: 0);
+		const uintptr_t base = pa->address[i].value + pageOffset;
+		const uintptr_t s = MIN(PAGE_SIZE - pageOffset, size);
+		if(regionSize != 0 && regionBase + regionSize == base && regionSize + s <= MAX_PHYSICAL_REGION_SIZE){
+			regionSize += s;
+		}
+		else{
+			if(regionSize != 0){
+				if(region != NULL){
+					setPhysicalRegion(region + regionLength, regionBase, regionSize);
+				}
+				regionLength++;
+			}
+			regionBase = base;
+			regionSize = s;
+		}
+		size -= s;
+	}
+	if(regionSize != 0){
+		if(region != NULL){
+			setPhysicalRegion(region + regionLength, regionBase, regionSize);
+		}
+		regionLength++;
+	}
+	return regionLength;
+}
+
+// call after physicalPages and sectorBufferOffset are set
+static int createPhysicalRegions(DiskRequest *dr, uintptr_t sectorBufferSize){
+	const int regionLength = buildPhysicalRegions(NULL, dr->physicalPages, dr->sectorBufferOffset, sectorBufferSize);
+	dr->physicalRegionLength = regionLength;
+	if(regionLength <= SLOT_PHYSICAL_REGION_COUNT){
+		dr->commandTable = NULL;
+		dr->commandTablePhysical.value = INVALID_PAGE_ADDRESS;
+		buildPhysicalRegions(dr->physicalRegion, dr->physicalPages, dr->sectorBufferOffset, sectorBufferSize);
+		return 1;
+	}
+	const uintptr_t tableSize =
+		MEMBER_OFFSET(struct CommandTable, physicalRegion) + regionLength * sizeof(struct PhysicalRegion);
+	dr->commandTable = allocateContiguousPages(kernelLinear, CEIL(tableSize, PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
+	if(dr->commandTable == NULL){
+		return 0;
+	}
+	dr->commandTablePhysical = checkAndTranslatePage(kernelLinear, dr->commandTable);
+	buildPhysicalRegions(
+		(struct PhysicalRegion*)(((uintptr_t)dr->commandTable) + MEMBER_OFFSET(struct CommandTable, physicalRegion)),
+		dr->physicalPages, dr->sectorBufferOffset, sectorBufferSize
+	);
+	return 1;
+}
+
 static int sendDiskRequest(DiskRequest *dr){
-	AHCIInterruptArgument *a = dr->ahci;
+	AHCIPortQueue *p = &dr->ahci->port[dr->portIndex];
+	volatile HBAPortRegister *pr = &dr->ahci->hbaRegisters->port[dr->portIndex];
+	struct CommandTable *ct = dr->commandTable;
+	uintptr_t ctPhysical = dr->commandTablePhysical.value;
+	int regionLength = dr->physicalRegionLength;
+	uint32_t sectorCount = dr->sectorCount;
+	if(ct == NULL){
+		ct = &p->hbaPortMemory->commandTable[dr->slot];
+		ctPhysical = p->hbaPortMemoryPhysical.value +
+			MEMBER_OFFSET(HBAPortMemory, commandTable) + dr->slot * sizeof(struct CommandTable);
+		memcpy(ct->physicalRegion, dr->physicalRegion, dr->physicalRegionLength * sizeof(struct PhysicalRegion));
+		// see mergePendingRequests
+		DiskRequest *m;
+		for(m = dr->mergedRequest; m != NULL; m = m->mergedRequest){
+			assert(m->commandTable == NULL);
+			memcpy(ct->physicalRegion + regionLength, m->physicalRegion, m->physicalRegionLength * sizeof(struct PhysicalRegion));
+			regionLength += m->physicalRegionLength;
+			sectorCount += m->sectorCount;
+		}
+	}
 	switch(dr->command){
 	case DMA_READ_EXT:
 	case DMA_WRITE_EXT:
+	case READ_FPDMA_QUEUED:
+	case WRITE_FPDMA_QUEUED:
 		return issueDMACommand(
-			&a->hbaRegisters->port[dr->portIndex], a->port[dr->portIndex].hbaPortMemory,
-			a->port[dr->portIndex].desc.sectorSize,
-			diskPhysicalSectorBuffer(dr), dr->lba, dr->sectorCount, dr->isWrite
+			pr, p->hbaPortMemory, dr->slot, ct, ctPhysical, regionLength,
+			dr->lba, sectorCount, dr->isWrite, isQueuedCommand(dr)
 		);
 	case IDENTIFY_DEVICE:
 		return issueIdentifyCommand(
-			&a->hbaRegisters->port[dr->portIndex], a->port[dr->portIndex].hbaPortMemory,
-			diskPhysicalSectorBuffer(dr)
+			pr, p->hbaPortMemory, dr->slot, ct, ctPhysical, regionLength
 		);
 	default:
 		assert(0); // unknown command;
@@ -526,7 +707,12 @@ static void cancelRWAHCI(void *instance){
 */
 
 static void deleteDiskRequest(DiskRequest *dr){
-	releaseReservedPage(dr->physicalBufferManager, dr->physicalBufferPage);
+	if(dr->commandTable != NULL){
+		if(checkAndReleaseKernelPages(dr->commandTable) == 0){
+			panic("");
+		}
+	}
+	deletePhysicalAddressArray(dr->physicalPages);
 	if(hasSeparateSectorBuffer(dr)){
 		if(checkAndReleaseKernelPages(dr->sectorBufferPage) == 0){
 			panic("");
@@ -543,11 +729,8 @@ static DiskRequest *createRWDiskRequest(
 	const uintptr_t sectorSize = a->port[portIndex].desc.sectorSize;
 	const uintptr_t sectorBufferSize = CEIL(position + bufferSize, sectorSize) - FLOOR(position, sectorSize);
 	// assert(PAGE_SIZE % a->desc.sectorSize == 0);
-	// TODO: allocate continuous physical pages or send multiple commands
-	// read sector size <= PAGE_SIZE and buffer resides in one page
-	if(sectorBufferSize > PAGE_SIZE ||
-		CEIL(((uintptr_t)buffer) + bufferSize, PAGE_SIZE) - FLOOR((uintptr_t)buffer, PAGE_SIZE) > PAGE_SIZE
-	){
+	// a request is sent as one command
+	if(sectorBufferSize / sectorSize > MAX_COMMAND_SECTOR_COUNT){
 		return NULL;
 	}
 	DiskRequest *NEW(dr);
@@ -559,7 +742,8 @@ static DiskRequest *createRWDiskRequest(
 	dr->inputBuffer = buffer;
 	dr->inputSize = bufferSize;
 
-	// buffer aligned to sector && size aligned to sector && resides in one page && position aligned to sector
+	LinearMemoryManager *physicalBufferManager;
+	// buffer aligned to sector && size aligned to sector && position aligned to sector
 	if(
 		((uintptr_t)buffer) % a->port[portIndex].desc.sectorSize == 0 &&
 		bufferSize == sectorBufferSize &&
@@ -568,26 +752,34 @@ static DiskRequest *createRWDiskRequest(
 		dr->sectorBufferOffset =
 		dr->bufferOffset = ((uintptr_t)buffer) % PAGE_SIZE;
 		dr->sectorBufferPage = (void*)(((uintptr_t)buffer) - dr->bufferOffset);
-		dr->physicalBufferManager = getTaskLinearMemory(processorLocalTask());
+		physicalBufferManager = getTaskLinearMemory(processorLocalTask());
 	}
 	else{ // not aligned
 		dr->sectorBufferOffset = 0;
 		dr->bufferOffset = position % sectorSize;
 		dr->sectorBufferPage = allocateKernelPages(CEIL(sectorBufferSize, PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
-		dr->physicalBufferManager  = kernelLinear;
+		physicalBufferManager = kernelLinear;
 	}
 	EXPECT(dr->sectorBufferPage != NULL);
-	dr->physicalBufferPage = checkAndReservePage(dr->physicalBufferManager, dr->sectorBufferPage, KERNEL_PAGE);
-	EXPECT(dr->physicalBufferPage.value != INVALID_PAGE_ADDRESS);
+	dr->physicalPages = checkAndReservePages(physicalBufferManager, dr->sectorBufferPage,
+		CEIL(dr->sectorBufferOffset + sectorBufferSize, PAGE_SIZE), KERNEL_PAGE);
+	EXPECT(dr->physicalPages != NULL);
+	EXPECT(createPhysicalRegions(dr, sectorBufferSize));
 	dr->lba = position / sectorSize;
 	dr->sectorCount = sectorBufferSize / sectorSize;
 	dr->ahci = a;
 	dr->portIndex = portIndex;
+	dr->slot = -1;
+	dr->enqueueTime = 0;
+	dr->deadline = 0;
+	dr->mergedRequest = NULL;
 	dr->isWrite = isWrite;
+	dr->isFailed = 0;
 	dr->prev = NULL;
 	dr->next = NULL;
 	return dr;
-	//releaseReservedPage(dr->bufferMemory, dr->buffer);
+	ON_ERROR;
+	deletePhysicalAddressArray(dr->physicalPages);
 	ON_ERROR;
 	if(hasSeparateSectorBuffer(dr)){
 		checkAndReleaseKernelPages(dr->sectorBufferPage);
@@ -600,7 +792,7 @@ static DiskRequest *createRWDiskRequest(
 
 static int acceptIdentifyDiskRequest(void *instance, uintptr_t *returnValues){
 	DiskRequest *dr = instance;
-	returnValues[0] = DEFAULT_SECTOR_SIZE;//(dr->sectorCount * dr->ahci->desc.sectorSize);
+	returnValues[0] = (dr->isFailed? 0: DEFAULT_SECTOR_SIZE);//(dr->sectorCount * dr->ahci->desc.sectorSize);
 	deleteDiskRequest(dr);
 	return 1;
 }
@@ -622,19 +814,25 @@ static DiskRequest *createIdentifyDiskRequest(
 	dr->inputSize = bufferSize;
 	dr->sectorBufferOffset = 0;
 	dr->bufferOffset = 0;
-	dr->physicalBufferManager = getTaskLinearMemory(processorLocalTask());
 	dr->sectorBufferPage = buffer;
-	dr->physicalBufferPage = checkAndReservePage(dr->physicalBufferManager, buffer, KERNEL_PAGE); // at least 512 bytes
-	EXPECT(dr->physicalBufferPage.value != INVALID_PAGE_ADDRESS);
+	dr->physicalPages = checkAndReservePages(getTaskLinearMemory(processorLocalTask()), buffer, PAGE_SIZE, KERNEL_PAGE); // at least 512 bytes
+	EXPECT(dr->physicalPages != NULL);
+	EXPECT(createPhysicalRegions(dr, DEFAULT_SECTOR_SIZE));
 	dr->lba = 0; // ignored
 	dr->sectorCount = 0; // ignored
 	dr->ahci = a;
 	dr->portIndex = portIndex;
+	dr->slot = -1;
+	dr->enqueueTime = 0;
+	dr->deadline = 0;
+	dr->mergedRequest = NULL;
 	dr->isWrite = 0;
+	dr->isFailed = 0;
 	dr->prev = NULL;
 	dr->next = NULL;
 	return dr;
-	//releaseReservedPage(kernelLinear, buffer);
+	ON_ERROR;
+	deletePhysicalAddressArray(dr->physicalPages);
 	ON_ERROR;
 	DELETE(dr);
 	ON_ERROR;
@@ -683,36 +881,193 @@ static DiskRequest *removeFromDiskRequestList(struct DiskRequestList *drList){
 	return dr;
 }
 
-// return 0 if failed to issue command
-// return 1 if command was issued or pended
-static int servePortQueue(AHCIInterruptArgument *a, int portIndex){
-	assert(isAcquirable(&a->lock) == 0);
-	if(a->port[portIndex].servingRequest != NULL){
-		return 1;
+static int countSetBits(uint32_t v){
+	int c;
+	for(c = 0; v != 0; c++){
+		v &= v - 1;
 	}
-	DiskRequest *dr = a->port[portIndex].pendingRequest;
-	if(dr == NULL){
-		return 1;
+	return c;
+}
+
+// also fail the merged requests
+static void failDiskRequest(DiskRequest *dr){
+	while(dr != NULL){
+		DiskRequest *m = dr->mergedRequest;
+		dr->mergedRequest = NULL;
+		dr->isFailed = 1;
+		// see completeDiskRequestTask
+		addToDiskRequestList(&finishInterrupt, dr);
+		dr = m;
+	}
+}
+
+// a request is bypassed by at most MAX_REQUEST_BYPASS commands
+#define MAX_REQUEST_BYPASS (64)
+
+// C-LOOK elevator: serve the first request after the last issued lba, or the lowest lba if there is none
+// a request which reaches its deadline is served first
+static DiskRequest *selectPendingRequest(AHCIPortQueue *p){
+	DiskRequest *dr, *expired = NULL, *next = NULL;
+	for(dr = p->pendingRequest; dr != NULL; dr = dr->next){
+		if((int)(p->issueCount - dr->deadline) >= 0 &&
+			(expired == NULL || (int)(dr->deadline - expired->deadline) < 0)){
+			expired = dr;
+		}
+		if(next == NULL && dr->lba >= p->nextLBA){
+			next = dr;
+		}
+	}
+	if(expired != NULL){
+		return expired;
+	}
+	return (next != NULL? next: p->pendingRequest);
+}
+
+// remove pending requests following dr with contiguous lba and attach them to dr
+// merged requests must fit in the command table of a slot
+static void mergePendingRequests(AHCIPortQueue *p, DiskRequest *dr){
+	if(dr->command == IDENTIFY_DEVICE || dr->commandTable != NULL){
+		return;
+	}
+	DiskRequest **last = &dr->mergedRequest;
+	int regionLength = dr->physicalRegionLength;
+	uint32_t sectorCount = dr->sectorCount;
+	while(dr->next != NULL){
+		DiskRequest *n = dr->next;
+		if(n->lba != dr->lba + sectorCount || n->command != dr->command || n->commandTable != NULL ||
+			regionLength + n->physicalRegionLength > SLOT_PHYSICAL_REGION_COUNT ||
+			sectorCount + n->sectorCount > MAX_COMMAND_SECTOR_COUNT){
+			break;
+		}
+		REMOVE_FROM_DQUEUE(n);
+		regionLength += n->physicalRegionLength;
+		sectorCount += n->sectorCount;
+		*last = n;
+		last = &n->mergedRequest;
+		p->mergeCount++;
+	}
+}
+
+static void recordQueueWaitTime(AHCIPortQueue *p, const DiskRequest *dr, uint64_t now){
+	for(; dr != NULL; dr = dr->mergedRequest){
+		const uint64_t wait = now - dr->enqueueTime;
+		p->requestCount++;
+		p->queueWaitCycles += wait;
+		p->maxQueueWaitCycles = MAX(p->maxQueueWaitCycles, wait);
+	}
+}
+
+static int toLatencyBucket(uint64_t cycles){
+	int b;
+	for(b = 0; b < DISK_LATENCY_BUCKET_COUNT - 1 && (cycles >> (b + 1)) != 0; b++);
+	return b;
+}
+
+static void recordLatency(AHCIPortQueue *p, const DiskRequest *dr, uint64_t now){
+	for(; dr != NULL; dr = dr->mergedRequest){
+		if(dr->command == IDENTIFY_DEVICE)
+			continue;
+		uint32_t *histogram = (dr->isWrite? p->writeLatency: p->readLatency);
+		histogram[toLatencyBucket(now - dr->enqueueTime)]++;
+	}
+}
+
+static uint64_t getEndLBA(const DiskRequest *dr){
+	uint64_t end = dr->lba;
+	for(; dr != NULL; dr = dr->mergedRequest){
+		end += dr->sectorCount;
+	}
+	return end;
+}
+
+// issue pending requests until all slots are used
+// a non-queued command is issued only if no command is outstanding
+// if a command cannot be issued, fail the request
+static void servePortQueue(AHCIInterruptArgument *a, int portIndex){
+	assert(isAcquirable(&a->lock) == 0);
+	AHCIPortQueue *p = &a->port[portIndex];
+	const int usableSlotCount = MIN(p->slotCount, p->depthLimit);
+	const uint32_t slotMask = (usableSlotCount >= 32? 0xffffffff: ((uint32_t)1 << usableSlotCount) - 1);
+	while(p->needReset == 0){
+		if(p->pendingRequest == NULL){
+			break;
+		}
+		DiskRequest *dr = selectPendingRequest(p);
+		if(p->issuedSlot != 0){
+			// queued and non-queued commands cannot be outstanding at the same time
+			if(isQueuedCommand(dr) == 0 || isQueuedCommand(p->slotRequest[bsf32(p->issuedSlot)]) == 0){
+				break;
+			}
+			if((p->issuedSlot & slotMask) == slotMask){
+				break;
+			}
+		}
+		mergePendingRequests(p, dr);
+		REMOVE_FROM_DQUEUE(dr);
+		dr->slot = bsf32(~p->issuedSlot & slotMask);
+		recordQueueWaitTime(p, dr, rdtsc());
+		p->nextLBA = getEndLBA(dr);
+		if(sendDiskRequest(dr) == 0){
+			printk("warning: failed to issue AHCI command %x\n", dr->command);
+			failDiskRequest(dr);
+			continue;
+		}
+		p->issuedSlot |= (1 << dr->slot);
+		p->slotRequest[dr->slot] = dr;
+		const int depth = countSetBits(p->issuedSlot);
+		p->issueCount++;
+		p->queueDepthSum += depth;
+		p->maxQueueDepth = MAX(p->maxQueueDepth, depth);
 	}
-	REMOVE_FROM_DQUEUE(dr);
-	ADD_TO_DQUEUE(dr, &a->port[portIndex].servingRequest);
-	return sendDiskRequest(dr);
 }
 
 static void addToPortQueue(DiskRequest *dr, /*hba, */int portIndex){
 	assert(isAcquirable(dr->lock) == 0);
 	struct AHCIPortQueue *p = dr->ahci->port + portIndex;
-	ADD_TO_DQUEUE(dr, &p->pendingRequest);
+	dr->enqueueTime = rdtsc();
+	dr->deadline = p->issueCount + MAX_REQUEST_BYPASS;
+	if(dr->command != IDENTIFY_DEVICE){
+		p->inFlightCount++;
+		p->maxInFlightCount = MAX(p->maxInFlightCount, p->inFlightCount);
+	}
+	// sort by lba; requests with the same lba are in FIFO order
+	DiskRequest **i;
+	for(i = &p->pendingRequest; *i != NULL && (*i)->lba <= dr->lba; i = &(*i)->next);
+	ADD_TO_DQUEUE(dr, i);
+}
+
+static void addCommandToList(DiskRequest *dr, DiskRequest **list){
+	while(dr != NULL){
+		DiskRequest *m = dr->mergedRequest;
+		dr->mergedRequest = NULL;
+		ADD_TO_DQUEUE(dr, list);
+		dr = m;
+	}
 }
 
-static DiskRequest *removeFromPortQueue(AHCIInterruptArgument *a, int portIndex){
+// move completed requests to completeList
+// a queued command is completed when its bit is cleared in both SATAActive and commandIssue
+// return number of completed requests
+static int removeFromPortQueue(AHCIInterruptArgument *a, int portIndex, DiskRequest **completeList){
 	assert(isAcquirable(&a->lock) == 0);
 	AHCIPortQueue *p = &a->port[portIndex];
-	DiskRequest *dr = p->servingRequest;
-	if(dr != NULL){
-		REMOVE_FROM_DQUEUE(dr);
+	volatile HBAPortRegister *pr = &a->hbaRegisters->port[portIndex];
+	uint32_t completed = p->issuedSlot & ~(pr->SATAActive | pr->commandIssue);
+	const uint64_t now = (completed != 0? rdtsc(): 0);
+	int count = 0;
+	while(completed != 0){
+		const int s = bsf32(completed);
+		completed &= ~(1 << s);
+		DiskRequest *dr = p->slotRequest[s];
+		assert(dr != NULL && dr->slot == s);
+		p->slotRequest[s] = NULL;
+		p->issuedSlot &= ~(1 << s);
+		recordLatency(p, dr, now);
+		addCommandToList(dr, completeList);
+		count++;
 	}
-	return dr;
+	p->completeCount += count;
+	return count;
 }
 
 // interrupt & system call
@@ -732,18 +1087,33 @@ static int AHCIHandler(const InterruptParam *param){
 		arg->hbaRegisters->port[p].interruptStatus = portStatus;
 
 		handled = 1;
+		DiskRequest *completeList = NULL;
 		acquireLock(&arg->lock);
-		DiskRequest *dr = removeFromPortQueue(arg, p);
-		if(servePortQueue(arg, p) == 0){
-			panic("servePortQueue == 0"); // TODO: how to handle?
+		const int wasResetting = arg->port[p].needReset;
+		if(portStatus & PR_INTERRUPT_ERROR){
+			// the failed commands remain in commandIssue; see resetAHCIPort
+			printk("AHCI port %d error: interrupt status %x, task file %x\n",
+				p, portStatus, arg->hbaRegisters->port[p].taskFileData);
+			arg->port[p].needReset = 1;
 		}
+		// after the port stops, commandIssue and SATAActive are cleared without completing the commands
+		// so leave the issued requests to resetAHCIPort
+		int completeCount = (wasResetting? 0: removeFromPortQueue(arg, p, &completeList));
+		servePortQueue(arg, p);
 		releaseLock(&arg->lock);
-		if(dr == NULL){
+		if(completeCount == 0){
+			if(wasResetting || arg->port[p].needReset){
+				continue;
+			}
 			printk("warning: AHCI driver received unexpected interrupt\n");
 			continue;
 		}
 		// see completeDiskRequestTask
-		addToDiskRequestList(&finishInterrupt, dr);
+		while(completeList != NULL){
+			DiskRequest *dr = completeList;
+			REMOVE_FROM_DQUEUE(dr);
+			addToDiskRequestList(&finishInterrupt, dr);
+		}
 	}
 	// VirtualBox requires clearing host status after clearing port status
 	arg->hbaRegisters->interruptStatus = hostStatus;
@@ -815,14 +1185,13 @@ static int initDiskDescription(struct DiskDescription *d, AHCIInterruptArgument
 	pendIO(dr->ior);
 	acquireLock(dr->lock);
 	addToPortQueue(dr, /*hba, */dr->portIndex);
-	if(servePortQueue(dr->ahci, dr->portIndex) == 0){
-		assert(0);
-		// TODO: how to handle?
-	}
+	servePortQueue(dr->ahci, dr->portIndex);
 	releaseLock(dr->lock);
 	// dr is deleted here
-	uintptr_t waitIOR = systemCall_waitIO((uintptr_t)dr->ior);
+	uintptr_t identifySize;
+	uintptr_t waitIOR = systemCall_waitIOReturn((uintptr_t)dr->ior, 1, &identifySize);
 	assert(waitIOR == (uintptr_t)&ior);
+	EXPECT(identifySize == DEFAULT_SECTOR_SIZE);
 
 	// the driver requires 48-bit address
 	const uint16_t buffer83 = buffer[83];
@@ -857,15 +1226,37 @@ static int initDiskDescription(struct DiskDescription *d, AHCIInterruptArgument
 	}
 #undef TO64
 	//printk("disk sector count = %u\n",(uint32_t)d->sectorCount);
+	// NCQ
+	if(buffer[76] & (1 << 8)){
+		d->queueDepth = (buffer[75] & 0x1f) + 1;
+	}
+	else{
+		d->queueDepth = 0;
+	}
 	systemCall_releaseHeap(buffer);
 	return 1;
 	ON_ERROR;
 	ON_ERROR;
+	ON_ERROR;
 	systemCall_releaseHeap(buffer);
 	ON_ERROR;
 	return 0;
 }
 
+// call after initDiskDescription
+static void enableNCQ(AHCIInterruptArgument *arg, int portIndex){
+	const uint32_t cap = arg->hbaRegisters->capabilities;
+	AHCIPortQueue *p = &arg->port[portIndex];
+	acquireLock(&arg->lock);
+	if((cap & HR_CAPABILITIES_SNCQ) != 0 && p->desc.queueDepth > 0){
+		p->slotCount = MIN((int)HR_CAPABILITIES_NCS(cap), p->desc.queueDepth);
+	}
+	else{
+		p->slotCount = 1;
+	}
+	releaseLock(&arg->lock);
+}
+
 static AHCIInterruptArgument *initAHCI(AHCIManager *am, const PCIConfigRegisters0 *regs){
 	PIC *pic = processorLocalPIC();
 	AHCIInterruptArgument *arg = initAHCIRegisters(regs->bar5);
@@ -888,15 +1279,15 @@ static AHCIInterruptArgument *initAHCI(AHCIManager *am, const PCIConfigRegisters
 // file interface
 
 static int seekReadAHCI(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uint64_t position, uintptr_t bufferSize){
-	// TODO: allow multiple pages/physical regions
 	HBAPortIndex index;
 	index.value = (uintptr_t)getFileInstance(of);
 	AHCIInterruptArgument *hba = searchHBAByPortIndex(&ahciManager, index);
 	EXPECT(hba != NULL);
 	const uint64_t diskSize = hba->port[index.portIndex].desc.sectorCount * hba->port[index.portIndex].desc.sectorSize;
 	EXPECT(bufferSize <= diskSize && position <= diskSize - bufferSize);
+	const int isQueued = (hba->port[index.portIndex].slotCount > 1);
 	DiskRequest *dr = createRWDiskRequest(
-		(0? DMA_WRITE_EXT: DMA_READ_EXT), rwfr,
+		(isQueued? READ_FPDMA_QUEUED: DMA_READ_EXT), rwfr,
 		buffer, bufferSize, position,
 		hba, index.portIndex, 0
 	);
@@ -905,10 +1296,7 @@ static int seekReadAHCI(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, ui
 	//setRWFileIOFunctions(rwfr, dr, cancelRWAHCI);
 	acquireLock(dr->lock);
 	addToPortQueue(dr, /*hba, */dr->portIndex);
-	if(servePortQueue(dr->ahci, dr->portIndex) == 0){
-		assert(0);
-		// TODO: how to handle?
-	}
+	servePortQueue(dr->ahci, dr->portIndex);
 	releaseLock(dr->lock);
 	return 1;
 	//deleteDiskRequest(dr);
@@ -918,6 +1306,129 @@ static int seekReadAHCI(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, ui
 	return 0;
 }
 
+// unaligned writes need read-modify-write and are not supported
+static int seekWriteAHCI(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buffer, uint64_t position, uintptr_t bufferSize){
+	HBAPortIndex index;
+	index.value = (uintptr_t)getFileInstance(of);
+	AHCIInterruptArgument *hba = searchHBAByPortIndex(&ahciManager, index);
+	EXPECT(hba != NULL);
+	const uintptr_t sectorSize = hba->port[index.portIndex].desc.sectorSize;
+	const uint64_t diskSize = hba->port[index.portIndex].desc.sectorCount * sectorSize;
+	EXPECT(bufferSize <= diskSize && position <= diskSize - bufferSize);
+	EXPECT(((uintptr_t)buffer) % sectorSize == 0 && bufferSize % sectorSize == 0 && position % sectorSize == 0);
+	const int isQueued = (hba->port[index.portIndex].slotCount > 1);
+	DiskRequest *dr = createRWDiskRequest(
+		(isQueued? WRITE_FPDMA_QUEUED: DMA_WRITE_EXT), rwfr,
+		(uint8_t*)buffer, bufferSize, position,
+		hba, index.portIndex, 1
+	);
+	EXPECT(dr != NULL);
+	acquireLock(dr->lock);
+	addToPortQueue(dr, dr->portIndex);
+	servePortQueue(dr->ahci, dr->portIndex);
+	releaseLock(dr->lock);
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+// return 0 if parameterCode is not a statistics parameter
+static int getPortStatistics(AHCIInterruptArgument *a, int portIndex, uintptr_t parameterCode, uint64_t *value){
+	const AHCIPortQueue *p = &a->port[portIndex];
+	int ok = 1;
+	acquireLock(&a->lock);
+	switch(parameterCode){
+	case FILE_PARAM_READ_COUNT:
+		*value = p->readCount;
+		break;
+	case FILE_PARAM_WRITE_COUNT:
+		*value = p->writeCount;
+		break;
+	case FILE_PARAM_READ_BYTE_COUNT:
+		*value = p->readByteCount;
+		break;
+	case FILE_PARAM_WRITE_BYTE_COUNT:
+		*value = p->writeByteCount;
+		break;
+	case FILE_PARAM_ERROR_COUNT:
+		*value = p->errorCount;
+		break;
+	case FILE_PARAM_IN_FLIGHT_COUNT:
+		*value = p->inFlightCount;
+		break;
+	case FILE_PARAM_MAX_IN_FLIGHT_COUNT:
+		*value = p->maxInFlightCount;
+		break;
+	default:
+		if(parameterCode >= FILE_PARAM_READ_LATENCY &&
+		parameterCode < FILE_PARAM_READ_LATENCY + DISK_LATENCY_BUCKET_COUNT){
+			*value = p->readLatency[parameterCode - FILE_PARAM_READ_LATENCY];
+		}
+		else if(parameterCode >= FILE_PARAM_WRITE_LATENCY &&
+		parameterCode < FILE_PARAM_WRITE_LATENCY + DISK_LATENCY_BUCKET_COUNT){
+			*value = p->writeLatency[parameterCode - FILE_PARAM_WRITE_LATENCY];
+		}
+		else{
+			ok = 0;
+		}
+	}
+	releaseLock(&a->lock);
+	return ok;
+}
+
+static int getAHCIParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode){
+	HBAPortIndex index;
+	index.value = (uintptr_t)getFileInstance(of);
+	AHCIInterruptArgument *hba = searchHBAByPortIndex(&ahciManager, index);
+	if(hba == NULL){
+		return 0;
+	}
+	AHCIPortQueue *p = &hba->port[index.portIndex];
+	uint64_t value;
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		completeFileIO64(fior2, p->desc.sectorCount * p->desc.sectorSize);
+		break;
+	case FILE_PARAM_MAX_QUEUE_DEPTH:
+		completeFileIO1(fior2, MIN(p->slotCount, p->depthLimit));
+		break;
+	default:
+		if(getPortStatistics(hba, index.portIndex, parameterCode, &value) == 0){
+			return 0;
+		}
+		completeFileIO64(fior2, value);
+		break;
+	}
+	return 1;
+}
+
+static int setAHCIParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode, uint64_t value){
+	HBAPortIndex index;
+	index.value = (uintptr_t)getFileInstance(of);
+	AHCIInterruptArgument *hba = searchHBAByPortIndex(&ahciManager, index);
+	if(hba == NULL){
+		return 0;
+	}
+	switch(parameterCode){
+	case FILE_PARAM_MAX_QUEUE_DEPTH:
+		if(value < 1 || value > MAX_COMMAND_SLOT_COUNT){
+			return 0;
+		}
+		acquireLock(&hba->lock);
+		hba->port[index.portIndex].depthLimit = (int)value;
+		servePortQueue(hba, index.portIndex);
+		releaseLock(&hba->lock);
+		completeFileIO0(fior2);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
 static void closeAHCI(CloseFileRequest *cfr, __attribute__((__unused__)) OpenedFile *of){
 	completeCloseFile(cfr);
 	// do not delete of->instance
@@ -937,23 +1448,37 @@ static int openAHCI(
 	}
 	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
 	ff.seekRead = seekReadAHCI;
-	//if(mode.writable){
-	//	ff.write = seekWriteAHCI;
-	//}
+	ff.seekWrite = seekWriteAHCI;
+	ff.getParameter = getAHCIParameter;
+	ff.setParameter = setAHCIParameter;
 	ff.close = closeAHCI;
 	completeOpenFile(ofr, (void*)index, &ff);
 	return 1;
 }
 
-/*
-static IORequest *seekWriteAHCI(OpenFileRequest *ofr, const uint8_t *buffer, uint64_t position, uintptr_t bufferSize){
-
-}
-*/
-
 static void completeDiskRequest(DiskRequest *dr){
-	if(hasSeparateSectorBuffer(dr)){
+	uintptr_t copySize = 0;
+	if(hasSeparateSectorBuffer(dr) && dr->isFailed == 0 && dr->isWrite == 0){
 		memcpy(dr->inputBuffer, diskLinearBuffer(dr), dr->inputSize);
+		copySize = dr->inputSize;
+	}
+	if(dr->command != IDENTIFY_DEVICE){
+		AHCIPortQueue *p = &dr->ahci->port[dr->portIndex];
+		acquireLock(dr->lock);
+		p->inFlightCount--;
+		if(dr->isFailed){
+			p->errorCount++;
+		}
+		else if(dr->isWrite){
+			p->writeCount++;
+			p->writeByteCount += dr->inputSize;
+		}
+		else{
+			p->readCount++;
+			p->readByteCount += dr->inputSize;
+			p->copyByteCount += copySize;
+		}
+		releaseLock(dr->lock);
 	}
 	if(dr->command == IDENTIFY_DEVICE){
 		assert(dr->rwfr == NULL && dr->ior != NULL);
@@ -961,7 +1486,12 @@ static void completeDiskRequest(DiskRequest *dr){
 	}
 	else{
 		assert(dr->rwfr != NULL && dr->ior == NULL);
-		completeRWFileIO(dr->rwfr, dr->inputSize, dr->inputSize);
+		if(dr->isFailed){
+			completeRWFileIO(dr->rwfr, 0, 0);
+		}
+		else{
+			completeRWFileIO(dr->rwfr, dr->inputSize, dr->inputSize);
+		}
 		deleteDiskRequest(dr);
 	}
 }
@@ -974,6 +1504,194 @@ static void completeDiskRequestTask(__attribute__((__unused__)) void *arg){
 	}
 }
 
+// error recovery
+
+#define AHCI_WATCHDOG_INTERVAL (200)
+#define AHCI_COMMAND_TIMEOUT (5000)
+
+// stop the port, fail all issued requests, and restart the port
+static void resetAHCIPort(AHCIInterruptArgument *a, int portIndex){
+	AHCIPortQueue *p = &a->port[portIndex];
+	volatile HBAPortRegister *pr = &a->hbaRegisters->port[portIndex];
+	DiskRequest *failList = NULL;
+	assert(p->needReset);
+	// the buffers of issued requests may still be DMA targets until the command list stops
+	// stopAndResetPort sleeps, so do not hold the lock
+	if(stopAndResetPort(pr) == 0){
+		// keep the requests and needReset; the watchdog retries later
+		printk("warning: cannot stop AHCI port %d\n", portIndex);
+		return;
+	}
+	acquireLock(&a->lock);
+	while(p->issuedSlot != 0){
+		const int s = bsf32(p->issuedSlot);
+		p->issuedSlot &= ~(1 << s);
+		addCommandToList(p->slotRequest[s], &failList);
+		p->slotRequest[s] = NULL;
+	}
+	releaseLock(&a->lock);
+	while(failList != NULL){
+		DiskRequest *dr = failList;
+		REMOVE_FROM_DQUEUE(dr);
+		failDiskRequest(dr);
+	}
+	if(startPort(pr, a->hbaRegisters) == 0){
+		printk("warning: cannot restart AHCI port %d\n", portIndex);
+	}
+	acquireLock(&a->lock);
+	p->needReset = 0;
+	p->stalledTime = 0;
+	servePortQueue(a, portIndex);
+	releaseLock(&a->lock);
+}
+
+// return 1 if the port needs reset
+static int checkPortTimeout(AHCIInterruptArgument *a, int portIndex){
+	AHCIPortQueue *p = &a->port[portIndex];
+	acquireLock(&a->lock);
+	if(p->issuedSlot == 0 || p->completeCount != p->watchdogCompleteCount){
+		p->stalledTime = 0;
+	}
+	else{
+		p->stalledTime += AHCI_WATCHDOG_INTERVAL;
+	}
+	p->watchdogCompleteCount = p->completeCount;
+	if(p->stalledTime >= AHCI_COMMAND_TIMEOUT && p->needReset == 0){
+		printk("AHCI port %d timeout: issued slots %x\n", portIndex, p->issuedSlot);
+		p->needReset = 1;
+	}
+	const int needReset = p->needReset;
+	releaseLock(&a->lock);
+	return needReset;
+}
+
+// AHCI controllers are never removed from ahciManager
+static AHCIInterruptArgument *nextAHCI(AHCIManager *am, AHCIInterruptArgument *a){
+	acquireLock(&am->lock);
+	AHCIInterruptArgument *n = (a == NULL? am->ahciList: a->next);
+	releaseLock(&am->lock);
+	return n;
+}
+
+static void ahciWatchdogTask(__attribute__((__unused__)) void *arg){
+	while(1){
+		sleep(AHCI_WATCHDOG_INTERVAL);
+		AHCIInterruptArgument *a;
+		for(a = nextAHCI(&ahciManager, NULL); a != NULL; a = nextAHCI(&ahciManager, a)){
+			int p;
+			for(p = 0; p < HBA_MAX_PORT_COUNT; p++){
+				if(hasPort(a, p) == 0){
+					continue;
+				}
+				if(checkPortTimeout(a, p)){
+					resetAHCIPort(a, p);
+				}
+			}
+		}
+	}
+}
+
+// statistics file
+// a snapshot of all ports is taken when the file is opened
+
+typedef struct{
+	uintptr_t length;
+	char text[];
+}AHCIStatisticsText;
+
+#define AHCI_STATISTICS_SIZE (4 * PAGE_SIZE)
+
+static uintptr_t printLatencyHistogram(const char *name, const uint32_t *histogram, char *text, uintptr_t size){
+	uintptr_t printCount = 0;
+	int b;
+	printCount += snprintf(text + printCount, size - printCount, "  %s latency (log2 cycles):", name);
+	for(b = 0; b < DISK_LATENCY_BUCKET_COUNT; b++){
+		if(histogram[b] != 0){
+			printCount += snprintf(text + printCount, size - printCount, " %d:%u", b, histogram[b]);
+		}
+	}
+	printCount += snprintf(text + printCount, size - printCount, "\n");
+	return printCount;
+}
+
+static uintptr_t printAHCIStatistics(char *text, uintptr_t size){
+	uintptr_t printCount = 0;
+	AHCIInterruptArgument *a;
+	for(a = nextAHCI(&ahciManager, NULL); a != NULL; a = nextAHCI(&ahciManager, a)){
+		int p;
+		for(p = 0; p < HBA_MAX_PORT_COUNT; p++){
+			if(hasPort(a, p) == 0){
+				continue;
+			}
+			AHCIPortQueue s;
+			acquireLock(&a->lock);
+			s = a->port[p];
+			releaseLock(&a->lock);
+			printCount += snprintf(text + printCount, size - printCount,
+				"ahci %d port %d: read %u (%u KB), write %u (%u KB), error %u, in flight %d (max %d)\n",
+				a->hbaIndex, p, (uint32_t)s.readCount, (uint32_t)(s.readByteCount / 1024),
+				(uint32_t)s.writeCount, (uint32_t)(s.writeByteCount / 1024), (uint32_t)s.errorCount,
+				s.inFlightCount, s.maxInFlightCount);
+			printCount += printLatencyHistogram("read", s.readLatency, text + printCount, size - printCount);
+			printCount += printLatencyHistogram("write", s.writeLatency, text + printCount, size - printCount);
+		}
+	}
+	return printCount;
+}
+
+static int seekReadAHCIStatistics(
+	RWFileRequest *rwfr, OpenedFile *of,
+	uint8_t *buffer, uint64_t offset64, uintptr_t bufferSize
+){
+	AHCIStatisticsText *st = getFileInstance(of);
+	uintptr_t copySize = 0;
+	if(offset64 < st->length){
+		copySize = MIN(bufferSize, st->length - (uintptr_t)offset64);
+	}
+	memcpy(buffer, st->text + (uintptr_t)offset64, copySize);
+	completeRWFileIO(rwfr, copySize, copySize);
+	return 1;
+}
+
+static int getAHCIStatisticsParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode){
+	AHCIStatisticsText *st = getFileInstance(of);
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		completeFileIO64(fior2, st->length);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void closeAHCIStatistics(CloseFileRequest *cfr, OpenedFile *of){
+	AHCIStatisticsText *st = getFileInstance(of);
+	completeCloseFile(cfr);
+	DELETE(st);
+}
+
+static int openAHCIStatistics(
+	OpenFileRequest *ofr,
+	__attribute__((__unused__)) const char *fileName, uintptr_t nameLength,
+	OpenFileMode mode
+){
+	EXPECT(nameLength == 0 && mode.enumeration == 0);
+	AHCIStatisticsText *st = allocateKernelMemory(AHCI_STATISTICS_SIZE);
+	EXPECT(st != NULL);
+	st->length = printAHCIStatistics(st->text, AHCI_STATISTICS_SIZE - sizeof(*st));
+	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
+	ff.read = seekReadByOffset;
+	ff.seekRead = seekReadAHCIStatistics;
+	ff.getParameter = getAHCIStatisticsParameter;
+	ff.close = closeAHCIStatistics;
+	completeOpenFile(ofr, st, &ff);
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
 void ahciDriver(void){
 	const char *driverName = "ahci";
 	// 0x01: mass storage; 0x06: SATA; 01: AHCI >= 1.0
@@ -993,11 +1711,21 @@ void ahciDriver(void){
 		printk("cannot register AHCI as file system");
 		systemCall_terminate();
 	}
+	FileNameFunctions statFF = INITIAL_FILE_NAME_FUNCTIONS;
+	statFF.open = openAHCIStatistics;
+	if(addFileSystem(&statFF, "ahcistat", strlen("ahcistat")) == 0){
+		printk("cannot register AHCI statistics file");
+	}
 	Task * task2 = createSharedMemoryTask(completeDiskRequestTask, NULL , 0, processorLocalTask());
 	if(task2 == NULL){
 		systemCall_terminate();
 	}
 	resume(task2);
+	Task *watchdogTask = createSharedMemoryTask(ahciWatchdogTask, NULL , 0, processorLocalTask());
+	if(watchdogTask == NULL){
+		systemCall_terminate();
+	}
+	resume(watchdogTask);
 	while(1){
 		PCIConfigRegisters pciConfig;
 		PCIConfigRegisters0 *regs0 = &pciConfig.regs0;
@@ -1016,6 +1744,7 @@ void ahciDriver(void){
 				printk("identify hba %d port %d failed\n", arg->hbaIndex, p);
 				continue;
 			}
+			enableNCQ(arg, p);
 			if(PAGE_SIZE % arg->port[p].desc.sectorSize != 0){
 				printk("warning: unsupported ahci disk sector size: %u\n", arg->port[p].desc.sectorSize);
 			}
@@ -1030,6 +1759,24 @@ void ahciDriver(void){
 
 #ifndef NDEBUG
 
+static void printAHCICopyStatistics(void){
+	AHCIManager *am = &ahciManager;
+	AHCIInterruptArgument *a;
+	for(a = nextAHCI(am, NULL); a != NULL; a = nextAHCI(am, a)){
+		int p;
+		for(p = 0; p < HBA_MAX_PORT_COUNT; p++){
+			acquireLock(&a->lock);
+			const uint64_t readSize = a->port[p].readByteCount, copySize = a->port[p].copyByteCount;
+			releaseLock(&a->lock);
+			if(readSize == 0){
+				continue;
+			}
+			printk("ahci %d port %d: read %u KB, copied %u bytes per 1000 bytes read\n",
+				a->hbaIndex, p, (uint32_t)(readSize / 1024), (uint32_t)((copySize * 1000) / readSize));
+		}
+	}
+}
+
 void testAHCI(void);
 void testAHCI(void){
 	printk("test ahci driver...\n");
@@ -1073,11 +1820,194 @@ void testAHCI(void){
 			assert(buffer1[0] == 9 && buffer1[1] == buffer[j2] && buffer1[2] == 9);
 		}
 	}
+	// test multiple physical regions
+	const uintptr_t largeSize = 40 * PAGE_SIZE;
+	uint8_t *largeBuffer = systemCall_allocateHeap(largeSize, USER_WRITABLE_PAGE);
+	assert(largeBuffer != NULL);
+	for(i = 0; i < 2; i++){
+		// aligned and not aligned
+		const uintptr_t largeOffset = (i == 0? 0: 123);
+		const uintptr_t bs0 = largeSize - largeOffset * 2;
+		const uint64_t offset = fe.diskPartition.startLBA * fe.diskPartition.sectorSize;
+		uintptr_t bs = bs0;
+		r = syncSeekReadFile(h, largeBuffer + largeOffset, offset + largeOffset, &bs);
+		assert(r != IO_REQUEST_FAILURE && bs == bs0);
+		uintptr_t p;
+		for(p = 0; p < largeSize; p += PAGE_SIZE){
+			bs = PAGE_SIZE;
+			r = syncSeekReadFile(h, buffer, offset + p, &bs);
+			assert(r != IO_REQUEST_FAILURE && bs == PAGE_SIZE);
+			uintptr_t j;
+			for(j = MAX(p, largeOffset); j < MIN(p + PAGE_SIZE, largeOffset + bs0); j++){
+				assert(largeBuffer[j] == buffer[j - p]);
+			}
+		}
+	}
+	r = systemCall_releaseHeap(largeBuffer);
+	assert(r);
 	r = systemCall_releaseHeap(buffer);
 	assert(r);
+	uint64_t readCount = 0, latencyCount = 0, v;
+	r = syncGetFileParameter(h, FILE_PARAM_READ_COUNT, &readCount);
+	assert(r == h && readCount > 0);
+	for(i = 0; i < DISK_LATENCY_BUCKET_COUNT; i++){
+		r = syncGetFileParameter(h, FILE_PARAM_READ_LATENCY + i, &v);
+		assert(r == h);
+		latencyCount += v;
+	}
+	assert(latencyCount > 0);
 	r = syncCloseFile(h);
 	assert(r != IO_REQUEST_FAILURE);
+	// print the statistics file
+	h = syncOpenFile("ahcistat:");
+	assert(h != IO_REQUEST_FAILURE);
+	while(1){
+		char text[65];
+		uintptr_t textSize = 64;
+		r = syncReadFile(h, text, &textSize);
+		assert(r == h);
+		if(textSize == 0)
+			break;
+		text[textSize] = '\0';
+		printk("%s", text);
+	}
+	r = syncCloseFile(h);
+	assert(r == h);
+	printAHCICopyStatistics();
 	printk("test ahci ok\n");
 	systemCall_terminate();
 }
+
+// sum statistics of all ports and reset max queue depth
+static void getAHCIQueueStatistics(
+	uint32_t *issueCount, uint64_t *queueDepthSum, int *maxQueueDepth,
+	uint32_t *requestCount, uint32_t *mergeCount, uint64_t *queueWaitCycles
+){
+	*issueCount = 0;
+	*queueDepthSum = 0;
+	*maxQueueDepth = 0;
+	*requestCount = 0;
+	*mergeCount = 0;
+	*queueWaitCycles = 0;
+	AHCIManager *am = &ahciManager;
+	acquireLock(&am->lock);
+	AHCIInterruptArgument *a;
+	for(a = am->ahciList; a != NULL; a = a->next){
+		acquireLock(&a->lock);
+		int p;
+		for(p = 0; p < HBA_MAX_PORT_COUNT; p++){
+			*issueCount += a->port[p].issueCount;
+			*queueDepthSum += a->port[p].queueDepthSum;
+			*maxQueueDepth = MAX(*maxQueueDepth, a->port[p].maxQueueDepth);
+			a->port[p].maxQueueDepth = 0;
+			*requestCount += a->port[p].requestCount;
+			*mergeCount += a->port[p].mergeCount;
+			*queueWaitCycles += a->port[p].queueWaitCycles;
+		}
+		releaseLock(&a->lock);
+	}
+	releaseLock(&am->lock);
+}
+
+#define QUEUE_TEST_MAX_DEPTH (32)
+
+// keep queueDepth random or sequential 4KB reads outstanding
+static void testQueueDepth(
+	uintptr_t h, const FileEnumeration *fe, uint8_t **buffer,
+	int queueDepth, int isSequential, int testSecond
+){
+	const uint64_t partitionSize = fe->diskPartition.sectorCount * fe->diskPartition.sectorSize;
+	const uint64_t partitionBase = fe->diskPartition.startLBA * fe->diskPartition.sectorSize;
+	assert(partitionSize >= PAGE_SIZE);
+	uintptr_t io[QUEUE_TEST_MAX_DEPTH];
+	uint32_t random = 12345;
+	uint32_t issue0, issue1, request0, request1, merge0, merge1;
+	uint64_t depthSum0, depthSum1, wait0, wait1;
+	int maxDepth;
+	int i;
+	getAHCIQueueStatistics(&issue0, &depthSum0, &maxDepth, &request0, &merge0, &wait0);
+	uint64_t t0 = systemCall_getTime(), t1;
+	while((t1 = systemCall_getTime()) == t0);
+	for(i = 0; i < queueDepth; i++){
+		random = (isSequential? random + 1: random * 1103515245 + 12345);
+		io[i] = systemCall_seekReadFile(h, buffer[i], partitionBase + (random % (partitionSize / PAGE_SIZE)) * PAGE_SIZE, PAGE_SIZE);
+		assert(io[i] != IO_REQUEST_FAILURE);
+	}
+	unsigned int count = 0;
+	while(1){
+		uintptr_t readSize;
+		uintptr_t r = systemCall_waitIOReturn(UINTPTR_NULL, 1, &readSize);
+		assert(r != IO_REQUEST_FAILURE && readSize == PAGE_SIZE);
+		count++;
+		for(i = 0; i < queueDepth && io[i] != r; i++);
+		assert(i < queueDepth);
+		if(systemCall_getTime() - t1 >= (uint64_t)testSecond){
+			io[i] = IO_REQUEST_FAILURE;
+			break;
+		}
+		random = (isSequential? random + 1: random * 1103515245 + 12345);
+		io[i] = systemCall_seekReadFile(h, buffer[i], partitionBase + (random % (partitionSize / PAGE_SIZE)) * PAGE_SIZE, PAGE_SIZE);
+		assert(io[i] != IO_REQUEST_FAILURE);
+	}
+	// wait for remaining requests
+	for(i = 0; i < queueDepth; i++){
+		if(io[i] == IO_REQUEST_FAILURE){
+			continue;
+		}
+		uintptr_t readSize;
+		uintptr_t r = systemCall_waitIOReturn(io[i], 1, &readSize);
+		assert(r == io[i]);
+	}
+	getAHCIQueueStatistics(&issue1, &depthSum1, &maxDepth, &request1, &merge1, &wait1);
+	printk("depth %d: %u IOPS, queue depth avg %u max %d\n",
+		queueDepth, count / testSecond,
+		(issue1 == issue0? 0: (uint32_t)((depthSum1 - depthSum0) / (issue1 - issue0))), maxDepth);
+	printk("    %u merged requests, average queue wait %u cycles\n",
+		merge1 - merge0, (request1 == request0? 0: (uint32_t)((wait1 - wait0) / (request1 - request0))));
+}
+
+void testAHCIQueueDepth(void);
+void testAHCIQueueDepth(void){
+	const int testSecond = 3, depth[] = {1, 2, 4, 8, 16, 32};
+	printk("test ahci queue depth...\n");
+	int ok = waitForFirstResource("ahci", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	uintptr_t enumDisk = syncEnumerateFile(resourceTypeToFileName(RESOURCE_DISK_PARTITION));
+	assert(enumDisk != IO_REQUEST_FAILURE);
+	FileEnumeration fe;
+	uintptr_t readSize = enumNextDiskPartition(enumDisk, MBR_FAT32, &fe);
+	assert(readSize == sizeof(fe));
+	uintptr_t r = syncCloseFile(enumDisk);
+	assert(r != IO_REQUEST_FAILURE);
+	OpenFileMode ofm = OPEN_FILE_MODE_0;
+	uintptr_t h = syncOpenFileN(fe.name, fe.nameLength, ofm);
+	assert(h != IO_REQUEST_FAILURE);
+	uint8_t *buffer[QUEUE_TEST_MAX_DEPTH];
+	int i;
+	for(i = 0; i < QUEUE_TEST_MAX_DEPTH; i++){
+		buffer[i] = systemCall_allocateHeap(PAGE_SIZE, USER_WRITABLE_PAGE);
+		assert(buffer[i] != NULL);
+	}
+	for(i = 0; i < (int)LENGTH_OF(depth); i++){
+		testQueueDepth(h, &fe, buffer, depth[i], 0, testSecond);
+	}
+	// adjacent requests are merged if they wait in queue
+	printk("sequential read with max queue depth 2\n");
+	r = syncSetFileParameter(h, FILE_PARAM_MAX_QUEUE_DEPTH, 2);
+	assert(r != IO_REQUEST_FAILURE);
+	testQueueDepth(h, &fe, buffer, QUEUE_TEST_MAX_DEPTH, 1, testSecond);
+	r = syncSetFileParameter(h, FILE_PARAM_MAX_QUEUE_DEPTH, MAX_COMMAND_SLOT_COUNT);
+	assert(r != IO_REQUEST_FAILURE);
+	for(i = 0; i < QUEUE_TEST_MAX_DEPTH; i++){
+		r = systemCall_releaseHeap(buffer[i]);
+		assert(r);
+	}
+	r = syncCloseFile(h);
+	assert(r != IO_REQUEST_FAILURE);
+	printk("test ahci queue depth ok\n");
+	systemCall_terminate();
+}
+
+#undef QUEUE_TEST_MAX_DEPTH
+
 #endif
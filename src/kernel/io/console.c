@@ -298,6 +298,34 @@ static uintptr_t dirCommand(const char *cmdLine, uintptr_t length){
 	return fileHandle;
 }
 
+static uintptr_t meminfoCommand(
+	__attribute__((__unused__)) const char *cmdLine,
+	__attribute__((__unused__)) uintptr_t length
+){
+	uintptr_t r, fileHandle = syncOpenFile("meminfo:");
+	if(fileHandle == IO_REQUEST_FAILURE){
+		printk("open file error\n");
+		return 0;
+	}
+	char buffer[256];
+	while(1){
+		uintptr_t readSize = sizeof(buffer);
+		r = syncReadFile(fileHandle, buffer, &readSize);
+		if(r == IO_REQUEST_FAILURE){
+			printk("read file error\n");
+			break;
+		}
+		if(readSize == 0)
+			break;
+		printkString(buffer, readSize);
+	}
+	r = syncCloseFile(fileHandle);
+	if(r == IO_REQUEST_FAILURE){
+		printk("close file error\n");
+	}
+	return fileHandle;
+}
+
 static uintptr_t runCommand(const char *cmdLine, uintptr_t length){
 	const char *programName = nextArgument(&cmdLine, &length);
 	if(programName == NULL){
@@ -325,6 +353,7 @@ static void parseCommand(const char *cmdLine, uintptr_t length){
 		{"write", writeCommand},
 		{"close", closeCommand},
 		{"dir", dirCommand},
+		{"meminfo", meminfoCommand},
 		{"run", runCommand}
 	};
 
@@ -854,7 +854,7 @@ static void i8254xTransmitTask(void *arg){
 				payloadSize = MIN(req->rwSize - writtenSize, q->maxBufferSize);
 				writingSize = payloadSize;
 			}
-			memcpy_volatile(payloadBegin, req->buffer + writtenSize, payloadSize);
+			memcpy_nonTemporal(payloadBegin, req->buffer + writtenSize, payloadSize);
 			if(i == 0 && payloadSize < MIN_PAYLOAD_SIZE){
 				memset_volatile(payloadBegin + payloadSize, 0, MIN_PAYLOAD_SIZE - payloadSize);
 			}
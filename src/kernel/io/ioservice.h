@@ -162,6 +162,12 @@ uintptr_t nextPCIConfigRegisters(uintptr_t pciEnumHandle, PCIConfigRegisters *re
 // ahci.c
 void ahciDriver(void);
 
+// virtioblock.c
+void virtioBlockDriver(void);
+
+// ramdisk.c
+void ramDiskDriver(void);
+
 // intel8254x.c
 void i8254xDriver(void);
 
@@ -1244,6 +1244,44 @@ void testReadIP(void);
 void testReadIP(void){
 	testRWIP(3, 0);
 }
+// another host should send UDP packets to port 60001 during the test
+static void testReadUDPSpeed(uint8_t *buffer, uintptr_t bufferSize, int cnt){
+	const char *fileName = "udp:0.0.0.0:0;srcport=60001";
+	uintptr_t f = syncOpenFileN(fileName, strlen(fileName), OPEN_FILE_MODE_0);
+	assert(f != IO_REQUEST_FAILURE);
+	uint64_t beginSecond = systemCall_getTime();
+	int i;
+	for(i = 0; i < cnt; i++){
+		uintptr_t rwSize = bufferSize;
+		uintptr_t r = syncReadFile(f, buffer, &rwSize);
+		assert(r != IO_REQUEST_FAILURE);
+	}
+	uint64_t second = systemCall_getTime() - beginSecond;
+	printk("read %d UDP packets with %u bytes buffer in %u seconds\n", cnt, bufferSize, (uintptr_t)second);
+	uintptr_t r = syncCloseFile(f);
+	assert(r != IO_REQUEST_FAILURE);
+}
+
+void testUDPSpeed(void);
+void testUDPSpeed(void){
+	const int cnt = 100000;
+	int ok = waitForFirstResource("udp", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	// wait for device & dhcp
+	sleep(1000);
+	// kernel buffer is used directly; user buffer is mapped by cached alias
+	uint8_t *kernelBuffer = allocateKernelMemory(PAGE_SIZE);
+	uint8_t *userBuffer = systemCall_allocateHeap(PAGE_SIZE, KERNEL_PAGE);
+	assert(kernelBuffer != NULL && userBuffer != NULL);
+	testReadUDPSpeed(kernelBuffer, 64, cnt);
+	testReadUDPSpeed(kernelBuffer, PAGE_SIZE, cnt);
+	testReadUDPSpeed(userBuffer, 64, cnt);
+	testReadUDPSpeed(userBuffer, PAGE_SIZE, cnt);
+	systemCall_releaseHeap(userBuffer);
+	DELETE(kernelBuffer);
+	systemCall_terminate();
+}
+
 void testIPFileName(void);
 void testIPFileName(void){
 	const char *name;
@@ -0,0 +1,247 @@
+#include"common.h"
+#include"kernel.h"
+#include"memory/memory.h"
+#include"file/fileservice.h"
+#include"resource/resource.h"
+#include"multiprocessor/spinlock.h"
+#include"task/task.h"
+#include"interrupt/systemcalltable.h"
+
+// disk in kernel memory, for measuring file systems without device latency
+// the disk is loaded from RAM_DISK_IMAGE if the BLOB exists;
+// otherwise, an empty FAT32 partition of RAM_DISK_SIZE bytes is created at boot
+
+#define RAM_DISK_NAME "ramdisk"
+#define RAM_DISK_IMAGE "kernelfs:ramdisk.img"
+#define RAM_DISK_SIZE (8 * 1024 * 1024)
+#define RAM_DISK_SECTOR_SIZE (512)
+// the partition begins at the second page
+#define RAM_DISK_PARTITION_LBA (PAGE_SIZE / RAM_DISK_SECTOR_SIZE)
+
+typedef struct{
+	uint8_t *data;
+	uintptr_t size;
+	// see FILE_PARAM_READ_COUNT
+	Spinlock statisticsLock;
+	uint64_t readCount, writeCount, readByteCount, writeByteCount;
+}RAMDisk;
+
+// there is only one RAM disk
+static RAMDisk ramDisk = {NULL, 0, INITIAL_SPINLOCK, 0, 0, 0, 0};
+
+static int isInRAMDisk(const RAMDisk *d, uint64_t position, uintptr_t size){
+	return size <= d->size && position <= d->size - size;
+}
+
+static int seekReadRAMDisk(
+	RWFileRequest *rwfr, OpenedFile *of,
+	uint8_t *buffer, uint64_t position, uintptr_t bufferSize
+){
+	RAMDisk *d = getFileInstance(of);
+	EXPECT(isInRAMDisk(d, position, bufferSize));
+	memcpy(buffer, d->data + (uintptr_t)position, bufferSize);
+	acquireLock(&d->statisticsLock);
+	d->readCount++;
+	d->readByteCount += bufferSize;
+	releaseLock(&d->statisticsLock);
+	completeRWFileIO(rwfr, bufferSize, bufferSize);
+	return 1;
+	ON_ERROR;
+	return 0;
+}
+
+static int seekWriteRAMDisk(
+	RWFileRequest *rwfr, OpenedFile *of,
+	const uint8_t *buffer, uint64_t position, uintptr_t bufferSize
+){
+	RAMDisk *d = getFileInstance(of);
+	EXPECT(isInRAMDisk(d, position, bufferSize));
+	memcpy(d->data + (uintptr_t)position, buffer, bufferSize);
+	acquireLock(&d->statisticsLock);
+	d->writeCount++;
+	d->writeByteCount += bufferSize;
+	releaseLock(&d->statisticsLock);
+	completeRWFileIO(rwfr, bufferSize, bufferSize);
+	return 1;
+	ON_ERROR;
+	return 0;
+}
+
+static int getRAMDiskParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode){
+	RAMDisk *d = getFileInstance(of);
+	uint64_t value;
+	acquireLock(&d->statisticsLock);
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		value = d->size;
+		break;
+	case FILE_PARAM_READ_COUNT:
+		value = d->readCount;
+		break;
+	case FILE_PARAM_WRITE_COUNT:
+		value = d->writeCount;
+		break;
+	case FILE_PARAM_READ_BYTE_COUNT:
+		value = d->readByteCount;
+		break;
+	case FILE_PARAM_WRITE_BYTE_COUNT:
+		value = d->writeByteCount;
+		break;
+	default:
+		releaseLock(&d->statisticsLock);
+		return 0;
+	}
+	releaseLock(&d->statisticsLock);
+	completeFileIO64(fior2, value);
+	return 1;
+}
+
+static void closeRAMDisk(CloseFileRequest *cfr, __attribute__((__unused__)) OpenedFile *of){
+	completeCloseFile(cfr);
+}
+
+static int openRAMDisk(
+	OpenFileRequest *ofr,
+	__attribute__((__unused__)) const char *fileName, uintptr_t nameLength,
+	OpenFileMode mode
+){
+	EXPECT(nameLength == 0 && mode.enumeration == 0 && ramDisk.data != NULL);
+	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
+	ff.read = seekReadByOffset;
+	ff.write = seekWriteByOffset;
+	ff.seekRead = seekReadRAMDisk;
+	ff.seekWrite = seekWriteRAMDisk;
+	ff.getParameter = getRAMDiskParameter;
+	ff.close = closeRAMDisk;
+	completeOpenFile(ofr, &ramDisk, &ff);
+	return 1;
+	ON_ERROR;
+	return 0;
+}
+
+// return 0 if the image does not exist or cannot be loaded
+static int loadRAMDiskImage(RAMDisk *d, const char *imageName){
+	uintptr_t imageHandle = syncOpenFile(imageName);
+	EXPECT(imageHandle != IO_REQUEST_FAILURE);
+	uint64_t imageSize;
+	uintptr_t r = syncSizeOfFile(imageHandle, &imageSize);
+	EXPECT(r == imageHandle && imageSize != 0 && imageSize % RAM_DISK_SECTOR_SIZE == 0 &&
+		imageSize <= RAM_DISK_SIZE);
+	d->size = (uintptr_t)imageSize;
+	d->data = allocateKernelPages(CEIL(d->size, PAGE_SIZE), KERNEL_PAGE);
+	EXPECT(d->data != NULL);
+	uintptr_t readSize = d->size;
+	r = syncSeekReadFile(imageHandle, d->data, 0, &readSize);
+	EXPECT(r == imageHandle && readSize == d->size);
+	syncCloseFile(imageHandle);
+	return 1;
+	ON_ERROR;
+	checkAndReleaseKernelPages(d->data);
+	ON_ERROR;
+	d->data = NULL;
+	d->size = 0;
+	ON_ERROR;
+	syncCloseFile(imageHandle);
+	ON_ERROR;
+	return 0;
+}
+
+// MBR and an empty FAT32 partition
+static int createEmptyRAMDisk(RAMDisk *d, uintptr_t size){
+	d->size = size;
+	d->data = allocateKernelPages(CEIL(d->size, PAGE_SIZE), KERNEL_PAGE);
+	EXPECT(d->data != NULL);
+	const uint32_t sectorCount = d->size / RAM_DISK_SECTOR_SIZE - RAM_DISK_PARTITION_LBA;
+	initSinglePartitionMBR(d->data, MBR_FAT32, RAM_DISK_PARTITION_LBA, sectorCount);
+	EXPECT(formatFAT32(d->data + RAM_DISK_PARTITION_LBA * RAM_DISK_SECTOR_SIZE,
+		RAM_DISK_PARTITION_LBA, sectorCount, RAM_DISK_SECTOR_SIZE));
+	return 1;
+	ON_ERROR;
+	checkAndReleaseKernelPages(d->data);
+	d->data = NULL;
+	ON_ERROR;
+	d->size = 0;
+	return 0;
+}
+
+void ramDiskDriver(void){
+	if(waitForFirstResource("kernelfs", RESOURCE_FILE_SYSTEM, matchName) == 0){
+		printk("cannot find kernel file system\n");
+		systemCall_terminate();
+	}
+	if(loadRAMDiskImage(&ramDisk, RAM_DISK_IMAGE) == 0 && createEmptyRAMDisk(&ramDisk, RAM_DISK_SIZE) == 0){
+		printk("cannot allocate RAM disk\n");
+		systemCall_terminate();
+	}
+	FileNameFunctions ff = INITIAL_FILE_NAME_FUNCTIONS;
+	ff.open = openRAMDisk;
+	if(addFileSystem(&ff, RAM_DISK_NAME, strlen(RAM_DISK_NAME)) == 0){
+		printk("cannot register RAM disk as file system\n");
+		systemCall_terminate();
+	}
+	readPartitions(RAM_DISK_NAME":", strlen(RAM_DISK_NAME":"),
+		ramDisk.size / RAM_DISK_SECTOR_SIZE, RAM_DISK_SECTOR_SIZE);
+	while(1){
+		sleep(10000);
+	}
+}
+
+#ifndef NDEBUG
+
+// page-sized reads at random positions for testSecond seconds
+void testRAMDisk(void);
+void testRAMDisk(void){
+	const int testSecond = 3;
+	printk("test ram disk...\n");
+	int ok = waitForFirstResource(RAM_DISK_NAME, RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	uintptr_t h = syncOpenFile(RAM_DISK_NAME":");
+	assert(h != IO_REQUEST_FAILURE);
+	uint64_t diskSize;
+	uintptr_t r = syncSizeOfFile(h, &diskSize);
+	assert(r == h && diskSize >= 2 * PAGE_SIZE);
+	uint8_t *buffer = systemCall_allocateHeap(3 * PAGE_SIZE, USER_WRITABLE_PAGE);
+	assert(buffer != NULL);
+	// write and read back the sectors between the MBR and the partition of createEmptyRAMDisk
+	// a loaded image may have a partition there, so the original content is restored
+	const uint64_t scratchPosition = RAM_DISK_SECTOR_SIZE;
+	const uintptr_t scratchSize = PAGE_SIZE - RAM_DISK_SECTOR_SIZE;
+	uint8_t *const original = buffer + 2 * PAGE_SIZE;
+	uintptr_t i, bs;
+	bs = scratchSize;
+	r = syncSeekReadFile(h, original, scratchPosition, &bs);
+	assert(r == h && bs == scratchSize);
+	for(i = 0; i < scratchSize; i++){
+		buffer[i] = (uint8_t)(i * 7);
+	}
+	bs = scratchSize;
+	r = syncSeekWriteFile(h, buffer, scratchPosition, &bs);
+	assert(r == h && bs == scratchSize);
+	bs = scratchSize;
+	r = syncSeekReadFile(h, buffer + PAGE_SIZE, scratchPosition, &bs);
+	assert(r == h && bs == scratchSize);
+	for(i = 0; i < scratchSize; i++){
+		assert(buffer[PAGE_SIZE + i] == (uint8_t)(i * 7));
+	}
+	bs = scratchSize;
+	r = syncSeekWriteFile(h, original, scratchPosition, &bs);
+	assert(r == h && bs == scratchSize);
+	uint32_t random = 1, count = 0;
+	uint64_t t0 = systemCall_getTime(), t1;
+	while((t1 = systemCall_getTime()) == t0);
+	while(systemCall_getTime() - t1 < (uint64_t)testSecond){
+		random = random * 1103515245 + 12345;
+		bs = PAGE_SIZE;
+		r = syncSeekReadFile(h, buffer, (random % (uint32_t)(diskSize / PAGE_SIZE)) * (uint64_t)PAGE_SIZE, &bs);
+		assert(r == h && bs == PAGE_SIZE);
+		count++;
+	}
+	printk("ram disk: %u IOPS, %u KB/s\n", count / testSecond, count / testSecond * (PAGE_SIZE / 1024));
+	r = syncCloseFile(h);
+	assert(r == h);
+	systemCall_releaseHeap(buffer);
+	printk("test ram disk ok\n");
+	systemCall_terminate();
+}
+
+#endif
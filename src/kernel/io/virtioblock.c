@@ -0,0 +1,956 @@
+#include"common.h"
+#include"kernel.h"
+#include"io.h"
+#include"memory/memory.h"
+#include"multiprocessor/processorlocal.h"
+#include"interrupt/handler.h"
+#include"file/fileservice.h"
+#include"interrupt/controller/pic.h"
+#include"task/task.h"
+#include"task/exclusivelock.h"
+#include"multiprocessor/spinlock.h"
+#include"resource/resource.h"
+#include"assembly/assembly.h"
+
+// virtio block device over PCI, legacy interface (virtio 0.9.5)
+// the registers are in the I/O space of BAR0
+
+#define VIRTIO_VENDOR_ID (0x1af4)
+// transitional block device; modern-only devices (0x1042) do not have legacy registers
+#define VIRTIO_BLOCK_DEVICE_ID (0x1001)
+
+enum VirtioRegister{
+	VIRTIO_DEVICE_FEATURES = 0x00, // 32 bits
+	VIRTIO_DRIVER_FEATURES = 0x04, // 32 bits
+	VIRTIO_QUEUE_ADDRESS = 0x08, // 32 bits, physical page number
+	VIRTIO_QUEUE_SIZE = 0x0c, // 16 bits
+	VIRTIO_QUEUE_SELECT = 0x0e, // 16 bits
+	VIRTIO_QUEUE_NOTIFY = 0x10, // 16 bits
+	VIRTIO_DEVICE_STATUS = 0x12, // 8 bits
+	VIRTIO_ISR_STATUS = 0x13, // 8 bits, cleared on read
+	// block device configuration, if MSI-X is disabled
+	VIRTIO_BLOCK_CAPACITY = 0x14, // 64 bits, in 512-byte sectors
+	VIRTIO_BLOCK_SEGMENT_MAX = 0x20 // 32 bits
+};
+
+#define VIRTIO_STATUS_ACKNOWLEDGE (1)
+#define VIRTIO_STATUS_DRIVER (2)
+#define VIRTIO_STATUS_DRIVER_OK (4)
+#define VIRTIO_STATUS_FAILED (128)
+
+#define VIRTIO_BLOCK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLOCK_F_RO (1 << 5)
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX (1 << 29)
+
+// split virtqueue
+
+typedef struct{
+	uint64_t address;
+	uint32_t length;
+	uint16_t flags;
+	uint16_t next;
+}VirtqDescriptor;
+
+static_assert(sizeof(VirtqDescriptor) == 16);
+
+#define VIRTQ_DESC_F_NEXT (1)
+#define VIRTQ_DESC_F_WRITE (2)
+#define VIRTQ_DESC_F_INDIRECT (4)
+
+// followed by the ring and the event index
+typedef struct{
+	uint16_t flags;
+	uint16_t index;
+}VirtqRingHeader;
+
+// in available ring header
+#define VIRTQ_AVAIL_F_NO_INTERRUPT (1)
+// in used ring header
+#define VIRTQ_USED_F_NO_NOTIFY (1)
+
+typedef struct{
+	uint32_t id;
+	uint32_t length;
+}VirtqUsedElement;
+
+static_assert(sizeof(VirtqUsedElement) == 8);
+
+// the legacy interface requires the used ring to be aligned to 4096 bytes
+static_assert(PAGE_SIZE == 4096);
+
+static uintptr_t getVirtqUsedOffset(uintptr_t queueSize){
+	return CEIL(sizeof(VirtqDescriptor) * queueSize +
+		sizeof(VirtqRingHeader) + sizeof(uint16_t) * (queueSize + 1), PAGE_SIZE);
+}
+
+static uintptr_t getVirtqSize(uintptr_t queueSize){
+	return getVirtqUsedOffset(queueSize) +
+		CEIL(sizeof(VirtqRingHeader) + sizeof(VirtqUsedElement) * queueSize + sizeof(uint16_t), PAGE_SIZE);
+}
+
+static void setVirtqDescriptor(volatile VirtqDescriptor *desc, uintptr_t address, uint32_t length, uint16_t flags, uint16_t next){
+	desc->address = address;
+	desc->length = length;
+	desc->flags = flags;
+	desc->next = next;
+}
+
+// order the ring updates with the index and event reads on the device side
+static void memoryBarrier(void){
+	volatile uint32_t v = 0;
+	lock_add32(&v, 0);
+}
+
+// block command
+
+#define VIRTIO_BLOCK_T_IN (0)
+#define VIRTIO_BLOCK_T_OUT (1)
+#define VIRTIO_BLOCK_S_OK (0)
+// the sector number in commands is always in 512 bytes
+#define VIRTIO_BLOCK_SECTOR_SIZE (512)
+static_assert(PAGE_SIZE % VIRTIO_BLOCK_SECTOR_SIZE == 0);
+
+// data descriptors in a command; a request which needs more is sent as multiple commands
+#define MAX_COMMAND_SEGMENT_COUNT (60)
+// maximum number of outstanding commands
+#define MAX_VIRTIO_SLOT_COUNT (32)
+
+// every command uses one descriptor in the virtqueue, which refers to the indirect table
+// command i always uses descriptor i
+typedef struct{
+	// device-readable
+	struct{
+		uint32_t type;
+		uint32_t reserved;
+		uint64_t sector;
+	}header;
+	// device-writable
+	uint8_t status;
+	uint8_t reserved[15];
+	// header, data segments and status
+	VirtqDescriptor indirect[MAX_COMMAND_SEGMENT_COUNT + 2];
+}VirtioBlockCommand;
+
+static_assert(sizeof(VirtioBlockCommand) == 1024);
+static_assert(MEMBER_OFFSET(VirtioBlockCommand, indirect) % 16 == 0);
+
+typedef struct VirtioBlockDevice VirtioBlockDevice;
+
+typedef struct VirtioBlockRequest{
+	RWFileRequest *rwfr;
+	VirtioBlockDevice *device;
+	// not aligned
+	void *inputBuffer;
+	uintptr_t inputSize;
+	// reserved physical pages of sectorBufferPage
+	PhysicalAddressArray *physicalPages;
+	// if inputBuffer is aligned, sectorBuffer == inputBuffer and not need to copy
+	void *sectorBufferPage;
+	uintptr_t sectorBufferOffset, sectorBufferSize;
+	// not aligned
+	uintptr_t bufferOffset;
+	uint64_t sector;
+	// bytes of sector buffer sent in commands; see buildVirtioBlockCommand
+	uintptr_t issuedSize;
+	// number of issued commands not completed
+	int pendingCommandCount;
+	// rdtsc() when added to queue
+	uint64_t enqueueTime;
+	char isWrite;
+	// set if any command failed
+	char isFailed;
+	struct VirtioBlockRequest **prev, *next;
+}VirtioBlockRequest;
+
+struct VirtioBlockDevice{
+	uint16_t ioBase;
+	uint16_t deviceIndex;
+	uint64_t sectorCount;
+	int isReadOnly;
+	// VIRTIO_RING_F_EVENT_IDX is negotiated
+	int useEventIndex;
+
+	Spinlock lock;
+	// virtqueue 0 in contiguous pages
+	void *virtq;
+	uint16_t queueSize;
+	volatile VirtqDescriptor *descriptor;
+	volatile VirtqRingHeader *available;
+	volatile uint16_t *availableRing, *usedEvent;
+	volatile VirtqRingHeader *used;
+	volatile VirtqUsedElement *usedRing;
+	volatile uint16_t *availableEvent;
+	// next available index to publish and next used index to read
+	uint16_t availableIndex, lastUsedIndex;
+	// contiguous pages of slotCount commands
+	VirtioBlockCommand *command;
+	PhysicalAddress commandPhysical;
+	int slotCount, segmentLimit;
+	// bit i is set if command i is in the virtqueue
+	uint32_t issuedSlot;
+	VirtioBlockRequest *slotRequest[MAX_VIRTIO_SLOT_COUNT];
+	// FIFO of requests which have commands not issued
+	VirtioBlockRequest *pendingHead, **pendingTail;
+
+	// statistics; see getVirtioBlockStatistics
+	uint64_t readCount, writeCount, readByteCount, writeByteCount, errorCount;
+	int inFlightCount, maxInFlightCount;
+	uint32_t readLatency[DISK_LATENCY_BUCKET_COUNT], writeLatency[DISK_LATENCY_BUCKET_COUNT];
+	// commands issued, notifications sent and interrupts handled
+	uint32_t commandCount, notifyCount, interruptCount;
+
+	// manager
+	struct VirtioBlockDevice **prev, *next;
+};
+
+static void *virtioLinearBuffer(VirtioBlockRequest *r){
+	return (void*)(((uintptr_t)r->sectorBufferPage) + r->bufferOffset);
+}
+
+static int hasSeparateSectorBuffer(VirtioBlockRequest *r){
+	return ((uintptr_t)r->inputBuffer) != ((uintptr_t)r->sectorBufferPage) + r->bufferOffset;
+}
+
+static void deleteVirtioBlockRequest(VirtioBlockRequest *r){
+	deletePhysicalAddressArray(r->physicalPages);
+	if(hasSeparateSectorBuffer(r)){
+		if(checkAndReleaseKernelPages(r->sectorBufferPage) == 0){
+			panic("");
+		}
+	}
+	DELETE(r);
+}
+
+static VirtioBlockRequest *createVirtioBlockRequest(
+	RWFileRequest *rwfr, void *buffer, uintptr_t bufferSize, uint64_t position,
+	VirtioBlockDevice *d, char isWrite
+){
+	const uintptr_t sectorBufferSize =
+		CEIL(position + bufferSize, VIRTIO_BLOCK_SECTOR_SIZE) - FLOOR(position, VIRTIO_BLOCK_SECTOR_SIZE);
+	VirtioBlockRequest *NEW(r);
+	EXPECT(r != NULL);
+	r->rwfr = rwfr;
+	r->device = d;
+	r->inputBuffer = buffer;
+	r->inputSize = bufferSize;
+	LinearMemoryManager *physicalBufferManager;
+	if(
+		((uintptr_t)buffer) % VIRTIO_BLOCK_SECTOR_SIZE == 0 &&
+		bufferSize == sectorBufferSize &&
+		position % VIRTIO_BLOCK_SECTOR_SIZE == 0
+	){ // aligned
+		r->sectorBufferOffset =
+		r->bufferOffset = ((uintptr_t)buffer) % PAGE_SIZE;
+		r->sectorBufferPage = (void*)(((uintptr_t)buffer) - r->bufferOffset);
+		physicalBufferManager = getTaskLinearMemory(processorLocalTask());
+	}
+	else{ // not aligned
+		r->sectorBufferOffset = 0;
+		r->bufferOffset = position % VIRTIO_BLOCK_SECTOR_SIZE;
+		r->sectorBufferPage = allocateKernelPages(CEIL(sectorBufferSize, PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
+		physicalBufferManager = kernelLinear;
+	}
+	EXPECT(r->sectorBufferPage != NULL);
+	r->physicalPages = checkAndReservePages(physicalBufferManager, r->sectorBufferPage,
+		CEIL(r->sectorBufferOffset + sectorBufferSize, PAGE_SIZE), KERNEL_PAGE);
+	EXPECT(r->physicalPages != NULL);
+	r->sectorBufferSize = sectorBufferSize;
+	r->sector = position / VIRTIO_BLOCK_SECTOR_SIZE;
+	r->issuedSize = 0;
+	r->pendingCommandCount = 0;
+	r->enqueueTime = 0;
+	r->isWrite = isWrite;
+	r->isFailed = 0;
+	r->prev = NULL;
+	r->next = NULL;
+	return r;
+	ON_ERROR;
+	if(hasSeparateSectorBuffer(r)){
+		checkAndReleaseKernelPages(r->sectorBufferPage);
+	}
+	ON_ERROR;
+	DELETE(r);
+	ON_ERROR;
+	return NULL;
+}
+
+// fill command slot with the next part of r
+// physically contiguous pages are merged into one segment
+static void buildVirtioBlockCommand(VirtioBlockDevice *d, int slot, VirtioBlockRequest *r){
+	VirtioBlockCommand *c = d->command + slot;
+	const uintptr_t commandPhysical = d->commandPhysical.value + slot * sizeof(VirtioBlockCommand);
+	c->header.type = (r->isWrite? VIRTIO_BLOCK_T_OUT: VIRTIO_BLOCK_T_IN);
+	c->header.reserved = 0;
+	c->header.sector = r->sector + r->issuedSize / VIRTIO_BLOCK_SECTOR_SIZE;
+	c->status = 0xff;
+	setVirtqDescriptor(c->indirect + 0, commandPhysical + MEMBER_OFFSET(VirtioBlockCommand, header),
+		sizeof(c->header), VIRTQ_DESC_F_NEXT, 1);
+	const uint16_t dataFlags = VIRTQ_DESC_F_NEXT | (r->isWrite? 0: VIRTQ_DESC_F_WRITE);
+	int n = 1;
+	while(r->issuedSize < r->sectorBufferSize){
+		const uintptr_t offset = r->sectorBufferOffset + r->issuedSize;
+		const uintptr_t base = r->physicalPages->address[offset / PAGE_SIZE].value + offset % PAGE_SIZE;
+		const uintptr_t s = MIN(PAGE_SIZE - offset % PAGE_SIZE, r->sectorBufferSize - r->issuedSize);
+		VirtqDescriptor *last = c->indirect + (n - 1);
+		if(n > 1 && last->address + last->length == base){
+			last->length += s;
+		}
+		else{
+			if(n - 1 == d->segmentLimit){
+				break;
+			}
+			setVirtqDescriptor(c->indirect + n, base, s, dataFlags, n + 1);
+			n++;
+		}
+		r->issuedSize += s;
+	}
+	setVirtqDescriptor(c->indirect + n, commandPhysical + MEMBER_OFFSET(VirtioBlockCommand, status),
+		sizeof(c->status), VIRTQ_DESC_F_WRITE, 0);
+	n++;
+	setVirtqDescriptor(d->descriptor + slot, commandPhysical + MEMBER_OFFSET(VirtioBlockCommand, indirect),
+		n * sizeof(VirtqDescriptor), VIRTQ_DESC_F_INDIRECT, 0);
+}
+
+// see VIRTIO_RING_F_EVENT_IDX
+static int needEvent(uint16_t eventIndex, uint16_t newIndex, uint16_t oldIndex){
+	return (uint16_t)(newIndex - eventIndex - 1) < (uint16_t)(newIndex - oldIndex);
+}
+
+static void addToVirtioBlockQueue(VirtioBlockDevice *d, VirtioBlockRequest *r){
+	assert(isAcquirable(&d->lock) == 0);
+	r->enqueueTime = rdtsc();
+	d->inFlightCount++;
+	d->maxInFlightCount = MAX(d->maxInFlightCount, d->inFlightCount);
+	ADD_TO_DQUEUE(r, d->pendingTail);
+	d->pendingTail = &r->next;
+}
+
+static void removeFirstPendingRequest(VirtioBlockDevice *d){
+	VirtioBlockRequest *r = d->pendingHead;
+	if(r->next == NULL){
+		d->pendingTail = &d->pendingHead;
+	}
+	REMOVE_FROM_DQUEUE(r);
+}
+
+// put commands of pending requests into free slots
+// the new commands are published together and the device is notified at most once
+static void serveVirtioBlockQueue(VirtioBlockDevice *d){
+	assert(isAcquirable(&d->lock) == 0);
+	const uint32_t slotMask = (d->slotCount >= 32? 0xffffffff: ((uint32_t)1 << d->slotCount) - 1);
+	const uint16_t oldIndex = d->availableIndex;
+	while(d->pendingHead != NULL && (d->issuedSlot & slotMask) != slotMask){
+		VirtioBlockRequest *r = d->pendingHead;
+		const int slot = bsf32(~d->issuedSlot & slotMask);
+		buildVirtioBlockCommand(d, slot, r);
+		r->pendingCommandCount++;
+		d->issuedSlot |= (1 << slot);
+		d->slotRequest[slot] = r;
+		d->availableRing[d->availableIndex % d->queueSize] = slot;
+		d->availableIndex++;
+		d->commandCount++;
+		if(r->issuedSize == r->sectorBufferSize){
+			removeFirstPendingRequest(d);
+		}
+	}
+	if(d->availableIndex == oldIndex){
+		return;
+	}
+	// the device may read the ring as soon as the index is updated
+	memoryBarrier();
+	d->available->index = d->availableIndex;
+	memoryBarrier();
+	int needNotify;
+	if(d->useEventIndex){
+		needNotify = needEvent(*d->availableEvent, d->availableIndex, oldIndex);
+	}
+	else{
+		needNotify = ((d->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0);
+	}
+	if(needNotify){
+		out16(d->ioBase + VIRTIO_QUEUE_NOTIFY, 0);
+		d->notifyCount++;
+	}
+}
+
+static int toLatencyBucket(uint64_t cycles){
+	int b;
+	for(b = 0; b < DISK_LATENCY_BUCKET_COUNT - 1 && (cycles >> (b + 1)) != 0; b++);
+	return b;
+}
+
+static void enableVirtqInterrupt(VirtioBlockDevice *d, int enable){
+	if(d->useEventIndex){
+		// interrupt when the entry at lastUsedIndex is used
+		// when disabled, the event index is behind and the device does not send interrupts
+		if(enable){
+			*d->usedEvent = d->lastUsedIndex;
+		}
+	}
+	else{
+		d->available->flags = (enable? 0: VIRTQ_AVAIL_F_NO_INTERRUPT);
+	}
+}
+
+// move the requests whose commands are all completed to completeList
+// interrupts are suppressed while draining the used ring;
+// after enabling, check again for commands completed in between
+static void removeFromVirtioBlockQueue(VirtioBlockDevice *d, VirtioBlockRequest **completeList){
+	assert(isAcquirable(&d->lock) == 0);
+	const uint64_t now = rdtsc();
+	while(1){
+		enableVirtqInterrupt(d, 0);
+		while(d->lastUsedIndex != d->used->index){
+			const int slot = d->usedRing[d->lastUsedIndex % d->queueSize].id;
+			d->lastUsedIndex++;
+			assert(slot < d->slotCount && ((d->issuedSlot >> slot) & 1) != 0);
+			VirtioBlockRequest *r = d->slotRequest[slot];
+			d->slotRequest[slot] = NULL;
+			d->issuedSlot &= ~(1 << slot);
+			if(d->command[slot].status != VIRTIO_BLOCK_S_OK){
+				r->isFailed = 1;
+			}
+			r->pendingCommandCount--;
+			if(r->pendingCommandCount != 0 || r->issuedSize != r->sectorBufferSize){
+				continue;
+			}
+			uint32_t *histogram = (r->isWrite? d->writeLatency: d->readLatency);
+			histogram[toLatencyBucket(now - r->enqueueTime)]++;
+			ADD_TO_DQUEUE(r, completeList);
+		}
+		enableVirtqInterrupt(d, 1);
+		memoryBarrier();
+		if(d->lastUsedIndex == d->used->index){
+			break;
+		}
+	}
+}
+
+// completed requests
+
+static struct VirtioBlockRequestList{
+	Spinlock lock;
+	Semaphore *semaphore;
+	VirtioBlockRequest *head;
+}virtioCompleteList;
+
+static int initVirtioBlockRequestList(struct VirtioBlockRequestList *rList){
+	rList->lock = initialSpinlock;
+	rList->semaphore = createSemaphore(0);
+	if(rList->semaphore == NULL)
+		return 0;
+	rList->head = NULL;
+	return 1;
+}
+
+static void addToVirtioBlockRequestList(struct VirtioBlockRequestList *rList, VirtioBlockRequest *r){
+	acquireLock(&rList->lock);
+	ADD_TO_DQUEUE(r, &rList->head);
+	releaseLock(&rList->lock);
+	releaseSemaphore(rList->semaphore);
+}
+
+static VirtioBlockRequest *removeFromVirtioBlockRequestList(struct VirtioBlockRequestList *rList){
+	acquireSemaphore(rList->semaphore);
+	acquireLock(&rList->lock);
+	VirtioBlockRequest *r = rList->head;
+	if(r != NULL){
+		REMOVE_FROM_DQUEUE(r);
+	}
+	releaseLock(&rList->lock);
+	return r;
+}
+
+static void completeVirtioBlockRequest(VirtioBlockRequest *r){
+	VirtioBlockDevice *d = r->device;
+	if(hasSeparateSectorBuffer(r) && r->isFailed == 0 && r->isWrite == 0){
+		memcpy(r->inputBuffer, virtioLinearBuffer(r), r->inputSize);
+	}
+	acquireLock(&d->lock);
+	d->inFlightCount--;
+	if(r->isFailed){
+		d->errorCount++;
+	}
+	else if(r->isWrite){
+		d->writeCount++;
+		d->writeByteCount += r->inputSize;
+	}
+	else{
+		d->readCount++;
+		d->readByteCount += r->inputSize;
+	}
+	releaseLock(&d->lock);
+	if(r->isFailed){
+		completeRWFileIO(r->rwfr, 0, 0);
+	}
+	else{
+		completeRWFileIO(r->rwfr, r->inputSize, r->inputSize);
+	}
+	deleteVirtioBlockRequest(r);
+}
+
+static void completeVirtioBlockRequestTask(__attribute__((__unused__)) void *arg){
+	while(1){
+		VirtioBlockRequest *r = removeFromVirtioBlockRequestList(&virtioCompleteList);
+		assert(r != NULL);
+		completeVirtioBlockRequest(r);
+	}
+}
+
+static int virtioBlockHandler(const InterruptParam *param){
+	VirtioBlockDevice *d = (VirtioBlockDevice*)param->argument;
+	// reading the register clears the interrupt
+	// bit 0: used ring updated; bit 1: configuration changed
+	const uint8_t isr = in8(d->ioBase + VIRTIO_ISR_STATUS);
+	if(isr == 0){
+		return 0;
+	}
+	VirtioBlockRequest *completeList = NULL;
+	acquireLock(&d->lock);
+	d->interruptCount++;
+	removeFromVirtioBlockQueue(d, &completeList);
+	serveVirtioBlockQueue(d);
+	releaseLock(&d->lock);
+	while(completeList != NULL){
+		VirtioBlockRequest *r = completeList;
+		REMOVE_FROM_DQUEUE(r);
+		addToVirtioBlockRequestList(&virtioCompleteList, r);
+	}
+	return 1;
+}
+
+// device manager
+typedef struct{
+	Spinlock lock;
+	VirtioBlockDevice *deviceList;
+	int deviceCount;
+}VirtioBlockManager;
+
+static VirtioBlockManager virtioBlockManager = {INITIAL_SPINLOCK, NULL, 0};
+
+static VirtioBlockDevice *searchVirtioBlockDevice(VirtioBlockManager *vm, uintptr_t deviceIndex){
+	VirtioBlockDevice *d;
+	acquireLock(&vm->lock);
+	for(d = vm->deviceList; d != NULL; d = d->next){
+		if(d->deviceIndex == deviceIndex){
+			break;
+		}
+	}
+	releaseLock(&vm->lock);
+	return d;
+}
+
+static void initVirtqueue(VirtioBlockDevice *d){
+	const uintptr_t usedOffset = getVirtqUsedOffset(d->queueSize);
+	d->descriptor = d->virtq;
+	d->available = (volatile VirtqRingHeader*)(d->descriptor + d->queueSize);
+	d->availableRing = (volatile uint16_t*)(d->available + 1);
+	d->usedEvent = d->availableRing + d->queueSize;
+	d->used = (volatile VirtqRingHeader*)(((uintptr_t)d->virtq) + usedOffset);
+	d->usedRing = (volatile VirtqUsedElement*)(d->used + 1);
+	d->availableEvent = (volatile uint16_t*)(d->usedRing + d->queueSize);
+	d->availableIndex = 0;
+	d->lastUsedIndex = 0;
+}
+
+static VirtioBlockDevice *initVirtioBlock(const PCIConfigRegisters0 *regs){
+	VirtioBlockDevice *NEW(d);
+	EXPECT(d != NULL);
+	// I/O space
+	EXPECT((regs->bar0 & 1) != 0);
+	const uint16_t io = d->ioBase = (uint16_t)(regs->bar0 & 0xfffc);
+	// reset
+	out8(io + VIRTIO_DEVICE_STATUS, 0);
+	out8(io + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	out8(io + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	const uint32_t features = in32(io + VIRTIO_DEVICE_FEATURES);
+	EXPECT((features & VIRTIO_RING_F_INDIRECT_DESC) != 0);
+	out32(io + VIRTIO_DRIVER_FEATURES, features &
+		(VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX | VIRTIO_BLOCK_F_SEG_MAX | VIRTIO_BLOCK_F_RO));
+	d->useEventIndex = ((features & VIRTIO_RING_F_EVENT_IDX) != 0);
+	d->isReadOnly = ((features & VIRTIO_BLOCK_F_RO) != 0);
+	d->sectorCount = COMBINE64(in32(io + VIRTIO_BLOCK_CAPACITY + 4), in32(io + VIRTIO_BLOCK_CAPACITY));
+	d->segmentLimit = MAX_COMMAND_SEGMENT_COUNT;
+	if(features & VIRTIO_BLOCK_F_SEG_MAX){
+		const uint32_t segmentMax = in32(io + VIRTIO_BLOCK_SEGMENT_MAX);
+		if(segmentMax != 0 && segmentMax < (uint32_t)d->segmentLimit){
+			d->segmentLimit = segmentMax;
+		}
+	}
+	out16(io + VIRTIO_QUEUE_SELECT, 0);
+	d->queueSize = in16(io + VIRTIO_QUEUE_SIZE);
+	EXPECT(d->queueSize != 0 && in32(io + VIRTIO_QUEUE_ADDRESS) == 0);
+	// a command uses one descriptor
+	d->slotCount = MIN(d->queueSize, MAX_VIRTIO_SLOT_COUNT);
+	d->virtq = allocateContiguousPages(kernelLinear, getVirtqSize(d->queueSize), KERNEL_NON_CACHED_PAGE);
+	EXPECT(d->virtq != NULL);
+	memset(d->virtq, 0, getVirtqSize(d->queueSize));
+	initVirtqueue(d);
+	d->command = allocateContiguousPages(kernelLinear,
+		CEIL(sizeof(VirtioBlockCommand) * MAX_VIRTIO_SLOT_COUNT, PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
+	EXPECT(d->command != NULL);
+	d->commandPhysical = checkAndTranslatePage(kernelLinear, d->command);
+	out32(io + VIRTIO_QUEUE_ADDRESS, checkAndTranslatePage(kernelLinear, d->virtq).value / PAGE_SIZE);
+
+	d->deviceIndex = 0xffff;
+	d->lock = initialSpinlock;
+	d->issuedSlot = 0;
+	memset(d->slotRequest, 0, sizeof(d->slotRequest));
+	d->pendingHead = NULL;
+	d->pendingTail = &d->pendingHead;
+	d->readCount = 0;
+	d->writeCount = 0;
+	d->readByteCount = 0;
+	d->writeByteCount = 0;
+	d->errorCount = 0;
+	d->inFlightCount = 0;
+	d->maxInFlightCount = 0;
+	memset(d->readLatency, 0, sizeof(d->readLatency));
+	memset(d->writeLatency, 0, sizeof(d->writeLatency));
+	d->commandCount = 0;
+	d->notifyCount = 0;
+	d->interruptCount = 0;
+	d->prev = NULL;
+	d->next = NULL;
+	return d;
+	ON_ERROR;
+	checkAndReleaseKernelPages(d->virtq);
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	printk("cannot initialize virtio block device\n");
+	out8(d->ioBase + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+	ON_ERROR;
+	DELETE(d);
+	ON_ERROR;
+	return NULL;
+}
+
+static VirtioBlockDevice *addVirtioBlock(VirtioBlockManager *vm, const PCIConfigRegisters0 *regs){
+	PIC *pic = processorLocalPIC();
+	VirtioBlockDevice *d = initVirtioBlock(regs);
+	if(d == NULL){
+		return NULL;
+	}
+	acquireLock(&vm->lock);
+	d->deviceIndex = (uint16_t)vm->deviceCount;
+	ADD_TO_DQUEUE(d, &vm->deviceList);
+	vm->deviceCount++;
+	releaseLock(&vm->lock);
+
+	InterruptVector *v = pic->irqToVector(pic, regs->interruptLine);
+	addHandler(v, virtioBlockHandler, (uintptr_t)d);
+	pic->setPICMask(pic, regs->interruptLine, 0);
+	out8(d->ioBase + VIRTIO_DEVICE_STATUS,
+		VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	return d;
+}
+
+// file interface
+
+static int seekRWVirtioBlock(
+	RWFileRequest *rwfr, OpenedFile *of,
+	uint8_t *buffer, uint64_t position, uintptr_t bufferSize, char isWrite
+){
+	VirtioBlockDevice *d = getFileInstance(of);
+	const uint64_t diskSize = d->sectorCount * VIRTIO_BLOCK_SECTOR_SIZE;
+	EXPECT(bufferSize <= diskSize && position <= diskSize - bufferSize);
+	VirtioBlockRequest *r = createVirtioBlockRequest(rwfr, buffer, bufferSize, position, d, isWrite);
+	EXPECT(r != NULL);
+	acquireLock(&d->lock);
+	addToVirtioBlockQueue(d, r);
+	serveVirtioBlockQueue(d);
+	releaseLock(&d->lock);
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+static int seekReadVirtioBlock(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uint64_t position, uintptr_t bufferSize){
+	return seekRWVirtioBlock(rwfr, of, buffer, position, bufferSize, 0);
+}
+
+// unaligned writes need read-modify-write and are not supported
+static int seekWriteVirtioBlock(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buffer, uint64_t position, uintptr_t bufferSize){
+	VirtioBlockDevice *d = getFileInstance(of);
+	if(d->isReadOnly){
+		return 0;
+	}
+	if(((uintptr_t)buffer) % VIRTIO_BLOCK_SECTOR_SIZE != 0 ||
+	bufferSize % VIRTIO_BLOCK_SECTOR_SIZE != 0 || position % VIRTIO_BLOCK_SECTOR_SIZE != 0){
+		return 0;
+	}
+	return seekRWVirtioBlock(rwfr, of, (uint8_t*)buffer, position, bufferSize, 1);
+}
+
+// return 0 if parameterCode is not a statistics parameter
+static int getVirtioBlockStatistics(VirtioBlockDevice *d, uintptr_t parameterCode, uint64_t *value){
+	int ok = 1;
+	acquireLock(&d->lock);
+	switch(parameterCode){
+	case FILE_PARAM_READ_COUNT:
+		*value = d->readCount;
+		break;
+	case FILE_PARAM_WRITE_COUNT:
+		*value = d->writeCount;
+		break;
+	case FILE_PARAM_READ_BYTE_COUNT:
+		*value = d->readByteCount;
+		break;
+	case FILE_PARAM_WRITE_BYTE_COUNT:
+		*value = d->writeByteCount;
+		break;
+	case FILE_PARAM_ERROR_COUNT:
+		*value = d->errorCount;
+		break;
+	case FILE_PARAM_IN_FLIGHT_COUNT:
+		*value = d->inFlightCount;
+		break;
+	case FILE_PARAM_MAX_IN_FLIGHT_COUNT:
+		*value = d->maxInFlightCount;
+		break;
+	default:
+		if(parameterCode >= FILE_PARAM_READ_LATENCY &&
+		parameterCode < FILE_PARAM_READ_LATENCY + DISK_LATENCY_BUCKET_COUNT){
+			*value = d->readLatency[parameterCode - FILE_PARAM_READ_LATENCY];
+		}
+		else if(parameterCode >= FILE_PARAM_WRITE_LATENCY &&
+		parameterCode < FILE_PARAM_WRITE_LATENCY + DISK_LATENCY_BUCKET_COUNT){
+			*value = d->writeLatency[parameterCode - FILE_PARAM_WRITE_LATENCY];
+		}
+		else{
+			ok = 0;
+		}
+	}
+	releaseLock(&d->lock);
+	return ok;
+}
+
+static int getVirtioBlockParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode){
+	VirtioBlockDevice *d = getFileInstance(of);
+	uint64_t value;
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		completeFileIO64(fior2, d->sectorCount * VIRTIO_BLOCK_SECTOR_SIZE);
+		break;
+	case FILE_PARAM_MAX_QUEUE_DEPTH:
+		completeFileIO1(fior2, d->slotCount);
+		break;
+	default:
+		if(getVirtioBlockStatistics(d, parameterCode, &value) == 0){
+			return 0;
+		}
+		completeFileIO64(fior2, value);
+		break;
+	}
+	return 1;
+}
+
+static void closeVirtioBlock(CloseFileRequest *cfr, __attribute__((__unused__)) OpenedFile *of){
+	completeCloseFile(cfr);
+	// do not delete of->instance
+}
+
+static int openVirtioBlock(
+	OpenFileRequest *ofr,
+	const char *fileName, uintptr_t length, __attribute__((__unused__)) OpenFileMode mode
+){
+	uintptr_t index;
+	if(snscanf(fileName, length, "%x", &index) != 1){
+		return 0;
+	}
+	VirtioBlockDevice *d = searchVirtioBlockDevice(&virtioBlockManager, index);
+	if(d == NULL){
+		return 0;
+	}
+	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
+	ff.seekRead = seekReadVirtioBlock;
+	ff.seekWrite = seekWriteVirtioBlock;
+	ff.getParameter = getVirtioBlockParameter;
+	ff.close = closeVirtioBlock;
+	completeOpenFile(ofr, d, &ff);
+	return 1;
+}
+
+void virtioBlockDriver(void){
+	const char *driverName = "virtio";
+	if(waitForFirstResource("pci", RESOURCE_FILE_SYSTEM, matchName) == 0){
+		printk("cannot find PCI driver\n");
+		systemCall_terminate();
+	}
+	// 0x01: mass storage; the subclass of legacy virtio block devices is 0x00 (SCSI)
+	uintptr_t enumPCI = enumeratePCI(0x01000000, 0xff000000);
+	assert(enumPCI != IO_REQUEST_FAILURE);
+
+	FileNameFunctions ff = INITIAL_FILE_NAME_FUNCTIONS;
+	ff.open = openVirtioBlock;
+	if(initVirtioBlockRequestList(&virtioCompleteList) == 0){
+		systemCall_terminate();
+	}
+	if(addFileSystem(&ff, driverName, strlen(driverName)) == 0){
+		printk("cannot register virtio as file system");
+		systemCall_terminate();
+	}
+	Task *completeTask = createSharedMemoryTask(completeVirtioBlockRequestTask, NULL, 0, processorLocalTask());
+	if(completeTask == NULL){
+		systemCall_terminate();
+	}
+	resume(completeTask);
+	while(1){
+		PCIConfigRegisters pciConfig;
+		PCIConfigRegisters0 *regs0 = &pciConfig.regs0;
+		if(nextPCIConfigRegisters(enumPCI, &pciConfig, sizeof(*regs0)) != sizeof(*regs0))
+			break;
+		if(regs0->vendorID != VIRTIO_VENDOR_ID || regs0->deviceID != VIRTIO_BLOCK_DEVICE_ID)
+			continue;
+		VirtioBlockDevice *d = addVirtioBlock(&virtioBlockManager, regs0);
+		if(d == NULL){
+			continue;
+		}
+		char fileName[20];
+		int nameLength = snprintf(fileName, 20, "%s:%x", driverName, d->deviceIndex);
+		readPartitions(fileName, nameLength, d->sectorCount, VIRTIO_BLOCK_SECTOR_SIZE);
+	}
+	syncCloseFile(enumPCI);
+	while(1){
+		sleep(10000);
+	}
+}
+
+#ifndef NDEBUG
+
+// return 0 if no FAT32 partition on the disks of driverName
+static int findPartitionByDriver(const char *driverName, FileEnumeration *fe){
+	const uintptr_t nameLength = strlen(driverName);
+	uintptr_t enumDisk = syncEnumerateFile(resourceTypeToFileName(RESOURCE_DISK_PARTITION));
+	assert(enumDisk != IO_REQUEST_FAILURE);
+	int found = 0;
+	while(found == 0 && enumNextDiskPartition(enumDisk, MBR_FAT32, fe) == sizeof(*fe)){
+		found = (fe->nameLength > nameLength && strncmp(fe->name, driverName, nameLength) == 0 &&
+			fe->name[nameLength] == ':');
+	}
+	uintptr_t r = syncCloseFile(enumDisk);
+	assert(r != IO_REQUEST_FAILURE);
+	return found;
+}
+
+#define IOPS_TEST_MAX_DEPTH (16)
+
+// keep queueDepth random 4KB reads outstanding for testSecond seconds
+static unsigned int testRandomReadIOPS(
+	uintptr_t h, const FileEnumeration *fe, uint8_t **buffer, int queueDepth, int testSecond
+){
+	const uint64_t partitionSize = fe->diskPartition.sectorCount * fe->diskPartition.sectorSize;
+	const uint64_t partitionBase = fe->diskPartition.startLBA * fe->diskPartition.sectorSize;
+	assert(partitionSize >= PAGE_SIZE);
+	uintptr_t io[IOPS_TEST_MAX_DEPTH];
+	uint32_t random = 12345;
+	int i;
+	uint64_t t0 = systemCall_getTime(), t1;
+	while((t1 = systemCall_getTime()) == t0);
+	for(i = 0; i < queueDepth; i++){
+		random = random * 1103515245 + 12345;
+		io[i] = systemCall_seekReadFile(h, buffer[i], partitionBase + (random % (partitionSize / PAGE_SIZE)) * PAGE_SIZE, PAGE_SIZE);
+		assert(io[i] != IO_REQUEST_FAILURE);
+	}
+	unsigned int count = 0;
+	while(1){
+		uintptr_t readSize;
+		uintptr_t r = systemCall_waitIOReturn(UINTPTR_NULL, 1, &readSize);
+		assert(r != IO_REQUEST_FAILURE && readSize == PAGE_SIZE);
+		count++;
+		for(i = 0; i < queueDepth && io[i] != r; i++);
+		assert(i < queueDepth);
+		if(systemCall_getTime() - t1 >= (uint64_t)testSecond){
+			io[i] = IO_REQUEST_FAILURE;
+			break;
+		}
+		random = random * 1103515245 + 12345;
+		io[i] = systemCall_seekReadFile(h, buffer[i], partitionBase + (random % (partitionSize / PAGE_SIZE)) * PAGE_SIZE, PAGE_SIZE);
+		assert(io[i] != IO_REQUEST_FAILURE);
+	}
+	for(i = 0; i < queueDepth; i++){
+		if(io[i] == IO_REQUEST_FAILURE){
+			continue;
+		}
+		uintptr_t readSize;
+		uintptr_t r = systemCall_waitIOReturn(io[i], 1, &readSize);
+		assert(r == io[i]);
+	}
+	return count / testSecond;
+}
+
+static void sumVirtioBlockCounts(uint32_t *commandCount, uint32_t *notifyCount, uint32_t *interruptCount){
+	VirtioBlockManager *vm = &virtioBlockManager;
+	*commandCount = 0;
+	*notifyCount = 0;
+	*interruptCount = 0;
+	acquireLock(&vm->lock);
+	VirtioBlockDevice *d;
+	for(d = vm->deviceList; d != NULL; d = d->next){
+		acquireLock(&d->lock);
+		*commandCount += d->commandCount;
+		*notifyCount += d->notifyCount;
+		*interruptCount += d->interruptCount;
+		releaseLock(&d->lock);
+	}
+	releaseLock(&vm->lock);
+}
+
+// compare with AHCI if an AHCI disk has a FAT32 partition
+// run QEMU with -drive if=virtio,... and -drive if=none,id=d -device ahci -device ide-hd,drive=d
+void testVirtioBlock(void);
+void testVirtioBlock(void){
+	const int testSecond = 3, depth[] = {1, 4, 16};
+	const char *driverName[] = {"virtio", "ahci"};
+	printk("test virtio block...\n");
+	int ok = waitForFirstResource("virtio", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	uint8_t *buffer[IOPS_TEST_MAX_DEPTH];
+	int i, j;
+	for(i = 0; i < IOPS_TEST_MAX_DEPTH; i++){
+		buffer[i] = systemCall_allocateHeap(PAGE_SIZE, USER_WRITABLE_PAGE);
+		assert(buffer[i] != NULL);
+	}
+	for(i = 0; i < (int)LENGTH_OF(driverName); i++){
+		FileEnumeration fe;
+		if(findPartitionByDriver(driverName[i], &fe) == 0){
+			printk("no FAT32 partition on %s disks\n", driverName[i]);
+			continue;
+		}
+		OpenFileMode ofm = OPEN_FILE_MODE_0;
+		uintptr_t h = syncOpenFileN(fe.name, fe.nameLength, ofm);
+		assert(h != IO_REQUEST_FAILURE);
+		// the first sector of the partition
+		uintptr_t bs = VIRTIO_BLOCK_SECTOR_SIZE;
+		uintptr_t r = syncSeekReadFile(h, buffer[0], fe.diskPartition.startLBA * fe.diskPartition.sectorSize, &bs);
+		assert(r == h && bs == VIRTIO_BLOCK_SECTOR_SIZE);
+		assert(buffer[0][510] == 0x55 && buffer[0][511] == 0xaa);
+		for(j = 0; j < (int)LENGTH_OF(depth); j++){
+			uint32_t command0, notify0, interrupt0, command1, notify1, interrupt1;
+			sumVirtioBlockCounts(&command0, &notify0, &interrupt0);
+			unsigned int iops = testRandomReadIOPS(h, &fe, buffer, depth[j], testSecond);
+			sumVirtioBlockCounts(&command1, &notify1, &interrupt1);
+			printk("%s depth %d: %u IOPS\n", driverName[i], depth[j], iops);
+			if(command1 != command0){
+				printk("    %u notifications and %u interrupts per 100 commands\n",
+					(notify1 - notify0) * 100 / (command1 - command0),
+					(interrupt1 - interrupt0) * 100 / (command1 - command0));
+			}
+		}
+		r = syncCloseFile(h);
+		assert(r == h);
+	}
+	for(i = 0; i < IOPS_TEST_MAX_DEPTH; i++){
+		uintptr_t r = systemCall_releaseHeap(buffer[i]);
+		assert(r);
+	}
+	printk("test virtio block ok\n");
+	systemCall_terminate();
+}
+
+#undef IOPS_TEST_MAX_DEPTH
+
+#endif
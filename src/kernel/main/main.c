@@ -18,6 +18,7 @@ SystemGlobal global;
 static void builtInService(void){
 	initKernelFile();
 	initFIFOFile();
+	initMemoryInfoFile();
 	systemCall_terminate();
 }
 
@@ -29,6 +30,8 @@ static void initService(void){
 		kernelConsoleService,
 		pciDriver,
 		ahciDriver,
+		virtioBlockDriver,
+		//ramDiskDriver,
 		i8254xDriver,
 		fatService,
 		internetService,
@@ -36,9 +39,19 @@ static void initService(void){
 		//testResource,
 		//testKFS,
 		//testAHCI,
+		//testAHCIQueueDepth,
+		//testVirtioBlock,
+		//testRAMDisk,
 		//testPCI,
 		//testFAT,
+		//testFATAppend,
+		//testELFLoader,
+		//testMapFile,
+		//testFileHandle,
 		//testFIFOFile,
+		//testFIFOFileSpeed,
+		//testBuddySpeed,
+		//testMemoryCopySpeed,
 		//testI8254xTransmit2
 		//testI8254xTransmit,
 		//testI8254xReceive,
@@ -46,6 +59,7 @@ static void initService(void){
 		//testIPFileName,
 		//testTCPClient,
 		//testTCPServer,
+		//testUDPSpeed,
 		//testCountDays,
 		//testCreateThread,
 		//testTimer,
@@ -71,6 +85,7 @@ void c_entry(void){
 	if(isBSP){
 		// 1. memory
 		initKernelMemory();
+		initNonTemporalCopy();
 		// 2. printk
 		initKernelConsole();
 		//kprintf("available memory: %u KB\n", getUsableSize(page) / 1024);
@@ -111,6 +126,8 @@ void c_entry(void){
 	// 9. file
 	if(isBSP){
 		initFile(global.syscallTable);
+		initELFLoader();
+		initMappedFile(global.syscallTable);
 		initWaitableResource();
 	}
 	// 10. driver
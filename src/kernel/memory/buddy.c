@@ -88,16 +88,57 @@ size_t ceilAllocateOrder(size_t s){
 	return i;
 }
 
+// free lists, freeOrderMask and freeBitmap are updated together
+
+static int freeBitIndex(MemoryBlockManager *m, int index, size_t order){
+	const int o = order - MIN_BLOCK_ORDER;
+	assert(index % (1 << o) == 0);
+	return m->freeBitmapOffset[o] + (index >> o);
+}
+
+static void setFreeBit(MemoryBlockManager *m, int index, size_t order, int isFree){
+	if(m->freeBitmap == NULL){
+		return;
+	}
+	const int i = freeBitIndex(m, index, order);
+	if(isFree){
+		m->freeBitmap[i / 32] |= (((uint32_t)1) << (i % 32));
+	}
+	else{
+		m->freeBitmap[i / 32] &= ~(((uint32_t)1) << (i % 32));
+	}
+}
+
+static int isFreeBitSet(MemoryBlockManager *m, int index, size_t order){
+	const int i = freeBitIndex(m, index, order);
+	return (m->freeBitmap[i / 32] >> (i % 32)) & 1;
+}
+
+static void addFreeBlock(MemoryBlockManager *m, MemoryBlock *b, int index){
+	const int o = b->sizeOrder - MIN_BLOCK_ORDER;
+	ADD_TO_DQUEUE(b, &m->freeBlock[o]);
+	m->freeOrderMask |= (((uint32_t)1) << o);
+	setFreeBit(m, index, b->sizeOrder, 1);
+}
+
+static void removeFreeBlock(MemoryBlockManager *m, MemoryBlock *b, int index){
+	const int o = b->sizeOrder - MIN_BLOCK_ORDER;
+	REMOVE_FROM_DQUEUE(b);
+	if(m->freeBlock[o] == NULL){
+		m->freeOrderMask &= ~(((uint32_t)1) << o);
+	}
+	setFreeBit(m, index, b->sizeOrder, 0);
+}
+
 static MemoryBlock *findFreeBlock(MemoryBlockManager *m, size_t minOrder){
-	size_t o;
-	for(o = minOrder; 1; o++){
-		if(o > MAX_BLOCK_ORDER){
-			return NULL;
-		}
-		if(m->freeBlock[o - MIN_BLOCK_ORDER] != NULL){
-			return m->freeBlock[o - MIN_BLOCK_ORDER];
-		}
+	assert(minOrder >= MIN_BLOCK_ORDER && minOrder <= MAX_BLOCK_ORDER);
+	const uint32_t mask = (m->freeOrderMask >> (minOrder - MIN_BLOCK_ORDER));
+	if(mask == 0){
+		return NULL;
 	}
+	const size_t o = minOrder + bsf32(mask);
+	assert(m->freeBlock[o - MIN_BLOCK_ORDER] != NULL);
+	return m->freeBlock[o - MIN_BLOCK_ORDER];
 }
 
 int isAddressInRange(MemoryBlockManager *m, uintptr_t address){
@@ -132,16 +173,18 @@ MemoryBlock *allocateBlock_noLock(MemoryBlockManager *m, size_t size, size_t spl
 	const int splitBlockCount = DIV_CEIL(size, splitSize);
 	int s;
 	for(s = 0; s < splitBlockCount; s++){
-		MemoryBlock *const b = indexToBlock(m, blockBegin + s * (splitSize / MIN_BLOCK_SIZE));
+		const int i = blockBegin + s * (splitSize / MIN_BLOCK_SIZE);
+		MemoryBlock *const b = indexToBlock(m, i);
 		assert(IS_IN_DQUEUE(b));
-		REMOVE_FROM_DQUEUE(b);
+		removeFreeBlock(m, b, i);
 		while(b->sizeOrder != so){
 			// split b and get buddy
 			b->sizeOrder--;
-			MemoryBlock *b2 = getBuddy(m, b);
-			assert(b2 != NULL && ((uintptr_t)b2) > ((uintptr_t)b));
+			const int i2 = i + (1 << (b->sizeOrder - MIN_BLOCK_ORDER));
+			MemoryBlock *b2 = indexToBlock(m, i2);
+			assert(b2 == getBuddy(m, b) && ((uintptr_t)b2) > ((uintptr_t)b));
 			assert(IS_IN_DQUEUE(b2) == 0 && b2->sizeOrder == b->sizeOrder);
-			ADD_TO_DQUEUE(b2, &m->freeBlock[b2->sizeOrder - MIN_BLOCK_ORDER]);
+			addFreeBlock(m, b2, i2);
 		}
 	}
 	m->freeSize -= splitBlockCount * splitSize;
@@ -151,31 +194,66 @@ MemoryBlock *allocateBlock_noLock(MemoryBlockManager *m, size_t size, size_t spl
 void releaseBlock_noLock(MemoryBlockManager *m, MemoryBlock *b){
 	m->freeSize += (1 << b->sizeOrder);
 	assert(IS_IN_DQUEUE(b) == 0);
+	int index = blockToIndex(m, b);
 	while(b->sizeOrder < MAX_BLOCK_ORDER){
-		MemoryBlock *buddy = getBuddy(m, b);
-		if(buddy == NULL)
-			break;
-		assert(buddy->sizeOrder <= b->sizeOrder);
-		if(IS_IN_DQUEUE(buddy) == 0 /*not free*/|| buddy->sizeOrder != b->sizeOrder/*partial free*/){
+		const int buddyIndex = (index ^ (1 << (b->sizeOrder - MIN_BLOCK_ORDER)));
+		if(buddyIndex >= m->blockCount)
 			break;
+		MemoryBlock *buddy;
+		if(m->freeBitmap != NULL){
+			// the buddy struct is not read unless it is going to be merged
+			if(isFreeBitSet(m, buddyIndex, b->sizeOrder) == 0){
+				break;
+			}
+			buddy = indexToBlock(m, buddyIndex);
+			assert(IS_IN_DQUEUE(buddy) && buddy->sizeOrder == b->sizeOrder);
+		}
+		else{
+			buddy = indexToBlock(m, buddyIndex);
+			assert(buddy->sizeOrder <= b->sizeOrder);
+			if(IS_IN_DQUEUE(buddy) == 0 /*not free*/|| buddy->sizeOrder != b->sizeOrder/*partial free*/){
+				break;
+			}
 		}
 		// merge
 		//printk("%d %d\n",buddy->sizeOrder, b->sizeOrder);
-		REMOVE_FROM_DQUEUE(buddy);
+		removeFreeBlock(m, buddy, buddyIndex);
 #ifndef NDEBUG
 			uintptr_t a1 = blockToAddress(m, b), a2 = blockToAddress(m, buddy);
 			assert((a1 > a2? a1 - a2: a2 - a1) == (uintptr_t)(1 << b->sizeOrder));
 #endif
-		b = (((uintptr_t)b) < ((uintptr_t)buddy)? b: buddy);
+		if(buddyIndex < index){
+			b = buddy;
+			index = buddyIndex;
+		}
 		b->sizeOrder++;
 	}
-	ADD_TO_DQUEUE(b, &m->freeBlock[b->sizeOrder - MIN_BLOCK_ORDER]);
+	addFreeBlock(m, b, index);
 }
 
 size_t getFreeBlockSize(MemoryBlockManager *m){
 	return m->freeSize;
 }
 
+// a block is free if it is in freeBlock list; otherwise it is allocated
+void getMemoryBlockUsage_noLock(MemoryBlockManager *m, MemoryBlockUsage *u){
+	assert(isAcquirable(&m->lock) == 0);
+	MEMSET0(u);
+	int i = 0;
+	while(i < m->blockCount){
+		MemoryBlock *b = indexToBlock(m, i);
+		const int o = b->sizeOrder - MIN_BLOCK_ORDER;
+		assert(o >= 0 && o <= MAX_BLOCK_ORDER - MIN_BLOCK_ORDER && i % (1 << o) == 0);
+		if(IS_IN_DQUEUE(b)){
+			u->freeBlockCount[o]++;
+		}
+		else{
+			u->usedBlockCount[o]++;
+		}
+		i += (1 << o);
+	}
+}
+
 void resetBlockArray(MemoryBlockManager *bm, int initialBlockCount, InitMemoryBlockFunction initBlockFunc){
 	int i;
 	bm->blockCount = initialBlockCount;
@@ -186,6 +264,10 @@ void resetBlockArray(MemoryBlockManager *bm, int initialBlockCount, InitMemoryBl
 	for(i = 0; i <= MAX_BLOCK_ORDER - MIN_BLOCK_ORDER; i++){
 		bm->freeBlock[i] = NULL;
 	}
+	bm->freeOrderMask = 0;
+	if(bm->freeBitmap != NULL){
+		memset(bm->freeBitmap, 0, getFreeBitmapSize(bm));
+	}
 }
 
 static int evaluateBlockCount(uintptr_t beginAddr, uintptr_t endAddr){
@@ -206,9 +288,29 @@ void initMemoryBlockManager(
 	bm->blockStructSize = blockStructSize;
 	bm->blockStructOffset = blockStructOffset;
 	bm->beginAddress = beginAddr;
+	bm->freeBitmap = NULL;
 	resetBlockArray(bm, evaluateBlockCount(beginAddr, endAddr), initBlockFunc);
 }
 
+size_t getFreeBitmapSize(const MemoryBlockManager *bm){
+	int o, bitCount = 0;
+	for(o = 0; o <= MAX_BLOCK_ORDER - MIN_BLOCK_ORDER; o++){
+		bitCount += DIV_CEIL(bm->blockCount, 1 << o);
+	}
+	return DIV_CEIL(bitCount, 32) * sizeof(uint32_t);
+}
+
+void initFreeBitmap(MemoryBlockManager *bm){
+	assert(bm->freeOrderMask == 0 && bm->freeBitmap == NULL);
+	int o, bitCount = 0;
+	for(o = 0; o <= MAX_BLOCK_ORDER - MIN_BLOCK_ORDER; o++){
+		bm->freeBitmapOffset[o] = bitCount;
+		bitCount += DIV_CEIL(bm->blockCount, 1 << o);
+	}
+	bm->freeBitmap = (uint32_t*)CEIL((uintptr_t)indexToElement(bm, bm->blockCount), sizeof(uint32_t));
+	memset(bm->freeBitmap, 0, getFreeBitmapSize(bm));
+}
+
 uintptr_t evaluateMemoryBlockManagerEnd(
 	const MemoryBlockManager *bm,
 	size_t blockStructSize,
@@ -218,3 +320,83 @@ uintptr_t evaluateMemoryBlockManagerEnd(
 	// indexToElement
 	return ((uintptr_t)bm->blockArray) + blockStructSize * evaluateBlockCount(beginAddr, endAddr);
 }
+
+#ifndef NDEBUG
+
+#define BENCHMARK_SLOT_COUNT (128)
+
+int benchmarkBuddy(uintptr_t manageBase, size_t manageSize, int useFreeBitmap,
+	int minOrder, int maxOrder, int opCount){
+	assert(minOrder >= MIN_BLOCK_ORDER && minOrder <= maxOrder && maxOrder <= MAX_BLOCK_ORDER);
+	MemoryBlockManager *m = (MemoryBlockManager*)manageBase;
+	// less than 2 bits per block in bitmap
+	const int blockCount = (manageSize - sizeof(*m)) / (sizeof(MemoryBlock) + 1);
+	initMemoryBlockManager(m, sizeof(MemoryBlock), 0, 0, blockCount * MIN_BLOCK_SIZE, (InitMemoryBlockFunction)initMemoryBlock);
+	if(useFreeBitmap){
+		initFreeBitmap(m);
+		assert(((uintptr_t)m->freeBitmap) + getFreeBitmapSize(m) <= manageBase + manageSize);
+	}
+	MemoryBlock *slot[BENCHMARK_SLOT_COUNT];
+	int i, failCount = 0;
+	uint32_t r = 1;
+	acquireLock(&m->lock);
+	for(i = 0; i < blockCount; i++){
+		releaseBlock_noLock(m, indexToBlock(m, i));
+	}
+	releaseLock(&m->lock);
+	for(i = 0; i < BENCHMARK_SLOT_COUNT; i++){
+		slot[i] = NULL;
+	}
+	for(i = 0; i < opCount; i++){
+		r = r * 1103515245 + 12345;
+		MemoryBlock **s = &slot[(r >> 8) % BENCHMARK_SLOT_COUNT];
+		acquireLock(&m->lock);
+		if(*s != NULL){
+			releaseBlock_noLock(m, *s);
+			*s = NULL;
+		}
+		else{
+			const size_t size = (1 << (minOrder + (r >> 20) % (maxOrder - minOrder + 1)));
+			*s = allocateBlock_noLock(m, size, size);
+			failCount += (*s == NULL);
+		}
+		releaseLock(&m->lock);
+	}
+	acquireLock(&m->lock);
+	for(i = 0; i < BENCHMARK_SLOT_COUNT; i++){
+		if(slot[i] != NULL){
+			releaseBlock_noLock(m, slot[i]);
+		}
+	}
+	assert(m->freeSize == (size_t)blockCount * MIN_BLOCK_SIZE);
+	releaseLock(&m->lock);
+	return failCount;
+}
+
+void testBuddySpeed(void);
+void testBuddySpeed(void){
+	const size_t manageSize = 64 * 1024;
+	const int opCount = 100000;
+	const unsigned testSecond = 3;
+	uint8_t *manageBuffer = allocateKernelMemory(manageSize);
+	assert(manageBuffer != NULL);
+	int useFreeBitmap;
+	for(useFreeBitmap = 0; useFreeBitmap < 2; useFreeBitmap++){
+		unsigned count = 0;
+		int failCount = 0;
+		uint64_t beginSecond = systemCall_getTime();
+		while(systemCall_getTime() == beginSecond);
+		beginSecond++;
+		while(systemCall_getTime() < beginSecond + testSecond){
+			failCount += benchmarkBuddy((uintptr_t)manageBuffer, manageSize, useFreeBitmap,
+				MIN_BLOCK_ORDER, MIN_BLOCK_ORDER + 8, opCount);
+			count++;
+		}
+		printk("buddy %s free bitmap: %u operations/s, %d failed\n",
+			(useFreeBitmap? "with": "without"), count * opCount / testSecond, failCount);
+	}
+	releaseKernelMemory(manageBuffer);
+	systemCall_terminate();
+}
+
+#endif
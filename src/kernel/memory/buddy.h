@@ -17,7 +17,13 @@ typedef struct MemoryBlockManager{
 	size_t blockStructOffset;
 	int blockCount;
 	size_t freeSize;
+	// bit (o - MIN_BLOCK_ORDER) is set if freeBlock[o - MIN_BLOCK_ORDER] is not empty
+	uint32_t freeOrderMask;
 	MemoryBlock *freeBlock[MAX_BLOCK_ORDER - MIN_BLOCK_ORDER + 1];
+	// optional. for each order, 1 bit per block head; set if the head is in freeBlock list of that order
+	// so that releaseBlock_noLock does not read the buddy struct before merging
+	uint32_t *freeBitmap;
+	int freeBitmapOffset[MAX_BLOCK_ORDER - MIN_BLOCK_ORDER + 1];
 
 	uint8_t blockArray[0];
 }MemoryBlockManager;
@@ -38,6 +44,7 @@ MemoryBlock *getBuddy(MemoryBlockManager *m, const MemoryBlock *b);
 size_t ceilAllocateOrder(size_t s);
 
 size_t getFreeBlockSize(MemoryBlockManager *m);
+void getMemoryBlockUsage_noLock(MemoryBlockManager *m, MemoryBlockUsage *u);
 int isAddressInRange(MemoryBlockManager *m, uintptr_t address);
 
 // return NULL if fail
@@ -57,9 +64,22 @@ void initMemoryBlockManager(
 	InitMemoryBlockFunction initBlockFunc
 );
 
+// the bitmap is placed right after the block array
+// call after initMemoryBlockManager and before any block is released
+// the block count must not change after this
+void initFreeBitmap(MemoryBlockManager *bm);
+size_t getFreeBitmapSize(const MemoryBlockManager *bm);
+
 uintptr_t evaluateMemoryBlockManagerEnd(
 	const MemoryBlockManager *bm,
 	size_t blockStructSize,
 	uintptr_t beginAddr,
 	uintptr_t endAddr
 );
+
+#ifndef NDEBUG
+// run opCount random allocate/release of orders in [minOrder, maxOrder] on a manager placed at manageBase
+// return the number of failed allocations
+int benchmarkBuddy(uintptr_t manageBase, size_t manageSize, int useFreeBitmap,
+	int minOrder, int maxOrder, int opCount);
+#endif
@@ -85,6 +85,12 @@ size_t getFreeLinearBlockSize(LinearMemoryBlockManager *m){
 	return m->b.freeSize;
 }
 
+void getLinearBlockUsage(LinearMemoryBlockManager *m, MemoryBlockUsage *u){
+	acquireLock(&m->b.lock);
+	getMemoryBlockUsage_noLock(&m->b, u);
+	releaseLock(&m->b.lock);
+}
+
 static int getExtendBlockCount(LinearMemoryBlockManager *m, size_t size){
 	assert(isAcquirable(&m->b.lock) == 0);
 	size_t i = ceilAllocateOrder(size);
@@ -100,9 +106,8 @@ static int getExtendBlockCount(LinearMemoryBlockManager *m, size_t size){
 	return newBlockCount - m->b.blockCount;
 }
 
-// if MEMORY_RELEASING or MEMORY_FREE, return 0
-// if MEMORY_USING, return 1
-static int isUsingBlock_noLock(LinearMemoryBlockManager *m, uintptr_t address){
+// return the block covering address
+static LinearMemoryBlock *coveringBlock_noLock(LinearMemoryBlockManager *m, uintptr_t address){
 	MemoryBlock *b1, *b2;
 	b1 = addressToBlock(&m->b, address);
 	while(1){
@@ -114,7 +119,13 @@ static int isUsingBlock_noLock(LinearMemoryBlockManager *m, uintptr_t address){
 		assert(b2 < b1);
 		b1 = b2;
 	}
-	return (((LinearMemoryBlock*)blockToElement(&m->b, b1))->status == MEMORY_USING);
+	return blockToElement(&m->b, b1);
+}
+
+// if MEMORY_RELEASING or MEMORY_FREE, return 0
+// if MEMORY_USING, return 1
+static int isUsingBlock_noLock(LinearMemoryBlockManager *m, uintptr_t address){
+	return coveringBlock_noLock(m, address)->status == MEMORY_USING;
 }
 
 // return whether a block is a valid argument of releaseBlock
@@ -247,7 +258,13 @@ int checkAndReleaseLinearBlock(LinearMemoryManager *m, uintptr_t linearAddress){
 	lmb->status = MEMORY_LOCKED;
 	releaseLock(&bm->b.lock);
 
-	_unmapPage(m->page, m->physical, (void*)linearAddress, s);
+	if(s == 0){
+		// see isUnmappedBlock_noLock
+		_unmapPresentPage(m->page, m->physical, (void*)linearAddress, (1 << lmb->block.sizeOrder));
+	}
+	else{
+		_unmapPage(m->page, m->physical, (void*)linearAddress, s);
+	}
 
 	acquireLock(&bm->b.lock);
 	assert(lmb->status == MEMORY_LOCKED);
@@ -281,6 +298,69 @@ void releaseAllLinearBlocks(LinearMemoryManager *m){
 	resetBlockArray(&bm->b, bm->initialBlockCount, initLinearMemoryBlock);
 }
 
+// demand paging
+// the pages of a block with mappedSize == 0 are mapped one by one in mapUnmappedLinearBlock,
+// so whether a page is mapped is decided by its PTE
+// releasing the block unmaps the present pages only
+static int isUnmappedBlock_noLock(LinearMemoryManager *m, uintptr_t address){
+	LinearMemoryBlockManager *bm = m->linear;
+	if(isAddressInRange(&bm->b, address) == 0)
+		return 0;
+	LinearMemoryBlock *lmb = coveringBlock_noLock(bm, address);
+	if(lmb->status != MEMORY_USING || lmb->mappedSize != 0)
+		return 0;
+	return _isPagePresent(m->page, FLOOR(address, PAGE_SIZE)) == 0;
+}
+
+void setUnmappedLinearBlock(LinearMemoryBlockManager *bm, uintptr_t address){
+	acquireLock(&bm->b.lock);
+	LinearMemoryBlock *lmb = addressToElement(&bm->b, address);
+	assert(lmb->status == MEMORY_USING && lmb->mappedSize == PAGE_SIZE &&
+		(1 << lmb->block.sizeOrder) == PAGE_SIZE);
+	lmb->mappedSize = 0;
+	releaseLock(&bm->b.lock);
+}
+
+uintptr_t allocateUnmappedLinearBlock(LinearMemoryManager *m, size_t size){
+	LinearMemoryBlockManager *bm = m->linear;
+	uintptr_t linearAddress = allocateLinearBlock(m, size);
+	if(linearAddress == INVALID_PAGE_ADDRESS)
+		return linearAddress;
+	acquireLock(&bm->b.lock);
+	LinearMemoryBlock *lmb = addressToElement(&bm->b, linearAddress);
+	assert(lmb->status == MEMORY_LOCKED);
+	lmb->mappedSize = 0;
+	lmb->status = MEMORY_USING;
+	releaseLock(&bm->b.lock);
+	return linearAddress;
+}
+
+int isUnmappedLinearBlock(LinearMemoryManager *m, uintptr_t address){
+	LinearMemoryBlockManager *bm = m->linear;
+	acquireLock(&bm->b.lock);
+	int r = isUnmappedBlock_noLock(m, address);
+	releaseLock(&bm->b.lock);
+	return r;
+}
+
+int mapUnmappedLinearBlock(
+	LinearMemoryManager *m, uintptr_t address,
+	PhysicalAddress physicalAddress, PageAttribute attribute
+){
+	LinearMemoryBlockManager *bm = m->linear;
+	int r;
+	acquireLock(&bm->b.lock);
+	r = isUnmappedBlock_noLock(m, address);
+	if(r == 0){
+		goto map_return;
+	}
+	// _mapPage_LP does not unmap anything if it fails on the first page
+	r = _mapPage_LP(m->page, m->physical, (void*)FLOOR(address, PAGE_SIZE), physicalAddress, PAGE_SIZE, attribute);
+	map_return:
+	releaseLock(&bm->b.lock);
+	return r;
+}
+
 static PhysicalAddress checkAndTranslateBlock(
 	LinearMemoryManager *m, uintptr_t linearAddress,
 	PageAttribute hasAttribute, int doReserve
@@ -295,8 +375,13 @@ static PhysicalAddress checkAndTranslateBlock(
 		goto translate_return;
 	if(isUsingBlock_noLock(bm, linearAddress) == 0)
 		goto translate_return;
+	// not mapped yet, see mapUnmappedLinearBlock
+	if(isUnmappedBlock_noLock(m, linearAddress))
+		goto translate_return;
 	p = _translatePage(m->page, linearAddress, hasAttribute);
-	assert(p.value != INVALID_PAGE_ADDRESS);
+	// the page is mapped without hasAttribute, e.g., a read-only user page as a write target
+	if(p.value == INVALID_PAGE_ADDRESS)
+		goto translate_return;
 	if(doReserve){
 		int ok = addPhysicalBlockReference(m->physical, p.value);
 		assert(ok);
@@ -7,9 +7,9 @@
 // physical
 typedef struct PhysicalMemoryBlockManager PhysicalMemoryBlockManager;
 
-// return free size
-//size_t physicalMemoryUsage(size_t *totalSize);
-//size_t getKernelMemoryUsage(size_t *totalSize);
+// print buddy usage of physical and kernel linear memory, and kernel slab usage
+// return printed length
+uintptr_t printKernelMemoryUsage(char *buffer, uintptr_t bufferSize);
 
 // page
 #define PAGE_SIZE (4096)
@@ -29,6 +29,8 @@ void releaseInvalidatedPageTable(PageManager *deletePage);
 void releasePageTable(PageManager *deletePage);
 
 uint32_t toCR3(PageManager *p);
+// number of present pages in user space (or kernel space if p is kernelPageManager)
+uintptr_t getPresentPageCount(PageManager *p);
 
 int _mapPage_L(
 	PageManager *p, PhysicalMemoryBlockManager *physical,
@@ -100,7 +102,9 @@ typedef struct{
 
 // reserve multiple physical pages
 // the returned data structure is in kernel space
-PhysicalAddressArray *checkAndReservePages(LinearMemoryManager *lm, const void *linearAddress, uintptr_t size);
+PhysicalAddressArray *checkAndReservePages(
+	LinearMemoryManager *lm, const void *linearAddress, uintptr_t size, PageAttribute hasAttribute
+);
 void deletePhysicalAddressArray(/*PhysicalMemoryBlockManager *physical, */PhysicalAddressArray *pa);
 // call unmapPages to release
 void *mapReservedPages(LinearMemoryManager *lm, const PhysicalAddressArray*pa, PageAttribute attribute);
@@ -4,6 +4,20 @@
 #include<std.h>
 #include"memory.h"
 
+// 4K~1G
+// block is always aligned to MIN_BLOCK_SIZE
+#define MIN_BLOCK_ORDER (12)
+#define MIN_BLOCK_SIZE (1<<MIN_BLOCK_ORDER)
+#define MAX_BLOCK_ORDER (30)
+#define MAX_BLOCK_SIZE (1<<MAX_BLOCK_ORDER)
+
+// buddy.c
+// number of blocks of each order
+typedef struct{
+	uintptr_t freeBlockCount[MAX_BLOCK_ORDER - MIN_BLOCK_ORDER + 1];
+	uintptr_t usedBlockCount[MAX_BLOCK_ORDER - MIN_BLOCK_ORDER + 1];
+}MemoryBlockUsage;
+
 // physicalblock.c
 typedef struct PhysicalMemoryBlockManager PhysicalMemoryBlockManager;
 
@@ -17,6 +31,7 @@ PhysicalMemoryBlockManager *createPhysicalMemoryBlockManager(
 size_t getPhysicalBlockManagerSize(PhysicalMemoryBlockManager *m);
 int getPhysicalBlockCount(PhysicalMemoryBlockManager *m);
 size_t getFreePhysicalBlockSize(PhysicalMemoryBlockManager *m);
+void getPhysicalBlockUsage(PhysicalMemoryBlockManager *m, MemoryBlockUsage *u);
 
 // change reference count from 0 to 1
 uintptr_t allocatePhysicalBlock(PhysicalMemoryBlockManager *m, size_t size, size_t splitSize);
@@ -47,6 +62,7 @@ extern const size_t maxLinearBlockManagerSize;
 size_t getMaxLinearBlockManagerSize(LinearMemoryBlockManager *m);
 int getMaxBlockCount(LinearMemoryBlockManager *m);
 size_t getFreeLinearBlockSize(LinearMemoryBlockManager *m);
+void getLinearBlockUsage(LinearMemoryBlockManager *m, MemoryBlockUsage *u);
 
 size_t getAllocatedBlockSize(LinearMemoryBlockManager *m, uintptr_t address);
 // release linear blocks only
@@ -58,27 +74,38 @@ void commitAllocatingLinearBlock(LinearMemoryManager *m, uintptr_t linearAddress
 // release linear blocks, pages, and physical blocks
 int checkAndReleaseLinearBlock(LinearMemoryManager *m, uintptr_t linearAddress);
 void releaseAllLinearBlocks(LinearMemoryManager *m);
-
-// 4K~1G
-// block is always aligned to MIN_BLOCK_SIZE
-#define MIN_BLOCK_ORDER (12)
-#define MIN_BLOCK_SIZE (1<<MIN_BLOCK_ORDER)
-#define MAX_BLOCK_ORDER (30)
-#define MAX_BLOCK_SIZE (1<<MAX_BLOCK_ORDER)
+// demand paging: keep an initial block of one page but unmap its page (mappedSize = 0)
+void setUnmappedLinearBlock(LinearMemoryBlockManager *m, uintptr_t address);
+// allocate a block whose pages are all unmapped
+uintptr_t allocateUnmappedLinearBlock(LinearMemoryManager *m, size_t size);
+// return 1 if address is in a block of demand paging and its page is not present
+int isUnmappedLinearBlock(LinearMemoryManager *m, uintptr_t address);
+// return 1 if the page is unmapped and mapped successfully
+// return 0 if failed or the block has been mapped by another task
+int mapUnmappedLinearBlock(
+	LinearMemoryManager *m, uintptr_t address,
+	PhysicalAddress physicalAddress, PageAttribute attribute
+);
 
 // page.c
 PageManager *initKernelPageTable(uintptr_t manageBase, uintptr_t *manageBegin, uintptr_t manageEnd);
 
 PhysicalAddress _translatePage(PageManager *p, uintptr_t linearAddress, PageAttribute hasAtribute);
+int _isPagePresent(PageManager *p, uintptr_t linearAddress);
+void _unmapPresentPage(PageManager *p, PhysicalMemoryBlockManager *physical, void *linearAddress, size_t size);
 
 // linear + physical + page
 struct LinearMemoryManager{
 	PhysicalMemoryBlockManager *physical;
 	LinearMemoryBlockManager *linear;
 	PageManager *page;
+	// see mappedfile.c
+	struct FileMapping *fileMappingList;
 };
 
 // slab.c (linear memory)
 SlabManager *createKernelSlabManager(void);
+// return printed length
+uintptr_t printSlabUsage(SlabManager *m, char *buffer, uintptr_t bufferSize);
 
 #endif
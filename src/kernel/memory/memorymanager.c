@@ -165,16 +165,17 @@ void releaseReservedPage(LinearMemoryManager *m, PhysicalAddress physicalAddress
 	releasePhysicalBlock(m->physical, physicalAddress.value);
 }
 
-/* unused functions
 static void _deleteBufferPhysicalAddressArray(PhysicalAddressArray *pa, uintptr_t paLength){
 	while(paLength != 0){
 		paLength--;
-		_releasePhysicalPages(pa->physicalManager, pa->address[paLength]);
+		releasePhysicalBlock(pa->physicalManager, pa->address[paLength].value);
 	}
-	DELETE(pa);
+	releaseKernelMemory(pa);
 }
 
-PhysicalAddressArray *checkAndReservePages(LinearMemoryManager *lm, const void *linearAddress, uintptr_t size){
+PhysicalAddressArray *checkAndReservePages(
+	LinearMemoryManager *lm, const void *linearAddress, uintptr_t size, PageAttribute hasAttribute
+){
 	EXPECT(((uintptr_t)linearAddress) % PAGE_SIZE == 0 && size % PAGE_SIZE == 0);
 	const uintptr_t pageLength = (size) / PAGE_SIZE;
 	PhysicalAddressArray *pa = allocateKernelMemory(sizeof(*pa) + sizeof(pa->address[0]) * pageLength);
@@ -183,8 +184,7 @@ PhysicalAddressArray *checkAndReservePages(LinearMemoryManager *lm, const void *
 	pa->physicalManager = lm->physical;
 	uintptr_t a = 0;
 	for(a = 0; a < pageLength; a++){
-		// TODO: attribute
-		pa->address[a] = checkAndReservePage(lm, (void*)(((uintptr_t)linearAddress) + a * PAGE_SIZE), 0);
+		pa->address[a] = checkAndReservePage(lm, (void*)(((uintptr_t)linearAddress) + a * PAGE_SIZE), hasAttribute);
 		if(pa->address[a].value == INVALID_PAGE_ADDRESS)
 			break;
 	}
@@ -202,6 +202,7 @@ void deletePhysicalAddressArray(PhysicalAddressArray *pa){
 	_deleteBufferPhysicalAddressArray(pa, pa->length);
 }
 
+/* unused functions
 void *mapReservedPages(LinearMemoryManager *lm, const PhysicalAddressArray *pa, PageAttribute attribute){
 	size_t l_size = PAGE_SIZE * pa->length;
 	uintptr_t linearAddress = allocateLinearBlock(lm, &l_size);
@@ -269,10 +270,43 @@ int checkAndReleasePages(LinearMemoryManager *m, void *linearAddress){
 	return checkAndReleaseLinearBlock(m, (uintptr_t)linearAddress);
 }
 
-/*
-size_t getKernelMemoryUsage(){
+// memory usage
+
+// print free and used size of each order in KB
+static uintptr_t printBlockUsage(const char *name, const MemoryBlockUsage *u, char *buffer, uintptr_t bufferSize){
+	uintptr_t printCount = 0, freeKB = 0, maxFreeKB = 0;
+	int o;
+	for(o = MIN_BLOCK_ORDER; o <= MAX_BLOCK_ORDER; o++){
+		const uintptr_t f = u->freeBlockCount[o - MIN_BLOCK_ORDER], n = u->usedBlockCount[o - MIN_BLOCK_ORDER];
+		if(f == 0 && n == 0)
+			continue;
+		printCount += snprintf(buffer + printCount, bufferSize - printCount,
+			"%s order %d: free %u KB (%u blocks), used %u KB (%u blocks)\n",
+			name, o, f << (o - 10), f, n << (o - 10), n);
+		freeKB += (f << (o - 10));
+		if(f != 0){
+			maxFreeKB = (1 << (o - 10));
+		}
+	}
+	// 0 if all free memory is in the largest free block
+	// close to 100 if free memory is split into small blocks
+	uintptr_t fragmentation = (freeKB == 0? 0: 100 - maxFreeKB * 100 / freeKB);
+	printCount += snprintf(buffer + printCount, bufferSize - printCount,
+		"%s free %u KB, largest free block %u KB, fragmentation index %u%%\n",
+		name, freeKB, maxFreeKB, fragmentation);
+	return printCount;
+}
+
+uintptr_t printKernelMemoryUsage(char *buffer, uintptr_t bufferSize){
+	uintptr_t printCount = 0;
+	MemoryBlockUsage u;
+	getPhysicalBlockUsage(kernelLinear->physical, &u);
+	printCount += printBlockUsage("physical", &u, buffer + printCount, bufferSize - printCount);
+	getLinearBlockUsage(kernelLinear->linear, &u);
+	printCount += printBlockUsage("kernel linear", &u, buffer + printCount, bufferSize - printCount);
+	printCount += printSlabUsage(kernelSlab, buffer + printCount, bufferSize - printCount);
+	return printCount;
 }
-*/
 
 // initialize kernel MemoryBlockManager
 static int isUsableInAddressRange(
@@ -499,4 +533,80 @@ void testMemoryManager4(void){
 }
 
 #undef TEST_N
+
+enum CopyTestFunction{
+	TEST_BYTE_COPY,
+	TEST_MEMCPY,
+	TEST_MEMCPY_NON_TEMPORAL,
+	TEST_MEMSET,
+	TEST_MEMCMP,
+	COPY_TEST_FUNCTION_COUNT
+};
+
+static unsigned countCopyPerSecond(enum CopyTestFunction f, uint8_t *dst, uint8_t *src, size_t size, unsigned testSecond){
+	const unsigned batch = MAX(1, (64 * 1024) / size);
+	unsigned count = 0, i;
+	size_t j;
+	uint64_t beginSecond = systemCall_getTime();
+	while(systemCall_getTime() == beginSecond);
+	beginSecond++;
+	while(systemCall_getTime() < beginSecond + testSecond){
+		for(i = 0; i < batch; i++){
+			switch(f){
+			case TEST_BYTE_COPY:
+				for(j = 0; j < size; j++){
+					dst[j] = src[j];
+				}
+				break;
+			case TEST_MEMCPY:
+				memcpy(dst, src, size);
+				break;
+			case TEST_MEMCPY_NON_TEMPORAL:
+				memcpy_nonTemporal(dst, src, size);
+				break;
+			case TEST_MEMSET:
+				memset(dst, i, size);
+				break;
+			case TEST_MEMCMP:
+				if(memcmp(dst, src, size) != 0){
+					panic("memcmp test failed");
+				}
+				break;
+			default:
+				assert(0);
+			}
+		}
+		count += batch;
+	}
+	return count / testSecond;
+}
+
+void testMemoryCopySpeed(void);
+void testMemoryCopySpeed(void){
+	const char *const functionName[COPY_TEST_FUNCTION_COUNT] = {"byte loop", "memcpy", "non-temporal", "memset", "memcmp"};
+	const size_t testSize[] = {8, 64, 512, 4096, 64 * 1024, 1024 * 1024};
+	const size_t maxSize = testSize[LENGTH_OF(testSize) - 1];
+	const unsigned testSecond = 1;
+	uint8_t *src = allocateKernelMemory(maxSize), *dst = allocateKernelMemory(maxSize);
+	assert(src != NULL && dst != NULL);
+	size_t s;
+	unsigned t;
+	for(s = 0; s < maxSize; s++){
+		src[s] = (uint8_t)(s * 7);
+	}
+	for(t = 0; t < LENGTH_OF(testSize); t++){
+		s = testSize[t];
+		int f;
+		for(f = 0; f < COPY_TEST_FUNCTION_COUNT; f++){
+			// memcmp compares equal buffers to scan the whole size
+			memcpy(dst, src, s);
+			unsigned c = countCopyPerSecond(f, dst, src, s, testSecond);
+			printk("%s %u bytes: %u/s, %u KB/s\n", functionName[f], s, c, (unsigned)(((uint64_t)c) * s / 1024));
+		}
+	}
+	releaseKernelMemory(src);
+	releaseKernelMemory(dst);
+	systemCall_terminate();
+}
+
 #endif
@@ -212,6 +212,8 @@ struct PageManager{
 	PageTableSet *page;
 	const PageTableSet *pageInUserSpace;
 	Spinlock pdLock[NUMBER_OF_PAGE_LOCKS];
+	// see setPage & invalidatePage
+	volatile uint32_t presentPageCount;
 };
 
 PageManager *kernelPageManager = NULL;
@@ -225,10 +227,19 @@ uint32_t toCR3(PageManager *p){
 }
 
 
+uintptr_t getPresentPageCount(PageManager *p){
+	return p->presentPageCount;
+}
+
 int isKernelLinearAddress(uintptr_t address){
 	return address >= KERNEL_LINEAR_BEGIN && address < KERNEL_LINEAR_END;
 }
 
+// kernel pages are counted in kernelPageManager
+static volatile uint32_t *presentPageCountByLinearAddress(PageManager *p, uintptr_t linear){
+	return &(isKernelLinearAddress(linear)? kernelPageManager: p)->presentPageCount;
+}
+
 #define PD_INDEX_ADD_BASE(P, LINEAR) ((PD_INDEX(LINEAR) + (P)->pdIndexBase) & (PAGE_DIRECTORY_LENGTH - 1))
 
 static Spinlock *pdLockByLinearAddress(PageManager *p, uintptr_t linear){
@@ -263,6 +274,12 @@ static volatile PageTableEntry *pteByLinearAddress(PageTable *p, uintptr_t linea
 
 #undef PD_INDEX_ADD_BASE
 
+int _isPagePresent(PageManager *p, uintptr_t linearAddress){
+	if(isPDEPresent(pdeByLinearAddress(p, linearAddress)) == 0)
+		return 0;
+	return isPTEPresent(pteByLinearAddress(ptByLinearAddress(p, linearAddress), linearAddress));
+}
+
 // assume the arguments are valid
 PhysicalAddress _translatePage(PageManager *p, uintptr_t linearAddress, PageAttribute hasAttribute){
 	assert(isPDEPresent(pdeByLinearAddress(p, linearAddress)));
@@ -331,6 +348,7 @@ static int setPage(
 	volatile PageTableEntry *pte = pteByLinearAddress(pt_linear, linearAddress);
 	//assert(isPTEPresent(pte) == 0);
 	setPTE(pte, attribute, physicalAddress);
+	lock_add32(presentPageCountByLinearAddress(p, linearAddress), 1);
 	//assert(isPTEPresent(pte) == 1);
 	return 1;
 }
@@ -346,6 +364,7 @@ static void invalidatePage(
 	PageTable *pt_linear = ptByLinearAddress(p, linear);
 	assert(isPTEPresent(pt_linear->entry + i2));
 	invalidatePTE(pt_linear->entry + i2);
+	lock_add32(presentPageCountByLinearAddress(p, linear), (uint32_t)-1);
 	// invalidate PDE if the PD is empty
 	// releaseLock(lock);
 }
@@ -431,6 +450,7 @@ static void initPageManager(
 	for(i = 0; i < NUMBER_OF_PAGE_LOCKS; i++){
 		p->pdLock[i] = initialSpinlock;
 	}
+	p->presentPageCount = 0;
 	PageDirectory *kpd = &tables->pd;
 	MEMSET0(kpd);
 }
@@ -593,6 +613,16 @@ void _unmapPage(PageManager *p, PhysicalMemoryBlockManager *physical, void *line
 
 }
 
+// unmap the present pages only, for the blocks mapped on demand
+void _unmapPresentPage(PageManager *p, PhysicalMemoryBlockManager *physical, void *linearAddress, size_t size){
+	size_t s;
+	for(s = 0; s < size; s += PAGE_SIZE){
+		if(_isPagePresent(p, ((uintptr_t)linearAddress) + s)){
+			_unmapPage(p, physical, (void*)(((uintptr_t)linearAddress) + s), PAGE_SIZE);
+		}
+	}
+}
+
 // user page table
 
 const size_t sizeOfPageTableSet = sizeof(PageTableSet);
@@ -38,11 +38,12 @@ PhysicalMemoryBlockManager *createPhysicalMemoryBlockManager(
 	if(getPhysicalBlockManagerSize(pm) >= manageSize){
 		panic("cannot initialize physical memory manager");
 	}
+	initFreeBitmap(&pm->b);
 	return pm;
 }
 
 size_t getPhysicalBlockManagerSize(PhysicalMemoryBlockManager *m){
-	return sizeof(*m) + m->b.blockCount * m->b.blockStructSize;
+	return sizeof(*m) + m->b.blockCount * m->b.blockStructSize + getFreeBitmapSize(&m->b);
 }
 
 int getPhysicalBlockCount(PhysicalMemoryBlockManager *m){
@@ -53,6 +54,12 @@ size_t getFreePhysicalBlockSize(PhysicalMemoryBlockManager *m){
 	return m->b.freeSize;
 }
 
+void getPhysicalBlockUsage(PhysicalMemoryBlockManager *m, MemoryBlockUsage *u){
+	acquireLock(&m->b.lock);
+	getMemoryBlockUsage_noLock(&m->b, u);
+	releaseLock(&m->b.lock);
+}
+
 uintptr_t allocatePhysicalBlock(PhysicalMemoryBlockManager *m, size_t size, size_t splitSize){
 	acquireLock(&m->b.lock);
 	MemoryBlock *b = allocateBlock_noLock(&m->b, size, splitSize);
@@ -189,6 +189,31 @@ static SlabManager *createSlabManager(
 	return m;
 }
 
+uintptr_t printSlabUsage(SlabManager *m, char *buffer, uintptr_t bufferSize){
+	uintptr_t printCount = 0;
+	unsigned i;
+	for(i = 0; i < NUMBER_OF_SLAB_UNIT; i++){
+		uintptr_t slabCount = 0, usedUnitCount = 0;
+		Slab *p;
+		acquireLock(&m->lock);
+		for(p = m->usableSlab[i]; p != NULL; p = p->next){
+			slabCount++;
+			usedUnitCount += p->usedCount;
+		}
+		for(p = m->usedSlab[i]; p != NULL; p = p->next){
+			slabCount++;
+			usedUnitCount += p->usedCount;
+		}
+		releaseLock(&m->lock);
+		// see initSlab
+		const uintptr_t unitPerSlab = (SLAB_SIZE - sizeof(Slab)) / slabUnit[i];
+		printCount += snprintf(buffer + printCount, bufferSize - printCount,
+			"slab %u bytes: %u/%u objects in %u pages\n",
+			slabUnit[i], usedUnitCount, slabCount * unitPerSlab, slabCount * (SLAB_SIZE / PAGE_SIZE));
+	}
+	return printCount;
+}
+
 SlabManager *createKernelSlabManager(void){
 	return createSlabManager(allocateKernelPages, checkAndReleaseKernelPages, KERNEL_PAGE);
 }
@@ -6,6 +6,10 @@
 #include"io.h"
 #include"task/task.h"
 #include"multiprocessor/processorlocal.h"
+#include"multiprocessor/spinlock.h"
+#include"assembly/assembly.h"
+#include"resource/resource.h"
+#include"file/fileservice.h"
 
 typedef struct{
 	uint8_t magic[4]; // 0x7f, "ELF"
@@ -112,125 +116,580 @@ static int checkAllocateProgramHeader32(
 	return  *programBegin < *programEnd;
 }
 
-// no matter ok or not, the pages in range will wither be mapped or released
-static int mapAllocateProgramHeader32(
-	const ProgramHeader32 *programHeaderArray, int programHeaderCount,
+static const ProgramHeader32 *findProgramHeader32(
+	const ProgramHeader32 *programHeaderArray, int programHeaderCount, uintptr_t address
+){
+	int i;
+	for(i = 0; i < programHeaderCount; i++){
+		const ProgramHeader32 *ph = programHeaderArray + i;
+		if(ph->segmentType != 1)
+			continue;
+		const uintptr_t phBegin = FLOOR(ph->memoryAddress, ph->alignSize),
+			phEnd = CEIL(ph->memoryAddress + ph->memorySize, ph->alignSize);
+		if(address >= phBegin && address < phEnd)
+			return ph;
+	}
+	return NULL;
+}
+
+// return the number of bytes in the page at address which are initialized from the file
+// the other bytes are 0
+static uintptr_t pageFileRange(
+	const ProgramHeader32 *ph, uintptr_t address,
+	uintptr_t *pageOffset, uintptr_t *fileOffset
+){
+	const uintptr_t fileBegin = MAX(address, ph->memoryAddress),
+		fileEnd = MIN(address + PAGE_SIZE, ph->memoryAddress + ph->fileSize);
+	if(fileBegin >= fileEnd)
+		return 0;
+	*pageOffset = fileBegin - address;
+	*fileOffset = ph->offset + (fileBegin - ph->memoryAddress);
+	return fileEnd - fileBegin;
+}
+
+// ELFImage
+
+// the pages of an ELF file, shared by the tasks running it
+// read-only pages are mapped to tasks directly; writable pages are copied when the task touches them
+// if the file system provides FILE_PARAM_FILE_ID, the image is kept after the tasks terminate
+// and later tasks start from the image without opening the file
+struct ELFImage{
+	int referenceCount;
+	int hasFileID;
+	uint64_t fileID;
+	// 0 if the file may have changed. new tasks do not use the image
+	int isValid;
+	// 1 if notifyFileChange is called for fileID. protected by pageLock
+	// the pages not loaded yet would come from the new file, so the running tasks cannot load them
+	int isChanged;
+	uintptr_t entry;
+	uintptr_t programBegin, programEnd;
+	int programHeaderLength;
+	ProgramHeader32 *programHeader;
+	// initial content of every page in [programBegin, programEnd); NULL if not loaded
+	Spinlock pageLock;
+	void **page;
+	// global handle of the file for loading pages, or IO_REQUEST_FAILURE if not opened. protected by pageLock
+	// the kernel owns the handle, so the tasks cannot close it
+	uintptr_t file;
+	uintptr_t nameLength;
+	char *fileName;
+	struct ELFImage **prev, *next;
+};
+
+// number of cached images which are not used by any task
+#define MAX_UNUSED_ELF_IMAGE_COUNT (8)
+
+// the most recently used image is the first
+static Spinlock elfImageListLock = INITIAL_SPINLOCK;
+static ELFImage *elfImageList = NULL;
+
+// see testELFLoader
+static Spinlock elfStatisticsLock = INITIAL_SPINLOCK;
+typedef struct{
+	// from createUserTaskFromELF to switchToUserMode
+	uint64_t startCount, startCycles;
+	uint64_t faultCount, readPageCount, sharedImageCount, cachedImageCount;
+}ELFStatistics;
+static ELFStatistics elfStatistics = {0, 0, 0, 0, 0, 0};
+
+#define ADD_ELF_STATISTICS(FIELD, VALUE) do{\
+	acquireLock(&elfStatisticsLock);\
+	elfStatistics.FIELD += (VALUE);\
+	releaseLock(&elfStatisticsLock);\
+}while(0)
+
+static int isELFImageName(const ELFImage *image, const char *fileName, uintptr_t nameLength){
+	return image->nameLength == nameLength && strncmp(image->fileName, fileName, nameLength) == 0;
+}
+
+static int isSameELFImage_noLock(
+	const ELFImage *image, const char *fileName, uintptr_t nameLength,
+	int hasFileID, uint64_t fileID,
+	const ELFHeader32 *elfHeader, const ProgramHeader32 *programHeader
+){
+	return image->isValid &&
+		isELFImageName(image, fileName, nameLength) &&
+		image->hasFileID == hasFileID && (hasFileID == 0 || image->fileID == fileID) &&
+		image->entry == elfHeader->entry &&
+		image->programHeaderLength == elfHeader->programHeaderLength &&
+		memcmp(image->programHeader, programHeader,
+			elfHeader->programHeaderLength * sizeof(ProgramHeader32)) == 0;
+}
+
+static void deleteELFImage(ELFImage *image){
+	uintptr_t i;
+	for(i = 0; i < (image->programEnd - image->programBegin) / PAGE_SIZE; i++){
+		if(image->page[i] != NULL){
+			// the tasks mapping the page keep their own reference
+			checkAndReleaseKernelPages(image->page[i]);
+		}
+	}
+	if(image->file != IO_REQUEST_FAILURE && syncCloseFile(image->file) == IO_REQUEST_FAILURE){
+		printk("warning: cannot close ELF file\n");
+	}
+	DELETE(image->fileName);
+	DELETE(image->page);
+	DELETE(image->programHeader);
+	DELETE(image);
+}
+
+static void deleteELFImageList(ELFImage *image){
+	while(image != NULL){
+		ELFImage *next = image->next;
+		deleteELFImage(image);
+		image = next;
+	}
+}
+
+// remove the unused images which are invalid, not cachable, or least recently used
+// return the removed images linked by next
+static ELFImage *removeUnusedELFImages_noLock(void){
+	ELFImage *image = elfImageList, *removedList = NULL;
+	int unusedCount = 0;
+	while(image != NULL){
+		ELFImage *next = image->next;
+		if(image->referenceCount == 0){
+			if(image->isValid == 0 || image->hasFileID == 0 || unusedCount >= MAX_UNUSED_ELF_IMAGE_COUNT){
+				REMOVE_FROM_DQUEUE(image);
+				image->next = removedList;
+				removedList = image;
+			}
+			else{
+				unusedCount++;
+			}
+		}
+		image = next;
+	}
+	return removedList;
+}
+
+static ELFImage *createELFImage(
+	const char *fileName, uintptr_t nameLength,
+	int hasFileID, uint64_t fileID, int isValid,
+	const ELFHeader32 *elfHeader, ProgramHeader32 *programHeader,
 	uintptr_t programBegin, uintptr_t programEnd
 ){
-	int ok = 1;
-	LinearMemoryManager *taskMemory = getTaskLinearMemory(processorLocalTask());
-	uintptr_t address;
-	for(address = programBegin; address < programEnd; address += PAGE_SIZE){
-		// is address in range?
-		int j;
-		for(j = 0; j < programHeaderCount; j++){
-			const ProgramHeader32 *ph = programHeaderArray + j;
-			if(ph->segmentType != 1)
-				continue;
-			const uintptr_t phBegin = FLOOR(ph->memoryAddress, ph->alignSize),
-				phEnd = CEIL(ph->memoryAddress + ph->memorySize, ph->alignSize);
-			if(address >= phBegin && address < phEnd)
-				break;
+	ELFImage *NEW(image);
+	EXPECT(image != NULL);
+	const uintptr_t pageCount = (programEnd - programBegin) / PAGE_SIZE;
+	NEW_ARRAY(image->page, pageCount);
+	EXPECT(image->page != NULL);
+	memset(image->page, 0, pageCount * sizeof(image->page[0]));
+	NEW_ARRAY(image->fileName, nameLength);
+	EXPECT(image->fileName != NULL);
+	strncpy(image->fileName, fileName, nameLength);
+	image->nameLength = nameLength;
+	image->referenceCount = 1;
+	image->hasFileID = hasFileID;
+	image->fileID = fileID;
+	image->isValid = isValid;
+	image->isChanged = 0;
+	image->entry = elfHeader->entry;
+	image->programBegin = programBegin;
+	image->programEnd = programEnd;
+	image->programHeaderLength = elfHeader->programHeaderLength;
+	image->programHeader = programHeader;
+	image->pageLock = initialSpinlock;
+	image->file = IO_REQUEST_FAILURE;
+	image->prev = NULL;
+	image->next = NULL;
+	return image;
+	ON_ERROR;
+	DELETE(image->page);
+	ON_ERROR;
+	DELETE(image);
+	ON_ERROR;
+	return NULL;
+}
+
+// return a valid image of fileName, or NULL if not cached
+// matching the path without FILE_PARAM_FILE_ID is safe because
+// only images with file id are cached, the file systems do not delete or rename files,
+// and writing the file invalidates the image before the next search; see invalidateELFImage
+static ELFImage *acquireCachedELFImage(const char *fileName, uintptr_t nameLength){
+	ELFImage *image;
+	acquireLock(&elfImageListLock);
+	for(image = elfImageList; image != NULL; image = image->next){
+		if(image->isValid && isELFImageName(image, fileName, nameLength)){
+			image->referenceCount++;
+			REMOVE_FROM_DQUEUE(image);
+			ADD_TO_DQUEUE(image, &elfImageList);
+			break;
 		}
-		// not failed and in range
-		if(ok && j < programHeaderCount){
-			ok = _mapPage_L(taskMemory->page, taskMemory->physical, (void*)address, PAGE_SIZE,
-				programHeaderToPageAttribute(programHeaderArray + j));
-			if(ok)
-				continue;
+	}
+	releaseLock(&elfImageListLock);
+	if(image != NULL){
+		ADD_ELF_STATISTICS(cachedImageCount, 1);
+	}
+	return image;
+}
+
+// return an image with the same file name, file id, and program headers, or create one
+// the image owns programHeader if this function succeeds
+// isValid = 0 if the file may have changed after the headers were read
+static ELFImage *acquireELFImage(
+	const char *fileName, uintptr_t nameLength,
+	int hasFileID, uint64_t fileID, int isValid,
+	const ELFHeader32 *elfHeader, ProgramHeader32 *programHeader,
+	uintptr_t programBegin, uintptr_t programEnd
+){
+	ELFImage *image = NULL;
+	acquireLock(&elfImageListLock);
+	for(image = (isValid? elfImageList: NULL); image != NULL; image = image->next){
+		if(isSameELFImage_noLock(image, fileName, nameLength, hasFileID, fileID, elfHeader, programHeader)){
+			image->referenceCount++;
+			break;
+		}
+	}
+	releaseLock(&elfImageListLock);
+	if(image != NULL){
+		ADD_ELF_STATISTICS(sharedImageCount, 1);
+		DELETE(programHeader);
+		return image;
+	}
+	image = createELFImage(fileName, nameLength, hasFileID, fileID, isValid,
+		elfHeader, programHeader, programBegin, programEnd);
+	if(image == NULL){
+		return NULL;
+	}
+	acquireLock(&elfImageListLock);
+	ADD_TO_DQUEUE(image, &elfImageList);
+	releaseLock(&elfImageListLock);
+	return image;
+}
+
+void releaseELFImage(ELFImage *image){
+	acquireLock(&elfImageListLock);
+	image->referenceCount--;
+	ELFImage *removedList = (image->referenceCount == 0? removeUnusedELFImages_noLock(): NULL);
+	releaseLock(&elfImageListLock);
+	deleteELFImageList(removedList);
+}
+
+// FileChangeHandler
+// running tasks keep the loaded pages, but they fail to load the other pages
+// otherwise a task would run with a mix of the old and new file
+static void invalidateELFImage(uint64_t fileID){
+	ELFImage *image;
+	acquireLock(&elfImageListLock);
+	for(image = elfImageList; image != NULL; image = image->next){
+		if(image->hasFileID && image->fileID == fileID){
+			image->isValid = 0;
+			acquireLock(&image->pageLock);
+			image->isChanged = 1;
+			releaseLock(&image->pageLock);
 		}
-		// address is not in range or failed to allocate memory
-		releaseLinearBlock(taskMemory->linear, address);
 	}
+	ELFImage *removedList = removeUnusedELFImages_noLock();
+	releaseLock(&elfImageListLock);
+	deleteELFImageList(removedList);
+}
+
+void initELFLoader(void){
+	if(addFileChangeHandler(invalidateELFImage) == 0){
+		panic("cannot initialize ELF loader");
+	}
+}
+
+static void *getELFImagePage(ELFImage *image, uintptr_t address){
+	acquireLock(&image->pageLock);
+	void *page = image->page[(address - image->programBegin) / PAGE_SIZE];
+	releaseLock(&image->pageLock);
+	return page;
+}
+
+// return 0 if another task has loaded the page, or the file has changed during reading
+static int setELFImagePage(ELFImage *image, uintptr_t address, void *page){
+	void **p = image->page + (address - image->programBegin) / PAGE_SIZE;
+	int ok;
+	acquireLock(&image->pageLock);
+	ok = (*p == NULL && image->isChanged == 0);
+	if(ok){
+		*p = page;
+	}
+	releaseLock(&image->pageLock);
 	return ok;
 }
 
-static int setAllocateProgramHeader32(
-	uintptr_t file, const ProgramHeader32 *programHeaderArray, int programHeaderCount
-){
-	int i;
-	for(i = 0; i < programHeaderCount; i++){
-		const ProgramHeader32 *ph = programHeaderArray + i;
-		if(ph->segmentType != 1)
-			continue;
-		uintptr_t readCount = ph->fileSize;
-		if(syncSeekReadFile(file, (void*)ph->memoryAddress, ph->offset, &readCount) == IO_REQUEST_FAILURE)
+static void *readELFImagePage(uintptr_t file, const ProgramHeader32 *ph, uintptr_t address){
+	void *page = allocateKernelPages(PAGE_SIZE, KERNEL_PAGE);
+	EXPECT(page != NULL);
+	memset(page, 0, PAGE_SIZE);
+	uintptr_t pageOffset, fileOffset;
+	const uintptr_t fileSize = pageFileRange(ph, address, &pageOffset, &fileOffset);
+	if(fileSize == 0)
+		return page;
+	uintptr_t readCount = fileSize;
+	uintptr_t request = syncSeekReadFile(file, ((uint8_t*)page) + pageOffset, fileOffset, &readCount);
+	EXPECT(request != IO_REQUEST_FAILURE && readCount == fileSize);
+	ADD_ELF_STATISTICS(readPageCount, 1);
+	return page;
+	ON_ERROR;
+	checkAndReleaseKernelPages(page);
+	ON_ERROR;
+	return NULL;
+}
+
+// writable pages without file content are not cached
+static int needELFImagePage(const ProgramHeader32 *ph, uintptr_t address){
+	uintptr_t pageOffset, fileOffset;
+	return programHeaderToPageAttribute(ph) != USER_WRITABLE_PAGE ||
+		pageFileRange(ph, address, &pageOffset, &fileOffset) != 0;
+}
+
+// return a new page with the content of imagePage, or a zero page if imagePage is NULL
+static void *copyELFImagePage(const void *imagePage){
+	void *page = allocateKernelPages(PAGE_SIZE, KERNEL_PAGE);
+	if(page == NULL)
+		return NULL;
+	if(imagePage != NULL){
+		memcpy(page, imagePage, PAGE_SIZE);
+	}
+	else{
+		memset(page, 0, PAGE_SIZE);
+	}
+	return page;
+}
+
+// pages loaded together with a faulting page
+#define ELF_FAULT_AROUND_PAGES (16)
+
+// keep the global handle file in image until the image is deleted
+// if the image already has one, close file and return the handle of the image
+static uintptr_t setELFImageFile(ELFImage *image, uintptr_t file){
+	acquireLock(&image->pageLock);
+	if(image->file == IO_REQUEST_FAILURE){
+		image->file = file;
+	}
+	const uintptr_t imageFile = image->file;
+	releaseLock(&image->pageLock);
+	if(imageFile != file){
+		// opened by another task
+		syncCloseFile(file);
+	}
+	return imageFile;
+}
+
+// return the file of the image, or open it if the tasks started from a cached image
+static uintptr_t openELFImageFile(ELFImage *image){
+	acquireLock(&image->pageLock);
+	uintptr_t file = image->file;
+	releaseLock(&image->pageLock);
+	if(file != IO_REQUEST_FAILURE)
+		return file;
+	file = syncOpenGlobalFileN(image->fileName, image->nameLength, OPEN_FILE_MODE_0);
+	EXPECT(file != IO_REQUEST_FAILURE);
+	// the cached image was found by path
+	uint64_t fileID = 0;
+	const int hasFileID = (syncGetFileParameter(file, FILE_PARAM_FILE_ID, &fileID) != IO_REQUEST_FAILURE);
+	EXPECT(hasFileID == image->hasFileID && fileID == image->fileID);
+	return setELFImageFile(image, file);
+	ON_ERROR;
+	syncCloseFile(file);
+	ON_ERROR;
+	return IO_REQUEST_FAILURE;
+}
+
+// load the page at address and the following pages of the segment which are not loaded
+// the file is read through the file system and its block cache
+static int loadELFImagePages(ELFImage *image, const ProgramHeader32 *ph, uintptr_t address){
+	const uintptr_t segmentEnd = CEIL(ph->memoryAddress + ph->memorySize, ph->alignSize);
+	acquireLock(&image->pageLock);
+	const int isChanged = image->isChanged;
+	releaseLock(&image->pageLock);
+	if(isChanged){
+		printk("warning: ELF file changed while the task is running\n");
+		return 0;
+	}
+	uintptr_t file = openELFImageFile(image);
+	EXPECT(file != IO_REQUEST_FAILURE);
+	uintptr_t a;
+	for(a = address; a < segmentEnd && a - address < ELF_FAULT_AROUND_PAGES * PAGE_SIZE; a += PAGE_SIZE){
+		if(a != address && (getELFImagePage(image, a) != NULL || needELFImagePage(ph, a) == 0))
 			break;
-		if(readCount != ph->fileSize)
+		void *page = readELFImagePage(file, ph, a);
+		if(page == NULL)
 			break;
-		memset((void*)(ph->memoryAddress + ph->fileSize), 0, ph->memorySize - ph->fileSize);
+		if(setELFImagePage(image, a, page) == 0){
+			checkAndReleaseKernelPages(page);
+		}
+	}
+	EXPECT(getELFImagePage(image, address) != NULL);
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+int loadELFPage(uintptr_t address){
+	Task *t = processorLocalTask();
+	ELFImage *image = getTaskELFImage(t);
+	LinearMemoryManager *m = getTaskLinearMemory(t);
+	address = FLOOR(address, PAGE_SIZE);
+	EXPECT(image != NULL && address >= image->programBegin && address < image->programEnd);
+	const ProgramHeader32 *ph = findProgramHeader32(image->programHeader, image->programHeaderLength, address);
+	EXPECT(ph != NULL);
+	if(isUnmappedLinearBlock(m, address) == 0){
+		// loaded by another thread, or released by the task
+		return checkAndTranslatePage(m, (void*)address).value != INVALID_PAGE_ADDRESS;
+	}
+	ADD_ELF_STATISTICS(faultCount, 1);
+	const PageAttribute attribute = programHeaderToPageAttribute(ph);
+	void *imagePage = getELFImagePage(image, address);
+	if(imagePage == NULL && needELFImagePage(ph, address) && loadELFImagePages(image, ph, address)){
+		imagePage = getELFImagePage(image, address);
+	}
+	EXPECT(imagePage != NULL || needELFImagePage(ph, address) == 0);
+	// read-only pages are shared
+	void *page = (attribute == USER_WRITABLE_PAGE? copyELFImagePage(imagePage): imagePage);
+	EXPECT(page != NULL);
+	int ok = mapUnmappedLinearBlock(m, address, checkAndTranslatePage(kernelLinear, page), attribute);
+	if(page != imagePage){
+		// the task holds the only reference
+		checkAndReleaseKernelPages(page);
+	}
+	if(ok == 0){
+		return checkAndTranslatePage(m, (void*)address).value != INVALID_PAGE_ADDRESS;
+	}
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+void loadELFPages(uintptr_t pageBegin, uintptr_t pageSize){
+	Task *t = processorLocalTask();
+	ELFImage *image = getTaskELFImage(t);
+	if(image == NULL)
+		return;
+	uintptr_t a;
+	for(a = 0; a < pageSize; a += PAGE_SIZE){
+		if(pageBegin + a >= image->programBegin && pageBegin + a < image->programEnd &&
+			isUnmappedLinearBlock(getTaskLinearMemory(t), pageBegin + a)){
+			loadELFPage(pageBegin + a);
+		}
+	}
+}
+
+// keep the pages of the segments unmapped and release the others
+// the read-only pages already loaded in the image are mapped without page fault
+static void mapProgramHeader32(ELFImage *image){
+	LinearMemoryManager *taskMemory = getTaskLinearMemory(processorLocalTask());
+	uintptr_t address;
+	for(address = image->programBegin; address < image->programEnd; address += PAGE_SIZE){
+		const ProgramHeader32 *ph = findProgramHeader32(image->programHeader, image->programHeaderLength, address);
+		if(ph == NULL){
+			releaseLinearBlock(taskMemory->linear, address);
+			continue;
+		}
+		setUnmappedLinearBlock(taskMemory->linear, address);
+		if(programHeaderToPageAttribute(ph) == USER_WRITABLE_PAGE)
+			continue;
+		void *imagePage = getELFImagePage(image, address);
+		if(imagePage != NULL){
+			// if failed, the page is loaded by page fault
+			mapUnmappedLinearBlock(taskMemory, address,
+				checkAndTranslatePage(kernelLinear, imagePage), USER_READ_ONLY_PAGE);
+		}
 	}
-	return i >= programHeaderCount;
 }
 
-static int loadProgramHeader32(uintptr_t file, uintptr_t programHeaderOffset, int programHeaderLength){
-	int ok = 0;
+static ELFImage *loadProgramHeader32(
+	uintptr_t file, const char *fileName, uintptr_t nameLength,
+	int hasFileID, uint64_t fileID, uint32_t fileChangeCount,
+	const ELFHeader32 *elfHeader
+){
+	const int programHeaderLength = elfHeader->programHeaderLength;
 	const size_t programHeaderSize = programHeaderLength * sizeof(ProgramHeader32);
 	ProgramHeader32 *programHeader32 = allocateKernelMemory(programHeaderSize);
 	EXPECT(programHeader32 != NULL);
 	uintptr_t readCount = programHeaderSize;
-	uintptr_t request = syncSeekReadFile(file, programHeader32, programHeaderOffset, &readCount);
+	uintptr_t request = syncSeekReadFile(file, programHeader32, elfHeader->programHeaderOffset, &readCount);
 	EXPECT(request != IO_REQUEST_FAILURE && readCount == programHeaderSize);
 	uintptr_t programBegin;
 	uintptr_t programEnd;
-	ok = checkAllocateProgramHeader32(
+	int ok = checkAllocateProgramHeader32(
 		programHeader32, programHeaderLength, &programBegin, &programEnd);
 	// check address overflow
 	EXPECT(ok);
-	ok = initUserLinearBlockManager(programBegin, programEnd);
-	EXPECT(ok);
-	// TaskMemoryManager
-	ok = mapAllocateProgramHeader32(programHeader32, programHeaderLength, programBegin, programEnd);
-	EXPECT(ok);
-	// fill in memory
-	ok = setAllocateProgramHeader32(file, programHeader32, programHeaderLength);
-	EXPECT(ok);
-	// ok = 1;
+	// do not cache the headers if any file has been modified since the file was opened
+	const int isValid = (getFileChangeCount() == fileChangeCount);
+	ELFImage *image = acquireELFImage(fileName, nameLength, hasFileID, fileID, isValid,
+		elfHeader, programHeader32, programBegin, programEnd);
+	EXPECT(image != NULL);
+	return image;
 	ON_ERROR;
 	ON_ERROR;
 	ON_ERROR;
+	DELETE(programHeader32);
+	ON_ERROR;
+	return NULL;
+}
+
+// read and check the headers if the image is not cached
+// the file is kept open in the image for loading pages
+static ELFImage *openELFImage(const char *fileName, uintptr_t nameLength){
+	const uint32_t fileChangeCount = getFileChangeCount();
+	uintptr_t file = syncOpenGlobalFileN(fileName, nameLength, OPEN_FILE_MODE_0);
+	EXPECT(file != IO_REQUEST_FAILURE);
+	// ELFHeader32
+	ELFHeader32 elfHeader32;
+	uintptr_t readCount = sizeof(elfHeader32);
+	uintptr_t request = syncSeekReadFile(file, &elfHeader32, 0, &readCount);
+	EXPECT(request != IO_REQUEST_FAILURE && readCount == sizeof(elfHeader32) &&
+		checkELFHeader32(&elfHeader32));
+	// images of files without id are not cached
+	uint64_t fileID = 0;
+	const int hasFileID = (syncGetFileParameter(file, FILE_PARAM_FILE_ID, &fileID) != IO_REQUEST_FAILURE);
+	// ProgramHeader32
+	ELFImage *image = loadProgramHeader32(file, fileName, nameLength,
+		hasFileID, fileID, fileChangeCount, &elfHeader32);
+	EXPECT(image != NULL);
+	setELFImageFile(image, file);
+	return image;
 	ON_ERROR;
 	ON_ERROR;
-	DELETE(programHeader32);
+	syncCloseFile(file);
 	ON_ERROR;
-	return ok;
+	return NULL;
 }
 
 struct ELFLoaderParam{
+	uint64_t createTime;
 	uintptr_t nameLength;
 	char fileName[];
 };
 
+// segments are not read here
+// pages are loaded from the file or ELFImage when the task touches them; see loadELFPage
 static void elfLoader(void *arg){
 	struct ELFLoaderParam *p = arg;
-	uintptr_t file;
-	uintptr_t request;
-	file = syncOpenFileN(p->fileName, p->nameLength, OPEN_FILE_MODE_0);
-	EXPECT(file != IO_REQUEST_FAILURE);
-	// ELFHeader32
-	ELFHeader32 elfHeader32;
-	uintptr_t readCount = sizeof(elfHeader32);
-	request = syncSeekReadFile(file, &elfHeader32, 0, &readCount);
-	EXPECT(request != IO_REQUEST_FAILURE && readCount == sizeof(elfHeader32) &&
-		checkELFHeader32(&elfHeader32));
-
-	// ProgramHeader32
-	int ok = loadProgramHeader32(file, elfHeader32.programHeaderOffset, elfHeader32.programHeaderLength);
+	ELFImage *image = acquireCachedELFImage(p->fileName, p->nameLength);
+	if(image == NULL){
+		image = openELFImage(p->fileName, p->nameLength);
+	}
+	EXPECT(image != NULL);
+	int ok = initUserLinearBlockManager(image->programBegin, image->programEnd);
 	EXPECT(ok);
-	ok = syncCloseFile(file);
-	if(!ok)
-		printk("warnging: cannot close ELF file\n");
-	file = IO_REQUEST_FAILURE;
+	mapProgramHeader32(image);
+	// released in terminateCurrentTask
+	setTaskELFImage(processorLocalTask(), image);
+	const uintptr_t entry = image->entry;
+	image = NULL;
+	ADD_ELF_STATISTICS(startCount, 1);
+	ADD_ELF_STATISTICS(startCycles, rdtsc() - p->createTime);
 	//printk("elf ok\n\n");
-	//((void(*)(void))elfHeader32.entry)();
-	ok = switchToUserMode(elfHeader32.entry, DEFAULT_USER_STACK_SIZE);
+	//((void(*)(void))entry)();
+	ok = switchToUserMode(entry, DEFAULT_USER_STACK_SIZE);
 	EXPECT(ok);
 	assert(0);
 	ON_ERROR;
 	ON_ERROR;
-	ON_ERROR;
-	if(file != IO_REQUEST_FAILURE){
-		syncCloseFile(file);
+	if(image != NULL){
+		releaseELFImage(image);
 	}
 	ON_ERROR;
 	printk("warning: cannot load task from ELF\n");
@@ -242,9 +701,63 @@ Task *createUserTaskFromELF(const char *fileName, uintptr_t nameLength, int prio
 	struct ELFLoaderParam *p = allocateKernelMemory(pSize);
 	if(p == NULL)
 		return NULL;
+	p->createTime = rdtsc();
 	p->nameLength = nameLength;
 	strncpy(p->fileName, fileName, nameLength);
 	Task *t = createTaskAndMemorySpace(elfLoader, p, pSize, priority);
 	releaseKernelMemory(p);
 	return t;
 }
+
+#ifndef NDEBUG
+
+static void getELFStatistics(ELFStatistics *s){
+	acquireLock(&elfStatisticsLock);
+	*s = elfStatistics;
+	releaseLock(&elfStatisticsLock);
+}
+
+static void startELFTasks(const char *fileName, int startCount){
+	int i;
+	for(i = 0; i < startCount; i++){
+		Task *t = createUserTaskFromELF(fileName, strlen(fileName), 3);
+		assert(t != NULL);
+		resume(t);
+		sleep(50);
+	}
+}
+
+// start every ELF repeatedly and print the average time to enter user mode
+// the first start reads the headers; the later ones start from the cached ELFImage
+void testELFLoader(void);
+void testELFLoader(void){
+	const char *const fileName[] = {"fat:C/SMALLELF.ELF", "fat:C/LARGEELF.ELF"};
+	const int startCount = 20;
+	printk("test ELF loader...\n");
+	int ok = waitForFirstResource("fat", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	unsigned i;
+	for(i = 0; i < LENGTH_OF(fileName); i++){
+		ELFStatistics s0, s1, s2;
+		getELFStatistics(&s0);
+		startELFTasks(fileName[i], 1);
+		getELFStatistics(&s1);
+		startELFTasks(fileName[i], startCount - 1);
+		getELFStatistics(&s2);
+		const uint64_t count = s2.startCount - s1.startCount;
+		if(count == 0){
+			printk("%s: cannot start task\n", fileName[i]);
+			continue;
+		}
+		printk("%s: first start %u kilo-cycles, %u starts from %u cached images, %u kilo-cycles per start\n",
+			fileName[i], (uintptr_t)((s1.startCycles - s0.startCycles) / 1000), (uintptr_t)count,
+			(uintptr_t)(s2.cachedImageCount - s1.cachedImageCount),
+			(uintptr_t)((s2.startCycles - s1.startCycles) / count / 1000));
+		printk("%s: %u page faults, %u pages read\n", fileName[i],
+			(uintptr_t)(s2.faultCount - s0.faultCount), (uintptr_t)(s2.readPageCount - s0.readPageCount));
+	}
+	printk("test ELF loader ok\n");
+	systemCall_terminate();
+}
+
+#endif
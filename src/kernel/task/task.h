@@ -37,12 +37,27 @@ Task *createTaskWithoutLoader(void (*eip0)(void), int priority);
 // create new page table and preallocated linear memory
 // elfloader.c
 Task *createUserTaskFromELF(const char *fileName, uintptr_t nameLength, int priority);
+// segments are loaded when the task touches them. read-only pages are shared by the tasks of the same ELF file
+typedef struct ELFImage ELFImage;
+// ELFImages are cached until the file is changed, see notifyFileChange
+void initELFLoader(void);
+void releaseELFImage(ELFImage *image);
+// return 1 if the page at address of the current task has been loaded from its ELFImage
+int loadELFPage(uintptr_t address);
+// load the unmapped pages in range, for the kernel to access user buffers
+void loadELFPages(uintptr_t pageBegin, uintptr_t pageSize);
+// the image is released when all tasks sharing the memory terminate
+void setTaskELFImage(Task *t, ELFImage *image);
+ELFImage *getTaskELFImage(Task *t);
 // apply a custom loader to a task
 Task *createTaskAndMemorySpace(void (*loader)(void*), void *arg, size_t argSize, int priority);
 // the loader function is responsible to initialize LinearBlockManager
 //typedef struct LinearMemoryBlockManager LinearMemoryBlockManager;
 int initUserLinearBlockManager(uintptr_t beginAddr, uintptr_t initEndAddr);
 
+// print resident pages of each address space; return printed length
+uintptr_t printTaskMemoryUsage(char *buffer, uintptr_t bufferSize);
+
 Task *createSharedMemoryTask(void (*entry)(void*), void *arg, uintptr_t argSize, Task *sharedMemoryTask);
 // always succeed and do not return
 void terminateCurrentTask(void);
@@ -16,11 +16,17 @@
 
 typedef struct TaskMemoryManager{
 	LinearMemoryManager manager;
+	// NULL if not created by createUserTaskFromELF
+	ELFImage *elfImage;
 	Spinlock lock;
 	int referenceCount;
+	struct TaskMemoryManager **prev, *next;
 }TaskMemoryManager;
 
 static TaskMemoryManager *kernelTaskMemory = NULL;
+// see printTaskMemoryUsage
+static Spinlock taskMemoryListLock = INITIAL_SPINLOCK;
+static TaskMemoryManager *taskMemoryList = NULL;
 static OpenFileManager *kernelOpenFileManager = NULL;
 
 static int addTaskMemoryReference(TaskMemoryManager *m, int value){
@@ -43,15 +49,42 @@ static TaskMemoryManager *createTaskMemory(
 	m->manager.page = page;
 	m->manager.linear = linear;
 	m->manager.physical = physical;
+	m->manager.fileMappingList = NULL;
+	m->elfImage = NULL;
 	m->lock = initialSpinlock;
 	m->referenceCount = 0;
+	m->prev = NULL;
+	m->next = NULL;
+	acquireLock(&taskMemoryListLock);
+	ADD_TO_DQUEUE(m, &taskMemoryList);
+	releaseLock(&taskMemoryListLock);
 	return m;
 }
 
 static void deleteTaskMemory(TaskMemoryManager *m){
 	assert(m->referenceCount == 0 && isAcquirable(&m->lock));
+	acquireLock(&taskMemoryListLock);
+	REMOVE_FROM_DQUEUE(m);
+	releaseLock(&taskMemoryListLock);
 	DELETE(m);
 }
+
+uintptr_t printTaskMemoryUsage(char *buffer, uintptr_t bufferSize){
+	uintptr_t printCount = 0;
+	acquireLock(&taskMemoryListLock);
+	TaskMemoryManager *m;
+	for(m = taskMemoryList; m != NULL; m = m->next){
+		if(m == kernelTaskMemory)
+			continue;
+		printCount += snprintf(buffer + printCount, bufferSize - printCount,
+			"task memory %x: %u tasks, %u resident pages\n",
+			m, m->referenceCount, getPresentPageCount(m->manager.page));
+	}
+	releaseLock(&taskMemoryListLock);
+	printCount += snprintf(buffer + printCount, bufferSize - printCount,
+		"kernel: %u resident pages\n", getPresentPageCount(kernelPageManager));
+	return printCount;
+}
 enum TaskState{
 	// RUNNING,
 	READY,
@@ -556,11 +589,12 @@ void terminateCurrentTask(void){
 		closeAllOpenFileRequest(t->openFileManager);
 		deleteOpenFileManager(t->openFileManager);
 	}
+	else if(t->userStackBottom != INVALID_PAGE_ADDRESS){
+		// the user stack is released below
+		invalidateBufferAlias(t->openFileManager);
+	}
 	t->openFileManager = NULL;
-	// 1. delete ioSemaphore
-	deleteSemaphore(t->ioSemaphore);
-	t->ioSemaphore = NULL;
-	// 2. delete user stack
+	// 1. delete user stack
 	TaskMemoryManager *tmm = t->taskMemory;
 	if(t->userStackBottom != INVALID_PAGE_ADDRESS){
 		if(checkAndReleasePages(&tmm->manager, (void*)t->userStackBottom) == 0){
@@ -569,10 +603,16 @@ void terminateCurrentTask(void){
 		}
 		t->userStackBottom = INVALID_PAGE_ADDRESS;
 	}
-	// 3. delete user space
+	// 2. delete user space
+	// releasing ELFImage and MappedFile may close their global file handles
 	int memoryRefCnt = addTaskMemoryReference(tmm, -1);
 	if(memoryRefCnt == 0){
 		PageManager *p = tmm->manager.page;
+		if(tmm->elfImage != NULL){
+			releaseELFImage(tmm->elfImage);
+			tmm->elfImage = NULL;
+		}
+		releaseFileMappings(&tmm->manager);
 		// delete linear
 		if(tmm->manager.linear != NULL){
 			destroyUserLinearBlockManager(&tmm->manager);
@@ -593,6 +633,9 @@ void terminateCurrentTask(void){
 		t->taskMemory = kernelTaskMemory;
 		sti();
 	}
+	// 3. delete ioSemaphore
+	deleteSemaphore(t->ioSemaphore);
+	t->ioSemaphore = NULL;
 	cli();
 	taskSwitch(pushTerminateQueue, (uintptr_t)&terminateQueue);
 	assert(0); // never return
@@ -624,6 +667,15 @@ LinearMemoryManager *getTaskLinearMemory(Task *t){
 	return &t->taskMemory->manager;
 }
 
+void setTaskELFImage(Task *t, ELFImage *image){
+	assert(t->taskMemory->elfImage == NULL);
+	t->taskMemory->elfImage = image;
+}
+
+ELFImage *getTaskELFImage(Task *t){
+	return t->taskMemory->elfImage;
+}
+
 OpenFileManager *getOpenFileManager(Task *t){
 	return t->openFileManager;
 }
@@ -838,7 +890,11 @@ static void allocateHeapHandler(InterruptParam *p){
 static void releaseHeapHandler(InterruptParam *p){
 	sti();
 	uintptr_t address = SYSTEM_CALL_ARGUMENT_0(p);
-	int ret = checkAndReleasePages(&processorLocalTask()->taskMemory->manager, (void*)address);
+	Task *t = processorLocalTask();
+	int ret = checkAndReleasePages(&t->taskMemory->manager, (void*)address);
+	if(ret){
+		invalidateBufferAlias(t->openFileManager);
+	}
 	SYSTEM_CALL_RETURN_VALUE_0(p) = ret;
 }
 
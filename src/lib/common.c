@@ -12,29 +12,77 @@ static_assert(sizeof(uintptr_t) == sizeof(void*));
 
 static_assert(sizeof(unsigned char) == 1);
 
-#define MEMSET(D, I, V, SIZE) \
-size_t (I);\
-for((I) = 0; (I) < (SIZE); (I)++){\
-	((unsigned char*)(D))[(I)] = (V);\
-}\
-return (D)
+// fill/copy the bytes before dst is aligned to 4, then by rep stosd/movsd, then the remaining bytes
+// the direction flag may be set by user, so clear it
+
+static void fillString(volatile void *dst, unsigned char value, size_t size){
+	const size_t head = MIN((4 - ((uintptr_t)dst) % 4) % 4, size);
+	const size_t dwordCount = (size - head) / 4, tail = (size - head) % 4;
+	const uint32_t value4 = value * 0x01010101;
+	uint32_t d0, d1;
+	__asm__ __volatile__(
+	"cld\n"
+	"rep stosb\n"
+	"movl %5, %%ecx\n"
+	"rep stosl\n"
+	"movl %6, %%ecx\n"
+	"rep stosb\n"
+	:"=D"(d0), "=c"(d1)
+	:"0"(dst), "1"(head), "a"(value4), "m"(dwordCount), "m"(tail)
+	:"memory", "cc"
+	);
+}
+
+static void copyString(volatile void *dst, volatile const void *src, size_t size){
+	const size_t head = MIN((4 - ((uintptr_t)dst) % 4) % 4, size);
+	const size_t dwordCount = (size - head) / 4, tail = (size - head) % 4;
+	uint32_t d0, d1, d2;
+	__asm__ __volatile__(
+	"cld\n"
+	"rep movsb\n"
+	"movl %6, %%ecx\n"
+	"rep movsl\n"
+	"movl %7, %%ecx\n"
+	"rep movsb\n"
+	:"=D"(d0), "=S"(d1), "=c"(d2)
+	:"0"(dst), "1"(src), "2"(head), "m"(dwordCount), "m"(tail)
+	:"memory", "cc"
+	);
+}
 
 void *memset(void *ptr, unsigned char value, size_t size){
-	MEMSET(ptr, i, value, size);
+	fillString(ptr, value, size);
+	return ptr;
 }
 
 volatile void *memset_volatile(volatile void *ptr, unsigned char value, size_t size){
-	MEMSET(ptr, i, value, size);
+	fillString(ptr, value, size);
+	return ptr;
 }
 
 void *memcpy(void *dst, const void *src, size_t size){
-	MEMSET(dst, i, ((unsigned char*)src)[i], size);
+	copyString(dst, src, size);
+	return dst;
 }
 
 volatile void *memcpy_volatile(volatile void *dst, volatile const void *src, size_t size){
-	MEMSET(dst, i, ((volatile unsigned char*)src)[i], size);
+	copyString(dst, src, size);
+	return dst;
+}
+
+int memcmp(const void *ptr1, const void *ptr2, size_t size){
+	const unsigned char *p1 = ptr1, *p2 = ptr2;
+	size_t i = 0;
+	// unaligned access is allowed in x86
+	while(i + 4 <= size && *(const uint32_t*)(p1 + i) == *(const uint32_t*)(p2 + i)){
+		i += 4;
+	}
+	for(; i < size; i++){
+		if(p1[i] != p2[i])
+			return p1[i] > p2[i]? 1: -1;
+	}
+	return 0;
 }
-#undef MEMSET
 
 int strlen(const char *s){
 	int len;
@@ -11,6 +11,7 @@ volatile void *memset_volatile(volatile void *ptr, unsigned char value, size_t s
 #define MEMSET0(P) memset((P), 0, sizeof(*(P)))
 void *memcpy(void *dst, const void *src, size_t size);
 volatile void *memcpy_volatile(volatile void *dst, volatile const void *src, size_t size);
+int memcmp(const void *ptr1, const void *ptr2, size_t size);
 
 // string.h
 int strlen(const char *s);
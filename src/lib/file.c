@@ -90,11 +90,21 @@ uintptr_t syncSeekReadFile(uintptr_t handle, void *buffer, uint64_t position, ui
 	return handle;
 }
 
-uintptr_t systemCall_seekWriteFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t bufferSize){
-	return systemCall6(SYSCALL_SEEK_READ_FILE, handle, (uintptr_t)buffer, bufferSize,
+uintptr_t systemCall_seekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t bufferSize){
+	return systemCall6(SYSCALL_SEEK_WRITE_FILE, handle, (uintptr_t)buffer, bufferSize,
 		LOW64(position), HIGH64(position));
 }
 
+uintptr_t syncSeekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t *bufferSize){
+	uintptr_t r;
+	r = systemCall_seekWriteFile(handle, buffer, position, *bufferSize);
+	if(r == IO_REQUEST_FAILURE)
+		return r;
+	if(r != systemCall_waitIOReturn(r, 1, bufferSize))
+		return IO_REQUEST_FAILURE;
+	return handle;
+}
+
 uintptr_t systemCall_getFileParameter(uintptr_t handle, enum FileParameter parameterCode){
 	return systemCall3(SYSCALL_GET_FILE_PARAMETER, handle, parameterCode);
 }
@@ -145,3 +155,15 @@ uintptr_t syncSetFileParameter(uintptr_t handle, enum FileParameter paramCode, u
 		return IO_REQUEST_FAILURE;
 	return handle;
 }
+
+void *systemCall_mapFile(const char *fileName, uintptr_t fileNameLength, uintptr_t offset, uintptr_t size){
+	return (void*)systemCall5(SYSCALL_MAP_FILE, (uintptr_t)fileName, fileNameLength, offset, size);
+}
+
+int systemCall_unmapFile(void *address){
+	return (int)systemCall2(SYSCALL_UNMAP_FILE, (uintptr_t)address);
+}
+
+int systemCall_syncMappedFile(void *address){
+	return (int)systemCall2(SYSCALL_SYNC_MAPPED_FILE, (uintptr_t)address);
+}
@@ -9,6 +9,12 @@ typedef union{
 	uintptr_t value;
 	struct{
 		uintptr_t enumeration: 1;
+		// create the file if it does not exist
+		uintptr_t create: 1;
+		// set the file size to 0 after opening
+		uintptr_t truncate: 1;
+		// every write is at the end of the file
+		uintptr_t append: 1;
 		// uintptr_t noWrite: 1;
 		// uintptr_t noRead: 1;
 	};
@@ -17,10 +23,15 @@ typedef union{
 #define OPEN_FILE_MODE_0 ((OpenFileMode)(uintptr_t)0)
 #define OPEN_FILE_MODE_ENUMERATION ((OpenFileMOde){enumeration: 1})
 
+// number of log2 buckets of disk latency histograms
+#define DISK_LATENCY_BUCKET_COUNT (40)
+
 // get parameter
 enum FileParameter{
 	// file size
 	FILE_PARAM_SIZE = 0x10,
+	// write cached data to disk. the value is ignored
+	FILE_PARAM_FLUSH = 0x11,
 	// network MTU
 	FILE_PARAM_MAX_WRITE_SIZE = 0x20,
 	FILE_PARAM_MIN_READ_SIZE = 0x21,
@@ -31,7 +42,33 @@ enum FileParameter{
 	FILE_PARAM_DESTINATION_PORT = 0x33,
 	FILE_PARAM_TRANSMIT_ETHERTYPE = 0x36,
 	//FILE_PARAM_RECEIVE_ETHERTYPE = 37
-	FILE_PARAM_FILE_INSTANCE = 0x50
+	// maximum number of outstanding disk commands
+	FILE_PARAM_MAX_QUEUE_DEPTH = 0x40,
+	// FileAccessPattern hint of a file handle
+	FILE_PARAM_ACCESS_PATTERN = 0x41,
+	FILE_PARAM_FILE_INSTANCE = 0x50,
+	// a number identifying the file in its file system, see notifyFileChange
+	FILE_PARAM_FILE_ID = 0x51,
+	// disk statistics since the device is initialized
+	FILE_PARAM_READ_COUNT = 0x60,
+	FILE_PARAM_WRITE_COUNT = 0x61,
+	FILE_PARAM_READ_BYTE_COUNT = 0x62,
+	FILE_PARAM_WRITE_BYTE_COUNT = 0x63,
+	FILE_PARAM_ERROR_COUNT = 0x64,
+	// number of submitted and not completed requests
+	FILE_PARAM_IN_FLIGHT_COUNT = 0x65,
+	FILE_PARAM_MAX_IN_FLIGHT_COUNT = 0x66,
+	// FILE_PARAM_READ_LATENCY + i is the number of reads which take [2^i, 2^(i+1)) time stamp cycles
+	// from submission to completion interrupt. the last bucket includes all longer reads
+	FILE_PARAM_READ_LATENCY = 0x80,
+	FILE_PARAM_WRITE_LATENCY = FILE_PARAM_READ_LATENCY + DISK_LATENCY_BUCKET_COUNT
+};
+
+enum FileAccessPattern{
+	// detect sequential reads
+	FILE_ACCESS_NORMAL = 0,
+	FILE_ACCESS_SEQUENTIAL = 1,
+	FILE_ACCESS_RANDOM = 2
 };
 
 // enumerate
@@ -86,7 +123,8 @@ uintptr_t syncWriteFile(uintptr_t handle, const void *buffer, uintptr_t *bufferS
 uintptr_t systemCall_seekReadFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t bufferSize);
 uintptr_t syncSeekReadFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t *bufferSize);
 
-uintptr_t systemCall_seekWriteFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t bufferSize);
+uintptr_t systemCall_seekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t bufferSize);
+uintptr_t syncSeekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t *bufferSize);
 
 uintptr_t systemCall_getFileParameter(uintptr_t handle, enum FileParameter parameterCode);
 uintptr_t syncGetFileParameter(uintptr_t handle, enum FileParameter paramCode, uint64_t *value);
@@ -100,4 +138,13 @@ uintptr_t syncSetFileParameter(uintptr_t handle, enum FileParameter parameterCod
 uintptr_t systemCall_closeFile(uintptr_t handle);
 uintptr_t syncCloseFile(uintptr_t handle);
 
+// map size bytes at offset of the file to read-only pages, which are loaded when accessed
+// offset has to be a multiple of PAGE_SIZE; size is truncated at the end of the file
+// if failed, return NULL
+void *systemCall_mapFile(const char *fileName, uintptr_t fileNameLength, uintptr_t offset, uintptr_t size);
+// address is returned by systemCall_mapFile
+// return 1 if success, 0 if failed
+int systemCall_unmapFile(void *address);
+int systemCall_syncMappedFile(void *address);
+
 #endif
@@ -27,9 +27,14 @@ enum SystemCall{
 	SYSCALL_GET_TIME = 17,
 	// file
 	SYSCALL_OPEN_FILE = 20,
+	SYSCALL_MAP_FILE = 21,
+	SYSCALL_UNMAP_FILE = 22,
+	SYSCALL_SYNC_MAPPED_FILE = 23,
 	SYSCALL_CLOSE_FILE = 24,
 	SYSCALL_READ_FILE = 25,
 	SYSCALL_WRITE_FILE = 26,
+	// kernel only, see syncOpenGlobalFileN
+	SYSCALL_OPEN_GLOBAL_FILE = 27,
 	SYSCALL_SEEK_READ_FILE = 28,
 	SYSCALL_SEEK_WRITE_FILE = 29,
 	SYSCALL_GET_FILE_PARAMETER = 30,
@@ -0,0 +1,18 @@
+#include"systemcall.h"
+
+// 1MB read-only data and 256KB writable data, of which only a few pages are touched
+// see testELFLoader
+#define TABLE_LENGTH (256 * 1024)
+#define DATA_LENGTH (64 * 1024)
+
+static const unsigned table[TABLE_LENGTH] = {1, 2, 3};
+static unsigned data[DATA_LENGTH] = {4, 5, 6};
+
+int main(int argc, char *argv[]){
+	data[DATA_LENGTH - 1] = table[0] + table[TABLE_LENGTH - 1];
+	if(data[0] != 4 || data[DATA_LENGTH - 1] != 1){
+		__asm__("hlt\n");
+	}
+	systemCall_terminate();
+	return 0;
+}
@@ -0,0 +1,7 @@
+#include"systemcall.h"
+
+// start and terminate, see testELFLoader
+int main(int argc, char *argv[]){
+	systemCall_terminate();
+	return 0;
+}